@@ -1141,14 +1141,17 @@ static void
 printPeersImpl (tr_variant * peers)
 {
   int i, n;
-  printf ("%-20s  %-12s  %-5s %-6s  %-6s  %s\n",
-          "Address", "Flags", "Done", "Down", "Up", "Client");
+  printf ("%-20s  %-12s  %-5s %-6s  %-6s  %-5s  %-9s  %s\n",
+          "Address", "Flags", "Done", "Down", "Up", "RTT", "Reqs", "Client");
 
   for (i=0, n=tr_variantListSize(peers); i<n; ++i)
     {
       double progress;
       const char * address, * client, * flagstr;
       int64_t rateToClient, rateToPeer;
+      int64_t rtt = -1, pendingReqs = 0, desiredReqs = 0;
+      char rttStr[16];
+      char reqsStr[32];
       tr_variant * d = tr_variantListChild (peers, i);
 
       if  (tr_variantDictFindStr  (d, TR_KEY_address, &address, NULL)
@@ -1158,10 +1161,22 @@ printPeersImpl (tr_variant * peers)
         && tr_variantDictFindInt  (d, TR_KEY_rateToClient, &rateToClient)
         && tr_variantDictFindInt  (d, TR_KEY_rateToPeer, &rateToPeer))
         {
-          printf ("%-20s  %-12s  %-5.1f %6.1f  %6.1f  %s\n",
+          /* these are newer fields, so older servers won't send them */
+          tr_variantDictFindInt (d, TR_KEY_rtt, &rtt);
+          tr_variantDictFindInt (d, TR_KEY_pendingReqsToPeer, &pendingReqs);
+          tr_variantDictFindInt (d, TR_KEY_desiredReqsToPeer, &desiredReqs);
+
+          if (rtt >= 0)
+            tr_snprintf (rttStr, sizeof (rttStr), "%" PRId64, rtt);
+          else
+            tr_strlcpy (rttStr, "-", sizeof (rttStr));
+          tr_snprintf (reqsStr, sizeof (reqsStr), "%" PRId64 "/%" PRId64, pendingReqs, desiredReqs);
+
+          printf ("%-20s  %-12s  %-5.1f %6.1f  %6.1f  %5s  %-9s  %s\n",
                   address, flagstr, (progress*100.0),
                   rateToClient / (double)tr_speed_K,
                   rateToPeer / (double)tr_speed_K,
+                  rttStr, reqsStr,
                   client);
         }
     }
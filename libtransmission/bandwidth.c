@@ -14,10 +14,12 @@
 #include <limits.h>
 #include <string.h> /* memset () */
 
+#include <event2/event.h>
+
 #include "transmission.h"
 #include "bandwidth.h"
-#include "crypto.h" /* tr_cryptoWeakRandInt () */
 #include "peer-io.h"
+#include "session.h"
 #include "utils.h"
 
 #define dbgmsg(...) \
@@ -114,6 +116,7 @@ tr_bandwidthDestruct (tr_bandwidth * b)
     assert (tr_isBandwidth (b));
 
     tr_bandwidthSetParent (b, NULL);
+    tr_bandwidthClearWaiters (b);
     tr_ptrArrayDestruct (&b->children, NULL);
 
     memset (b, ~0, sizeof (tr_bandwidth));
@@ -159,133 +162,299 @@ tr_bandwidthSetParent (tr_bandwidth  * b,
 ****
 ***/
 
-static void
-allocateBandwidth (tr_bandwidth  * b,
-                   tr_priority_t   parent_priority,
-                   tr_direction    dir,
-                   unsigned int    period_msec,
-                   tr_ptrArray   * peer_pool)
+/***
+****  Token buckets
+***/
+
+static int64_t
+bandCapacity (const struct tr_band * band)
 {
-    const tr_priority_t priority = MAX (parent_priority, b->priority);
+    const int64_t burst = (int64_t)band->desiredSpeed_Bps * BANDWIDTH_BURST_MSEC;
 
-    assert (tr_isBandwidth (b));
-    assert (tr_isDirection (dir));
+    return MAX (burst, BANDWIDTH_QUANTUM_MIN * 1000);
+}
 
-    /* set the available bandwidth */
-    if (b->band[dir].isLimited)
+static unsigned int
+bandQuantum (const struct tr_band * band)
+{
+    const unsigned int quantum = ((uint64_t)band->desiredSpeed_Bps * BANDWIDTH_QUANTUM_MSEC) / 1000u;
+
+    return MAX (quantum, BANDWIDTH_QUANTUM_MIN);
+}
+
+/* add the tokens earned since the last refill, up to the bucket's capacity */
+static void
+bandRefill (const struct tr_band * band, uint64_t now)
+{
+    if (now > band->lastRefill)
     {
-        const uint64_t nextPulseSpeed = b->band[dir].desiredSpeed_Bps;
-        b->band[dir].bytesLeft = (unsigned int)(nextPulseSpeed * period_msec) / 1000u;
+        const int64_t capacity = bandCapacity (band);
+        const int64_t speed = band->desiredSpeed_Bps;
+        int64_t msec = now - band->lastRefill;
+        struct tr_band * bvolatile = (struct tr_band*) band;
+
+        /* don't overflow when a bucket has sat idle for a long time */
+        if (speed > 0)
+            msec = MIN (msec, (capacity - band->tokens) / speed + 1);
+
+        bvolatile->tokens = MIN (capacity, band->tokens + speed * msec);
+        bvolatile->lastRefill = now;
     }
+}
+
+/* the nearest band above (and including) b that is starving it */
+static tr_bandwidth *
+getDryBandwidth (tr_bandwidth * b, tr_direction dir, uint64_t now)
+{
+    while (b != NULL)
+    {
+        const struct tr_band * band = &b->band[dir];
+
+        if (band->isLimited)
+        {
+            bandRefill (band, now);
 
-    /* add this bandwidth's peer, if any, to the peer pool */
-    if (b->peer != NULL) {
-        b->peer->priority = priority;
-        tr_ptrArrayAppend (peer_pool, b->peer);
+            if (band->tokens < 1000)
+                return b;
+        }
+
+        b = band->honorParentLimits ? b->parent : NULL;
     }
 
-    /* traverse & repeat for the subtree */
-    if (1) {
-        int i;
-        struct tr_bandwidth ** children = (struct tr_bandwidth**) tr_ptrArrayBase (&b->children);
-        const int n = tr_ptrArraySize (&b->children);
-        for (i=0; i<n; ++i)
-            allocateBandwidth (children[i], priority, dir, period_msec, peer_pool);
+    return NULL;
+}
+
+static tr_priority_t
+getEffectivePriority (const tr_bandwidth * b)
+{
+    tr_priority_t priority = b->priority;
+
+    while ((b = b->parent))
+        priority = MAX (priority, b->priority);
+
+    return priority;
+}
+
+/***
+****  Wait queues
+***/
+
+static void
+waitListAppend (tr_bandwidth * owner, tr_direction dir, tr_bandwidth * b, tr_priority_t priority)
+{
+    struct tr_band * band = &owner->band[dir];
+    struct tr_band * waiter = &b->band[dir];
+    const int i = priority - TR_PRI_LOW;
+
+    assert (waiter->waitingOn == NULL);
+    assert (0 <= i && i < BANDWIDTH_PRIORITY_COUNT);
+
+    waiter->waitingOn = owner;
+    waiter->waitPriority = i;
+    waiter->waitNext = NULL;
+    waiter->waitPrev = band->waitTail[i];
+
+    if (band->waitTail[i] != NULL)
+        band->waitTail[i]->band[dir].waitNext = b;
+    else
+        band->waitHead[i] = b;
+
+    band->waitTail[i] = b;
+    ++band->waitCount;
+}
+
+static void
+waitListRemove (tr_bandwidth * b, tr_direction dir)
+{
+    struct tr_band * waiter = &b->band[dir];
+    struct tr_band * band = &waiter->waitingOn->band[dir];
+    const int i = waiter->waitPriority;
+
+    if (waiter->waitPrev != NULL)
+        waiter->waitPrev->band[dir].waitNext = waiter->waitNext;
+    else
+        band->waitHead[i] = waiter->waitNext;
+
+    if (waiter->waitNext != NULL)
+        waiter->waitNext->band[dir].waitPrev = waiter->waitPrev;
+    else
+        band->waitTail[i] = waiter->waitPrev;
+
+    --band->waitCount;
+    waiter->waitingOn = NULL;
+    waiter->waitPrev = NULL;
+    waiter->waitNext = NULL;
+}
+
+static unsigned int
+getWakeDelay_msec (const tr_bandwidth * b, tr_direction dir, uint64_t now)
+{
+    const struct tr_band * band = &b->band[dir];
+    int64_t wanted;
+
+    /* nothing to refill; the waiters just want another look soon */
+    if (!band->isLimited)
+        return BANDWIDTH_QUANTUM_MSEC;
+
+    /* nothing will refill until someone raises the limit */
+    if (band->desiredSpeed_Bps == 0)
+        return BANDWIDTH_IDLE_MSEC;
+
+    /* wait until there's a full quantum to hand out */
+    bandRefill (band, now);
+    wanted = (int64_t)bandQuantum (band) * 1000;
+    if (band->tokens >= wanted)
+        return 0;
+
+    wanted = (wanted - band->tokens + band->desiredSpeed_Bps - 1) / band->desiredSpeed_Bps;
+    return MIN (wanted, BANDWIDTH_IDLE_MSEC);
+}
+
+static void onWakeTimer (evutil_socket_t fd, short what, void * vb);
+
+static void
+armWakeTimer (tr_bandwidth * b, uint64_t now)
+{
+    int dir;
+    unsigned int msec = UINT_MAX;
+
+    for (dir=0; dir<2; ++dir)
+        if (b->band[dir].waitCount > 0)
+            msec = MIN (msec, getWakeDelay_msec (b, dir, now));
+
+    if (msec != UINT_MAX)
+    {
+        if (b->wakeTimer == NULL)
+            b->wakeTimer = evtimer_new (b->session->event_base, onWakeTimer, b);
+
+        tr_timerAddMsec (b->wakeTimer, msec);
     }
 }
 
 static void
-phaseOne (tr_ptrArray * peerArray, tr_direction dir)
+wakePeer (tr_peerIo * io, tr_direction dir, unsigned int quantum)
 {
-    int n;
-    int peerCount = tr_ptrArraySize (peerArray);
-    struct tr_peerIo ** peers = (struct tr_peerIo**) tr_ptrArrayBase (peerArray);
-
-    /* First phase of IO. Tries to distribute bandwidth fairly to keep faster
-     * peers from starving the others. Loop through the peers, giving each a
-     * small chunk of bandwidth. Keep looping until we run out of bandwidth
-     * and/or peers that can use it */
-    n = peerCount;
-    dbgmsg ("%d peers to go round-robin for %s", n, (dir==TR_UP?"upload":"download"));
-    while (n > 0)
+    tr_peerIoRef (io);
+
+    /* give the peer a head start, then let it poll for more */
+    tr_peerIoFlush (io, dir, quantum);
+
+    if (!tr_bandwidthIsWaiting (&io->bandwidth, dir))
     {
-        const int i = tr_cryptoWeakRandInt (n); /* pick a peer at random */
+        const bool hasBandwidth = tr_peerIoHasBandwidthLeft (io, dir);
+
+        tr_peerIoSetEnabled (io, dir, hasBandwidth);
+
+        if (!hasBandwidth)
+            tr_bandwidthWait (&io->bandwidth, dir);
+    }
 
-        /* value of 3000 bytes chosen so that when using uTP we'll send a full-size
-         * frame right away and leave enough buffered data for the next frame to go
-         * out in a timely manner. */
-        const size_t increment = 3000;
+    tr_peerIoUnref (io);
+}
+
+static void
+wakeWaiters (tr_bandwidth * b, tr_direction dir, uint64_t now)
+{
+    struct tr_band * band = &b->band[dir];
+    const unsigned int quantum = band->isLimited ? bandQuantum (band)
+                                                 : (unsigned int)BANDWIDTH_UNLIMITED_QUANTUM;
 
-        const int bytesUsed = tr_peerIoFlush (peers[i], dir, increment);
+    /* Only look at the peers that were waiting when we started,
+     * since waking a peer can send it straight back to the queue.
+     * Stop when the band runs dry again; the rest wait for the next refill. */
+    int n = band->waitCount;
 
-        dbgmsg ("peer #%d of %d used %d bytes in this pass", i, n, bytesUsed);
+    while (n-- > 0)
+    {
+        int i;
+        tr_bandwidth * waiter = NULL;
+
+        if (band->isLimited)
+        {
+            bandRefill (band, now);
 
-        if (bytesUsed != (int)increment) {
-            /* peer is done writing for now; move it to the end of the list */
-            tr_peerIo * pio = peers[i];
-            peers[i] = peers[n-1];
-            peers[n-1] = pio;
-            --n;
+            if (band->tokens < 1000)
+                break;
         }
+
+        for (i=BANDWIDTH_PRIORITY_COUNT-1; i>=0 && waiter==NULL; --i)
+            waiter = band->waitHead[i];
+
+        if (waiter == NULL)
+            break;
+
+        waitListRemove (waiter, dir);
+
+        if (waiter->peer != NULL)
+            wakePeer (waiter->peer, dir, quantum);
     }
 }
 
+static void
+onWakeTimer (evutil_socket_t fd UNUSED, short what UNUSED, void * vb)
+{
+    tr_bandwidth * b = vb;
+    tr_session * session = b->session;
+    uint64_t now;
+
+    assert (tr_isBandwidth (b));
+
+    tr_sessionLock (session);
+
+    now = tr_time_msec ();
+    wakeWaiters (b, TR_UP, now);
+    wakeWaiters (b, TR_DOWN, now);
+    armWakeTimer (b, tr_time_msec ());
+
+    tr_sessionUnlock (session);
+}
+
 void
-tr_bandwidthAllocate (tr_bandwidth  * b,
-                      tr_direction    dir,
-                      unsigned int    period_msec)
+tr_bandwidthWait (tr_bandwidth * b, tr_direction dir)
 {
-    int i, peerCount;
-    tr_ptrArray tmp = TR_PTR_ARRAY_INIT;
-    tr_ptrArray low = TR_PTR_ARRAY_INIT;
-    tr_ptrArray high = TR_PTR_ARRAY_INIT;
-    tr_ptrArray normal = TR_PTR_ARRAY_INIT;
-    struct tr_peerIo ** peers;
-
-    /* allocateBandwidth () is a helper function with two purposes:
-     * 1. allocate bandwidth to b and its subtree
-     * 2. accumulate an array of all the peerIos from b and its subtree. */
-    allocateBandwidth (b, TR_PRI_LOW, dir, period_msec, &tmp);
-    peers = (struct tr_peerIo**) tr_ptrArrayBase (&tmp);
-    peerCount = tr_ptrArraySize (&tmp);
-
-    for (i=0; i<peerCount; ++i)
+    uint64_t now;
+    tr_bandwidth * owner;
+
+    assert (tr_isBandwidth (b));
+    assert (tr_isDirection (dir));
+
+    if (tr_bandwidthIsWaiting (b, dir))
+        return;
+
+    /* if no band is starving b, it waits on itself for a quick retry */
+    now = tr_time_msec ();
+    if ((owner = getDryBandwidth (b, dir, now)) == NULL)
+        owner = b;
+
+    waitListAppend (owner, dir, b, getEffectivePriority (b));
+    armWakeTimer (owner, now);
+}
+
+void
+tr_bandwidthClearWaiters (tr_bandwidth * b)
+{
+    int dir;
+
+    assert (tr_isBandwidth (b));
+
+    for (dir=0; dir<2; ++dir)
     {
-        tr_peerIo * io = peers[i];
-        tr_peerIoRef (io);
+        int i;
+        struct tr_band * band = &b->band[dir];
 
-        tr_peerIoFlushOutgoingProtocolMsgs (io);
+        if (band->waitingOn != NULL)
+            waitListRemove (b, dir);
 
-        switch (io->priority) {
-            case TR_PRI_HIGH:   tr_ptrArrayAppend (&high,   io); /* fall through */
-            case TR_PRI_NORMAL: tr_ptrArrayAppend (&normal, io); /* fall through */
-            default:            tr_ptrArrayAppend (&low,    io);
-        }
+        for (i=0; i<BANDWIDTH_PRIORITY_COUNT; ++i)
+            while (band->waitHead[i] != NULL)
+                waitListRemove (band->waitHead[i], dir);
     }
 
-    /* First phase of IO. Tries to distribute bandwidth fairly to keep faster
-     * peers from starving the others. Loop through the peers, giving each a
-     * small chunk of bandwidth. Keep looping until we run out of bandwidth
-     * and/or peers that can use it */
-    phaseOne (&high, dir);
-    phaseOne (&normal, dir);
-    phaseOne (&low, dir);
-
-    /* Second phase of IO. To help us scale in high bandwidth situations,
-     * enable on-demand IO for peers with bandwidth left to burn.
-     * This on-demand IO is enabled until (1) the peer runs out of bandwidth,
-     * or (2) the next tr_bandwidthAllocate () call, when we start over again. */
-    for (i=0; i<peerCount; ++i)
-        tr_peerIoSetEnabled (peers[i], dir, tr_peerIoHasBandwidthLeft (peers[i], dir));
-
-    for (i=0; i<peerCount; ++i)
-        tr_peerIoUnref (peers[i]);
-
-    /* cleanup */
-    tr_ptrArrayDestruct (&normal, NULL);
-    tr_ptrArrayDestruct (&high, NULL);
-    tr_ptrArrayDestruct (&low, NULL);
-    tr_ptrArrayDestruct (&tmp, NULL);
+    if (b->wakeTimer != NULL)
+    {
+        event_free (b->wakeTimer);
+        b->wakeTimer = NULL;
+    }
 }
 
 void
@@ -312,32 +481,22 @@ bandwidthClamp (const tr_bandwidth  * b,
 
     if (b)
     {
-        if (b->band[dir].isLimited)
+        const struct tr_band * band = &b->band[dir];
+
+        if (band->isLimited && (byteCount > 0))
         {
-            byteCount = MIN (byteCount, b->band[dir].bytesLeft);
-
-            /* if we're getting close to exceeding the speed limit,
-             * clamp down harder on the bytes available */
-            if (byteCount > 0)
-            {
-                double current;
-                double desired;
-                double r;
-
-                if (now == 0)
-                    now = tr_time_msec ();
-
-                current = tr_bandwidthGetRawSpeed_Bps (b, now, TR_DOWN);
-                desired = tr_bandwidthGetDesiredSpeed_Bps (b, TR_DOWN);
-                r = desired >= 1 ? current / desired : 0;
-
-                     if (r > 1.0) byteCount = 0;
-                else if (r > 0.9) byteCount *= 0.8;
-                else if (r > 0.8) byteCount *= 0.9;
-            }
+            if (now == 0)
+                now = tr_time_msec ();
+
+            /* take no more than the bucket holds, and while other
+             * peers are queued for it, no more than a quantum */
+            bandRefill (band, now);
+            byteCount = band->tokens > 0 ? MIN (byteCount, band->tokens / 1000) : 0;
+            if (band->waitCount > 0)
+                byteCount = MIN (byteCount, bandQuantum (band));
         }
 
-        if (b->parent && b->band[dir].honorParentLimits && (byteCount > 0))
+        if (b->parent && band->honorParentLimits && (byteCount > 0))
             byteCount = bandwidthClamp (b->parent, now, dir, byteCount);
     }
 
@@ -351,6 +510,15 @@ tr_bandwidthClamp (const tr_bandwidth  * b,
     return bandwidthClamp (b, 0, dir, byteCount);
 }
 
+unsigned int
+tr_bandwidthClampAt (const tr_bandwidth  * b,
+                     uint64_t              now,
+                     tr_direction          dir,
+                     unsigned int          byteCount)
+{
+    return bandwidthClamp (b, now, dir, byteCount);
+}
+
 
 unsigned int
 tr_bandwidthGetRawSpeed_Bps (const tr_bandwidth * b, const uint64_t now, const tr_direction dir)
@@ -385,12 +553,12 @@ tr_bandwidthUsed (tr_bandwidth  * b,
     band = &b->band[dir];
 
     if (band->isLimited && isPieceData)
-        band->bytesLeft -= MIN (band->bytesLeft, byteCount);
+        band->tokens -= (int64_t)byteCount * 1000;
 
 #ifdef DEBUG_DIRECTION
 if ((dir == DEBUG_DIRECTION) && (band->isLimited))
-fprintf (stderr, "%p consumed %5zu bytes of %5s data... was %6zu, now %6zu left\n",
-         b, byteCount, (isPieceData?"piece":"raw"), oldBytesLeft, band->bytesLeft);
+fprintf (stderr, "%p consumed %5zu bytes of %5s data... now %6lld left\n",
+         b, byteCount, (isPieceData?"piece":"raw"), (long long)(band->tokens / 1000));
 #endif
 
     bytesUsed (now, &band->raw, byteCount);
@@ -23,6 +23,7 @@
 #include "ptrarray.h"
 #include "utils.h" /* tr_new (), tr_free () */
 
+struct event;
 struct tr_peerIo;
 
 /**
@@ -38,7 +39,25 @@ enum
     INTERVAL_MSEC = HISTORY_MSEC,
     GRANULARITY_MSEC = 200,
     HISTORY_SIZE = (INTERVAL_MSEC / GRANULARITY_MSEC),
-    BANDWIDTH_MAGIC_NUMBER = 43143
+    BANDWIDTH_MAGIC_NUMBER = 43143,
+
+    /* a limited band hands out at most this many milliseconds' worth of
+     * bytes per I/O call, but never less than BANDWIDTH_QUANTUM_MIN bytes.
+     * 3000 bytes is enough for uTP to send a full-size frame right away
+     * and leave enough buffered for the next frame to go out promptly. */
+    BANDWIDTH_QUANTUM_MSEC = 10,
+    BANDWIDTH_QUANTUM_MIN = 3000,
+
+    /* how much a peer woken by an unlimited band may move right away */
+    BANDWIDTH_UNLIMITED_QUANTUM = 256 * 1024,
+
+    /* how many milliseconds' worth of bytes an idle band may save up */
+    BANDWIDTH_BURST_MSEC = 100,
+
+    /* how often to look at waiters whose band has no speed to give */
+    BANDWIDTH_IDLE_MSEC = 500,
+
+    BANDWIDTH_PRIORITY_COUNT = 3 /* TR_PRI_LOW, TR_PRI_NORMAL, TR_PRI_HIGH */
 };
 
 /* these are PRIVATE IMPLEMENTATION details that should not be touched.
@@ -57,10 +76,27 @@ struct tr_band
 {
     bool isLimited;
     bool honorParentLimits;
-    unsigned int bytesLeft;
     unsigned int desiredSpeed_Bps;
     struct bratecontrol raw;
     struct bratecontrol piece;
+
+    /* the token bucket, in thousandths of a byte so that refilling
+     * desiredSpeed_Bps for a number of msec is exact. see bandRefill ().
+     * It goes negative when a write overshoots its clamp (libevent sends
+     * an evbuffer_add_file () segment whole), and that debt is paid back. */
+    int64_t tokens;
+    uint64_t lastRefill;
+
+    /* peer bandwidths waiting for this band to refill, one FIFO per priority */
+    struct tr_bandwidth * waitHead[BANDWIDTH_PRIORITY_COUNT];
+    struct tr_bandwidth * waitTail[BANDWIDTH_PRIORITY_COUNT];
+    int waitCount;
+
+    /* if this is a peer's bandwidth and it is waiting, the band it waits on */
+    struct tr_bandwidth * waitingOn;
+    struct tr_bandwidth * waitPrev;
+    struct tr_bandwidth * waitNext;
+    int waitPriority;
 };
 
 /**
@@ -90,17 +126,20 @@ struct tr_band
  *
  * CONSTRAINING
  *
- *   Call tr_bandwidthAllocate () periodically. tr_bandwidth knows its current
- *   speed and will decide how many bytes to make available over the
- *   user-specified period to reach the user-specified desired speed.
- *   If appropriate, it notifies its peer-ios that new bandwidth is available.
- *
- *   tr_bandwidthAllocate () operates on the tr_bandwidth subtree, so usually
- *   you'll only need to invoke it for the top-level tr_session bandwidth.
- *
+ *   Each limited bandwidth is a token bucket that refills continuously at
+ *   its desired speed and can save up BANDWIDTH_BURST_MSEC worth of bytes.
  *   The peer-ios all have a pointer to their associated tr_bandwidth object,
  *   and call tr_bandwidthClamp () before performing I/O to see how much
- *   bandwidth they can safely use.
+ *   they can safely use. The answer is bounded by every limited ancestor
+ *   whose limits are honored, and by a small quantum so that one fast peer
+ *   can't drain a bucket that its siblings are sharing.
+ *
+ *   When a peer-io is clamped down to nothing, it stops polling its socket
+ *   and calls tr_bandwidthWait (). That queues the peer on the bucket that
+ *   ran dry, and that bucket's timer wakes the queue as soon as it has
+ *   refilled, highest priority first and in FIFO order within a priority.
+ *   Peers that have bandwidth are never visited, so the cost is
+ *   proportional to the number of starved peers, not to the number of peers.
  */
 typedef struct tr_bandwidth
 {
@@ -115,6 +154,7 @@ typedef struct tr_bandwidth
     tr_session * session;
     tr_ptrArray children; /* struct tr_bandwidth */
     struct tr_peerIo * peer;
+    struct event * wakeTimer;
 }
 tr_bandwidth;
 
@@ -187,11 +227,28 @@ static inline bool tr_bandwidthIsLimited (const tr_bandwidth  * bandwidth,
 }
 
 /**
- * @brief allocate the next period_msec's worth of bandwidth for the peer-ios to consume
+ * @brief queue a peer's bandwidth until the band that starved it has refilled.
+ *
+ * When it has, the peer-io is flushed and re-enabled. If no band is starving
+ * it, the peer is woken again after BANDWIDTH_QUANTUM_MSEC.
  */
-void    tr_bandwidthAllocate        (tr_bandwidth        * bandwidth,
-                                        tr_direction          direction,
-                                        unsigned int          period_msec);
+void    tr_bandwidthWait            (tr_bandwidth        * bandwidth,
+                                        tr_direction          direction);
+
+/**
+ * @brief stop waiting, forget this bandwidth's waiters, and free its timer.
+ *
+ * tr_bandwidthDestruct () does this too, but tr_session's bandwidth outlives
+ * the event loop and has to do it while the loop is still around.
+ */
+void    tr_bandwidthClearWaiters    (tr_bandwidth        * bandwidth);
+
+/** @return true if the bandwidth is queued by tr_bandwidthWait () */
+static inline bool tr_bandwidthIsWaiting (const tr_bandwidth  * bandwidth,
+                                          tr_direction          direction)
+{
+    return bandwidth->band[direction].waitingOn != NULL;
+}
 
 /**
  * @brief clamps byteCount down to a number that this bandwidth will allow to be consumed
@@ -200,6 +257,15 @@ unsigned int  tr_bandwidthClamp     (const tr_bandwidth  * bandwidth,
                                         tr_direction          direction,
                                         unsigned int          byteCount);
 
+/**
+ * @brief like tr_bandwidthClamp (), but refills the buckets as of `now' msec
+ * @see tr_bandwidthUsed
+ */
+unsigned int  tr_bandwidthClampAt   (const tr_bandwidth  * bandwidth,
+                                        uint64_t              now,
+                                        tr_direction          direction,
+                                        unsigned int          byteCount);
+
 /******
 *******
 ******/
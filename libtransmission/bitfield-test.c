@@ -1,8 +1,9 @@
-#include <string.h> /* strlen () */
+#include <stdio.h> /* fprintf () */
+#include <string.h> /* strcmp () */
 #include "transmission.h"
 #include "crypto.h"
 #include "bitfield.h"
-#include "utils.h" /* tr_free */
+#include "utils.h" /* tr_free (), tr_time_msec () */
 
 #include "libtransmission-test.h"
 
@@ -108,12 +109,220 @@ test_bitfields (void)
   return 0;
 }
 
+static void
+randomBitfield (tr_bitfield * b, size_t bit_count, int percent)
+{
+  size_t i;
+  bool * flags = tr_new (bool, bit_count);
+
+  for (i=0; i<bit_count; ++i)
+    flags[i] = (int)tr_cryptoWeakRandInt (100) < percent;
+
+  tr_bitfieldConstruct (b, bit_count);
+  tr_bitfieldSetFromFlags (b, flags, bit_count);
+  tr_free (flags);
+}
+
+static int
+test_bitfield_rem (void)
+{
+  size_t i;
+  tr_bitfield b;
+
+  tr_bitfieldConstruct (&b, 100);
+  tr_bitfieldAddRange (&b, 0, 50);
+
+  /* removing a bit that's set clears it... */
+  tr_bitfieldRem (&b, 10);
+  check (!tr_bitfieldHas (&b, 10));
+  check_int_eq (49, tr_bitfieldCountTrueBits (&b));
+
+  /* ...and removing one that isn't is a no-op */
+  tr_bitfieldRem (&b, 10);
+  tr_bitfieldRem (&b, 70);
+  check_int_eq (49, tr_bitfieldCountTrueBits (&b));
+
+  /* removing from a full bitfield */
+  tr_bitfieldSetHasAll (&b);
+  tr_bitfieldRem (&b, 99);
+  check_int_eq (99, tr_bitfieldCountTrueBits (&b));
+  for (i=0; i<100; ++i)
+    check (tr_bitfieldHas (&b, i) == (i != 99));
+
+  tr_bitfieldDestruct (&b);
+  return 0;
+}
+
+static int
+test_bitfield_find_next_set (void)
+{
+  int l;
+
+  for (l=0; l<200; ++l)
+    {
+      size_t i;
+      size_t expected;
+      tr_bitfield b;
+      const size_t bit_count = 1 + tr_cryptoWeakRandInt (2000);
+
+      randomBitfield (&b, bit_count, tr_cryptoWeakRandInt (4) == 0 ? 50 : 1);
+
+      /* walk the bits both ways */
+      expected = 0;
+      while (expected < bit_count && !tr_bitfieldHas (&b, expected))
+        ++expected;
+      for (i=0; i<=bit_count; ++i)
+        {
+          if (i > expected)
+            for (expected=i; expected<bit_count && !tr_bitfieldHas (&b, expected); )
+              ++expected;
+          check_int_eq (expected, tr_bitfieldFindNextSet (&b, i));
+        }
+
+      tr_bitfieldDestruct (&b);
+    }
+
+  return 0;
+}
+
+static int
+test_bitfield_set_algebra (void)
+{
+  int l;
+
+  for (l=0; l<200; ++l)
+    {
+      size_t i;
+      size_t count;
+      bool intersects;
+      tr_bitfield a;
+      tr_bitfield b;
+      tr_bitfield c;
+      const size_t bit_count = 1 + tr_cryptoWeakRandInt (3000);
+
+      randomBitfield (&a, bit_count, tr_cryptoWeakRandInt (100));
+      randomBitfield (&b, bit_count, tr_cryptoWeakRandInt (3) == 0 ? 1 : 50);
+
+      /* sometimes, try the special cases */
+      switch (l % 7)
+        {
+          case 1: tr_bitfieldSetHasAll (&a); break;
+          case 2: tr_bitfieldSetHasNone (&a); break;
+          case 3: tr_bitfieldSetHasAll (&b); break;
+          case 4: tr_bitfieldSetHasNone (&b); break;
+          default: break;
+        }
+
+      count = 0;
+      for (i=0; i<bit_count; ++i)
+        if (tr_bitfieldHas (&a, i) && tr_bitfieldHas (&b, i))
+          ++count;
+      intersects = count > 0;
+
+      check (tr_bitfieldIntersects (&a, &b) == intersects);
+      check (tr_bitfieldIntersects (&b, &a) == intersects);
+      check_int_eq (count, tr_bitfieldCountIntersection (&a, &b));
+      check_int_eq (count, tr_bitfieldCountIntersection (&b, &a));
+
+      tr_bitfieldConstruct (&c, bit_count);
+      tr_bitfieldSetFromBitfield (&c, &a);
+      tr_bitfieldSetIntersection (&c, &b);
+      for (i=0; i<bit_count; ++i)
+        check (tr_bitfieldHas (&c, i) == (tr_bitfieldHas (&a, i) && tr_bitfieldHas (&b, i)));
+      check_int_eq (count, tr_bitfieldCountTrueBits (&c));
+
+      tr_bitfieldSetFromBitfield (&c, &a);
+      tr_bitfieldSetDifference (&c, &b);
+      count = 0;
+      for (i=0; i<bit_count; ++i)
+        {
+          const bool expected = tr_bitfieldHas (&a, i) && !tr_bitfieldHas (&b, i);
+          check (tr_bitfieldHas (&c, i) == expected);
+          count += expected;
+        }
+      check_int_eq (count, tr_bitfieldCountTrueBits (&c));
+
+      tr_bitfieldDestruct (&c);
+      tr_bitfieldDestruct (&b);
+      tr_bitfieldDestruct (&a);
+    }
+
+  return 0;
+}
+
+/***
+****  Benchmarks: run with --benchmark
+***/
+
+#define BENCH_BITS (256 * 1024)
+#define BENCH_LOOPS 1000
+
+static void
+benchmark_bitfield (void)
+{
+  int l;
+  size_t i;
+  size_t sum;
+  uint64_t begin;
+  tr_bitfield have;
+  tr_bitfield want;
+
+  randomBitfield (&have, BENCH_BITS, 50);
+  randomBitfield (&want, BENCH_BITS, 1);
+
+  fprintf (stderr, "%d bits, %d passes each\n", BENCH_BITS, BENCH_LOOPS);
+
+  /* popcount a range */
+  begin = tr_time_msec ();
+  for (l=0, sum=0; l<BENCH_LOOPS; ++l)
+    for (i=1; i<BENCH_BITS-1; ++i)
+      sum += tr_bitfieldHas (&have, i);
+  fprintf (stderr, "%-34s %6" PRIu64 " msec (%zu)\n", "count range, per-bit", tr_time_msec () - begin, sum);
+
+  begin = tr_time_msec ();
+  for (l=0, sum=0; l<BENCH_LOOPS; ++l)
+    sum += tr_bitfieldCountRange (&have, 1, BENCH_BITS-1);
+  fprintf (stderr, "%-34s %6" PRIu64 " msec (%zu)\n", "count range, tr_bitfieldCountRange", tr_time_msec () - begin, sum);
+
+  /* "pieces this peer has that we want" */
+  begin = tr_time_msec ();
+  for (l=0, sum=0; l<BENCH_LOOPS; ++l)
+    for (i=0; i<BENCH_BITS; ++i)
+      sum += tr_bitfieldHas (&want, i) && tr_bitfieldHas (&have, i);
+  fprintf (stderr, "%-34s %6" PRIu64 " msec (%zu)\n", "intersection, per-bit", tr_time_msec () - begin, sum);
+
+  begin = tr_time_msec ();
+  for (l=0, sum=0; l<BENCH_LOOPS; ++l)
+    sum += tr_bitfieldCountIntersection (&want, &have);
+  fprintf (stderr, "%-34s %6" PRIu64 " msec (%zu)\n", "intersection, tr_bitfield", tr_time_msec () - begin, sum);
+
+  /* walk the set bits of a sparse bitfield */
+  begin = tr_time_msec ();
+  for (l=0, sum=0; l<BENCH_LOOPS; ++l)
+    for (i=0; i<BENCH_BITS; ++i)
+      if (tr_bitfieldHas (&want, i))
+        sum += i;
+  fprintf (stderr, "%-34s %6" PRIu64 " msec (%zu)\n", "iterate set bits, per-bit", tr_time_msec () - begin, sum);
+
+  begin = tr_time_msec ();
+  for (l=0, sum=0; l<BENCH_LOOPS; ++l)
+    for (i=tr_bitfieldFindNextSet (&want, 0); i<BENCH_BITS; i=tr_bitfieldFindNextSet (&want, i+1))
+      sum += i;
+  fprintf (stderr, "%-34s %6" PRIu64 " msec (%zu)\n", "iterate set bits, find-next-set", tr_time_msec () - begin, sum);
+
+  tr_bitfieldDestruct (&want);
+  tr_bitfieldDestruct (&have);
+}
+
 int
-main (void)
+main (int argc, char ** argv)
 {
   int l;
   int ret;
-  const testFunc tests[] = { test_bitfields };
+  const testFunc tests[] = { test_bitfields,
+                             test_bitfield_rem,
+                             test_bitfield_find_next_set,
+                             test_bitfield_set_algebra };
 
   if ((ret = runTests (tests, NUM_TESTS (tests))))
     return ret;
@@ -123,5 +332,8 @@ main (void)
     if ((ret = test_bitfield_count_range ()))
       return ret;
 
+  if ((argc > 1) && !strcmp (argv[1], "--benchmark"))
+    benchmark_bitfield ();
+
   return 0;
 }
@@ -12,7 +12,13 @@
 
 #include <assert.h>
 #include <stdlib.h> /* realloc () */
-#include <string.h> /* memset */
+#include <string.h> /* memcpy (), memset () */
+
+#if defined (__GNUC__) && (defined (__x86_64__) || defined (__i386__)) \
+    && (defined (__clang__) || (__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+ #define HAVE_BITFIELD_AVX2
+ #include <immintrin.h>
+#endif
 
 #include "transmission.h"
 #include "bitfield.h"
@@ -44,18 +50,235 @@ static const int8_t trueBitCount[256] =
   4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8
 };
 
+/***
+****  Word-wide kernels
+****
+****  Counting and masking don't care about the order of the bits,
+****  so these work a 64-bit word at a time -- or on CPUs with AVX2,
+****  a 256-bit vector at a time -- instead of a byte at a time.
+***/
+
+static inline uint64_t
+loadWord (const uint8_t * bytes)
+{
+  uint64_t word;
+  memcpy (&word, bytes, sizeof (word));
+  return word;
+}
+
+/* the bits are stored most-significant first, as on the wire,
+ * so a big-endian load keeps bit 0 in the word's high bit */
+static inline uint64_t
+loadWordBigEndian (const uint8_t * bytes)
+{
+  int i;
+  uint64_t word = 0;
+
+  for (i=0; i<8; ++i)
+    word = (word << 8) | bytes[i];
+
+  return word;
+}
+
+static inline int
+popcount64 (uint64_t x)
+{
+  x = x - ((x >> 1) & 0x5555555555555555ull);
+  x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+  x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0full;
+  return (int)((x * 0x0101010101010101ull) >> 56);
+}
+
+static inline int
+countLeadingZeroes64 (uint64_t x)
+{
+#ifdef __GNUC__
+  return __builtin_clzll (x);
+#else
+  int n = 0;
+  while (!(x & 0x8000000000000000ull))
+    {
+      x <<= 1;
+      ++n;
+    }
+  return n;
+#endif
+}
+
 static size_t
-countArray (const tr_bitfield * b)
+countBytes_scalar (const uint8_t * a, size_t n)
 {
+  size_t i;
   size_t ret = 0;
-  ssize_t i = b->alloc_count;
 
-  while (--i >= 0)
-    ret += trueBitCount[b->bits[i]];
+  for (i=0; i+8<=n; i+=8)
+    ret += popcount64 (loadWord (a+i));
+  for (; i<n; ++i)
+    ret += trueBitCount[a[i]];
 
   return ret;
 }
 
+static size_t
+countAndBytes_scalar (const uint8_t * a, const uint8_t * b, size_t n)
+{
+  size_t i;
+  size_t ret = 0;
+
+  for (i=0; i+8<=n; i+=8)
+    ret += popcount64 (loadWord (a+i) & loadWord (b+i));
+  for (; i<n; ++i)
+    ret += trueBitCount[a[i] & b[i]];
+
+  return ret;
+}
+
+#ifdef HAVE_BITFIELD_AVX2
+
+#define TR_TARGET_AVX2 __attribute__ ((target ("avx2")))
+
+/* Mula's nibble-lookup popcount: look up the count of each nibble
+ * with a byte shuffle, then sum the bytes into 64-bit lanes */
+static inline __m256i TR_TARGET_AVX2
+popcount256 (__m256i v)
+{
+  const __m256i lookup = _mm256_setr_epi8 (0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low_mask = _mm256_set1_epi8 (0x0f);
+  const __m256i lo = _mm256_and_si256 (v, low_mask);
+  const __m256i hi = _mm256_and_si256 (_mm256_srli_epi16 (v, 4), low_mask);
+  const __m256i counts = _mm256_add_epi8 (_mm256_shuffle_epi8 (lookup, lo),
+                                          _mm256_shuffle_epi8 (lookup, hi));
+
+  return _mm256_sad_epu8 (counts, _mm256_setzero_si256 ());
+}
+
+static inline size_t TR_TARGET_AVX2
+sumLanes (__m256i acc)
+{
+  return (size_t)_mm256_extract_epi64 (acc, 0) + (size_t)_mm256_extract_epi64 (acc, 1)
+       + (size_t)_mm256_extract_epi64 (acc, 2) + (size_t)_mm256_extract_epi64 (acc, 3);
+}
+
+static size_t TR_TARGET_AVX2
+countBytes_avx2 (const uint8_t * a, size_t n)
+{
+  size_t i;
+  __m256i acc = _mm256_setzero_si256 ();
+
+  for (i=0; i+32<=n; i+=32)
+    acc = _mm256_add_epi64 (acc, popcount256 (_mm256_loadu_si256 ((const __m256i*)(a+i))));
+
+  return sumLanes (acc) + countBytes_scalar (a+i, n-i);
+}
+
+static size_t TR_TARGET_AVX2
+countAndBytes_avx2 (const uint8_t * a, const uint8_t * b, size_t n)
+{
+  size_t i;
+  __m256i acc = _mm256_setzero_si256 ();
+
+  for (i=0; i+32<=n; i+=32)
+    acc = _mm256_add_epi64 (acc, popcount256 (_mm256_and_si256 (_mm256_loadu_si256 ((const __m256i*)(a+i)),
+                                                                _mm256_loadu_si256 ((const __m256i*)(b+i)))));
+
+  return sumLanes (acc) + countAndBytes_scalar (a+i, b+i, n-i);
+}
+
+static bool
+cpuHasAVX2 (void)
+{
+  static int hasAVX2 = -1;
+
+  if (hasAVX2 < 0)
+    {
+      __builtin_cpu_init ();
+      hasAVX2 = __builtin_cpu_supports ("avx2") != 0;
+    }
+
+  return hasAVX2 != 0;
+}
+
+#endif /* HAVE_BITFIELD_AVX2 */
+
+/* short arrays aren't worth the vector setup */
+#define AVX2_MIN_BYTES 128
+
+static size_t
+countBytes (const uint8_t * a, size_t n)
+{
+#ifdef HAVE_BITFIELD_AVX2
+  if (n >= AVX2_MIN_BYTES && cpuHasAVX2 ())
+    return countBytes_avx2 (a, n);
+#endif
+
+  return countBytes_scalar (a, n);
+}
+
+static size_t
+countAndBytes (const uint8_t * a, const uint8_t * b, size_t n)
+{
+#ifdef HAVE_BITFIELD_AVX2
+  if (n >= AVX2_MIN_BYTES && cpuHasAVX2 ())
+    return countAndBytes_avx2 (a, b, n);
+#endif
+
+  return countAndBytes_scalar (a, b, n);
+}
+
+static bool
+anyAndBytes (const uint8_t * a, const uint8_t * b, size_t n)
+{
+  size_t i;
+
+  for (i=0; i+8<=n; i+=8)
+    if (loadWord (a+i) & loadWord (b+i))
+      return true;
+  for (; i<n; ++i)
+    if (a[i] & b[i])
+      return true;
+
+  return false;
+}
+
+static void
+andBytes (uint8_t * a, const uint8_t * b, size_t n)
+{
+  size_t i;
+
+  for (i=0; i+8<=n; i+=8)
+    {
+      const uint64_t word = loadWord (a+i) & loadWord (b+i);
+      memcpy (a+i, &word, sizeof (word));
+    }
+  for (; i<n; ++i)
+    a[i] &= b[i];
+}
+
+static void
+andNotBytes (uint8_t * a, const uint8_t * b, size_t n)
+{
+  size_t i;
+
+  for (i=0; i+8<=n; i+=8)
+    {
+      const uint64_t word = loadWord (a+i) & ~loadWord (b+i);
+      memcpy (a+i, &word, sizeof (word));
+    }
+  for (; i<n; ++i)
+    a[i] &= ~b[i];
+}
+
+/***
+****
+***/
+
+static size_t
+countArray (const tr_bitfield * b)
+{
+  return countBytes (b->bits, b->alloc_count);
+}
+
 static size_t
 countRange (const tr_bitfield * b, size_t begin, size_t end)
 {
@@ -100,8 +323,8 @@ countRange (const tr_bitfield * b, size_t begin, size_t end)
       ret += trueBitCount[val];
 
       /* middle bytes */
-      for (i=first_byte+1; i<walk_end; ++i)
-        ret += trueBitCount[b->bits[i]];
+      if (walk_end > first_byte+1)
+        ret += countBytes (b->bits + first_byte + 1, walk_end - (first_byte + 1));
 
       /* last byte */
       if (last_byte < b->alloc_count)
@@ -350,7 +573,18 @@ tr_bitfieldSetFromFlags (tr_bitfield * b, const bool * flags, size_t n)
   tr_bitfieldFreeArray (b);
   tr_bitfieldEnsureBitsAlloced (b, n);
 
-  for (i=0; i<n; ++i)
+  /* pack eight flags into each byte */
+  for (i=0; i+8<=n; i+=8)
+    {
+      const uint8_t byte = (flags[i+0] << 7) | (flags[i+1] << 6)
+                         | (flags[i+2] << 5) | (flags[i+3] << 4)
+                         | (flags[i+4] << 3) | (flags[i+5] << 2)
+                         | (flags[i+6] << 1) | (flags[i+7]);
+      b->bits[i >> 3u] = byte;
+      trueCount += trueBitCount[byte];
+    }
+
+  for (; i<n; ++i)
     {
       if (flags[i])
         {
@@ -414,7 +648,7 @@ tr_bitfieldRem (tr_bitfield * b, size_t nth)
 {
   assert (tr_bitfieldIsValid (b));
 
-  if (!tr_bitfieldHas (b, nth))
+  if (tr_bitfieldHas (b, nth))
     {
       tr_bitfieldEnsureNthBitAlloced (b, nth);
       b->bits[nth >> 3u] &= (0xff7f >> (nth & 7u));
@@ -458,3 +692,118 @@ tr_bitfieldRemRange (tr_bitfield * b, size_t begin, size_t end)
 
   tr_bitfieldIncTrueCount (b, -diff);
 }
+
+/***
+****  Set algebra
+***/
+
+bool
+tr_bitfieldIntersects (const tr_bitfield * a, const tr_bitfield * b)
+{
+  if (tr_bitfieldHasNone (a) || tr_bitfieldHasNone (b))
+    return false;
+
+  if (tr_bitfieldHasAll (a) || tr_bitfieldHasAll (b))
+    return true;
+
+  return anyAndBytes (a->bits, b->bits, MIN (a->alloc_count, b->alloc_count));
+}
+
+size_t
+tr_bitfieldCountIntersection (const tr_bitfield * a, const tr_bitfield * b)
+{
+  if (tr_bitfieldHasNone (a) || tr_bitfieldHasNone (b))
+    return 0;
+
+  if (tr_bitfieldHasAll (a))
+    return b->true_count;
+
+  if (tr_bitfieldHasAll (b))
+    return a->true_count;
+
+  return countAndBytes (a->bits, b->bits, MIN (a->alloc_count, b->alloc_count));
+}
+
+void
+tr_bitfieldSetIntersection (tr_bitfield * b, const tr_bitfield * other)
+{
+  size_t n;
+
+  if (tr_bitfieldHasAll (other) || tr_bitfieldHasNone (b))
+    return;
+
+  if (tr_bitfieldHasNone (other))
+    {
+      tr_bitfieldSetHasNone (b);
+      return;
+    }
+
+  if (tr_bitfieldHasAll (b))
+    {
+      tr_bitfieldSetFromBitfield (b, other);
+      return;
+    }
+
+  n = MIN (b->alloc_count, other->alloc_count);
+  andBytes (b->bits, other->bits, n);
+  memset (b->bits + n, 0, b->alloc_count - n);
+  tr_bitfieldRebuildTrueCount (b);
+}
+
+void
+tr_bitfieldSetDifference (tr_bitfield * b, const tr_bitfield * other)
+{
+  if (tr_bitfieldHasNone (other) || tr_bitfieldHasNone (b))
+    return;
+
+  if (tr_bitfieldHasAll (other))
+    {
+      tr_bitfieldSetHasNone (b);
+      return;
+    }
+
+  if (tr_bitfieldHasAll (b))
+    tr_bitfieldEnsureBitsAlloced (b, b->bit_count);
+
+  andNotBytes (b->bits, other->bits, MIN (b->alloc_count, other->alloc_count));
+  tr_bitfieldRebuildTrueCount (b);
+}
+
+size_t
+tr_bitfieldFindNextSet (const tr_bitfield * b, size_t begin)
+{
+  size_t i;
+  uint8_t val;
+
+  if (begin >= b->bit_count)
+    return b->bit_count;
+
+  if (tr_bitfieldHasAll (b))
+    return begin;
+
+  if (tr_bitfieldHasNone (b))
+    return b->bit_count;
+
+  i = begin >> 3u;
+  if (i >= b->alloc_count)
+    return b->bit_count;
+
+  /* the rest of the first byte */
+  val = b->bits[i] & (0xff >> (begin & 7u));
+  if (val)
+    return MIN (i*8 + countLeadingZeroes64 ((uint64_t)val << 56), b->bit_count);
+
+  /* then a word at a time */
+  for (++i; i+8<=b->alloc_count; i+=8)
+    {
+      const uint64_t word = loadWordBigEndian (b->bits + i);
+      if (word)
+        return MIN (i*8 + countLeadingZeroes64 (word), b->bit_count);
+    }
+
+  for (; i<b->alloc_count; ++i)
+    if (b->bits[i])
+      return MIN (i*8 + countLeadingZeroes64 ((uint64_t)b->bits[i] << 56), b->bit_count);
+
+  return b->bit_count;
+}
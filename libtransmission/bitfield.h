@@ -100,4 +100,27 @@ tr_bitfieldHasNone (const tr_bitfield * b)
 
 bool tr_bitfieldHas (const tr_bitfield * b, size_t n);
 
+/**
+ * @return the index of the first set bit at or after `begin',
+ *         or the bitfield's bit_count if there isn't one
+ */
+size_t tr_bitfieldFindNextSet (const tr_bitfield * b, size_t begin);
+
+/***
+****  Set algebra.
+****  These assume both bitfields have the same bit_count.
+***/
+
+/** @return true if any bit is set in both a and b */
+bool   tr_bitfieldIntersects (const tr_bitfield * a, const tr_bitfield * b);
+
+/** @return how many bits are set in both a and b */
+size_t tr_bitfieldCountIntersection (const tr_bitfield * a, const tr_bitfield * b);
+
+/** @brief clear the bits in b that aren't set in other */
+void   tr_bitfieldSetIntersection (tr_bitfield * b, const tr_bitfield * other);
+
+/** @brief clear the bits in b that are set in other */
+void   tr_bitfieldSetDifference (tr_bitfield * b, const tr_bitfield * other);
+
 #endif
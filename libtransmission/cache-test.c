@@ -0,0 +1,587 @@
+#include <stdio.h> /* fopen () */
+#include <stdlib.h> /* mkdtemp () */
+#include <string.h> /* memcmp () */
+
+#include <event2/buffer.h>
+
+#include "transmission.h"
+#include "cache.h"
+#include "crypto.h" /* tr_cryptoRandBuf () */
+#include "peer-common.h" /* MAX_BLOCK_SIZE */
+#include "session.h"
+#include "torrent.h"
+#include "utils.h"
+#include "variant.h"
+
+#include "libtransmission-test.h"
+
+enum
+{
+    PIECE_SIZE = 32 * 1024, /* two blocks per piece */
+    PIECE_COUNT = 16
+};
+
+/* the cache is only touched from the libtransmission thread,
+ * so each of these runs one call there and waits for it */
+struct cache_call
+{
+    tr_torrent * tor;
+    tr_block_index_t block;
+    uint8_t * buf;
+    int64_t limit;
+    int err;
+};
+
+static void
+getBlock (const struct cache_call * call, tr_piece_index_t * piece, uint32_t * offset, uint32_t * length)
+{
+    tr_torrentGetBlockLocation (call->tor, call->block, piece, offset, length);
+}
+
+static void
+writeBlockImpl (void * vcall)
+{
+    uint32_t offset;
+    uint32_t length;
+    tr_piece_index_t piece;
+    struct cache_call * call = vcall;
+    struct evbuffer * evbuf = evbuffer_new ();
+
+    getBlock (call, &piece, &offset, &length);
+    evbuffer_add (evbuf, call->buf, length);
+    call->err = tr_cacheWriteBlock (call->tor->session->cache, call->tor, piece, offset, length, evbuf);
+    evbuffer_free (evbuf);
+}
+
+static void
+readBlockImpl (void * vcall)
+{
+    uint32_t offset;
+    uint32_t length;
+    tr_piece_index_t piece;
+    struct cache_call * call = vcall;
+
+    getBlock (call, &piece, &offset, &length);
+    call->err = tr_cacheReadBlock (call->tor->session->cache, call->tor, piece, offset, length, call->buf);
+}
+
+static void
+setLimitImpl (void * vcall)
+{
+    struct cache_call * call = vcall;
+
+    call->err = tr_cacheSetLimit (call->tor->session->cache, call->limit);
+}
+
+static void
+flushTorrentImpl (void * vcall)
+{
+    struct cache_call * call = vcall;
+
+    call->err = tr_cacheFlushTorrent (call->tor->session->cache, call->tor);
+}
+
+static int
+cacheCall (void (*func)(void*), tr_torrent * tor, tr_block_index_t block, uint8_t * buf)
+{
+    struct cache_call call;
+
+    memset (&call, 0, sizeof (call));
+    call.tor = tor;
+    call.block = block;
+    call.buf = buf;
+    libttest_run_in_event_thread (tor->session, func, &call);
+    return call.err;
+}
+
+static int
+setLimit (tr_torrent * tor, int64_t limit)
+{
+    struct cache_call call;
+
+    memset (&call, 0, sizeof (call));
+    call.tor = tor;
+    call.limit = limit;
+    libttest_run_in_event_thread (tor->session, setLimitImpl, &call);
+    return call.err;
+}
+
+/* read straight from the file, behind the cache's back */
+static bool
+readFromFile (const char * path, tr_block_index_t block, uint8_t * buf)
+{
+    bool ok;
+    FILE * fp = fopen (path, "rb");
+
+    ok = (fp != NULL)
+      && !fseek (fp, (long)block * MAX_BLOCK_SIZE, SEEK_SET)
+      && (fread (buf, 1, MAX_BLOCK_SIZE, fp) == MAX_BLOCK_SIZE);
+
+    if (fp != NULL)
+        fclose (fp);
+
+    return ok;
+}
+
+/* tr_cacheReadBlockAsync () callbacks all land here */
+struct read_results
+{
+    const uint8_t * expected; /* the whole file */
+    int count;
+    int errors;
+    int mismatches;
+};
+
+static void
+onBlockRead (void * vresults, int err, tr_piece_index_t piece, uint32_t offset, uint32_t len, const uint8_t * data)
+{
+    struct read_results * results = vresults;
+
+    ++results->count;
+
+    if (err)
+        ++results->errors;
+    else if (memcmp (results->expected + (size_t)piece * PIECE_SIZE + offset, data, len))
+        ++results->mismatches;
+}
+
+struct read_async_data
+{
+    tr_torrent * tor;
+    tr_block_index_t first;
+    tr_block_index_t last;
+    struct read_results * results;
+};
+
+static void
+readBlocksAsyncImpl (void * vdata)
+{
+    tr_block_index_t i;
+    struct read_async_data * data = vdata;
+
+    for (i=data->first; i<=data->last; ++i)
+    {
+        uint32_t offset;
+        uint32_t length;
+        tr_piece_index_t piece;
+
+        tr_torrentGetBlockLocation (data->tor, i, &piece, &offset, &length);
+        tr_cacheReadBlockAsync (data->tor->session->cache, data->tor, piece, offset, length,
+                                onBlockRead, data->results);
+    }
+}
+
+static void
+readBlocksAsync (tr_torrent * tor, tr_block_index_t first, tr_block_index_t last, struct read_results * results)
+{
+    struct read_async_data data;
+
+    data.tor = tor;
+    data.first = first;
+    data.last = last;
+    data.results = results;
+    libttest_run_in_event_thread (tor->session, readBlocksAsyncImpl, &data);
+}
+
+struct read_cache_call
+{
+    tr_torrent * tor;
+    int64_t limit;
+    bool cached[PIECE_COUNT];
+};
+
+static void
+setReadLimitImpl (void * vcall)
+{
+    struct read_cache_call * call = vcall;
+
+    tr_cacheSetReadLimit (call->tor->session->cache, call->limit);
+}
+
+static void
+getCachedPiecesImpl (void * vcall)
+{
+    tr_piece_index_t i;
+    struct read_cache_call * call = vcall;
+
+    for (i=0; i<PIECE_COUNT; ++i)
+        call->cached[i] = tr_cacheHasBlock (call->tor->session->cache, call->tor, i, 0);
+}
+
+/* read a piece's first block `times' times, and wait for the answers */
+static void
+readPiece (tr_torrent * tor, tr_piece_index_t piece, int times, struct read_results * results)
+{
+    const tr_block_index_t block = piece * (PIECE_SIZE / MAX_BLOCK_SIZE);
+
+    while (times-- > 0)
+    {
+        const int count = results->count;
+
+        readBlocksAsync (tor, block, block, results);
+        while (results->count == count)
+            libttest_sync (tor->session);
+    }
+}
+
+static uint8_t *
+loadFile (const char * path)
+{
+    size_t len;
+    uint8_t * buf = tr_loadFile (path, &len);
+
+    return len == (size_t)PIECE_SIZE * PIECE_COUNT ? buf : NULL;
+}
+
+/***
+****
+***/
+
+static int
+test_write_then_read (void)
+{
+    char * path;
+    tr_torrent * tor;
+    tr_session * session;
+    uint8_t written[MAX_BLOCK_SIZE];
+    uint8_t readback[MAX_BLOCK_SIZE];
+    char config_dir[] = "/tmp/transmission-cache-test-XXXXXX";
+
+    check (mkdtemp (config_dir) != NULL);
+    session = libttest_session_init (config_dir, NULL);
+    tor = libttest_torrent_init (session, PIECE_SIZE, PIECE_COUNT);
+    check (tor != NULL);
+    check_int_eq (MAX_BLOCK_SIZE, tor->blockSize);
+    path = tr_torrentFindFile (tor, 0);
+    check (path != NULL);
+
+    /* a dirty block is read back from memory */
+    tr_cryptoRandBuf (written, sizeof (written));
+    check_int_eq (0, cacheCall (writeBlockImpl, tor, 3, written));
+    check_int_eq (0, cacheCall (readBlockImpl, tor, 3, readback));
+    check (!memcmp (written, readback, MAX_BLOCK_SIZE));
+
+    /* so is one that's just been handed to the disk writer,
+     * whether or not the writer has gotten to it yet */
+    tr_cryptoRandBuf (written, sizeof (written));
+    check_int_eq (0, cacheCall (writeBlockImpl, tor, 5, written));
+    check_int_eq (0, setLimit (tor, 0));
+    check_int_eq (0, cacheCall (readBlockImpl, tor, 5, readback));
+    check (!memcmp (written, readback, MAX_BLOCK_SIZE));
+
+    /* once the torrent's flushed, the file has it too */
+    check_int_eq (0, cacheCall (flushTorrentImpl, tor, 0, NULL));
+    check (readFromFile (path, 5, readback));
+    check (!memcmp (written, readback, MAX_BLOCK_SIZE));
+    check_int_eq (0, cacheCall (readBlockImpl, tor, 5, readback));
+    check (!memcmp (written, readback, MAX_BLOCK_SIZE));
+
+    tr_free (path);
+    tr_sessionClose (session);
+    libttest_rm_rf (config_dir);
+    return 0;
+}
+
+/* rewrite a block while its old copy is on its way to disk,
+ * then flush the torrent: the newer copy must be what's left in the file */
+struct rewrite_data
+{
+    tr_torrent * tor;
+    uint8_t * first;
+    uint8_t * second;
+    int err;
+    bool has_block;
+};
+
+static void
+rewriteAndFlushImpl (void * vdata)
+{
+    struct cache_call call;
+    struct rewrite_data * data = vdata;
+    tr_cache * cache = data->tor->session->cache;
+
+    memset (&call, 0, sizeof (call));
+    call.tor = data->tor;
+    call.block = 7;
+
+    call.buf = data->first;
+    writeBlockImpl (&call);
+    tr_cacheSetLimit (cache, 0);
+    tr_cacheSetLimit (cache, 4 * 1024 * 1024);
+
+    call.buf = data->second;
+    writeBlockImpl (&call);
+
+    data->err = tr_cacheFlushTorrent (cache, data->tor);
+    data->has_block = tr_cacheHasBlock (cache, data->tor, 3, data->tor->blockSize);
+}
+
+static int
+test_flush_during_write (void)
+{
+    char * path;
+    tr_torrent * tor;
+    tr_session * session;
+    tr_cache_stats stats;
+    struct rewrite_data data;
+    uint8_t first[MAX_BLOCK_SIZE];
+    uint8_t second[MAX_BLOCK_SIZE];
+    uint8_t readback[MAX_BLOCK_SIZE];
+    char config_dir[] = "/tmp/transmission-cache-test-XXXXXX";
+
+    check (mkdtemp (config_dir) != NULL);
+    session = libttest_session_init (config_dir, NULL);
+    tor = libttest_torrent_init (session, PIECE_SIZE, PIECE_COUNT);
+    check (tor != NULL);
+    check_int_eq (MAX_BLOCK_SIZE, tor->blockSize);
+    check_int_eq (7, _tr_block (tor, 3, MAX_BLOCK_SIZE));
+    path = tr_torrentFindFile (tor, 0);
+
+    tr_cryptoRandBuf (first, sizeof (first));
+    tr_cryptoRandBuf (second, sizeof (second));
+    data.tor = tor;
+    data.first = first;
+    data.second = second;
+    libttest_run_in_event_thread (session, rewriteAndFlushImpl, &data);
+    check_int_eq (0, data.err);
+    check (!data.has_block);
+
+    /* both copies went to disk, in order */
+    tr_cacheGetStats (session->cache, &stats);
+    check_int_eq (2, stats.disk_writes);
+    check (readFromFile (path, 7, readback));
+    check (!memcmp (second, readback, MAX_BLOCK_SIZE));
+
+    tr_free (path);
+    tr_sessionClose (session);
+    libttest_rm_rf (config_dir);
+    return 0;
+}
+
+/* reads that go to the reader threads see what was written before them */
+static int
+test_async_read_after_write (void)
+{
+    char * path;
+    tr_torrent * tor;
+    tr_session * session;
+    tr_variant settings;
+    tr_cache_stats stats;
+    struct read_results results;
+    uint8_t * expected;
+    char config_dir[] = "/tmp/transmission-cache-test-XXXXXX";
+
+    check (mkdtemp (config_dir) != NULL);
+    tr_variantInitDict (&settings, 1);
+    tr_variantDictAddInt (&settings, TR_KEY_read_cache_size_mb, 1);
+    session = libttest_session_init (config_dir, &settings);
+    tr_variantFree (&settings);
+    tor = libttest_torrent_init (session, PIECE_SIZE, PIECE_COUNT);
+    check (tor != NULL);
+    check_int_eq (MAX_BLOCK_SIZE, tor->blockSize);
+    path = tr_torrentFindFile (tor, 0);
+    expected = loadFile (path);
+    check (expected != NULL);
+
+    /* a cold block comes back later, from a reader thread */
+    memset (&results, 0, sizeof (results));
+    results.expected = expected;
+    readBlocksAsync (tor, 4, 4, &results);
+    while (results.count < 1)
+        libttest_sync (session);
+    check_int_eq (0, results.errors);
+    check_int_eq (0, results.mismatches);
+    tr_cacheGetStats (session->cache, &stats);
+    check_int_eq (1, stats.read_cache_pieces);
+
+    /* writing the block replaces the copy in the read cache */
+    tr_cryptoRandBuf (expected + 4 * MAX_BLOCK_SIZE, MAX_BLOCK_SIZE);
+    check_int_eq (0, cacheCall (writeBlockImpl, tor, 4, expected + 4 * MAX_BLOCK_SIZE));
+    readBlocksAsync (tor, 4, 5, &results);
+    while (results.count < 3)
+        libttest_sync (session);
+    check_int_eq (0, results.errors);
+    check_int_eq (0, results.mismatches);
+
+    /* and after it's been flushed, a reader thread gets it from the file */
+    check_int_eq (0, cacheCall (flushTorrentImpl, tor, 0, NULL));
+    readBlocksAsync (tor, 4, 4, &results);
+    while (results.count < 4)
+        libttest_sync (session);
+    check_int_eq (0, results.errors);
+    check_int_eq (0, results.mismatches);
+
+    tr_free (expected);
+    tr_free (path);
+    tr_sessionClose (session);
+    libttest_rm_rf (config_dir);
+    return 0;
+}
+
+/* the read cache evicts the piece that's served the fewest reads */
+static int
+test_read_cache_eviction (void)
+{
+    char * path;
+    tr_torrent * tor;
+    tr_session * session;
+    tr_piece_index_t i;
+    tr_variant settings;
+    tr_cache_stats stats;
+    struct read_results results;
+    struct read_cache_call call;
+    char config_dir[] = "/tmp/transmission-cache-test-XXXXXX";
+
+    check (mkdtemp (config_dir) != NULL);
+    tr_variantInitDict (&settings, 1);
+    tr_variantDictAddInt (&settings, TR_KEY_read_cache_size_mb, 1);
+    session = libttest_session_init (config_dir, &settings);
+    tr_variantFree (&settings);
+    tor = libttest_torrent_init (session, PIECE_SIZE, PIECE_COUNT);
+    check (tor != NULL);
+    check_int_eq (MAX_BLOCK_SIZE, tor->blockSize);
+    path = tr_torrentFindFile (tor, 0);
+    memset (&results, 0, sizeof (results));
+    results.expected = loadFile (path);
+    check (results.expected != NULL);
+
+    /* room for four pieces */
+    memset (&call, 0, sizeof (call));
+    call.tor = tor;
+    call.limit = 4 * PIECE_SIZE;
+    libttest_run_in_event_thread (session, setReadLimitImpl, &call);
+
+    /* fill it, with each piece having served a different number of reads */
+    readPiece (tor, 0, 7, &results);
+    readPiece (tor, 1, 1, &results);
+    readPiece (tor, 2, 3, &results);
+    readPiece (tor, 3, 15, &results);
+    tr_cacheGetStats (session->cache, &stats);
+    check_int_eq (4, stats.read_cache_pieces);
+    check_int_eq (4 * PIECE_SIZE, stats.read_cache_bytes);
+
+    /* the least popular piece makes room for the next one */
+    readPiece (tor, 4, 21, &results);
+    libttest_run_in_event_thread (session, getCachedPiecesImpl, &call);
+    check (call.cached[0]);
+    check (!call.cached[1]);
+    check (call.cached[2]);
+    check (call.cached[3]);
+    check (call.cached[4]);
+
+    readPiece (tor, 5, 1, &results);
+    libttest_run_in_event_thread (session, getCachedPiecesImpl, &call);
+    check (!call.cached[2]);
+    check (call.cached[5]);
+
+    /* a stream of pieces that are only read once each evict one another,
+     * including across the hit counts being aged and the heap rebuilt */
+    for (i=6; i<PIECE_COUNT; ++i)
+        readPiece (tor, i, 1, &results);
+    libttest_run_in_event_thread (session, getCachedPiecesImpl, &call);
+    for (i=0; i<PIECE_COUNT; ++i)
+        check_int_eq (i==0 || i==3 || i==4 || i==PIECE_COUNT-1, call.cached[i]);
+
+    check_int_eq (0, results.errors);
+    check_int_eq (0, results.mismatches);
+    tr_cacheGetStats (session->cache, &stats);
+    check_int_eq (4, stats.read_cache_pieces);
+    check_int_eq (PIECE_COUNT, stats.read_misses);
+
+    tr_free ((uint8_t*)results.expected);
+    tr_free (path);
+    tr_sessionClose (session);
+    libttest_rm_rf (config_dir);
+    return 0;
+}
+
+/* close the session while the reader threads still have a queue.
+ * every request is answered before the torrent goes away */
+static int
+test_teardown_with_queued_reads (void)
+{
+    char * path;
+    tr_torrent * tor;
+    tr_session * session;
+    struct read_results results;
+    uint8_t * expected;
+    char config_dir[] = "/tmp/transmission-cache-test-XXXXXX";
+    const tr_block_index_t n = PIECE_SIZE / MAX_BLOCK_SIZE * PIECE_COUNT;
+
+    check (mkdtemp (config_dir) != NULL);
+    session = libttest_session_init (config_dir, NULL);
+    tor = libttest_torrent_init (session, PIECE_SIZE, PIECE_COUNT);
+    check (tor != NULL);
+    check_int_eq (MAX_BLOCK_SIZE, tor->blockSize);
+    path = tr_torrentFindFile (tor, 0);
+    expected = loadFile (path);
+    check (expected != NULL);
+
+    memset (&results, 0, sizeof (results));
+    results.expected = expected;
+    readBlocksAsync (tor, 0, n - 1, &results);
+    tr_sessionClose (session);
+
+    check_int_eq (n, results.count);
+    check_int_eq (0, results.errors);
+    check_int_eq (0, results.mismatches);
+
+    tr_free (expected);
+    tr_free (path);
+    libttest_rm_rf (config_dir);
+    return 0;
+}
+
+/* close the session while the disk writer still has a queue */
+static int
+test_teardown_with_queued_jobs (void)
+{
+    char * path;
+    tr_torrent * tor;
+    tr_session * session;
+    tr_block_index_t i;
+    uint8_t * written;
+    uint8_t readback[MAX_BLOCK_SIZE];
+    char config_dir[] = "/tmp/transmission-cache-test-XXXXXX";
+    const tr_block_index_t n = PIECE_SIZE / MAX_BLOCK_SIZE * PIECE_COUNT;
+
+    check (mkdtemp (config_dir) != NULL);
+    session = libttest_session_init (config_dir, NULL);
+    tor = libttest_torrent_init (session, PIECE_SIZE, PIECE_COUNT);
+    check (tor != NULL);
+    check_int_eq (MAX_BLOCK_SIZE, tor->blockSize);
+    path = tr_torrentFindFile (tor, 0);
+
+    /* with no room in the cache, every write becomes its own disk job */
+    check_int_eq (0, setLimit (tor, 0));
+    written = tr_new (uint8_t, n * MAX_BLOCK_SIZE);
+    tr_cryptoRandBuf (written, n * MAX_BLOCK_SIZE);
+    for (i=0; i<n; ++i)
+        check_int_eq (0, cacheCall (writeBlockImpl, tor, i, written + i * MAX_BLOCK_SIZE));
+
+    tr_sessionClose (session);
+
+    for (i=0; i<n; ++i)
+    {
+        check (readFromFile (path, i, readback));
+        check (!memcmp (written + i * MAX_BLOCK_SIZE, readback, MAX_BLOCK_SIZE));
+    }
+
+    tr_free (written);
+    tr_free (path);
+    libttest_rm_rf (config_dir);
+    return 0;
+}
+
+int
+main (void)
+{
+    const testFunc tests[] = { test_write_then_read,
+                               test_flush_during_write,
+                               test_teardown_with_queued_jobs,
+                               test_async_read_after_write,
+                               test_read_cache_eviction,
+                               test_teardown_with_queued_reads };
+
+    return runTests (tests, NUM_TESTS (tests));
+}
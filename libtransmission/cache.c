@@ -11,6 +11,7 @@
  */
 
 #include <stdlib.h> /* qsort () */
+#include <string.h> /* memcpy () */
 
 #include <event2/buffer.h>
 
@@ -18,8 +19,10 @@
 #include "cache.h"
 #include "inout.h"
 #include "peer-common.h" /* MAX_BLOCK_SIZE */
-#include "ptrarray.h"
+#include "peer-mgr.h" /* tr_peerMgrPieceReplication () */
+#include "platform.h" /* tr_lock, tr_threadNew () */
 #include "torrent.h"
+#include "trevent.h" /* tr_runInEventThread () */
 #include "utils.h"
 
 #define MY_NAME "Cache"
@@ -36,6 +39,9 @@
 *****
 ****/
 
+struct cache_run;
+struct cache_job;
+
 struct cache_block
 {
   tr_torrent * tor;
@@ -48,196 +54,1048 @@ struct cache_block
   tr_block_index_t block;
 
   struct evbuffer * evbuf;
+
+  /* the next block in this hash bucket */
+  struct cache_block * next;
+
+  /* the run of contiguous blocks that this block belongs to */
+  struct cache_run * run;
+
+  /* if non-NULL, this block is waiting on the disk writer.
+     its evbuf has been freed and its data lives in job->buf */
+  struct cache_job * job;
+};
+
+/* a span of contiguous cached blocks [first...last] in a single torrent.
+ * runs are grown and merged as blocks are written and shrunk as they're
+ * flushed, so finding what to flush never needs to walk every block. */
+struct cache_run
+{
+  tr_torrent * tor;
+
+  tr_block_index_t first;
+  tr_block_index_t last;
+
+  /* the last time any block in this run was written */
+  time_t time;
+
+  /* scratch space for cacheTrim () */
+  int rank;
+
+  struct cache_run * prev;
+  struct cache_run * next;
+};
+
+/* a run that's been handed off to the disk writer thread.
+ * the writer only touches buf, err, and failed_file; everything
+ * else belongs to the libtransmission thread. */
+struct cache_job
+{
+  tr_torrent * tor;
+
+  tr_block_index_t first;
+  tr_block_index_t last;
+
+  tr_piece_index_t piece;
+  uint32_t offset;
+  uint32_t length;
+  uint8_t * buf;
+  tr_io_paths * paths;
+
+  int err;
+  tr_file_index_t failed_file;
+
+  struct cache_job * next;
+};
+
+/* one caller waiting on a cache_read_job */
+struct cache_read_request
+{
+  tr_cache_read_func * func;
+  void * user_data;
+
+  uint32_t offset;
+  uint32_t length;
+
+  struct cache_read_request * next;
+};
+
+/* a span of one piece that a reader thread pulls off the disk.
+ * adjacent requests for the same piece get merged into one job
+ * for as long as it's waiting in the queue. the reader only
+ * touches buf and err; the requests belong to the libtransmission thread. */
+struct cache_read_job
+{
+  tr_torrent * tor;
+
+  tr_piece_index_t piece;
+  uint32_t offset;
+  uint32_t length;
+  uint8_t * buf;
+
+  /* the whole piece's files, since the span can grow while it's queued */
+  tr_io_paths * paths;
+  int err;
+
+  struct cache_read_request * requests;
+
+  struct cache_read_job * next;
+};
+
+/* a whole piece kept in memory after a reader thread fetched it,
+ * so that peers asking for the same piece don't each cost a disk read */
+struct cache_piece
+{
+  tr_torrent * tor;
+  tr_piece_index_t piece;
+  uint32_t length;
+  uint8_t * buf;
+
+  /* how many reads it has served. these get halved every so often
+     so that a piece which was popular yesterday can be evicted today */
+  unsigned int hits;
+  time_t time;
+
+  /* how many peers had the piece when we last looked, and the
+     eviction score that gives. see getPieceScore () */
+  int replication;
+  uint64_t score;
+
+  /* where it is in tr_cache.piece_heap */
+  int heap_pos;
+
+  struct cache_piece * next;
 };
 
 struct tr_cache
 {
-  tr_ptrArray blocks;
+  /* blocks hashed by (torrent, block index).
+     bucket_count is always a power of two */
+  struct cache_block ** buckets;
+  size_t bucket_count;
+  int block_count;
+
+  struct cache_run * runs;
+  int run_count;
+
+  /* how many indexed blocks are waiting on the disk writer */
+  int flushing_blocks;
+  size_t flushing_bytes;
+
+  /* protects the fields below, which are shared with the writer thread */
+  tr_lock * lock;
+  struct cache_job * pending;
+  struct cache_job * pending_tail;
+  struct cache_job * writing;
+  struct cache_job * finished;
+  struct cache_job * finished_tail;
+  bool writer_running;
+  bool reap_posted;
+
+  struct cache_read_job * read_pending;
+  struct cache_read_job * read_pending_tail;
+  struct cache_read_job * read_active;
+  struct cache_read_job * read_finished;
+  struct cache_read_job * read_finished_tail;
+  int reader_count;
+
+  /* read jobs whose callbacks are being invoked right now.
+     only the libtransmission thread touches this */
+  struct cache_read_job * read_reaping;
+
   int max_blocks;
   size_t max_bytes;
 
+  /* the read cache: pieces hashed by (torrent, piece index).
+     only the libtransmission thread touches these */
+  struct cache_piece ** piece_buckets;
+  size_t piece_bucket_count;
+  int piece_count;
+
+  /* the same pieces as a binary min-heap on score,
+     so the next one to evict is always piece_heap[0] */
+  struct cache_piece ** piece_heap;
+  int piece_heap_alloc;
+  int piece_inserts;
+  size_t read_bytes;
+  size_t max_read_bytes;
+
   size_t disk_writes;
   size_t disk_write_bytes;
   size_t cache_writes;
   size_t cache_write_bytes;
+  size_t read_hits;
+  size_t read_hit_bytes;
+  size_t read_misses;
+  size_t read_miss_bytes;
+};
+
+enum
+{
+  MIN_BUCKET_COUNT = 64,
+
+  /* tr_cacheIsBacklogged () uses the larger of this and the cache size */
+  MIN_BACKLOG_BYTES = (4 * 1024 * 1024),
+
+  /* how long to sleep between checks when waiting on the disk threads */
+  MSEC_TO_WAIT_FOR_DISK = 10,
+
+  /* how many threads may service tr_cacheReadBlockAsync () */
+  MAX_READER_THREADS = 2
 };
 
 /****
-*****
+*****  Block index
 ****/
 
-struct run_info
+static inline size_t
+hashIndex (const tr_torrent * tor, uint32_t index, size_t bucket_count)
 {
-  int pos;
-  int rank;
-  time_t last_block_time;
-  bool is_multi_piece;
-  bool is_piece_done;
-  unsigned len;
-};
+  uint32_t h = ((uint32_t)tor->uniqueId * 0x9E3779B1u) ^ index;
 
+  h ^= h >> 16;
+  h *= 0x85EBCA6Bu;
+  h ^= h >> 13;
 
-/* return a count of how many contiguous blocks there are starting at this pos */
-static int
-getBlockRun (const tr_cache * cache, int pos, struct run_info * info)
+  return h & (bucket_count - 1);
+}
+
+static inline size_t
+getBucket (const tr_cache * cache, const tr_torrent * tor, tr_block_index_t block)
+{
+  return hashIndex (tor, block, cache->bucket_count);
+}
+
+static struct cache_block *
+findBlockByIndex (const tr_cache * cache, const tr_torrent * tor, tr_block_index_t block)
+{
+  struct cache_block * cb;
+
+  for (cb=cache->buckets[getBucket (cache, tor, block)]; cb!=NULL; cb=cb->next)
+    if ((cb->block == block) && (cb->tor == tor))
+      break;
+
+  return cb;
+}
+
+static void
+rehash (tr_cache * cache, size_t bucket_count)
 {
-  int i;
-  const int n = tr_ptrArraySize (&cache->blocks);
-  const struct cache_block ** blocks = (const struct cache_block**) tr_ptrArrayBase (&cache->blocks);
-  const struct cache_block * ref = blocks[pos];
-  tr_block_index_t block = ref->block;
+  size_t i;
+  struct cache_block ** old = cache->buckets;
+  const size_t old_count = cache->bucket_count;
 
-  for (i=pos; i<n; ++i, ++block)
+  cache->buckets = tr_new0 (struct cache_block*, bucket_count);
+  cache->bucket_count = bucket_count;
+
+  for (i=0; i<old_count; ++i)
     {
-      const struct cache_block * b = blocks[i];
-      if (b->block != block)
-        break;
-      if (b->tor != ref->tor)
-        break;
-      //fprintf (stderr, "pos %d tor %d block %zu time %zu\n", i, b->tor->uniqueId, (size_t)b->block, (size_t)b->time);
+      struct cache_block * cb = old[i];
+
+      while (cb != NULL)
+        {
+          struct cache_block * next = cb->next;
+          const size_t bucket = getBucket (cache, cb->tor, cb->block);
+          cb->next = cache->buckets[bucket];
+          cache->buckets[bucket] = cb;
+          cb = next;
+        }
     }
 
-  //fprintf (stderr, "run is %d long from [%d to %d)\n", (int)(i-pos), i, (int)pos);
+  tr_free (old);
+}
+
+static void
+indexBlock (tr_cache * cache, struct cache_block * cb)
+{
+  size_t bucket;
+
+  if ((size_t)cache->block_count >= cache->bucket_count)
+    rehash (cache, cache->bucket_count * 2);
+
+  bucket = getBucket (cache, cb->tor, cb->block);
+  cb->next = cache->buckets[bucket];
+  cache->buckets[bucket] = cb;
+  ++cache->block_count;
+}
+
+static void
+unindexBlock (tr_cache * cache, struct cache_block * cb)
+{
+  struct cache_block ** walk = &cache->buckets[getBucket (cache, cb->tor, cb->block)];
+
+  while (*walk != cb)
+    walk = &(*walk)->next;
+
+  *walk = cb->next;
+  --cache->block_count;
+}
+
+/****
+*****  Runs
+****/
+
+static struct cache_run *
+runNew (tr_cache * cache, tr_torrent * tor, tr_block_index_t block)
+{
+  struct cache_run * run = tr_new0 (struct cache_run, 1);
+
+  run->tor = tor;
+  run->first = block;
+  run->last = block;
+
+  run->next = cache->runs;
+  if (run->next != NULL)
+    run->next->prev = run;
+  cache->runs = run;
+  ++cache->run_count;
+
+  return run;
+}
+
+static void
+runFree (tr_cache * cache, struct cache_run * run)
+{
+  if (run->prev != NULL)
+    run->prev->next = run->next;
+  else
+    cache->runs = run->next;
+
+  if (run->next != NULL)
+    run->next->prev = run->prev;
+
+  --cache->run_count;
+  tr_free (run);
+}
+
+static inline tr_block_index_t
+runLength (const struct cache_run * run)
+{
+  return run->last + 1 - run->first;
+}
 
-  if (info != NULL)
+/* join a newly-cached block to the runs on either side of it */
+static void
+addToRuns (tr_cache * cache, struct cache_block * cb)
+{
+  tr_torrent * tor = cb->tor;
+  const tr_block_index_t block = cb->block;
+  struct cache_block * prev = block > 0 ? findBlockByIndex (cache, tor, block-1) : NULL;
+  struct cache_block * next = block+1 < tor->blockCount ? findBlockByIndex (cache, tor, block+1) : NULL;
+
+  /* blocks on their way to disk aren't part of any run */
+  if ((prev != NULL) && (prev->job != NULL))
+    prev = NULL;
+  if ((next != NULL) && (next->job != NULL))
+    next = NULL;
+
+  if ((prev != NULL) && (next != NULL))
     {
-      const struct cache_block * b = blocks[i-1];
-      info->last_block_time = b->time;
-      info->is_piece_done = tr_cpPieceIsComplete (&b->tor->completion, b->piece);
-      info->is_multi_piece = b->piece != blocks[pos]->piece ? true : false;
-      info->len = i - pos;
-      info->pos = pos;
+      /* this block bridges two runs. keep the longer one and relabel the other */
+      tr_block_index_t i;
+      struct cache_run * keep = prev->run;
+      struct cache_run * drop = next->run;
+      const tr_block_index_t first = prev->run->first;
+      const tr_block_index_t last = next->run->last;
+
+      if (runLength (drop) > runLength (keep))
+        {
+          keep = next->run;
+          drop = prev->run;
+        }
+
+      for (i=drop->first; i<=drop->last; ++i)
+        findBlockByIndex (cache, tor, i)->run = keep;
+
+      keep->first = first;
+      keep->last = last;
+      runFree (cache, drop);
+      cb->run = keep;
+    }
+  else if (prev != NULL)
+    {
+      cb->run = prev->run;
+      cb->run->last = block;
+    }
+  else if (next != NULL)
+    {
+      cb->run = next->run;
+      cb->run->first = block;
+    }
+  else
+    {
+      cb->run = runNew (cache, tor, block);
     }
-
-  return i-pos;
 }
 
 /* higher rank comes before lower rank */
 static int
 compareRuns (const void * va, const void * vb)
 {
-  const struct run_info * a = va;
-  const struct run_info * b = vb;
+  const struct cache_run * a = *(const struct cache_run**) va;
+  const struct cache_run * b = *(const struct cache_run**) vb;
   return b->rank - a->rank;
 }
 
 enum
 {
   MULTIFLAG   = 0x1000,
-  DONEFLAG    = 0x2000,
-  SESSIONFLAG = 0x4000
+  DONEFLAG    = 0x2000
 };
 
-/* Calculte runs
+static bool
+runIsPieceDone (const struct cache_run * run)
+{
+  return tr_cpPieceIsComplete (&run->tor->completion, tr_torBlockPiece (run->tor, run->last));
+}
+
+static bool
+runIsMultiPiece (const struct cache_run * run)
+{
+  return tr_torBlockPiece (run->tor, run->first) != tr_torBlockPiece (run->tor, run->last);
+}
+
+/* Rank a run
  *   - Stale runs, runs sitting in cache for a long time or runs not growing, get priority.
- *     Returns number of runs.
  */
 static int
-calcRuns (tr_cache * cache, struct run_info * runs)
+getRunRank (const struct cache_run * run, time_t now)
 {
-  const int n = tr_ptrArraySize (&cache->blocks);
-  int i = 0, pos;
-  const time_t now = tr_time ();
+  int rank = runLength (run);
 
-  for (pos = 0; pos < n; pos += runs[i++].len)
-    {
-      int rank = getBlockRun (cache, pos, &runs[i]);
+  /* This adds ~2 to the relative length of a run for every minute it has
+   * languished in the cache. */
+  rank += (now - run->time) / 32;
 
-      /* This adds ~2 to the relative length of a run for every minute it has
-       * languished in the cache. */
-      rank += (now - runs[i].last_block_time) / 32;
+  /* Flushing stale blocks should be a top priority as the probability of them
+   * growing is very small, for blocks on piece boundaries, and nonexistant for
+   * blocks inside pieces. */
+  rank |= runIsPieceDone (run) ? DONEFLAG : 0;
 
-      /* Flushing stale blocks should be a top priority as the probability of them
-       * growing is very small, for blocks on piece boundaries, and nonexistant for
-       * blocks inside pieces. */
-      rank |= runs[i].is_piece_done ? DONEFLAG : 0;
+  /* Move the multi piece runs higher */
+  rank |= runIsMultiPiece (run) ? MULTIFLAG : 0;
 
-      /* Move the multi piece runs higher */
-      rank |= runs[i].is_multi_piece ? MULTIFLAG : 0;
+  return rank;
+}
 
-      runs[i].rank = rank;
+/****
+*****  Disk writer
+****/
 
-      //fprintf (stderr,"block run at pos %d of length %d and age %ld adjusted +%d\n",runs[i].pos,runs[i].len,now-runs[i].last_block_time,rank-runs[i].len);
-    }
+static void
+appendJob (struct cache_job ** head, struct cache_job ** tail, struct cache_job * job)
+{
+  job->next = NULL;
+
+  if (*tail != NULL)
+    (*tail)->next = job;
+  else
+    *head = job;
+
+  *tail = job;
+}
+
+static int reapJobs (tr_cache * cache);
 
-  //fprintf (stderr, "%d block runs\n", i);
-  qsort (runs, i, sizeof (struct run_info), compareRuns);
-  return i;
+static void
+onDiskDone (void * vsession)
+{
+  tr_session * session = vsession;
+
+  /* the cache may have been freed while this was in the event queue */
+  if (session->cache != NULL)
+    reapJobs (session->cache);
+}
+
+static void
+writerThreadFunc (void * vcache)
+{
+  tr_cache * cache = vcache;
+
+  for (;;)
+    {
+      struct cache_job * job;
+      tr_session * post_to = NULL;
+
+      tr_lockLock (cache->lock);
+
+      if (cache->writing != NULL)
+        {
+          if (!cache->reap_posted)
+            {
+              cache->reap_posted = true;
+              post_to = cache->writing->tor->session;
+            }
+
+          appendJob (&cache->finished, &cache->finished_tail, cache->writing);
+          cache->writing = NULL;
+        }
+
+      if ((job = cache->pending) != NULL)
+        {
+          cache->pending = job->next;
+          if (cache->pending == NULL)
+            cache->pending_tail = NULL;
+          cache->writing = job;
+        }
+      else
+        {
+          cache->writer_running = false;
+        }
+
+      tr_lockUnlock (cache->lock);
+
+      /* let the libtransmission thread handle the results */
+      if (post_to != NULL)
+        tr_runInEventThread (post_to, onDiskDone, post_to);
+
+      if (job == NULL)
+        break;
+
+      job->err = tr_ioWriteQuietly (job->tor, job->piece, job->offset,
+                                    job->length, job->buf, job->paths,
+                                    &job->failed_file);
+    }
 }
 
+/* finish up the jobs that the writer is done with.
+ * returns the first error encountered, or 0 if they all succeeded */
 static int
-flushContiguous (tr_cache * cache, int pos, int n)
+reapWrites (tr_cache * cache)
 {
-  int i;
   int err = 0;
-  uint8_t * buf = tr_new (uint8_t, n * MAX_BLOCK_SIZE);
-  uint8_t * walk = buf;
-  struct cache_block ** blocks = (struct cache_block**) tr_ptrArrayBase (&cache->blocks);
+  struct cache_job * job;
 
-  struct cache_block * b = blocks[pos];
-  tr_torrent * tor = b->tor;
-  const tr_piece_index_t piece = b->piece;
-  const uint32_t offset = b->offset;
+  tr_lockLock (cache->lock);
+  job = cache->finished;
+  cache->finished = cache->finished_tail = NULL;
+  cache->reap_posted = false;
+  tr_lockUnlock (cache->lock);
 
-  for (i=pos; i<pos+n; ++i)
+  while (job != NULL)
     {
-      b = blocks[i];
-      evbuffer_copyout (b->evbuf, walk, b->length);
-      walk += b->length;
-      evbuffer_free (b->evbuf);
-      tr_free (b);
+      tr_block_index_t i;
+      struct cache_job * next = job->next;
+
+      /* drop the blocks that weren't rewritten while the job was in flight */
+      for (i=job->first; i<=job->last; ++i)
+        {
+          struct cache_block * b = findBlockByIndex (cache, job->tor, i);
+
+          if ((b != NULL) && (b->job == job))
+            {
+              unindexBlock (cache, b);
+              --cache->flushing_blocks;
+              tr_free (b);
+            }
+        }
+
+      if (job->err)
+        {
+          tr_ioSetWriteError (job->tor, job->failed_file, job->err);
+
+          if (!err)
+            err = job->err;
+        }
+
+      ++cache->disk_writes;
+      cache->disk_write_bytes += job->length;
+      cache->flushing_bytes -= job->length;
+
+      tr_ioFreePaths (job->paths);
+      tr_free (job->buf);
+      tr_free (job);
+      job = next;
     }
-  tr_ptrArrayErase (&cache->blocks, pos, pos+n);
-
-  err = tr_ioWrite (tor, piece, offset, walk-buf, buf);
-  tr_free (buf);
 
-  ++cache->disk_writes;
-  cache->disk_write_bytes += walk-buf;
   return err;
 }
 
-static int
-flushRuns (tr_cache * cache, struct run_info * runs, int n)
+/****
+*****  Piece read cache
+****/
+
+static struct cache_piece *
+findPiece (const tr_cache * cache, const tr_torrent * tor, tr_piece_index_t piece)
 {
-  int i;
-  int err = 0;
+  struct cache_piece * cp = NULL;
+
+  if (cache->piece_count > 0)
+    for (cp=cache->piece_buckets[hashIndex (tor, piece, cache->piece_bucket_count)]; cp!=NULL; cp=cp->next)
+      if ((cp->piece == piece) && (cp->tor == tor))
+        break;
 
-  for (i=0; !err && i<n; i++)
+  return cp;
+}
+
+/* LFU, except that a piece few other peers can serve is worth
+ * more: we're where the swarm has to come to get it */
+static void
+updatePieceScore (struct cache_piece * cp)
+{
+  cp->score = ((uint64_t)cp->hits << 10) / (1 + cp->replication);
+}
+
+/* ties go to the piece that's been idle longest */
+static inline bool
+pieceIsLess (const struct cache_piece * a, const struct cache_piece * b)
+{
+  return (a->score < b->score) || ((a->score == b->score) && (a->time < b->time));
+}
+
+static inline void
+heapSet (tr_cache * cache, int pos, struct cache_piece * cp)
+{
+  cache->piece_heap[pos] = cp;
+  cp->heap_pos = pos;
+}
+
+/* move the piece at pos down until neither child is less than it */
+static void
+heapSiftDown (tr_cache * cache, int pos)
+{
+  struct cache_piece ** heap = cache->piece_heap;
+  struct cache_piece * cp = heap[pos];
+  const int n = cache->piece_count;
+
+  for (;;)
     {
-      int j;
+      int child = 2 * pos + 1;
 
-      err = flushContiguous (cache, runs[i].pos, runs[i].len);
+      if (child >= n)
+        break;
+      if ((child + 1 < n) && pieceIsLess (heap[child + 1], heap[child]))
+        ++child;
+      if (!pieceIsLess (heap[child], cp))
+        break;
 
-      for (j=i+1; j<n; j++)
-        if (runs[j].pos > runs[i].pos)
-          runs[j].pos -= runs[i].len;
+      heapSet (cache, pos, heap[child]);
+      pos = child;
     }
 
-  return err;
+  heapSet (cache, pos, cp);
+}
+
+/* move the piece at pos up or down after its score changed */
+static void
+heapFix (tr_cache * cache, int pos)
+{
+  struct cache_piece ** heap = cache->piece_heap;
+  struct cache_piece * cp = heap[pos];
+
+  while ((pos > 0) && pieceIsLess (cp, heap[(pos - 1) / 2]))
+    {
+      heapSet (cache, pos, heap[(pos - 1) / 2]);
+      pos = (pos - 1) / 2;
+    }
+
+  heapSet (cache, pos, cp);
+  heapSiftDown (cache, pos);
+}
+
+static void
+indexPiece (tr_cache * cache, struct cache_piece * cp)
+{
+  size_t bucket;
+
+  if ((size_t)cache->piece_count >= cache->piece_bucket_count)
+    {
+      size_t i;
+      struct cache_piece ** old = cache->piece_buckets;
+      const size_t old_count = cache->piece_bucket_count;
+
+      cache->piece_bucket_count *= 2;
+      cache->piece_buckets = tr_new0 (struct cache_piece*, cache->piece_bucket_count);
+
+      for (i=0; i<old_count; ++i)
+        {
+          struct cache_piece * walk = old[i];
+
+          while (walk != NULL)
+            {
+              struct cache_piece * next = walk->next;
+              bucket = hashIndex (walk->tor, walk->piece, cache->piece_bucket_count);
+              walk->next = cache->piece_buckets[bucket];
+              cache->piece_buckets[bucket] = walk;
+              walk = next;
+            }
+        }
+
+      tr_free (old);
+    }
+
+  bucket = hashIndex (cp->tor, cp->piece, cache->piece_bucket_count);
+  cp->next = cache->piece_buckets[bucket];
+  cache->piece_buckets[bucket] = cp;
+
+  if (cache->piece_count >= cache->piece_heap_alloc)
+    {
+      cache->piece_heap_alloc = MAX (MIN_BUCKET_COUNT, cache->piece_heap_alloc * 2);
+      cache->piece_heap = tr_renew (struct cache_piece*, cache->piece_heap, cache->piece_heap_alloc);
+    }
+  heapSet (cache, cache->piece_count++, cp);
+  heapFix (cache, cp->heap_pos);
+
+  cache->read_bytes += cp->length;
+}
+
+static void
+removePiece (tr_cache * cache, struct cache_piece * cp)
+{
+  struct cache_piece ** walk;
+
+  walk = &cache->piece_buckets[hashIndex (cp->tor, cp->piece, cache->piece_bucket_count)];
+  while (*walk != cp)
+    walk = &(*walk)->next;
+  *walk = cp->next;
+
+  /* fill its place in the heap with the last piece */
+  if (--cache->piece_count > cp->heap_pos)
+    {
+      heapSet (cache, cp->heap_pos, cache->piece_heap[cache->piece_count]);
+      heapFix (cache, cp->heap_pos);
+    }
+
+  cache->read_bytes -= cp->length;
+  tr_free (cp->buf);
+  tr_free (cp);
+}
+
+/* evict the lowest-scoring pieces until the read cache fits in max_bytes */
+static void
+readCacheTrim (tr_cache * cache, size_t max_bytes)
+{
+  while (cache->read_bytes > max_bytes)
+    {
+      struct cache_piece * victim = cache->piece_heap[0];
+
+      dbgmsg ("evicting piece %zu from the read cache", (size_t)victim->piece);
+      removePiece (cache, victim);
+    }
+}
+
+static void
+readCacheRemoveTorrent (tr_cache * cache, const tr_torrent * tor)
+{
+  size_t i;
+
+  for (i=0; cache->piece_count>0 && i<cache->piece_bucket_count; ++i)
+    {
+      struct cache_piece * cp = cache->piece_buckets[i];
+
+      while (cp != NULL)
+        {
+          struct cache_piece * next = cp->next;
+
+          if ((tor == NULL) || (cp->tor == tor))
+            removePiece (cache, cp);
+
+          cp = next;
+        }
+    }
+}
+
+/* take ownership of a finished whole-piece read's buffer */
+static void
+readCacheAdd (tr_cache * cache, struct cache_read_job * job)
+{
+  struct cache_piece * cp;
+
+  if ((job->length > cache->max_read_bytes) || (findPiece (cache, job->tor, job->piece) != NULL))
+    return;
+
+  /* age the hit counts once the cache has turned over a couple of times.
+     the peers' bitfields have changed since then too, so look at the
+     replication again while we're rescoring everything */
+  if (++cache->piece_inserts > 2 * cache->piece_count)
+    {
+      int i;
+
+      for (i=0; i<cache->piece_count; ++i)
+        {
+          cp = cache->piece_heap[i];
+          cp->hits /= 2;
+          cp->replication = tr_peerMgrPieceReplication (cp->tor, cp->piece);
+          updatePieceScore (cp);
+        }
+
+      /* every score changed, so rebuild the heap from the bottom up */
+      for (i=cache->piece_count/2 - 1; i>=0; --i)
+        heapSiftDown (cache, i);
+
+      cache->piece_inserts = 0;
+    }
+
+  readCacheTrim (cache, cache->max_read_bytes - job->length);
+
+  cp = tr_new0 (struct cache_piece, 1);
+  cp->tor = job->tor;
+  cp->piece = job->piece;
+  cp->length = job->length;
+  cp->buf = job->buf;
+  cp->hits = 1;
+  cp->time = tr_time ();
+  cp->replication = tr_peerMgrPieceReplication (cp->tor, cp->piece);
+  updatePieceScore (cp);
+  job->buf = NULL;
+  indexPiece (cache, cp);
+}
+
+/****
+*****  Disk readers
+****/
+
+static void
+appendReadJob (struct cache_read_job ** head, struct cache_read_job ** tail, struct cache_read_job * job)
+{
+  job->next = NULL;
+
+  if (*tail != NULL)
+    (*tail)->next = job;
+  else
+    *head = job;
+
+  *tail = job;
+}
+
+static void
+readerThreadFunc (void * vcache)
+{
+  tr_cache * cache = vcache;
+  struct cache_read_job * done = NULL;
+
+  for (;;)
+    {
+      struct cache_read_job * job;
+      tr_session * post_to = NULL;
+
+      tr_lockLock (cache->lock);
+
+      if (done != NULL)
+        {
+          struct cache_read_job ** walk = &cache->read_active;
+          while (*walk != done)
+            walk = &(*walk)->next;
+          *walk = done->next;
+
+          if (!cache->reap_posted)
+            {
+              cache->reap_posted = true;
+              post_to = done->tor->session;
+            }
+
+          appendReadJob (&cache->read_finished, &cache->read_finished_tail, done);
+        }
+
+      if ((job = cache->read_pending) != NULL)
+        {
+          cache->read_pending = job->next;
+          if (cache->read_pending == NULL)
+            cache->read_pending_tail = NULL;
+          job->next = cache->read_active;
+          cache->read_active = job;
+        }
+      else
+        {
+          --cache->reader_count;
+        }
+
+      tr_lockUnlock (cache->lock);
+
+      /* let the libtransmission thread hand out the data */
+      if (post_to != NULL)
+        tr_runInEventThread (post_to, onDiskDone, post_to);
+
+      if (job == NULL)
+        break;
+
+      job->buf = tr_new (uint8_t, job->length);
+      job->err = tr_ioReadFromPaths (job->tor, job->piece, job->offset,
+                                     job->length, job->buf, job->paths);
+      done = job;
+    }
+}
+
+/* pass the finished reads' data along to whoever asked for it */
+static void
+reapReads (tr_cache * cache)
+{
+  /* if a callback got us here, let the outer call finish its list.
+     the rest will be picked up by the onDiskDone () that's pending */
+  if (cache->read_reaping != NULL)
+    return;
+
+  tr_lockLock (cache->lock);
+  cache->read_reaping = cache->read_finished;
+  cache->read_finished = cache->read_finished_tail = NULL;
+  cache->reap_posted = false;
+  tr_lockUnlock (cache->lock);
+
+  while (cache->read_reaping != NULL)
+    {
+      struct cache_read_job * job = cache->read_reaping;
+      struct cache_read_request * req;
+
+      /* pop each request before calling it, since the callback
+         is allowed to cancel other requests in this job */
+      while ((req = job->requests) != NULL)
+        {
+          job->requests = req->next;
+
+          if (req->func != NULL)
+            req->func (req->user_data, job->err, job->piece, req->offset, req->length,
+                       job->err ? NULL : job->buf + (req->offset - job->offset));
+
+          tr_free (req);
+        }
+
+      if (!job->err && (cache->max_read_bytes > 0)
+                    && (job->offset == 0)
+                    && (job->length == tr_torPieceCountBytes (job->tor, job->piece)))
+        readCacheAdd (cache, job);
+
+      cache->read_reaping = job->next;
+      tr_ioFreePaths (job->paths);
+      tr_free (job->buf);
+      tr_free (job);
+    }
 }
 
 static int
-cacheTrim (tr_cache * cache)
+reapJobs (tr_cache * cache)
 {
-  int err = 0;
+  reapReads (cache);
+  return reapWrites (cache);
+}
+
+static bool
+readJobsBusy (const struct cache_read_job * job, const tr_torrent * tor)
+{
+  for (; job!=NULL; job=job->next)
+    if ((tor == NULL) || (job->tor == tor))
+      return true;
+
+  return false;
+}
+
+/* wait for the disk threads to finish every job for this torrent,
+ * or for every torrent if tor is NULL, then reap them */
+static int
+waitForDisk (tr_cache * cache, const tr_torrent * tor)
+{
+  for (;;)
+    {
+      bool busy;
+      const struct cache_job * job;
+
+      tr_lockLock (cache->lock);
+      busy = (cache->writing != NULL) && ((tor == NULL) || (cache->writing->tor == tor));
+      for (job=cache->pending; !busy && job!=NULL; job=job->next)
+        busy = (tor == NULL) || (job->tor == tor);
+      busy = busy || readJobsBusy (cache->read_pending, tor)
+                  || readJobsBusy (cache->read_active, tor);
+      tr_lockUnlock (cache->lock);
+
+      if (!busy)
+        break;
+
+      tr_wait_msec (MSEC_TO_WAIT_FOR_DISK);
+    }
+
+  return reapJobs (cache);
+}
+
+/* hand blocks [from...run->last] to the disk writer.
+ * if `from' is the run's first block, the run is freed too. */
+static void
+flushRun (tr_cache * cache, struct cache_run * run, tr_block_index_t from)
+{
+  tr_block_index_t i;
+  tr_torrent * tor = run->tor;
+  const tr_block_index_t last = run->last;
+  struct cache_job * job = tr_new0 (struct cache_job, 1);
+  uint8_t * walk;
+
+  job->tor = tor;
+  job->first = from;
+  job->last = last;
+  job->buf = walk = tr_new (uint8_t, (last + 1 - from) * tor->blockSize);
+
+  for (i=from; i<=last; ++i)
+    {
+      struct cache_block * b = findBlockByIndex (cache, tor, i);
+      assert (b != NULL);
+      assert (b->run == run);
+
+      if (i == from)
+        {
+          job->piece = b->piece;
+          job->offset = b->offset;
+        }
+
+      evbuffer_copyout (b->evbuf, walk, b->length);
+      walk += b->length;
+      evbuffer_free (b->evbuf);
+      b->evbuf = NULL;
+      b->run = NULL;
+      b->job = job;
+      ++cache->flushing_blocks;
+    }
+
+  job->length = walk - job->buf;
+  job->paths = tr_ioGetPaths (tor, job->piece, job->offset, job->length, true);
+  cache->flushing_bytes += job->length;
+
+  if (from == run->first)
+    runFree (cache, run);
+  else
+    run->last = from - 1;
+
+  tr_lockLock (cache->lock);
+  appendJob (&cache->pending, &cache->pending_tail, job);
+  if (!cache->writer_running)
+    {
+      cache->writer_running = true;
+      tr_threadNew (writerThreadFunc, cache);
+    }
+  tr_lockUnlock (cache->lock);
+}
 
-  if (tr_ptrArraySize (&cache->blocks) > cache->max_blocks)
+static void
+cacheTrim (tr_cache * cache)
+{
+  if (cache->block_count - cache->flushing_blocks > cache->max_blocks)
     {
       /* Amount of cache that should be removed by the flush. This influences how large
        * runs can grow as well as how often flushes will happen. */
       const int cacheCutoff = 1 + cache->max_blocks / 4;
-      struct run_info * runs = tr_new (struct run_info, tr_ptrArraySize (&cache->blocks));
+      const int n = cache->run_count;
+      const time_t now = tr_time ();
+      struct cache_run ** runs = tr_new (struct cache_run*, n);
+      struct cache_run * run;
       int i=0, j=0;
 
-      calcRuns (cache, runs);
-      while (j < cacheCutoff)
-        j += runs[i++].len;
-      err = flushRuns (cache, runs, i);
+      for (run=cache->runs; run!=NULL; run=run->next)
+        {
+          run->rank = getRunRank (run, now);
+          runs[i++] = run;
+        }
+      qsort (runs, n, sizeof (struct cache_run*), compareRuns);
+
+      for (i=0; i<n && j<cacheCutoff; ++i)
+        {
+          j += runLength (runs[i]);
+          flushRun (cache, runs[i], runs[i]->first);
+        }
+
       tr_free (runs);
     }
+}
 
-  return err;
+bool
+tr_cacheIsBacklogged (const tr_cache * cache)
+{
+  return cache->flushing_bytes > MAX (cache->max_bytes, MIN_BACKLOG_BYTES);
 }
 
 /***
@@ -261,7 +1119,8 @@ tr_cacheSetLimit (tr_cache * cache, int64_t max_bytes)
   tr_formatter_mem_B (buf, cache->max_bytes, sizeof (buf));
   tr_ndbg (MY_NAME, "Maximum cache size set to %s (%d blocks)", buf, cache->max_blocks);
 
-  return cacheTrim (cache);
+  cacheTrim (cache);
+  return reapJobs (cache);
 }
 
 int64_t
@@ -270,21 +1129,70 @@ tr_cacheGetLimit (const tr_cache * cache)
   return cache->max_bytes;
 }
 
+void
+tr_cacheSetReadLimit (tr_cache * cache, int64_t max_bytes)
+{
+  char buf[128];
+
+  cache->max_read_bytes = max_bytes;
+
+  tr_formatter_mem_B (buf, cache->max_read_bytes, sizeof (buf));
+  tr_ndbg (MY_NAME, "Maximum read cache size set to %s", buf);
+
+  readCacheTrim (cache, cache->max_read_bytes);
+}
+
+int64_t
+tr_cacheGetReadLimit (const tr_cache * cache)
+{
+  return cache->max_read_bytes;
+}
+
+void
+tr_cacheGetStats (const tr_cache * cache, tr_cache_stats * setme)
+{
+  setme->cache_writes = cache->cache_writes;
+  setme->cache_write_bytes = cache->cache_write_bytes;
+  setme->disk_writes = cache->disk_writes;
+  setme->disk_write_bytes = cache->disk_write_bytes;
+  setme->read_hits = cache->read_hits;
+  setme->read_hit_bytes = cache->read_hit_bytes;
+  setme->read_misses = cache->read_misses;
+  setme->read_miss_bytes = cache->read_miss_bytes;
+  setme->read_cache_pieces = cache->piece_count;
+  setme->read_cache_bytes = cache->read_bytes;
+}
+
 tr_cache *
 tr_cacheNew (int64_t max_bytes)
 {
   tr_cache * cache = tr_new0 (tr_cache, 1);
-  cache->blocks = TR_PTR_ARRAY_INIT;
+  cache->buckets = tr_new0 (struct cache_block*, MIN_BUCKET_COUNT);
+  cache->bucket_count = MIN_BUCKET_COUNT;
+  cache->piece_buckets = tr_new0 (struct cache_piece*, MIN_BUCKET_COUNT);
+  cache->piece_bucket_count = MIN_BUCKET_COUNT;
   cache->max_bytes = max_bytes;
   cache->max_blocks = getMaxBlocks (max_bytes);
+  cache->lock = tr_lockNew ();
   return cache;
 }
 
 void
 tr_cacheFree (tr_cache * cache)
 {
-  assert (tr_ptrArrayEmpty (&cache->blocks));
-  tr_ptrArrayDestruct (&cache->blocks, NULL);
+  /* the disk threads exit once their queues are empty */
+  waitForDisk (cache, NULL);
+  while (cache->writer_running || (cache->reader_count > 0))
+    tr_wait_msec (MSEC_TO_WAIT_FOR_DISK);
+
+  readCacheRemoveTorrent (cache, NULL);
+
+  assert (cache->block_count == 0);
+  assert (cache->runs == NULL);
+  tr_lockFree (cache->lock);
+  tr_free (cache->buckets);
+  tr_free (cache->piece_buckets);
+  tr_free (cache->piece_heap);
   tr_free (cache);
 }
 
@@ -292,34 +1200,13 @@ tr_cacheFree (tr_cache * cache)
 ****
 ***/
 
-static int
-cache_block_compare (const void * va, const void * vb)
-{
-  const struct cache_block * a = va;
-  const struct cache_block * b = vb;
-
-  /* primary key: torrent id */
-  if (a->tor->uniqueId != b->tor->uniqueId)
-    return a->tor->uniqueId < b->tor->uniqueId ? -1 : 1;
-
-  /* secondary key: block # */
-  if (a->block != b->block)
-    return a->block < b->block ? -1 : 1;
-
-  /* they're equal */
-  return 0;
-}
-
 static struct cache_block *
 findBlock (tr_cache           * cache,
            tr_torrent         * torrent,
            tr_piece_index_t     piece,
            uint32_t             offset)
 {
-  struct cache_block key;
-  key.tor = torrent;
-  key.block = _tr_block (torrent, piece, offset);
-  return tr_ptrArrayFindSorted (&cache->blocks, &key, cache_block_compare);
+  return findBlockByIndex (cache, torrent, _tr_block (torrent, piece, offset));
 }
 
 int
@@ -331,20 +1218,36 @@ tr_cacheWriteBlock (tr_cache         * cache,
                     struct evbuffer  * writeme)
 {
   struct cache_block * cb = findBlock (cache, torrent, piece, offset);
+  struct cache_piece * cp = findPiece (cache, torrent, piece);
 
-  if (cb == NULL)
+  /* the piece is changing, so the read cache's copy is stale */
+  if (cp != NULL)
+    removePiece (cache, cp);
+
+  if ((cb != NULL) && (cb->job != NULL))
     {
-      cb = tr_new (struct cache_block, 1);
+      /* the old copy is still on its way to disk. leave that write alone
+         and queue this copy up behind it as a dirty block */
+      cb->job = NULL;
+      cb->evbuf = evbuffer_new ();
+      --cache->flushing_blocks;
+      addToRuns (cache, cb);
+    }
+  else if (cb == NULL)
+    {
+      cb = tr_new0 (struct cache_block, 1);
       cb->tor = torrent;
       cb->piece = piece;
       cb->offset = offset;
       cb->length = length;
       cb->block = _tr_block (torrent, piece, offset);
       cb->evbuf = evbuffer_new ();
-      tr_ptrArrayInsertSorted (&cache->blocks, cb, cache_block_compare);
+      addToRuns (cache, cb);
+      indexBlock (cache, cb);
     }
 
   cb->time = tr_time ();
+  cb->run->time = cb->time;
 
   assert (cb->length == length);
   evbuffer_drain (cb->evbuf, evbuffer_get_length (cb->evbuf));
@@ -353,7 +1256,8 @@ tr_cacheWriteBlock (tr_cache         * cache,
   cache->cache_writes++;
   cache->cache_write_bytes += cb->length;
 
-  return cacheTrim (cache);
+  cacheTrim (cache);
+  return 0;
 }
 
 int
@@ -367,7 +1271,9 @@ tr_cacheReadBlock (tr_cache         * cache,
   int err = 0;
   struct cache_block * cb = findBlock (cache, torrent, piece, offset);
 
-  if (cb)
+  if (cb && cb->job)
+    memcpy (setme, cb->job->buf + (cb->block - cb->job->first) * torrent->blockSize, len);
+  else if (cb)
     evbuffer_copyout (cb->evbuf, setme, len);
   else
     err = tr_ioRead (torrent, piece, offset, len, setme);
@@ -375,6 +1281,163 @@ tr_cacheReadBlock (tr_cache         * cache,
   return err;
 }
 
+bool
+tr_cacheHasBlock (tr_cache         * cache,
+                  tr_torrent       * torrent,
+                  tr_piece_index_t   piece,
+                  uint32_t           offset)
+{
+  return (findBlock (cache, torrent, piece, offset) != NULL)
+      || (findPiece (cache, torrent, piece) != NULL);
+}
+
+static struct cache_read_job *
+findReadJob (struct cache_read_job  * job,
+             const tr_torrent       * tor,
+             tr_piece_index_t         piece,
+             uint32_t                 offset,
+             uint32_t                 len)
+{
+  for (; job!=NULL; job=job->next)
+    if ((job->tor == tor) && (job->piece == piece)
+                          && (job->offset <= offset)
+                          && (offset + len <= job->offset + job->length))
+      break;
+
+  return job;
+}
+
+void
+tr_cacheReadBlockAsync (tr_cache           * cache,
+                        tr_torrent         * torrent,
+                        tr_piece_index_t     piece,
+                        uint32_t             offset,
+                        uint32_t             len,
+                        tr_cache_read_func * func,
+                        void               * user_data)
+{
+  struct cache_read_job * job;
+  struct cache_read_request * req;
+  struct cache_piece * cp;
+  struct cache_block * cb = findBlock (cache, torrent, piece, offset);
+
+  /* if we've already got it in memory, there's no need to wait */
+  if ((cp = findPiece (cache, torrent, piece)) != NULL)
+    {
+      ++cp->hits;
+      cp->time = tr_time ();
+      updatePieceScore (cp);
+      heapFix (cache, cp->heap_pos);
+      ++cache->read_hits;
+      cache->read_hit_bytes += len;
+      func (user_data, 0, piece, offset, len, cp->buf + offset);
+      return;
+    }
+
+  if (cb != NULL)
+    {
+      uint8_t * buf = tr_new (uint8_t, len);
+      const int err = tr_cacheReadBlock (cache, torrent, piece, offset, len, buf);
+      ++cache->read_hits;
+      cache->read_hit_bytes += len;
+      func (user_data, err, piece, offset, len, err ? NULL : buf);
+      tr_free (buf);
+      return;
+    }
+
+  ++cache->read_misses;
+  cache->read_miss_bytes += len;
+
+  req = tr_new0 (struct cache_read_request, 1);
+  req->func = func;
+  req->user_data = user_data;
+  req->offset = offset;
+  req->length = len;
+
+  tr_lockLock (cache->lock);
+
+  /* if another peer wants an adjacent part of the same piece,
+     fold this request into that job so it's all one read */
+  for (job=cache->read_pending; job!=NULL; job=job->next)
+    if ((job->tor == torrent) && (job->piece == piece)
+                              && (offset <= job->offset + job->length)
+                              && (job->offset <= offset + len))
+      break;
+
+  if (job != NULL)
+    {
+      const uint32_t end = MAX (job->offset + job->length, offset + len);
+      job->offset = MIN (job->offset, offset);
+      job->length = end - job->offset;
+    }
+
+  /* a read that's already underway may cover this request too */
+  if (job == NULL)
+    job = findReadJob (cache->read_active, torrent, piece, offset, len);
+  if (job == NULL)
+    job = findReadJob (cache->read_finished, torrent, piece, offset, len);
+
+  if (job == NULL)
+    {
+      const uint32_t piece_size = tr_torPieceCountBytes (torrent, piece);
+
+      job = tr_new0 (struct cache_read_job, 1);
+      job->tor = torrent;
+      job->piece = piece;
+      job->paths = tr_ioGetPaths (torrent, piece, 0, piece_size, false);
+
+      /* read the whole piece if it'll go into the read cache */
+      if (piece_size <= cache->max_read_bytes)
+        {
+          job->offset = 0;
+          job->length = piece_size;
+        }
+      else
+        {
+          job->offset = offset;
+          job->length = len;
+        }
+
+      appendReadJob (&cache->read_pending, &cache->read_pending_tail, job);
+
+      if (cache->reader_count < MAX_READER_THREADS)
+        {
+          ++cache->reader_count;
+          tr_threadNew (readerThreadFunc, cache);
+        }
+    }
+
+  req->next = job->requests;
+  job->requests = req;
+
+  tr_lockUnlock (cache->lock);
+}
+
+static void
+cancelReads (struct cache_read_job * job, const void * user_data)
+{
+  for (; job!=NULL; job=job->next)
+    {
+      struct cache_read_request * req;
+
+      for (req=job->requests; req!=NULL; req=req->next)
+        if (req->user_data == user_data)
+          req->func = NULL;
+    }
+}
+
+void
+tr_cacheCancelReads (tr_cache * cache, const void * user_data)
+{
+  tr_lockLock (cache->lock);
+  cancelReads (cache->read_pending, user_data);
+  cancelReads (cache->read_active, user_data);
+  cancelReads (cache->read_finished, user_data);
+  tr_lockUnlock (cache->lock);
+
+  cancelReads (cache->read_reaping, user_data);
+}
+
 int
 tr_cachePrefetchBlock (tr_cache         * cache,
                        tr_torrent       * torrent,
@@ -395,82 +1458,66 @@ tr_cachePrefetchBlock (tr_cache         * cache,
 ****
 ***/
 
-static int
-findBlockPos (tr_cache * cache, tr_torrent * torrent, tr_piece_index_t block)
-{
-  struct cache_block key;
-  key.tor = torrent;
-  key.block = block;
-  return tr_ptrArrayLowerBound (&cache->blocks, &key, cache_block_compare, NULL);
-}
-
 int tr_cacheFlushDone (tr_cache * cache)
 {
-  int err = 0;
+  struct cache_run * run = cache->runs;
 
-  if (tr_ptrArraySize (&cache->blocks) > 0)
+  while (run != NULL)
     {
-      int i, n;
-      struct run_info * runs;
+      struct cache_run * next = run->next;
 
-      runs = tr_new (struct run_info, tr_ptrArraySize (&cache->blocks));
-      i = 0;
-      n = calcRuns (cache, runs);
+      if (runIsPieceDone (run) || runIsMultiPiece (run))
+        flushRun (cache, run, run->first);
 
-      while (i < n && (runs[i].is_piece_done || runs[i].is_multi_piece))
-        runs[i++].rank |= SESSIONFLAG;
-
-      err = flushRuns (cache, runs, i);
-      tr_free (runs);
+      run = next;
     }
 
-  return err;
+  return reapJobs (cache);
 }
 
 int
 tr_cacheFlushFile (tr_cache * cache, tr_torrent * torrent, tr_file_index_t i)
 {
-  int pos;
-  int err = 0;
   tr_block_index_t first;
   tr_block_index_t last;
+  struct cache_run * run = cache->runs;
 
   tr_torGetFileBlockRange (torrent, i, &first, &last);
-  pos = findBlockPos (cache, torrent, first);
   dbgmsg ("flushing file %d from cache to disk: blocks [%zu...%zu]", (int)i, (size_t)first, (size_t)last);
 
   /* flush out all the blocks in that file */
-  while (!err && (pos < tr_ptrArraySize (&cache->blocks)))
+  while (run != NULL)
     {
-      const struct cache_block * b = tr_ptrArrayNth (&cache->blocks, pos);
+      struct cache_run * next = run->next;
 
-      if (b->tor != torrent)
-        break;
-      if ((b->block < first) || (b->block > last))
-        break;
+      if ((run->tor == torrent) && (run->last >= first) && (run->first <= last))
+        flushRun (cache, run, MAX (run->first, first));
 
-      err = flushContiguous (cache, pos, getBlockRun (cache, pos, NULL));
+      run = next;
     }
 
-    return err;
+  /* the caller is about to close or rename the file, so wait for it */
+  return waitForDisk (cache, torrent);
 }
 
 int
 tr_cacheFlushTorrent (tr_cache * cache, tr_torrent * torrent)
 {
-  int err = 0;
-  const int pos = findBlockPos (cache, torrent, 0);
+  int err;
+  struct cache_run * run = cache->runs;
 
   /* flush out all the blocks in that torrent */
-  while (!err && (pos < tr_ptrArraySize (&cache->blocks)))
+  while (run != NULL)
     {
-      const struct cache_block * b = tr_ptrArrayNth (&cache->blocks, pos);
+      struct cache_run * next = run->next;
 
-      if (b->tor != torrent)
-        break;
+      if (run->tor == torrent)
+        flushRun (cache, run, run->first);
 
-      err = flushContiguous (cache, pos, getBlockRun (cache, pos, NULL));
+      run = next;
     }
 
+  err = waitForDisk (cache, torrent);
+  readCacheRemoveTorrent (cache, torrent);
   return err;
 }
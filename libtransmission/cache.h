@@ -37,6 +37,37 @@ int tr_cacheSetLimit (tr_cache * cache, int64_t max_bytes);
 
 int64_t tr_cacheGetLimit (const tr_cache *);
 
+/* the read cache keeps whole pieces that were read for peers.
+   0 turns it off */
+void tr_cacheSetReadLimit (tr_cache * cache, int64_t max_bytes);
+
+int64_t tr_cacheGetReadLimit (const tr_cache *);
+
+typedef struct tr_cache_stats
+{
+  size_t cache_writes;
+  size_t cache_write_bytes;
+  size_t disk_writes;
+  size_t disk_write_bytes;
+
+  /* tr_cacheReadBlockAsync () calls that were, or weren't,
+     answered from memory without going to disk */
+  size_t read_hits;
+  size_t read_hit_bytes;
+  size_t read_misses;
+  size_t read_miss_bytes;
+
+  size_t read_cache_pieces;
+  size_t read_cache_bytes;
+}
+tr_cache_stats;
+
+void tr_cacheGetStats (const tr_cache * cache, tr_cache_stats * setme);
+
+/* true when so much data is queued for the disk writer
+   that we should stop asking peers for more */
+bool tr_cacheIsBacklogged (const tr_cache *);
+
 int tr_cacheWriteBlock (tr_cache         * cache,
                         tr_torrent       * torrent,
                         tr_piece_index_t   piece,
@@ -51,6 +82,36 @@ int tr_cacheReadBlock (tr_cache         * cache,
                        uint32_t           len,
                        uint8_t          * setme);
 
+/** true if the block is in memory: dirty, on its way to disk, or in the read cache */
+bool tr_cacheHasBlock (tr_cache         * cache,
+                       tr_torrent       * torrent,
+                       tr_piece_index_t   piece,
+                       uint32_t           offset);
+
+typedef void (tr_cache_read_func)(void              * user_data,
+                                  int                 err,
+                                  tr_piece_index_t    piece,
+                                  uint32_t            offset,
+                                  uint32_t            len,
+                                  const uint8_t     * data);
+
+/**
+ * Reads a block without making the libtransmission thread wait on the disk.
+ * If the block is already in memory, func is called before this returns.
+ * Otherwise a reader thread fetches it and func is called later from the
+ * libtransmission thread. data is only valid for the duration of the call.
+ */
+void tr_cacheReadBlockAsync (tr_cache           * cache,
+                             tr_torrent         * torrent,
+                             tr_piece_index_t     piece,
+                             uint32_t             offset,
+                             uint32_t             len,
+                             tr_cache_read_func * func,
+                             void               * user_data);
+
+/** Makes sure no pending tr_cacheReadBlockAsync () calls back to user_data */
+void tr_cacheCancelReads (tr_cache * cache, const void * user_data);
+
 int tr_cachePrefetchBlock (tr_cache         * cache,
                            tr_torrent       * torrent,
                            tr_piece_index_t   piece,
@@ -115,7 +115,7 @@ tr_cpBlockAdd (tr_completion * cp, tr_block_index_t block)
       cp->sizeNow += tr_torBlockCountBytes (tor, block);
 
       cp->haveValidIsDirty = true;
-      cp->sizeWhenDoneIsDirty |= tor->info.pieces[piece].dnd;
+      cp->sizeWhenDoneIsDirty |= tor->info.pieceDnd[piece];
     }
 }
 
@@ -168,7 +168,7 @@ tr_cpSizeWhenDone (const tr_completion * ccp)
               uint64_t n = 0;
               const uint64_t pieceSize = tr_torPieceCountBytes (tor, p);
 
-              if (!inf->pieces[p].dnd)
+              if (!inf->pieceDnd[p])
                 {
                   n = pieceSize;
                 }
@@ -0,0 +1,126 @@
+#include <stdio.h> /* fprintf () */
+#include <string.h> /* memcmp (), strcmp () */
+
+#include <openssl/sha.h>
+
+#include "transmission.h"
+#include "crypto.h"
+#include "utils.h" /* tr_time_msec (), tr_valloc () */
+
+#include "libtransmission-test.h"
+
+static const tr_sha1_backend backends[] = { TR_SHA1_BACKEND_OPENSSL,
+                                            TR_SHA1_BACKEND_AVX2 };
+
+static int
+test_sha1_batch (void)
+{
+  int i;
+  int b;
+  const int n = 21;
+  size_t lens[21];
+  const void * contents[21];
+  uint8_t expected[21 * SHA_DIGEST_LENGTH];
+  uint8_t actual[21 * SHA_DIGEST_LENGTH];
+  uint8_t * buf = tr_new (uint8_t, 70000);
+
+  tr_cryptoRandBuf (buf, 70000);
+
+  /* lengths chosen to hit every padding boundary */
+  for (i=0; i<n; ++i)
+    {
+      static const size_t sizes[] = { 0, 1, 55, 56, 63, 64, 65, 119, 120, 127, 128 };
+      lens[i] = i < (int)(sizeof (sizes) / sizeof (sizes[0])) ? sizes[i]
+                                                               : (size_t) tr_cryptoWeakRandInt (65536);
+      contents[i] = buf + tr_cryptoWeakRandInt (4096);
+      tr_sha1 (expected + i*SHA_DIGEST_LENGTH, contents[i], (int)lens[i], NULL);
+    }
+
+  for (b=0; b<NUM_TESTS (backends); ++b)
+    {
+      if (!tr_sha1SetBackend (backends[b]))
+        continue;
+
+      /* try every batch size, including partly-filled lanes */
+      for (i=1; i<=n; ++i)
+        {
+          memset (actual, 0, sizeof (actual));
+          tr_sha1_batch (actual, i, contents, lens);
+          check (!memcmp (expected, actual, i * SHA_DIGEST_LENGTH));
+        }
+    }
+
+  tr_sha1SetBackend (TR_SHA1_BACKEND_AUTO);
+  tr_free (buf);
+  return 0;
+}
+
+/***
+****  Benchmark: run with --benchmark
+***/
+
+static void
+benchmark_sha1 (void)
+{
+  int i;
+  int b;
+  int pass;
+  const int passes = 8;
+  const size_t pieceSize = 256 * 1024;
+  const int n = TR_SHA1_BATCH_SIZE * 8;
+  size_t lens[64];
+  const void * contents[64];
+  uint8_t digests[64 * SHA_DIGEST_LENGTH];
+  uint8_t * buf = tr_valloc (pieceSize * n);
+  const double mib = (double)pieceSize * n * passes / (1024.0 * 1024.0);
+  uint64_t msec;
+
+  tr_cryptoRandBuf (buf, pieceSize * n);
+  for (i=0; i<n; ++i)
+    {
+      lens[i] = pieceSize;
+      contents[i] = buf + i*pieceSize;
+    }
+
+  /* the path verify.c and makemeta.c used before batching */
+  msec = tr_time_msec ();
+  for (pass=0; pass<passes; ++pass)
+    for (i=0; i<n; ++i)
+      tr_sha1 (digests + i*SHA_DIGEST_LENGTH, contents[i], (int)lens[i], NULL);
+  msec = MAX (1, tr_time_msec () - msec);
+  fprintf (stderr, "%-10s %8.1f MiB/s\n", "tr_sha1", mib / (msec / 1000.0));
+
+  for (b=0; b<NUM_TESTS (backends); ++b)
+    {
+      if (!tr_sha1SetBackend (backends[b]))
+        {
+          fprintf (stderr, "%-10s unsupported on this CPU\n", tr_sha1BackendName (backends[b]));
+          continue;
+        }
+
+      msec = tr_time_msec ();
+      for (pass=0; pass<passes; ++pass)
+        tr_sha1_batch (digests, n, contents, lens);
+      msec = MAX (1, tr_time_msec () - msec);
+      fprintf (stderr, "%-10s %8.1f MiB/s\n", tr_sha1BackendName (backends[b]), mib / (msec / 1000.0));
+    }
+
+  tr_sha1SetBackend (TR_SHA1_BACKEND_AUTO);
+  fprintf (stderr, "auto-selected backend: %s\n", tr_sha1BackendName (tr_sha1GetBackend ()));
+  tr_free (buf);
+}
+
+int
+main (int argc, char ** argv)
+{
+  int ret;
+  const testFunc tests[] = { test_sha1_batch };
+
+  if ((ret = runTests (tests, NUM_TESTS (tests))))
+    return ret;
+
+  if ((argc > 1) && !strcmp (argv[1], "--benchmark"))
+    benchmark_sha1 ();
+
+  return 0;
+}
@@ -96,6 +96,40 @@ void tr_sha1 (uint8_t    * setme,
               int          content1_len,
               ...) TR_GNUC_NULL_TERMINATED;
 
+enum
+{
+    /* callers get the most out of tr_sha1_batch () when they hand it
+     * at least this many buffers of about the same size at a time */
+    TR_SHA1_BATCH_SIZE = 8
+};
+
+typedef enum
+{
+    TR_SHA1_BACKEND_AUTO,
+    TR_SHA1_BACKEND_OPENSSL,
+    TR_SHA1_BACKEND_AVX2
+}
+tr_sha1_backend;
+
+/**
+ * @brief generate the SHA1 hashes of n independent chunks of memory
+ * @param setme receives n * SHA_DIGEST_LENGTH bytes of digests
+ *
+ * Depending on the CPU, this may hash several chunks in lockstep.
+ */
+void tr_sha1_batch (uint8_t            * setme,
+                    int                  n,
+                    const void * const * contents,
+                    const size_t       * content_lens);
+
+/** @brief the SHA1 implementation picked for this CPU by tr_sha1_batch () */
+tr_sha1_backend tr_sha1GetBackend (void);
+
+/** @brief override the SHA1 implementation. Returns false if the CPU can't run it. */
+bool tr_sha1SetBackend (tr_sha1_backend backend);
+
+const char * tr_sha1BackendName (tr_sha1_backend backend);
+
 
 /** @brief returns a random number in the range of [0...n) */
 int tr_cryptoRandInt (int n);
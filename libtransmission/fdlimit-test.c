@@ -0,0 +1,362 @@
+#include <errno.h>
+#include <fcntl.h> /* fcntl () */
+#include <inttypes.h> /* PRIu64 */
+#include <stdio.h> /* fopen () */
+#include <stdlib.h> /* mkdtemp () */
+#include <string.h> /* strcmp () */
+#include <unistd.h> /* pread () */
+
+#include "transmission.h"
+#include "fdlimit.h"
+#include "platform.h" /* tr_threadNew () */
+#include "session.h"
+#include "utils.h"
+
+#include "libtransmission-test.h"
+
+enum
+{
+    TORRENT_ID = 1,
+    FILE_COUNT = 64,
+    FILE_SIZE = 16 * 1024
+};
+
+/* file i is FILE_SIZE copies of the byte i */
+static char *
+makeFile (const char * dir, tr_file_index_t i)
+{
+    FILE * fp;
+    char name[32];
+    char * filename;
+    char buf[FILE_SIZE];
+
+    tr_snprintf (name, sizeof (name), "file-%u", (unsigned int)i);
+    filename = tr_buildPath (dir, name, NULL);
+    memset (buf, (int)i, sizeof (buf));
+    fp = fopen (filename, "wb");
+    fwrite (buf, 1, sizeof (buf), fp);
+    fclose (fp);
+
+    return filename;
+}
+
+static int
+checkout (tr_session * session, const char * dir, tr_file_index_t i, bool writable)
+{
+    int fd;
+    char * filename = makeFile (dir, i);
+
+    fd = tr_fdFileCheckout (session, TORRENT_ID, i, filename, writable,
+                            TR_PREALLOCATE_NONE, FILE_SIZE);
+    tr_free (filename);
+    return fd;
+}
+
+static bool
+fdIsOpen (int fd)
+{
+    return (fcntl (fd, F_GETFD) != -1) || (errno != EBADF);
+}
+
+/***
+****
+***/
+
+static int
+test_hits_and_misses (void)
+{
+    int fd;
+    tr_fd_stats before;
+    tr_fd_stats after;
+    tr_session * session;
+    char config_dir[] = "/tmp/transmission-fdlimit-test-XXXXXX";
+
+    check (mkdtemp (config_dir) != NULL);
+    session = libttest_session_init (config_dir, NULL);
+    tr_fdGetStats (session, &before);
+
+    /* a real open is a miss */
+    fd = checkout (session, config_dir, 0, false);
+    check (fd >= 0);
+    tr_fdFileReturn (session, TORRENT_ID, 0, fd);
+
+    /* a checkout or lookup that finds it open is a hit */
+    fd = checkout (session, config_dir, 0, false);
+    check (fd >= 0);
+    tr_fdFileReturn (session, TORRENT_ID, 0, fd);
+    fd = tr_fdFileGetCached (session, TORRENT_ID, 0, false);
+    check (fd >= 0);
+    tr_fdFileReturn (session, TORRENT_ID, 0, fd);
+
+    /* a read-only fd can't be used for writing, so that's a lookup that
+       counts nothing, and then a checkout that reopens the file: a miss */
+    check_int_eq (-1, tr_fdFileGetCached (session, TORRENT_ID, 0, true));
+    fd = checkout (session, config_dir, 0, true);
+    check (fd >= 0);
+    tr_fdFileReturn (session, TORRENT_ID, 0, fd);
+
+    tr_fdGetStats (session, &after);
+    check_int_eq (2, after.hits - before.hits);
+    check_int_eq (2, after.misses - before.misses);
+    check_int_eq (before.openFiles + 1, after.openFiles);
+
+    tr_sessionClose (session);
+    libttest_rm_rf (config_dir);
+    return 0;
+}
+
+static int
+test_close_all_with_pinned_files (void)
+{
+    int pinned;
+    int retired;
+    tr_session * session;
+    char config_dir[] = "/tmp/transmission-fdlimit-test-XXXXXX";
+
+    check (mkdtemp (config_dir) != NULL);
+    session = libttest_session_init (config_dir, NULL);
+
+    /* one file that's still checked out... */
+    pinned = checkout (session, config_dir, 0, false);
+    check (pinned >= 0);
+
+    /* ...and one that was closed while checked out, so it's
+       waiting for a tr_fdFileReturn () that won't come */
+    retired = checkout (session, config_dir, 1, false);
+    check (retired >= 0);
+    tr_fdTorrentClose (session, TORRENT_ID);
+    check (fdIsOpen (retired));
+
+    /* tearing down the pool closes both */
+    tr_fdClose (session);
+    check (!fdIsOpen (pinned));
+    check (!fdIsOpen (retired));
+
+    tr_sessionClose (session);
+    libttest_rm_rf (config_dir);
+    return 0;
+}
+
+/***
+****  Several threads checking out more files than the pool holds
+***/
+
+enum
+{
+    WORKER_COUNT = 4,
+    WORKER_ITERATIONS = 2000
+};
+
+struct worker
+{
+    tr_session * session;
+    char ** filenames;
+    unsigned int seed;
+    int errors;
+    volatile bool done;
+};
+
+static void
+workerFunc (void * vworker)
+{
+    int n;
+    struct worker * w = vworker;
+
+    for (n=0; n<WORKER_ITERATIONS; ++n)
+    {
+        int fd;
+        unsigned char c;
+        const tr_file_index_t i = (w->seed = w->seed * 1103515245u + 12345u) % FILE_COUNT;
+        const bool writable = (n % 7) == 0;
+
+        fd = tr_fdFileCheckout (w->session, TORRENT_ID, i, w->filenames[i], writable,
+                                TR_PREALLOCATE_NONE, FILE_SIZE);
+        if (fd < 0)
+        {
+            ++w->errors;
+            continue;
+        }
+
+        if ((pread (fd, &c, 1, n % FILE_SIZE) != 1) || (c != (unsigned char)i))
+            ++w->errors;
+
+        tr_fdFileReturn (w->session, TORRENT_ID, i, fd);
+    }
+
+    w->done = true;
+}
+
+static int
+test_concurrent_checkouts (void)
+{
+    int i;
+    tr_fd_stats stats;
+    tr_session * session;
+    char * filenames[FILE_COUNT];
+    struct worker workers[WORKER_COUNT];
+    char config_dir[] = "/tmp/transmission-fdlimit-test-XXXXXX";
+
+    check (mkdtemp (config_dir) != NULL);
+    session = libttest_session_init (config_dir, NULL);
+
+    for (i=0; i<FILE_COUNT; ++i)
+        filenames[i] = makeFile (config_dir, i);
+
+    for (i=0; i<WORKER_COUNT; ++i)
+    {
+        workers[i].session = session;
+        workers[i].filenames = filenames;
+        workers[i].seed = i + 1;
+        workers[i].errors = 0;
+        workers[i].done = false;
+        tr_threadNew (workerFunc, &workers[i]);
+    }
+
+    for (i=0; i<WORKER_COUNT; ++i)
+    {
+        while (!workers[i].done)
+            tr_wait_msec (10);
+        check_int_eq (0, workers[i].errors);
+    }
+
+    /* every fd's been returned, and at most one copy of each file is open */
+    tr_fdGetStats (session, &stats);
+    check (stats.openFiles <= stats.fileLimit);
+    check (stats.openFiles <= FILE_COUNT);
+    check_int_eq (WORKER_COUNT * WORKER_ITERATIONS, stats.hits + stats.misses);
+
+    tr_sessionClose (session);
+    for (i=0; i<FILE_COUNT; ++i)
+        tr_free (filenames[i]);
+    libttest_rm_rf (config_dir);
+    return 0;
+}
+
+/***
+****  Benchmark: run with --benchmark
+****
+****  How long the pool's lock is held, and how much it's fought over,
+****  next to the I/O that each checkout is for.
+***/
+
+enum
+{
+    BENCH_ITERATIONS = 1000000,
+    BENCH_MAX_THREADS = 8
+};
+
+struct bench_worker
+{
+    tr_session * session;
+    tr_file_index_t file_index;
+    int fd;
+    volatile bool done;
+};
+
+static void
+benchLookupFunc (void * vworker)
+{
+    int n;
+    struct bench_worker * w = vworker;
+
+    for (n=0; n<BENCH_ITERATIONS; ++n)
+    {
+        const int fd = tr_fdFileGetCached (w->session, TORRENT_ID, w->file_index, false);
+        tr_fdFileReturn (w->session, TORRENT_ID, w->file_index, fd);
+    }
+
+    w->done = true;
+}
+
+static void
+benchReadFunc (void * vworker)
+{
+    int n;
+    char buf[FILE_SIZE];
+    struct bench_worker * w = vworker;
+
+    for (n=0; n<BENCH_ITERATIONS/10; ++n)
+        if (pread (w->fd, buf, sizeof (buf), 0) < 0)
+            break;
+
+    w->done = true;
+}
+
+static uint64_t
+benchRun (struct bench_worker * workers, int thread_count, void (*func)(void*))
+{
+    int i;
+    const uint64_t begin = tr_time_msec ();
+
+    for (i=0; i<thread_count; ++i)
+    {
+        workers[i].done = false;
+        tr_threadNew (func, &workers[i]);
+    }
+
+    for (i=0; i<thread_count; ++i)
+        while (!workers[i].done)
+            tr_wait_msec (1);
+
+    return tr_time_msec () - begin;
+}
+
+static void
+benchmark_lock (void)
+{
+    int i;
+    int thread_count;
+    tr_session * session;
+    struct bench_worker workers[BENCH_MAX_THREADS];
+    char config_dir[] = "/tmp/transmission-fdlimit-test-XXXXXX";
+
+    if (mkdtemp (config_dir) == NULL)
+        return;
+
+    session = libttest_session_init (config_dir, NULL);
+
+    /* each thread has its own file, as each disk thread would if the
+       pool were sharded by torrent id; the only thing shared is the lock */
+    for (i=0; i<BENCH_MAX_THREADS; ++i)
+    {
+        workers[i].session = session;
+        workers[i].file_index = i;
+        workers[i].fd = checkout (session, config_dir, i, false);
+    }
+
+    fprintf (stderr, "%-8s %16s %16s\n", "threads", "lookup+return", "16 KiB pread");
+
+    for (thread_count=1; thread_count<=BENCH_MAX_THREADS; thread_count*=2)
+    {
+        const uint64_t lookup_msec = benchRun (workers, thread_count, benchLookupFunc);
+        const uint64_t read_msec = benchRun (workers, thread_count, benchReadFunc);
+
+        /* wall time per call, per thread */
+        fprintf (stderr, "%-8d %13" PRIu64 " ns %13" PRIu64 " ns\n", thread_count,
+                 lookup_msec * 1000000 / BENCH_ITERATIONS,
+                 read_msec * 1000000 / (BENCH_ITERATIONS/10));
+    }
+
+    for (i=0; i<BENCH_MAX_THREADS; ++i)
+        tr_fdFileReturn (session, TORRENT_ID, i, workers[i].fd);
+
+    tr_sessionClose (session);
+    libttest_rm_rf (config_dir);
+}
+
+int
+main (int argc, char ** argv)
+{
+    int ret;
+    const testFunc tests[] = { test_hits_and_misses,
+                               test_close_all_with_pinned_files,
+                               test_concurrent_checkouts };
+
+    if ((ret = runTests (tests, NUM_TESTS (tests))))
+        return ret;
+
+    if ((argc > 1) && !strcmp (argv[1], "--benchmark"))
+        benchmark_lock ();
+
+    return 0;
+}
@@ -44,6 +44,7 @@
 #include "transmission.h"
 #include "fdlimit.h"
 #include "net.h"
+#include "platform.h" /* tr_lock */
 #include "session.h"
 #include "torrent.h" /* tr_isTorrent () */
 
@@ -311,7 +312,21 @@ struct tr_cached_file
   int fd;
   int torrent_id;
   tr_file_index_t file_index;
-  time_t used_at;
+
+  /* how many callers are reading or writing the fd right now.
+     a pinned file is never closed; if it's removed from the cache
+     while pinned, it's marked `closing' and closed by the last
+     tr_fdFileReturn () */
+  int pin_count;
+  bool closing;
+
+  /* open files are hashed by (torrent_id, file_index) and kept on an
+     LRU list, most recently used first. closed ones are on a free list
+     threaded through hash_next. closing ones stay in the hash table,
+     so tr_fdFileReturn () can find them, but are off the LRU list */
+  struct tr_cached_file * hash_next;
+  struct tr_cached_file * lru_prev;
+  struct tr_cached_file * lru_next;
 };
 
 static inline bool
@@ -414,36 +429,177 @@ struct tr_fileset
 {
   struct tr_cached_file * begin;
   const struct tr_cached_file * end;
+
+  /* bucket_count is a power of two */
+  struct tr_cached_file ** buckets;
+  size_t bucket_count;
+
+  struct tr_cached_file * lru_head;
+  struct tr_cached_file * lru_tail;
+  struct tr_cached_file * free_list;
+  int open_count;
+
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
 };
 
+static inline size_t
+fileset_bucket (const struct tr_fileset * set, int torrent_id, tr_file_index_t i)
+{
+  uint32_t h = ((uint32_t)torrent_id * 0x9E3779B1u) ^ (uint32_t)i;
+
+  h ^= h >> 16;
+  h *= 0x85EBCA6Bu;
+  h ^= h >> 13;
+
+  return h & (set->bucket_count - 1);
+}
+
 static void
 fileset_construct (struct tr_fileset * set, int n)
 {
   struct tr_cached_file * o;
-  const struct tr_cached_file TR_CACHED_FILE_INIT = { 0, -1, 0, 0, 0 };
+  const struct tr_cached_file TR_CACHED_FILE_INIT = { 0, -1, 0, 0, 0, false, NULL, NULL, NULL };
+
+  memset (set, 0, sizeof (struct tr_fileset));
 
   set->begin = tr_new (struct tr_cached_file, n);
   set->end = set->begin + n;
 
+  for (set->bucket_count=1; set->bucket_count<(size_t)n; )
+    set->bucket_count *= 2;
+  set->buckets = tr_new0 (struct tr_cached_file*, set->bucket_count);
+
   for (o=set->begin; o!=set->end; ++o)
-    *o = TR_CACHED_FILE_INIT;
+    {
+      *o = TR_CACHED_FILE_INIT;
+      o->hash_next = set->free_list;
+      set->free_list = o;
+    }
 }
 
+/* mark `o' as the most recently used */
+static void
+fileset_touch (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  if (set->lru_head == o)
+    return;
+
+  /* unlink... */
+  o->lru_prev->lru_next = o->lru_next;
+  if (o->lru_next != NULL)
+    o->lru_next->lru_prev = o->lru_prev;
+  else
+    set->lru_tail = o->lru_prev;
+
+  /* ...and push to the front */
+  o->lru_prev = NULL;
+  o->lru_next = set->lru_head;
+  set->lru_head->lru_prev = o;
+  set->lru_head = o;
+}
+
+/* call after opening `o' */
+static void
+fileset_add (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  const size_t bucket = fileset_bucket (set, o->torrent_id, o->file_index);
+
+  o->hash_next = set->buckets[bucket];
+  set->buckets[bucket] = o;
+
+  o->lru_prev = NULL;
+  o->lru_next = set->lru_head;
+  if (set->lru_head != NULL)
+    set->lru_head->lru_prev = o;
+  else
+    set->lru_tail = o;
+  set->lru_head = o;
+
+  ++set->open_count;
+}
+
+static void
+fileset_unlink_lru (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  if (o->lru_prev != NULL)
+    o->lru_prev->lru_next = o->lru_next;
+  else
+    set->lru_head = o->lru_next;
+  if (o->lru_next != NULL)
+    o->lru_next->lru_prev = o->lru_prev;
+  else
+    set->lru_tail = o->lru_prev;
+
+  o->lru_prev = o->lru_next = NULL;
+}
+
+/* close `o' and give its slot back to the free list */
+static void
+fileset_remove (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  struct tr_cached_file ** walk;
+
+  walk = &set->buckets[fileset_bucket (set, o->torrent_id, o->file_index)];
+  while (*walk != o)
+    walk = &(*walk)->hash_next;
+  *walk = o->hash_next;
+
+  if (!o->closing)
+    fileset_unlink_lru (set, o);
+
+  cached_file_close (o);
+  o->closing = false;
+  o->lru_prev = o->lru_next = NULL;
+  o->hash_next = set->free_list;
+  set->free_list = o;
+  --set->open_count;
+}
+
+/* like fileset_remove (), but if someone's using `o', let the last
+   tr_fdFileReturn () close it instead */
+static void
+fileset_retire (struct tr_fileset * set, struct tr_cached_file * o)
+{
+  if (o->pin_count == 0)
+    {
+      fileset_remove (set, o);
+    }
+  else if (!o->closing)
+    {
+      fileset_unlink_lru (set, o);
+      o->closing = true;
+    }
+}
+
+/* close every open file, including pinned and retired ones. only for
+   teardown, when nobody is left to return them */
 static void
 fileset_close_all (struct tr_fileset * set)
 {
-  struct tr_cached_file * o;
+  size_t i;
 
   if (set != NULL)
-    for (o=set->begin; o!=set->end; ++o)
-      if (cached_file_is_open (o))
-        cached_file_close (o);
+    for (i=0; i<set->bucket_count; ++i)
+      while (set->buckets[i] != NULL)
+        {
+          struct tr_cached_file * o = set->buckets[i];
+
+          if (o->pin_count != 0)
+            tr_dbg ("closing file %u of torrent %d, still pinned %d times",
+                    (unsigned int)o->file_index, o->torrent_id, o->pin_count);
+
+          o->pin_count = 0;
+          fileset_remove (set, o);
+        }
 }
 
 static void
 fileset_destruct (struct tr_fileset * set)
 {
   fileset_close_all (set);
+  tr_free (set->buckets);
   tr_free (set->begin);
   set->end = set->begin = NULL;
 }
@@ -454,47 +610,58 @@ fileset_close_torrent (struct tr_fileset * set, int torrent_id)
   struct tr_cached_file * o;
 
   if (set != NULL)
-    for (o=set->begin; o!=set->end; ++o)
-      if ((o->torrent_id == torrent_id) && cached_file_is_open (o))
-        cached_file_close (o);
+    {
+      o = set->lru_head;
+
+      while (o != NULL)
+        {
+          struct tr_cached_file * next = o->lru_next;
+
+          if (o->torrent_id == torrent_id)
+            fileset_retire (set, o);
+
+          o = next;
+        }
+    }
 }
 
 static struct tr_cached_file *
 fileset_lookup (struct tr_fileset * set, int torrent_id, tr_file_index_t i)
 {
-  struct tr_cached_file * o;
+  struct tr_cached_file * o = NULL;
 
   if (set != NULL)
-    for (o=set->begin; o!=set->end; ++o)
-      if ((torrent_id == o->torrent_id) && (i == o->file_index) && cached_file_is_open (o))
-        return o;
+    for (o=set->buckets[fileset_bucket (set, torrent_id, i)]; o!=NULL; o=o->hash_next)
+      if ((torrent_id == o->torrent_id) && (i == o->file_index) && !o->closing)
+        break;
 
-  return NULL;
+  return o;
 }
 
+/* returns a closed slot, recycling the least recently used file
+   that isn't pinned if need be. returns NULL if every file is pinned */
 static struct tr_cached_file *
 fileset_get_empty_slot (struct tr_fileset * set)
 {
-  struct tr_cached_file * cull = NULL;
+  struct tr_cached_file * o;
 
-  if (set->begin != NULL)
+  if (set->free_list == NULL)
     {
-      struct tr_cached_file * o;
-
-      /* try to find an unused slot */
-      for (o=set->begin; o!=set->end; ++o)
-        if (!cached_file_is_open (o))
-          return o;
+      for (o=set->lru_tail; o!=NULL; o=o->lru_prev)
+        if (o->pin_count == 0)
+          break;
 
-      /* all slots are full... recycle the least recently used */
-      for (cull=NULL, o=set->begin; o!=set->end; ++o)
-        if (!cull || o->used_at < cull->used_at)
-          cull = o;
-
-      cached_file_close (cull);
+      if (o != NULL)
+        {
+          fileset_remove (set, o);
+          ++set->evictions;
+        }
     }
 
-  return cull;
+  if ((o = set->free_list) != NULL)
+    set->free_list = o->hash_next;
+
+  return o;
 }
 
 /***
@@ -503,10 +670,17 @@ fileset_get_empty_slot (struct tr_fileset * set)
 ****
 ***/
 
+enum
+{
+  FILE_CACHE_MIN_SIZE = 32,
+  FILE_CACHE_MAX_SIZE = 1024
+};
+
 struct tr_fdInfo
 {
   int peerCount;
   struct tr_fileset fileset;
+  tr_lock * lock;
 };
 
 static void
@@ -518,12 +692,7 @@ ensureSessionFdInfoExists (tr_session * session)
     {
       struct rlimit limit;
       struct tr_fdInfo * i;
-      const int FILE_CACHE_SIZE = 32;
-
-      /* Create the local file cache */
-      i = tr_new0 (struct tr_fdInfo, 1);
-      fileset_construct (&i->fileset, FILE_CACHE_SIZE);
-      session->fdInfo = i;
+      int file_cache_size = FILE_CACHE_MIN_SIZE;
 
       /* set the open-file limit to the largest safe size wrt FD_SETSIZE */
       if (!getrlimit (RLIMIT_NOFILE, &limit))
@@ -537,10 +706,28 @@ ensureSessionFdInfoExists (tr_session * session)
               getrlimit (RLIMIT_NOFILE, &limit);
               tr_inf ("Changed open file limit from %d to %d", old_limit, (int)limit.rlim_cur);
             }
+
+          /* leave most of the descriptors for peers, trackers, and RPC */
+          file_cache_size = (int)limit.rlim_cur / 4;
+          file_cache_size = MAX (file_cache_size, FILE_CACHE_MIN_SIZE);
+          file_cache_size = MIN (file_cache_size, FILE_CACHE_MAX_SIZE);
         }
+
+      /* Create the local file cache */
+      i = tr_new0 (struct tr_fdInfo, 1);
+      fileset_construct (&i->fileset, file_cache_size);
+      i->lock = tr_lockNew ();
+      session->fdInfo = i;
+      tr_dbg ("Keeping up to %d local files open", file_cache_size);
     }
 }
 
+void
+tr_fdInit (tr_session * session)
+{
+  ensureSessionFdInfoExists (session);
+}
+
 void
 tr_fdClose (tr_session * session)
 {
@@ -548,6 +735,7 @@ tr_fdClose (tr_session * session)
     {
       struct tr_fdInfo * i = session->fdInfo;
       fileset_destruct (&i->fileset);
+      tr_lockFree (i->lock);
       tr_free (i);
       session->fdInfo = NULL;
     }
@@ -567,32 +755,76 @@ get_fileset (tr_session * session)
   return &session->fdInfo->fileset;
 }
 
+/* the libtransmission thread and the cache's disk threads all use the
+   repository. the lock is only held while it's being changed, not while
+   a file is opened, fsync ()ed, read or written.
+
+   it's one lock rather than one per shard of torrent ids: the busy case
+   is many threads serving the same popular torrent, which would all land
+   in one shard anyway, and per-shard file limits would starve a torrent
+   with many files. fdlimit-test --benchmark compares the time spent in
+   here with a 16 KiB pread () */
+static void
+fdLock (tr_session * session)
+{
+  ensureSessionFdInfoExists (session);
+  tr_lockLock (session->fdInfo->lock);
+}
+
+static void
+fdUnlock (tr_session * session)
+{
+  tr_lockUnlock (session->fdInfo->lock);
+}
+
 void
 tr_fdFileClose (tr_session * s, const tr_torrent * tor, tr_file_index_t i)
 {
   struct tr_cached_file * o;
 
+  fdLock (s);
+
   if ((o = fileset_lookup (get_fileset (s), tr_torrentId (tor), i)))
     {
       /* flush writable files so that their mtimes will be
-       * up-to-date when this function returns to the caller... */
+       * up-to-date when this function returns to the caller.
+       * the pin keeps `o' open while we fsync without the lock */
       if (o->is_writable)
-        tr_fsync (o->fd);
+        {
+          ++o->pin_count;
+          fdUnlock (s);
+          tr_fsync (o->fd);
+          fdLock (s);
+          --o->pin_count;
+        }
 
-      cached_file_close (o);
+      fileset_retire (get_fileset (s), o);
     }
+
+  fdUnlock (s);
 }
 
 int
 tr_fdFileGetCached (tr_session * s, int torrent_id, tr_file_index_t i, bool writable)
 {
-  struct tr_cached_file * o = fileset_lookup (get_fileset (s), torrent_id, i);
+  int fd = -1;
+  struct tr_cached_file * o;
+  struct tr_fileset * set;
 
-  if (!o || (writable && !o->is_writable))
-    return -1;
+  fdLock (s);
 
-  o->used_at = tr_time ();
-  return o->fd;
+  set = get_fileset (s);
+  o = fileset_lookup (set, torrent_id, i);
+  if (o && (!writable || o->is_writable))
+    {
+      fileset_touch (set, o);
+      fd = o->fd;
+      ++o->pin_count;
+      ++set->hits;
+    }
+
+  fdUnlock (s);
+  return fd;
 }
 
 #ifdef SYS_DARWIN
@@ -606,18 +838,41 @@ tr_fdFileGetCachedMTime (tr_session * s, int torrent_id, tr_file_index_t i, time
 {
   bool success;
   struct stat sb;
-  struct tr_cached_file * o = fileset_lookup (get_fileset (s), torrent_id, i);
+  struct tr_cached_file * o;
+
+  fdLock (s);
 
+  o = fileset_lookup (get_fileset (s), torrent_id, i);
   if ((success = (o != NULL) && !fstat (o->fd, &sb)))
     *mtime = TR_STAT_MTIME (sb);
 
+  fdUnlock (s);
   return success;
 }
 
+void
+tr_fdGetStats (tr_session * session, tr_fd_stats * setme)
+{
+  const struct tr_fileset * set;
+
+  fdLock (session);
+
+  set = get_fileset (session);
+  setme->hits = set->hits;
+  setme->misses = set->misses;
+  setme->evictions = set->evictions;
+  setme->openFiles = set->open_count;
+  setme->fileLimit = set->end - set->begin;
+
+  fdUnlock (session);
+}
+
 void
 tr_fdTorrentClose (tr_session * session, int torrent_id)
 {
-    fileset_close_torrent (get_fileset (session), torrent_id);
+  fdLock (session);
+  fileset_close_torrent (get_fileset (session), torrent_id);
+  fdUnlock (session);
 }
 
 /* returns an fd on success, or a -1 on failure and sets errno */
@@ -630,32 +885,104 @@ tr_fdFileCheckout (tr_session             * session,
                    tr_preallocation_mode    allocation,
                    uint64_t                 file_size)
 {
-  struct tr_fileset * set = get_fileset (session);
-  struct tr_cached_file * o = fileset_lookup (set, torrent_id, i);
+  int fd;
+  int err;
+  struct tr_fileset * set;
+  struct tr_cached_file * o;
+  struct tr_cached_file * other;
+
+  fdLock (session);
 
-  if (o && writable && !o->is_writable)
-    cached_file_close (o); /* close it so we can reopen in rw mode */
-  else if (!o)
-    o = fileset_get_empty_slot (set);
+  set = get_fileset (session);
+  o = fileset_lookup (set, torrent_id, i);
 
-  if (!cached_file_is_open (o))
+  if (o && (!writable || o->is_writable))
     {
-      const int err = cached_file_open (o, filename, writable, allocation, file_size);
-      if (err)
-        {
-          errno = err;
-          return -1;
-        }
+      fileset_touch (set, o);
+      fd = o->fd;
+      ++o->pin_count;
+      ++set->hits;
+      fdUnlock (session);
+      return fd;
+    }
+
+  if ((o = fileset_get_empty_slot (set)) == NULL)
+    {
+      fdUnlock (session);
+      errno = EMFILE;
+      return -1;
+    }
+
+  ++set->misses;
+
+  /* open it without the lock. `o' is on neither the free list
+     nor the hash table, so nobody else can touch it meanwhile */
+  fdUnlock (session);
+  err = cached_file_open (o, filename, writable, allocation, file_size);
+  fdLock (session);
+
+  if (err)
+    {
+      if (cached_file_is_open (o))
+        cached_file_close (o);
+      o->hash_next = set->free_list;
+      set->free_list = o;
+      fdUnlock (session);
+      errno = err;
+      return -1;
+    }
+
+  /* another thread may have opened the same file while we were */
+  other = fileset_lookup (set, torrent_id, i);
+  if (other && (!writable || other->is_writable))
+    {
+      cached_file_close (o);
+      o->hash_next = set->free_list;
+      set->free_list = o;
+      o = other;
+      fileset_touch (set, o);
+    }
+  else
+    {
+      /* close a read-only copy so that the rw one replaces it */
+      if (other != NULL)
+        fileset_retire (set, other);
 
       dbgmsg ("opened '%s' writable %c", filename, writable?'y':'n');
       o->is_writable = writable;
+      o->torrent_id = torrent_id;
+      o->file_index = i;
+      fileset_add (set, o);
     }
 
   dbgmsg ("checking out '%s'", filename);
-  o->torrent_id = torrent_id;
-  o->file_index = i;
-  o->used_at = tr_time ();
-  return o->fd;
+  fd = o->fd;
+  ++o->pin_count;
+
+  fdUnlock (session);
+  return fd;
+}
+
+void
+tr_fdFileReturn (tr_session * session, int torrent_id, tr_file_index_t i, int fd)
+{
+  struct tr_fileset * set;
+  struct tr_cached_file * o;
+
+  fdLock (session);
+
+  set = get_fileset (session);
+  for (o=set->buckets[fileset_bucket (set, torrent_id, i)]; o!=NULL; o=o->hash_next)
+    if ((o->fd == fd) && (o->torrent_id == torrent_id) && (o->file_index == i))
+      break;
+
+  assert (o != NULL);
+  assert (o->pin_count > 0);
+
+  if ((o != NULL) && (--o->pin_count == 0) && o->closing)
+    fileset_remove (set, o);
+
+  fdUnlock (session);
 }
 
 /***
@@ -54,6 +54,10 @@ int tr_prefetch (int fd, off_t offset, size_t count);
  * on success, a file descriptor >= 0 is returned.
  * on failure, a -1 is returned and errno is set.
  *
+ * The fd stays open until it's given back with tr_fdFileReturn (),
+ * even if the file is closed or evicted from the pool in the meantime,
+ * so it can be read or written without holding any lock.
+ *
  * @see tr_fdFileClose
  */
 int  tr_fdFileCheckout (tr_session             * session,
@@ -64,11 +68,23 @@ int  tr_fdFileCheckout (tr_session             * session,
                         tr_preallocation_mode    preallocation_mode,
                         uint64_t                 preallocation_file_size);
 
+/**
+ * Like tr_fdFileCheckout (), but only if the file is already open.
+ * Returns -1 if it isn't.
+ */
 int tr_fdFileGetCached (tr_session             * session,
                         int                      torrent_id,
                         tr_file_index_t          file_num,
                         bool                  doWrite);
 
+/**
+ * Gives back an fd from tr_fdFileCheckout () or tr_fdFileGetCached ().
+ */
+void tr_fdFileReturn (tr_session      * session,
+                      int               torrent_id,
+                      tr_file_index_t   file_num,
+                      int               fd);
+
 bool tr_fdFileGetCachedMTime (tr_session       * session,
                               int                torrent_id,
                               tr_file_index_t    file_num,
@@ -93,6 +109,24 @@ void tr_fdFileClose (tr_session        * session,
  */
 void tr_fdTorrentClose (tr_session * session, int torrentId);
 
+typedef struct tr_fd_stats
+{
+  /* lookups that found the file already open, and files that had to
+     be opened. tr_fdFileGetCached () only counts hits: when it misses,
+     the caller's tr_fdFileCheckout () counts the hit or miss */
+  uint64_t hits;
+  uint64_t misses;
+
+  /* files closed to make room for others */
+  uint64_t evictions;
+
+  int openFiles;
+  int fileLimit;
+}
+tr_fd_stats;
+
+void tr_fdGetStats (tr_session * session, tr_fd_stats * setme);
+
 
 /***********************************************************************
  * Sockets
@@ -106,6 +140,14 @@ int      tr_fdSocketAccept (tr_session  * session,
 
 void     tr_fdSocketClose (tr_session * session, int s);
 
+/***********************************************************************
+ * tr_fdInit
+ ***********************************************************************
+ * Creates the file repository. This must be called before any other
+ * thread can touch it.
+ **********************************************************************/
+void     tr_fdInit (tr_session * session);
+
 /***********************************************************************
  * tr_fdClose
  ***********************************************************************
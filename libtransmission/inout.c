@@ -15,8 +15,15 @@
 #include <stdlib.h> /* bsearch () */
 #include <string.h> /* memcmp () */
 
+#ifdef HAVE_MINCORE
+ #include <sys/mman.h> /* mmap (), mincore () */
+ #include <unistd.h> /* getpagesize () */
+#endif
+
 #include <openssl/sha.h>
 
+#include <event2/buffer.h>
+
 #include "transmission.h"
 #include "cache.h" /* tr_cacheReadBlock () */
 #include "fdlimit.h"
@@ -34,19 +41,262 @@ enum
 {
   TR_IO_READ,
   TR_IO_PREFETCH,
+  TR_IO_SEGMENT,
   /* Any operations that require write access must follow TR_IO_WRITE. */
   TR_IO_WRITE
 };
 
-/* returns 0 on success, or an errno on failure */
+/* returns the path a file should be read from or written to,
+ * or NULL if we're reading and the file doesn't exist */
+static char *
+getFilename (tr_torrent * tor, tr_file_index_t fileIndex, bool doWrite)
+{
+  char * subpath;
+  const char * base;
+  char * filename = NULL;
+
+  if (tr_torrentFindFile2 (tor, fileIndex, &base, &subpath, NULL))
+    {
+      filename = tr_buildPath (base, subpath, NULL);
+      tr_free (subpath);
+    }
+  else if (doWrite)
+    {
+      /* figure out where the file should go, so we can create it */
+      base = tr_torrentGetCurrentDir (tor);
+      subpath = tr_sessionIsIncompleteFileNamingEnabled (tor->session)
+              ? tr_torrentBuildPartial (tor, fileIndex)
+              : tr_strdup (tor->info.files[fileIndex].name);
+      filename = tr_buildPath (base, subpath, NULL);
+      tr_free (subpath);
+
+      /* make a note that we're about to create a file */
+      tr_statsFileCreated (tor->session);
+    }
+
+  return filename;
+}
+
+struct tr_io_paths
+{
+  tr_file_index_t firstFile;
+  tr_file_index_t fileCount;
+  char * filenames[1];
+};
+
+tr_io_paths *
+tr_ioGetPaths (tr_torrent       * tor,
+               tr_piece_index_t   pieceIndex,
+               uint32_t           begin,
+               uint32_t           len,
+               bool               doWrite)
+{
+  tr_file_index_t i;
+  tr_file_index_t fileIndex;
+  tr_file_index_t lastFile;
+  uint64_t fileOffset;
+  tr_io_paths * paths;
+
+  assert (tr_isTorrent (tor));
+  assert (len > 0);
+
+  tr_ioFindFileLocation (tor, pieceIndex, begin, &fileIndex, &fileOffset);
+  tr_ioFindFileLocation (tor, pieceIndex, begin + len - 1, &lastFile, &fileOffset);
+
+  paths = tr_malloc (sizeof (tr_io_paths) + (lastFile - fileIndex) * sizeof (char*));
+  paths->firstFile = fileIndex;
+  paths->fileCount = lastFile + 1 - fileIndex;
+  for (i=0; i<paths->fileCount; ++i)
+    paths->filenames[i] = tor->info.files[fileIndex + i].length > 0
+                        ? getFilename (tor, fileIndex + i, doWrite)
+                        : NULL;
+
+  return paths;
+}
+
+void
+tr_ioFreePaths (tr_io_paths * paths)
+{
+  tr_file_index_t i;
+
+  if (paths != NULL)
+    {
+      for (i=0; i<paths->fileCount; ++i)
+        tr_free (paths->filenames[i]);
+      tr_free (paths);
+    }
+}
+
+/* true if the span is known to be in the page cache,
+ * so sending it won't stall the caller on the disk */
+static bool
+isResident (int fd, uint64_t offset, size_t len)
+{
+  bool resident = len == 0;
+
+#ifdef HAVE_MINCORE
+  const uint64_t pageSize = (uint64_t) getpagesize ();
+  const uint64_t mapOffset = offset - (offset % pageSize);
+  const size_t mapLen = (size_t)(offset + len - mapOffset);
+  void * map = len ? mmap (NULL, mapLen, PROT_READ, MAP_SHARED, fd, (off_t) mapOffset) : MAP_FAILED;
+
+  if (map != MAP_FAILED)
+    {
+      size_t done = 0;
+      unsigned char vec[64];
+
+      /* check the pages a vec's worth at a time */
+      resident = true;
+      while (resident && (done < mapLen))
+        {
+          size_t i;
+          const size_t chunkLen = MIN (mapLen - done, sizeof (vec) * pageSize);
+          const size_t pageCount = (chunkLen + pageSize - 1) / pageSize;
+
+          /* some platforms declare vec as char*, others as unsigned char* */
+          resident = !mincore ((char*)map + done, chunkLen, (void*)vec);
+          for (i=0; resident && i<pageCount; ++i)
+            resident = (vec[i] & 1) != 0;
+
+          done += chunkLen;
+        }
+
+      munmap (map, mapLen);
+    }
+#else
+  (void) fd;
+  (void) offset;
+#endif
+
+  return resident;
+}
+
+/* true if every byte of the span is in the page cache, in files that
+ * are already open. Empty files have nothing to read, so they count */
+static bool
+spanIsResident (tr_torrent * tor, tr_piece_index_t pieceIndex, uint32_t begin, uint32_t len)
+{
+  bool resident = true;
+  tr_file_index_t fileIndex;
+  uint64_t fileOffset;
+
+  tr_ioFindFileLocation (tor, pieceIndex, begin, &fileIndex, &fileOffset);
+
+  while (len && resident)
+    {
+      const tr_file * file = &tor->info.files[fileIndex];
+      const uint64_t bytesThisPass = MIN (len, file->length - fileOffset);
+
+      if (bytesThisPass > 0)
+        {
+          const int fd = tr_fdFileGetCached (tor->session, tr_torrentId (tor), fileIndex, false);
+
+          resident = (fd >= 0) && isResident (fd, fileOffset, bytesThisPass);
+
+          if (fd >= 0)
+            tr_fdFileReturn (tor->session, tr_torrentId (tor), fileIndex, fd);
+        }
+
+      len -= bytesThisPass;
+      fileIndex++;
+      fileOffset = 0;
+    }
+
+  return resident;
+}
+
+#ifdef EVBUF_FS_CLOSE_ON_FREE
+
+struct segment_fd
+{
+  tr_session * session;
+  int torrent_id;
+  tr_file_index_t fileIndex;
+  int fd;
+};
+
+static void
+onSegmentFreed (const struct evbuffer_file_segment * seg UNUSED,
+                int                                  flags UNUSED,
+                void                               * vsfd)
+{
+  struct segment_fd * sfd = vsfd;
+
+  tr_fdFileReturn (sfd->session, sfd->torrent_id, sfd->fileIndex, sfd->fd);
+  tr_free (sfd);
+}
+
+/* The segment shares the fd in our file cache instead of a dup () of it,
+ * so fdlimit keeps counting it. It stays checked out until libevent has
+ * sent the last byte, then onSegmentFreed () gives it back.
+ * Either way, the caller's fd is given back. */
 static int
-readOrWriteBytes (tr_session       * session,
-                  tr_torrent       * tor,
-                  int                ioMode,
-                  tr_file_index_t    fileIndex,
-                  uint64_t           fileOffset,
-                  void             * buf,
-                  size_t             buflen)
+addFileSegment (tr_session       * session,
+                tr_torrent       * tor,
+                tr_file_index_t    fileIndex,
+                int                fd,
+                uint64_t           fileOffset,
+                struct evbuffer  * out,
+                size_t             len)
+{
+  int err = 0;
+  struct segment_fd * sfd;
+  struct evbuffer_file_segment * seg;
+
+  if ((seg = evbuffer_file_segment_new (fd, fileOffset, len, 0)) == NULL)
+    {
+      tr_fdFileReturn (session, tr_torrentId (tor), fileIndex, fd);
+      return EIO;
+    }
+
+  sfd = tr_new (struct segment_fd, 1);
+  sfd->session = session;
+  sfd->torrent_id = tr_torrentId (tor);
+  sfd->fileIndex = fileIndex;
+  sfd->fd = fd;
+  evbuffer_file_segment_add_cleanup_cb (seg, onSegmentFreed, sfd);
+
+  if (evbuffer_add_file_segment (out, seg, 0, len))
+    {
+      err = EIO;
+      tr_torerr (tor, "couldn't add \"%s\" to a buffer", tor->info.files[fileIndex].name);
+    }
+
+  /* drop our reference; out holds its own if the add worked */
+  evbuffer_file_segment_free (seg);
+  return err;
+}
+
+#else
+
+/* libevent 2.0 can only add file segments by handing over the fd */
+static int
+addFileSegment (tr_session       * session,
+                tr_torrent       * tor,
+                tr_file_index_t    fileIndex,
+                int                fd,
+                uint64_t           fileOffset UNUSED,
+                struct evbuffer  * out UNUSED,
+                size_t             len UNUSED)
+{
+  tr_fdFileReturn (session, tr_torrentId (tor), fileIndex, fd);
+  return ENOTSUP;
+}
+
+#endif
+
+/* returns 0 on success, or an errno on failure.
+ * if paths is NULL, the file's path is looked up in the torrent,
+ * which is only safe in the libtransmission thread */
+static int
+readOrWriteBytes (tr_session         * session,
+                  tr_torrent         * tor,
+                  int                  ioMode,
+                  tr_file_index_t      fileIndex,
+                  uint64_t             fileOffset,
+                  void               * buf,
+                  size_t               buflen,
+                  const tr_io_paths  * paths)
 {
   int fd;
   int err = 0;
@@ -66,34 +316,38 @@ readOrWriteBytes (tr_session       * session,
   ***/
 
   fd = tr_fdFileGetCached (session, tr_torrentId (tor), fileIndex, doWrite);
-  if (fd < 0)
+  if ((fd < 0) && (ioMode == TR_IO_SEGMENT))
+    {
+      /* opening files is the reader threads' job */
+      err = EAGAIN;
+    }
+  else if (fd < 0)
     {
       /* it's not cached, so open/create it now */
-      char * subpath;
-      const char * base;
+      char * filename;
 
-      /* see if the file exists... */
-      if (!tr_torrentFindFile2 (tor, fileIndex, &base, &subpath, NULL))
+      if (paths != NULL)
         {
-          /* we can't read a file that doesn't exist... */
-          if (!doWrite)
-            err = ENOENT;
-
-          /* figure out where the file should go, so we can create it */
-          base = tr_torrentGetCurrentDir (tor);
-          subpath = tr_sessionIsIncompleteFileNamingEnabled (tor->session)
-                  ? tr_torrentBuildPartial (tor, fileIndex)
-                  : tr_strdup (file->name);
-
+          assert (fileIndex >= paths->firstFile);
+          assert (fileIndex - paths->firstFile < paths->fileCount);
+          filename = tr_strdup (paths->filenames[fileIndex - paths->firstFile]);
+        }
+      else
+        {
+          filename = getFilename (tor, fileIndex, doWrite);
         }
 
-      if (!err)
+      /* we can't read a file that doesn't exist... */
+      if (filename == NULL)
+        {
+          err = ENOENT;
+        }
+      else
         {
           /* open (and maybe create) the file */
-          char * filename = tr_buildPath (base, subpath, NULL);
           const int prealloc = file->dnd || !doWrite
                              ? TR_PREALLOCATE_NONE
-                             : tor->session->preallocationMode;
+                             : session->preallocationMode;
           if (((fd = tr_fdFileCheckout (session, tor->uniqueId, fileIndex,
                                         filename, doWrite,
                                         prealloc, file->length))) < 0)
@@ -102,16 +356,9 @@ readOrWriteBytes (tr_session       * session,
               tr_torerr (tor, "tr_fdFileCheckout failed for \"%s\": %s",
                          filename, tr_strerror (err));
             }
-          else if (doWrite)
-            {
-              /* make a note that we just created a file */
-              tr_statsFileCreated (tor->session);
-            }
-
-          tr_free (filename);
         }
 
-      tr_free (subpath);
+      tr_free (filename);
     }
 
   /***
@@ -142,10 +389,18 @@ readOrWriteBytes (tr_session       * session,
         {
           tr_prefetch (fd, fileOffset, buflen);
         }
+      else if (ioMode == TR_IO_SEGMENT)
+        {
+          err = addFileSegment (session, tor, fileIndex, fd, fileOffset, buf, buflen);
+          fd = -1; /* addFileSegment () gives it back */
+        }
       else
         {
           abort ();
         }
+
+      if (fd >= 0)
+        tr_fdFileReturn (session, tr_torrentId (tor), fileIndex, fd);
     }
 
   return err;
@@ -193,14 +448,17 @@ tr_ioFindFileLocation (const tr_torrent * tor,
   assert (tor->info.files[*fileIndex].offset + *fileOffset == offset);
 }
 
-/* returns 0 on success, or an errno on failure */
+/* returns 0 on success, or an errno on failure.
+ * if setme_file is non-NULL, the index of the failing file is stored there */
 static int
-readOrWritePiece (tr_torrent       * tor,
-                  int                ioMode,
-                  tr_piece_index_t   pieceIndex,
-                  uint32_t           pieceOffset,
-                  uint8_t          * buf,
-                  size_t             buflen)
+readOrWritePiece (tr_torrent         * tor,
+                  int                  ioMode,
+                  tr_piece_index_t     pieceIndex,
+                  uint32_t             pieceOffset,
+                  uint8_t            * buf,
+                  size_t               buflen,
+                  const tr_io_paths  * paths,
+                  tr_file_index_t    * setme_file)
 {
   int err = 0;
   tr_file_index_t fileIndex;
@@ -218,18 +476,15 @@ readOrWritePiece (tr_torrent       * tor,
       const tr_file * file = &info->files[fileIndex];
       const uint64_t bytesThisPass = MIN (buflen, file->length - fileOffset);
 
-      err = readOrWriteBytes (tor->session, tor, ioMode, fileIndex, fileOffset, buf, bytesThisPass);
+      err = readOrWriteBytes (tor->session, tor, ioMode, fileIndex, fileOffset, buf, bytesThisPass, paths);
+
+      if (err && (setme_file != NULL))
+        *setme_file = fileIndex;
+
       buf += bytesThisPass;
       buflen -= bytesThisPass;
       fileIndex++;
       fileOffset = 0;
-
-      if ((err != 0) && (ioMode == TR_IO_WRITE) && (tor->error != TR_STAT_LOCAL_ERROR))
-        {
-          char * path = tr_buildPath (tor->downloadDir, file->name, NULL);
-          tr_torrentSetLocalError (tor, "%s (%s)", tr_strerror (err), path);
-          tr_free (path);
-        }
     }
 
   return err;
@@ -242,7 +497,18 @@ tr_ioRead (tr_torrent       * tor,
            uint32_t           len,
            uint8_t          * buf)
 {
-  return readOrWritePiece (tor, TR_IO_READ, pieceIndex, begin, buf, len);
+  return readOrWritePiece (tor, TR_IO_READ, pieceIndex, begin, buf, len, NULL, NULL);
+}
+
+int
+tr_ioReadFromPaths (tr_torrent         * tor,
+                    tr_piece_index_t     pieceIndex,
+                    uint32_t             begin,
+                    uint32_t             len,
+                    uint8_t            * buf,
+                    const tr_io_paths  * paths)
+{
+  return readOrWritePiece (tor, TR_IO_READ, pieceIndex, begin, buf, len, paths, NULL);
 }
 
 int
@@ -251,7 +517,47 @@ tr_ioPrefetch (tr_torrent       * tor,
                uint32_t           begin,
                uint32_t           len)
 {
-  return readOrWritePiece (tor, TR_IO_PREFETCH, pieceIndex, begin, NULL, len);
+  return readOrWritePiece (tor, TR_IO_PREFETCH, pieceIndex, begin, NULL, len, NULL, NULL);
+}
+
+int
+tr_ioAddFileSegments (tr_torrent       * tor,
+                      tr_piece_index_t   pieceIndex,
+                      uint32_t           begin,
+                      uint32_t           len,
+                      struct evbuffer  * out)
+{
+  int err = 0;
+  tr_file_index_t fileIndex;
+  uint64_t fileOffset;
+
+  if (pieceIndex >= tor->info.pieceCount)
+    return EINVAL;
+
+  /* check it all before adding any of it; the caller can't send half */
+  if (!spanIsResident (tor, pieceIndex, begin, len))
+    return EAGAIN;
+
+#ifdef EVBUFFER_FLAG_DRAINS_TO_FD
+  /* libevent >= 2.1 only uses sendfile () when it's told to */
+  evbuffer_set_flags (out, EVBUFFER_FLAG_DRAINS_TO_FD);
+#endif
+
+  tr_ioFindFileLocation (tor, pieceIndex, begin, &fileIndex, &fileOffset);
+
+  while (len && !err)
+    {
+      const tr_file * file = &tor->info.files[fileIndex];
+      const uint64_t bytesThisPass = MIN (len, file->length - fileOffset);
+
+      err = readOrWriteBytes (tor->session, tor, TR_IO_SEGMENT, fileIndex, fileOffset, out, bytesThisPass, NULL);
+
+      len -= bytesThisPass;
+      fileIndex++;
+      fileOffset = 0;
+    }
+
+  return err;
 }
 
 int
@@ -261,7 +567,36 @@ tr_ioWrite (tr_torrent       * tor,
             uint32_t           len,
             const uint8_t    * buf)
 {
-  return readOrWritePiece (tor, TR_IO_WRITE, pieceIndex, begin, (uint8_t*)buf, len);
+  tr_file_index_t fileIndex = 0;
+  const int err = readOrWritePiece (tor, TR_IO_WRITE, pieceIndex, begin, (uint8_t*)buf, len, NULL, &fileIndex);
+
+  if (err)
+    tr_ioSetWriteError (tor, fileIndex, err);
+
+  return err;
+}
+
+int
+tr_ioWriteQuietly (tr_torrent         * tor,
+                   tr_piece_index_t     pieceIndex,
+                   uint32_t             begin,
+                   uint32_t             len,
+                   const uint8_t      * buf,
+                   const tr_io_paths  * paths,
+                   tr_file_index_t    * setme_file)
+{
+  return readOrWritePiece (tor, TR_IO_WRITE, pieceIndex, begin, (uint8_t*)buf, len, paths, setme_file);
+}
+
+void
+tr_ioSetWriteError (tr_torrent * tor, tr_file_index_t fileIndex, int err)
+{
+  if (tor->error != TR_STAT_LOCAL_ERROR)
+    {
+      char * path = tr_buildPath (tor->downloadDir, tor->info.files[fileIndex].name, NULL);
+      tr_torrentSetLocalError (tor, "%s (%s)", tr_strerror (err), path);
+      tr_free (path);
+    }
 }
 
 /****
@@ -312,6 +647,7 @@ tr_ioTestPiece (tr_torrent * tor, tr_piece_index_t piece)
 {
   uint8_t hash[SHA_DIGEST_LENGTH];
 
-  return recalculateHash (tor, piece, hash)
-      && !memcmp (hash, tor->info.pieces[piece].hash, SHA_DIGEST_LENGTH);
+  return tr_torrentLoadPieceHashes (tor)
+      && recalculateHash (tor, piece, hash)
+      && !memcmp (hash, tor->info.pieceHashes + (size_t)piece * SHA_DIGEST_LENGTH, SHA_DIGEST_LENGTH);
 }
@@ -17,6 +17,7 @@
 #ifndef TR_IO_H
 #define TR_IO_H 1
 
+struct evbuffer;
 struct tr_torrent;
 
 /**
@@ -24,6 +25,24 @@ struct tr_torrent;
  * @{
  */
 
+/**
+ * The paths of the files that hold a span of a torrent.
+ *
+ * Finding a file means looking at the torrent's folders and the disk,
+ * which the cache's disk threads can't do safely, so the libtransmission
+ * thread looks them up when it hands the span over. Creating the
+ * list also counts any file that will be created in the session stats.
+ */
+typedef struct tr_io_paths tr_io_paths;
+
+tr_io_paths * tr_ioGetPaths (struct tr_torrent  * tor,
+                             tr_piece_index_t     pieceIndex,
+                             uint32_t             offset,
+                             uint32_t             len,
+                             bool                 doWrite);
+
+void tr_ioFreePaths (tr_io_paths * paths);
+
 /**
  * Reads the block specified by the piece index, offset, and length.
  * @return 0 on success, or an errno value on failure.
@@ -34,11 +53,42 @@ int tr_ioRead (struct tr_torrent   * tor,
                uint32_t              len,
                uint8_t             * setme);
 
+/**
+ * Like tr_ioRead (), but any file that isn't already open is found
+ * through paths instead of the torrent, so it's safe to call outside
+ * the libtransmission thread.
+ */
+int tr_ioReadFromPaths (struct tr_torrent   * tor,
+                        tr_piece_index_t      pieceIndex,
+                        uint32_t              offset,
+                        uint32_t              len,
+                        uint8_t             * setme,
+                        const tr_io_paths   * paths);
+
 int tr_ioPrefetch (tr_torrent       * tor,
                    tr_piece_index_t   pieceIndex,
                    uint32_t           begin,
                    uint32_t           len);
 
+/**
+ * Appends the specified bytes to an evbuffer as file segments rather
+ * than reading them into memory. When the evbuffer is written to a
+ * socket, libevent sends them straight from the file with sendfile ()
+ * where the platform supports it.
+ *
+ * This never touches the disk: it only works if the files are already
+ * open in the fd cache and the bytes are in the page cache. Otherwise
+ * it returns EAGAIN and the bytes should be read with
+ * tr_cacheReadBlockAsync () instead. On failure, out may hold part of
+ * the span and should be discarded.
+ * @return 0 on success, or an errno value on failure.
+ */
+int tr_ioAddFileSegments (tr_torrent        * tor,
+                          tr_piece_index_t    pieceIndex,
+                          uint32_t            begin,
+                          uint32_t            len,
+                          struct evbuffer   * out);
+
 /**
  * Writes the block specified by the piece index, offset, and length.
  * @return 0 on success, or an errno value on failure.
@@ -49,6 +99,30 @@ int tr_ioWrite (struct tr_torrent  * tor,
                 uint32_t             len,
                 const uint8_t      * writeme);
 
+/**
+ * Like tr_ioWrite (), but doesn't record failures in the torrent's
+ * error state and finds files through paths, so it's safe to call
+ * outside the libtransmission thread.
+ * On failure, the index of the file that couldn't be written is stored
+ * in setme_file so that the caller can pass it to tr_ioSetWriteError ().
+ * @return 0 on success, or an errno value on failure.
+ */
+int tr_ioWriteQuietly (struct tr_torrent  * tor,
+                       tr_piece_index_t     pieceIndex,
+                       uint32_t             offset,
+                       uint32_t             len,
+                       const uint8_t      * writeme,
+                       const tr_io_paths  * paths,
+                       tr_file_index_t    * setme_file);
+
+/**
+ * Flags the torrent with a local error because a write to one of
+ * its files failed.
+ */
+void tr_ioSetWriteError (struct tr_torrent  * tor,
+                         tr_file_index_t      fileIndex,
+                         int                  err);
+
 /**
  * @brief Test to see if the piece matches its metainfo's SHA1 checksum.
  */
@@ -1,5 +1,7 @@
 #include <string.h> /* strlen () */
 
+#include <event2/buffer.h>
+
 #define __LIBTRANSMISSION_VARIANT_MODULE___
 #include "transmission.h"
 #include "utils.h" /* tr_free */
@@ -218,6 +220,57 @@ test_unescape (void)
     return 0;
 }
 
+static int
+test_writer (void)
+{
+    int len;
+    char * str;
+    tr_variant top;
+    tr_variant tmp;
+    tr_variant * list;
+    tr_json_writer writer;
+    struct evbuffer * buf = evbuffer_new ();
+
+    /* build the same document as a tree and with the writer */
+    tr_variantInitDict (&top, 3);
+    tr_variantDictAddInt (&top, toQuark ("a"), 1);
+    list = tr_variantDictAddList (&top, toQuark ("b"), 3);
+    tr_variantListAddStr (list, "tab\tquote\"");
+    tr_variantListAddDict (list, 0);
+    tr_variantListAddList (list, 0);
+    tr_variantDictAddBool (&top, toQuark ("c"), true);
+
+    tr_jsonWriterInit (&writer, buf);
+    tr_jsonWriterBeginDict (&writer);
+    tr_variantInitInt (&tmp, 1);
+    tr_jsonWriterKey (&writer, toQuark ("a"));
+    tr_jsonWriterAdd (&writer, &tmp);
+    tr_jsonWriterKey (&writer, toQuark ("b"));
+    tr_jsonWriterBeginList (&writer);
+    tr_variantInitStr (&tmp, "tab\tquote\"", -1);
+    tr_jsonWriterAdd (&writer, &tmp);
+    tr_variantFree (&tmp);
+    tr_jsonWriterBeginDict (&writer);
+    tr_jsonWriterEnd (&writer);
+    tr_jsonWriterBeginList (&writer);
+    tr_jsonWriterEnd (&writer);
+    tr_jsonWriterEnd (&writer);
+    tr_variantInitBool (&tmp, true);
+    tr_jsonWriterKey (&writer, toQuark ("c"));
+    tr_jsonWriterAdd (&writer, &tmp);
+    tr_jsonWriterEnd (&writer);
+    evbuffer_add (buf, "\n", 1);
+
+    str = tr_variantToStr (&top, TR_VARIANT_FMT_JSON_LEAN, &len);
+    check_int_eq (len, evbuffer_get_length (buf));
+    check (!memcmp (str, evbuffer_pullup (buf, -1), len));
+
+    tr_free (str);
+    tr_variantFree (&top);
+    evbuffer_free (buf);
+    return 0;
+}
+
 int
 main (void)
 {
@@ -226,7 +279,8 @@ main (void)
                                test1,
                                test2,
                                test3,
-                               test_unescape };
+                               test_unescape,
+                               test_writer };
 
     return runTests (tests, NUM_TESTS (tests));
 }
@@ -1,7 +1,17 @@
 
 #include <stdio.h>
+#include <string.h> /* strcmp () */
+#include <dirent.h>
+#include <unistd.h> /* rmdir () */
 
 #include "transmission.h"
+#include "completion.h"
+#include "crypto.h" /* tr_cryptoRandBuf (), tr_sha1 () */
+#include "torrent.h"
+#include "trevent.h" /* tr_runInEventThread () */
+#include "utils.h"
+#include "variant.h"
+
 #include "libtransmission-test.h"
 
 bool verbose = false;
@@ -95,3 +105,160 @@ runTests (const testFunc * const tests, int numTests)
 
   return 0; /* All tests passed */
 }
+
+/***
+****  Sessions and torrents for the tests that need them
+***/
+
+void
+libttest_rm_rf (const char * path)
+{
+  DIR * odir;
+
+  if ((odir = opendir (path)))
+    {
+      struct dirent * d;
+
+      while ((d = readdir (odir)))
+        {
+          if (strcmp (d->d_name, ".") && strcmp (d->d_name, ".."))
+            {
+              char * child = tr_buildPath (path, d->d_name, NULL);
+              libttest_rm_rf (child);
+              tr_free (child);
+            }
+        }
+
+      closedir (odir);
+      rmdir (path);
+    }
+  else
+    {
+      remove (path);
+    }
+}
+
+tr_session *
+libttest_session_init (const char * config_dir, const tr_variant * settings)
+{
+  tr_session * session;
+  tr_variant defaults;
+
+  tr_formatter_mem_init (1024, "KiB", "MiB", "GiB", "TiB");
+  tr_formatter_size_init (1000, "kB", "MB", "GB", "TB");
+  tr_formatter_speed_init (1000, "kB/s", "MB/s", "GB/s", "TB/s");
+
+  tr_variantInitDict (&defaults, 0);
+  tr_sessionGetDefaultSettings (&defaults);
+  tr_variantDictAddBool (&defaults, TR_KEY_dht_enabled, false);
+  tr_variantDictAddBool (&defaults, TR_KEY_lpd_enabled, false);
+  tr_variantDictAddBool (&defaults, TR_KEY_utp_enabled, false);
+  tr_variantDictAddBool (&defaults, TR_KEY_port_forwarding_enabled, false);
+  tr_variantDictAddBool (&defaults, TR_KEY_rpc_enabled, false);
+  tr_variantDictAddInt  (&defaults, TR_KEY_message_level, TR_MSG_ERR);
+  tr_variantDictAddStr  (&defaults, TR_KEY_download_dir, config_dir);
+  if (settings != NULL)
+    tr_variantMergeDicts (&defaults, settings);
+  session = tr_sessionInit ("libtransmission-test", config_dir, false, &defaults);
+  tr_variantFree (&defaults);
+
+  return session;
+}
+
+struct run_in_event_thread_data
+{
+  void (*func)(void*);
+  void * user_data;
+  volatile bool done;
+};
+
+static void
+runInEventThreadImpl (void * vdata)
+{
+  struct run_in_event_thread_data * data = vdata;
+
+  data->func (data->user_data);
+  data->done = true;
+}
+
+void
+libttest_run_in_event_thread (tr_session * session, void (*func)(void*), void * user_data)
+{
+  struct run_in_event_thread_data data;
+
+  data.func = func;
+  data.user_data = user_data;
+  data.done = false;
+
+  tr_runInEventThread (session, runInEventThreadImpl, &data);
+  while (!data.done)
+    tr_wait_msec (1);
+}
+
+static void
+noop (void * unused UNUSED)
+{
+}
+
+void
+libttest_sync (tr_session * session)
+{
+  libttest_run_in_event_thread (session, noop, NULL);
+}
+
+tr_torrent *
+libttest_torrent_init (tr_session * session, uint32_t piece_size, tr_piece_index_t piece_count)
+{
+  int len;
+  char * benc;
+  char * path;
+  FILE * fp;
+  tr_ctor * ctor;
+  tr_torrent * tor;
+  tr_piece_index_t i;
+  tr_variant top;
+  tr_variant * info;
+  char name[64];
+  uint8_t * data = tr_new (uint8_t, piece_size);
+  uint8_t * hashes = tr_new (uint8_t, SHA_DIGEST_LENGTH * piece_count);
+  static int nextTorrent = 0;
+
+  tr_snprintf (name, sizeof (name), "libttest-torrent-%d", nextTorrent++);
+  path = tr_buildPath (tr_sessionGetDownloadDir (session), name, NULL);
+  fp = fopen (path, "wb");
+
+  for (i=0; i<piece_count; ++i)
+    {
+      tr_cryptoRandBuf (data, piece_size);
+      tr_sha1 (hashes + SHA_DIGEST_LENGTH * i, data, (int)piece_size, NULL);
+      fwrite (data, 1, piece_size, fp);
+    }
+
+  fclose (fp);
+  tr_free (path);
+
+  tr_variantInitDict (&top, 1);
+  info = tr_variantDictAddDict (&top, TR_KEY_info, 4);
+  tr_variantDictAddInt (info, TR_KEY_length, (int64_t)piece_size * piece_count);
+  tr_variantDictAddStr (info, TR_KEY_name, name);
+  tr_variantDictAddInt (info, TR_KEY_piece_length, piece_size);
+  tr_variantDictAddRaw (info, TR_KEY_pieces, hashes, SHA_DIGEST_LENGTH * piece_count);
+  benc = tr_variantToStr (&top, TR_VARIANT_FMT_BENC, &len);
+  tr_variantFree (&top);
+
+  ctor = tr_ctorNew (session);
+  tr_ctorSetMetainfo (ctor, (const uint8_t*)benc, len);
+  tr_ctorSetPaused (ctor, TR_FORCE, true);
+  tor = tr_torrentNew (ctor, NULL);
+  tr_ctorFree (ctor);
+
+  /* a new torrent gets verified. wait for that to find the data */
+  if (tor != NULL)
+    while ((tor->verifyState != TR_VERIFY_NONE) || !tr_cpHasAll (&tor->completion))
+      tr_wait_msec (10);
+
+  tr_free (benc);
+  tr_free (hashes);
+  tr_free (data);
+  return tor;
+}
@@ -65,4 +65,28 @@ int main (void) { \
     return runTests (tests, 1); \
 }
 
+/***
+****  Sessions and torrents for the tests that need them
+***/
+
+struct tr_variant;
+
+void libttest_rm_rf (const char * path);
+
+/* a session in config_dir that stays off the network.
+   settings, if not NULL, are merged over the test defaults */
+tr_session * libttest_session_init (const char * config_dir, const struct tr_variant * settings);
+
+/* calls func on the session's libtransmission thread and waits for it */
+void libttest_run_in_event_thread (tr_session * session, void (*func)(void*), void * user_data);
+
+/* waits for everything already queued for the libtransmission thread */
+void libttest_sync (tr_session * session);
+
+/* writes piece_count pieces of random data into the download dir, then
+   adds a paused single-file torrent for them and waits for its verify */
+tr_torrent * libttest_torrent_init (tr_session        * session,
+                                    uint32_t            piece_size,
+                                    tr_piece_index_t    piece_count);
+
 #endif /* !LIBTRANSMISSION_TEST_H */
@@ -24,7 +24,7 @@
 #include <event2/util.h> /* evutil_ascii_strcasecmp () */
 
 #include "transmission.h"
-#include "crypto.h" /* tr_sha1 */
+#include "crypto.h" /* tr_sha1_batch () */
 #include "fdlimit.h" /* tr_open_file_for_scanning () */
 #include "session.h"
 #include "makemeta.h"
@@ -194,6 +194,12 @@ tr_metaInfoBuilderFree (tr_metainfo_builder * builder)
 *****
 ****/
 
+enum
+{
+    /* upper bound on the memory used to hold a batch of pieces */
+    MAKEMETA_BATCH_BYTES = (1024 * 1024 * 32)
+};
+
 static uint8_t*
 getHashInfo (tr_metainfo_builder * b)
 {
@@ -204,11 +210,20 @@ getHashInfo (tr_metainfo_builder * b)
     uint64_t totalRemain;
     uint64_t off = 0;
     int fd;
+    int slot = 0;
+    int batchSize = 1;
+    size_t lens[TR_SHA1_BATCH_SIZE];
+    const void * contents[TR_SHA1_BATCH_SIZE];
 
     if (!b->totalSize)
         return ret;
 
-    buf = tr_valloc (b->pieceSize);
+    /* only hold several pieces in memory if the CPU can hash them together */
+    if ((tr_sha1GetBackend () != TR_SHA1_BACKEND_OPENSSL)
+          && (b->pieceSize <= MAKEMETA_BATCH_BYTES / TR_SHA1_BATCH_SIZE))
+        batchSize = TR_SHA1_BATCH_SIZE;
+
+    buf = tr_valloc (b->pieceSize * batchSize);
     b->pieceIndex = 0;
     totalRemain = b->totalSize;
     fd = tr_open_file_for_scanning (b->files[fileIndex].filename);
@@ -225,7 +240,8 @@ getHashInfo (tr_metainfo_builder * b)
     }
     while (totalRemain)
     {
-        uint8_t * bufptr = buf;
+        uint8_t * const pieceBuf = buf + slot * b->pieceSize;
+        uint8_t * bufptr = pieceBuf;
         const uint32_t thisPieceSize = (uint32_t) MIN (b->pieceSize, totalRemain);
         uint32_t leftInPiece = thisPieceSize;
 
@@ -261,10 +277,16 @@ getHashInfo (tr_metainfo_builder * b)
             }
         }
 
-        assert (bufptr - buf == (int)thisPieceSize);
+        assert (bufptr - pieceBuf == (int)thisPieceSize);
         assert (leftInPiece == 0);
-        tr_sha1 (walk, buf, thisPieceSize, NULL);
-        walk += SHA_DIGEST_LENGTH;
+        contents[slot] = pieceBuf;
+        lens[slot] = thisPieceSize;
+        if ((++slot == batchSize) || (thisPieceSize == totalRemain))
+        {
+            tr_sha1_batch (walk, slot, contents, lens);
+            walk += slot * SHA_DIGEST_LENGTH;
+            slot = 0;
+        }
 
         if (b->abortFlag)
         {
@@ -486,9 +486,7 @@ tr_metainfoParseImpl (const tr_session  * session,
         return "pieces";
 
       inf->pieceCount = len / SHA_DIGEST_LENGTH;
-      inf->pieces = tr_new0 (tr_piece, inf->pieceCount);
-      for (i=0; i<inf->pieceCount; i++)
-        memcpy (inf->pieces[i].hash, &raw[i * SHA_DIGEST_LENGTH], SHA_DIGEST_LENGTH);
+      inf->pieceHashes = tr_memdup (raw, len);
     }
 
   /* files */
@@ -555,7 +553,10 @@ tr_metainfoFree (tr_info * inf)
       tr_free (inf->files[ff].name);
 
   tr_free (inf->webseeds);
-  tr_free (inf->pieces);
+  tr_free (inf->pieceTimeChecked);
+  tr_free (inf->piecePriority);
+  tr_free (inf->pieceDnd);
+  tr_free (inf->pieceHashes);
   tr_free (inf->files);
   tr_free (inf->comment);
   tr_free (inf->creator);
@@ -582,3 +583,34 @@ tr_metainfoRemoveSaved (const tr_session * session, const tr_info * inf)
   tr_free (filename);
 }
 
+bool
+tr_metainfoGetPieceHashes (const tr_info * inf, uint8_t * setme)
+{
+  size_t len;
+  int bstrLen;
+  char * bstr;
+  bool ok = false;
+  const uint8_t * raw;
+  tr_variant top;
+  tr_variant * infoDict;
+  uint8_t hash[SHA_DIGEST_LENGTH];
+
+  if ((inf->torrent == NULL) || tr_variantFromFile (&top, TR_VARIANT_FMT_BENC, inf->torrent))
+    return false;
+
+  if (tr_variantDictFindDict (&top, TR_KEY_info, &infoDict)
+      && tr_variantDictFindRaw (infoDict, TR_KEY_pieces, &raw, &len)
+      && (len == (size_t)inf->pieceCount * SHA_DIGEST_LENGTH))
+    {
+      /* make sure the file still holds the same torrent */
+      bstr = tr_variantToStr (infoDict, TR_VARIANT_FMT_BENC, &bstrLen);
+      tr_sha1 (hash, bstr, bstrLen, NULL);
+      tr_free (bstr);
+
+      if ((ok = !memcmp (hash, inf->hash, SHA_DIGEST_LENGTH)))
+        memcpy (setme, raw, len);
+    }
+
+  tr_variantFree (&top);
+  return ok;
+}
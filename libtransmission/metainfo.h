@@ -31,5 +31,13 @@ void tr_metainfoRemoveSaved (const tr_session * session,
 
 char* tr_metainfoGetBasename (const tr_info *);
 
+/**
+ * Reads inf's piece hashes from its saved .torrent file
+ * into setme, which must hold inf->pieceCount of them.
+ * Returns false if the file is missing or doesn't match inf.
+ */
+bool tr_metainfoGetPieceHashes (const tr_info * inf,
+                                uint8_t       * setme);
+
 
 #endif
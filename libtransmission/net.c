@@ -166,6 +166,24 @@ tr_netSetCongestionControl (int s UNUSED, const char *algorithm UNUSED)
 #endif
 }
 
+int
+tr_netGetRTT_msec (int s UNUSED)
+{
+#ifdef TCP_INFO
+    struct tcp_info info;
+    socklen_t len = sizeof (info);
+
+    /* tcpi_rtt is the kernel's smoothed estimate, in microseconds */
+    if (!getsockopt (s, IPPROTO_TCP, TCP_INFO, &info, &len))
+        return info.tcpi_rtt / 1000u;
+
+    return -1;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
 bool
 tr_address_from_sockaddr_storage (tr_address                     * setme_addr,
                                   tr_port                        * setme_port,
@@ -137,6 +137,9 @@ int  tr_netSetTOS (int s,
 
 int tr_netSetCongestionControl (int s, const char *algorithm);
 
+/** @brief the socket's smoothed TCP round-trip time, or -1 if unavailable */
+int tr_netGetRTT_msec (int s);
+
 void tr_netClose (tr_session * session, int s);
 
 void tr_netCloseSocket (int fd);
@@ -266,9 +266,10 @@ event_read_cb (int fd, short event UNUSED, void * vio)
 
     dbgmsg (io, "libevent says this peer is ready to read");
 
-    /* if we don't have any bandwidth left, stop reading */
+    /* if we don't have any bandwidth left, stop reading until we do */
     if (howmuch < 1) {
         tr_peerIoSetEnabled (io, dir, false);
+        tr_bandwidthWait (&io->bandwidth, dir);
         return;
     }
 
@@ -339,13 +340,18 @@ event_write_cb (int fd, short event UNUSED, void * vio)
 
     dbgmsg (io, "libevent says this peer is ready to write");
 
+    /* nothing to write; addDatatype () will wake us up again */
+    if (!evbuffer_get_length (io->outbuf))
+        return;
+
     /* Write as much as possible, since the socket is non-blocking, write () will
      * return if it can't write any more data without blocking */
     howmuch = tr_bandwidthClamp (&io->bandwidth, dir, evbuffer_get_length (io->outbuf));
 
-    /* if we don't have any bandwidth left, stop writing */
+    /* if we don't have any bandwidth left, stop writing until we do */
     if (howmuch < 1) {
         tr_peerIoSetEnabled (io, dir, false);
+        tr_bandwidthWait (&io->bandwidth, dir);
         return;
     }
 
@@ -450,6 +456,11 @@ utp_get_rb_size (void *closure)
 
     bytes = tr_bandwidthClamp (&io->bandwidth, TR_DOWN, UTP_READ_BUFFER_SIZE);
 
+    /* a window narrowed by a speed limit may be too small for the peer
+     * to send into, so come back and widen it once the bucket refills */
+    if (bytes < UTP_READ_BUFFER_SIZE)
+        tr_bandwidthWait (&io->bandwidth, TR_DOWN);
+
     dbgmsg (io, "utp_get_rb_size is saying it's ready to read %zu bytes", bytes);
     return UTP_READ_BUFFER_SIZE - bytes;
 }
@@ -885,6 +896,23 @@ tr_peerIoGetAddress (const tr_peerIo * io, tr_port   * port)
     return &io->addr;
 }
 
+int
+tr_peerIoGetRTT_msec (const tr_peerIo * io)
+{
+    assert (tr_isPeerIo (io));
+
+    if (io->utp_socket != NULL)
+    {
+        const uint32 rtt = UTP_GetRTT (io->utp_socket);
+        return rtt > 0 ? (int)rtt : -1;
+    }
+
+    if (io->socket >= 0)
+        return tr_netGetRTT_msec (io->socket);
+
+    return -1;
+}
+
 const char*
 tr_peerIoAddrStr (const tr_address * addr, tr_port port)
 {
@@ -909,6 +937,9 @@ tr_peerIoSetIOFuncs (tr_peerIo        * io,
     io->didWrite = writecb;
     io->gotError = errcb;
     io->userData = userData;
+
+    if (readcb != NULL)
+        tr_peerIoSetEnabled (io, TR_DOWN, true);
 }
 
 void
@@ -1051,6 +1082,16 @@ addDatatype (tr_peerIo * io, size_t byteCount, bool isPieceData)
     d->isPieceData = isPieceData != 0;
     d->length = byteCount;
     peer_io_push_datatype (io, d);
+
+    /* wake up the writer, unless it's already waiting for bandwidth.
+     * uTP writes aren't driven by polling, so flush those on the next tick */
+    if (!tr_bandwidthIsWaiting (&io->bandwidth, TR_UP))
+    {
+        if (io->socket >= 0)
+            event_enable (io, EV_WRITE);
+        else
+            tr_bandwidthWait (&io->bandwidth, TR_UP);
+    }
 }
 
 static void
@@ -1226,11 +1267,12 @@ tr_peerIoTryRead (tr_peerIo * io, size_t howmuch)
     {
         if (io->utp_socket != NULL) /* utp peer connection */
         {
-            /* UTP_RBDrained notifies libutp that your read buffer is emtpy.
+            /* UTP_RBDrained notifies libutp that your read buffer has room.
              * It opens up the congestion window by sending an ACK (soonish)
-             * if one was not going to be sent. */
-            if (evbuffer_get_length (io->inbuf) == 0)
-                UTP_RBDrained (io->utp_socket);
+             * if one was not going to be sent. The inbuf may still hold a
+             * partial message here, so don't wait for it to empty: if our
+             * last advertised window was zero, nothing else reopens it. */
+            UTP_RBDrained (io->utp_socket);
         }
         else /* tcp peer connection */
         {
@@ -1257,6 +1299,10 @@ tr_peerIoTryRead (tr_peerIo * io, size_t howmuch)
             }
         }
     }
+    else
+    {
+        tr_bandwidthWait (&io->bandwidth, TR_DOWN);
+    }
 
     return res;
 }
@@ -1277,6 +1323,11 @@ tr_peerIoTryWrite (tr_peerIo * io, size_t howmuch)
         {
             UTP_Write (io->utp_socket, howmuch);
             n = old_len - evbuffer_get_length (io->outbuf);
+
+            /* libutp calls utp_on_writable () when its window opens up again,
+             * but if it took everything we offered, nothing will prod us */
+            if ((n == (int)howmuch) && (n < (int)old_len))
+                tr_bandwidthWait (&io->bandwidth, TR_UP);
         }
         else
         {
@@ -1302,6 +1353,10 @@ tr_peerIoTryWrite (tr_peerIo * io, size_t howmuch)
             }
         }
     }
+    else if (old_len > 0)
+    {
+        tr_bandwidthWait (&io->bandwidth, TR_UP);
+    }
 
     return n;
 }
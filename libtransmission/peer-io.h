@@ -79,8 +79,6 @@ typedef struct tr_peerIo
     bool                  dhtSupported;
     bool                  utpSupported;
 
-    tr_priority_t         priority;
-
     short int             pendingEvents;
 
     int                   magicNumber;
@@ -218,6 +216,10 @@ const char* tr_peerIoGetAddrStr (const tr_peerIo * io);
 const struct tr_address * tr_peerIoGetAddress (const tr_peerIo * io,
                                                tr_port         * port);
 
+/** @brief the smoothed round-trip time to the peer, or -1 if unknown.
+    uTP measures this itself; for TCP we ask the kernel. */
+int                  tr_peerIoGetRTT_msec (const tr_peerIo * io);
+
 const uint8_t*       tr_peerIoGetTorrentHash (tr_peerIo * io);
 
 int                  tr_peerIoHasTorrentHash (const tr_peerIo * io);
@@ -295,6 +297,17 @@ tr_peerIoIsEncrypted (const tr_peerIo * io)
     return (io != NULL) && (io->encryption_type == PEER_ENCRYPTION_RC4);
 }
 
+/* true if piece data can be sent to this peer straight from
+   the file with sendfile (): plaintext TCP only, since encrypted
+   and uTP data has to pass through our own buffers */
+static inline bool
+tr_peerIoSupportsSendfile (const tr_peerIo * io)
+{
+    return (io != NULL) && (io->socket >= 0)
+                        && (io->utp_socket == NULL)
+                        && !tr_peerIoIsEncrypted (io);
+}
+
 void evbuffer_add_uint8 (struct evbuffer * outbuf, uint8_t byte);
 void evbuffer_add_uint16 (struct evbuffer * outbuf, uint16_t hs);
 void evbuffer_add_uint32 (struct evbuffer * outbuf, uint32_t hl);
@@ -33,7 +33,9 @@
 #include "peer-io.h"
 #include "peer-mgr.h"
 #include "peer-msgs.h"
+#include "piece-list.h"
 #include "ptrarray.h"
+#include "rarity.h"
 #include "session.h"
 #include "stats.h" /* tr_statsAddUploaded, tr_statsAddDownloaded */
 #include "torrent.h"
@@ -168,18 +170,10 @@ struct block_request
 
 struct weighted_piece
 {
-    tr_piece_index_t index;
     int16_t salt;
     int16_t requestCount;
 };
 
-enum piece_sort_state
-{
-    PIECES_UNSORTED,
-    PIECES_SORTED_BY_INDEX,
-    PIECES_SORTED_BY_WEIGHT
-};
-
 /** @brief Opaque, per-torrent data structure for peer connection information */
 typedef struct tr_torrent_peers
 {
@@ -201,16 +195,23 @@ typedef struct tr_torrent_peers
     int                        requestCount;
     int                        requestAlloc;
 
+    /* per-piece request counts and tiebreakers, indexed by piece.
+       This is NULL until we start requesting pieces */
     struct weighted_piece    * pieces;
-    int                        pieceCount;
-    enum piece_sort_state      pieceSortState;
 
-    /* An array of pieceCount items stating how many peers have each piece.
+    /* the pieces we want, sorted by pieceWeight () */
+    tr_piece_list              pieceList;
+    bool                       pieceListIsValid;
+
+    /* the same pieces as pieceList, for cheaply checking
+       whether a peer has anything that we want */
+    tr_bitfield                wantedPieces;
+
+    /* How many peers have each piece.
        This is used to help us for downloading pieces "rarest first."
-       This may be NULL if we don't have metainfo yet, or if we're not
+       This is empty if we don't have metainfo yet, or if we're not
        downloading and don't care about rarity */
-    uint16_t                 * pieceReplication;
-    size_t                     pieceReplicationSize;
+    tr_rarity                  rarity;
 
     int                        interestedCount;
     int                        maxPeers;
@@ -448,41 +449,29 @@ peerDelete (Torrent * t, tr_peer * peer)
 static bool
 replicationExists (const Torrent * t)
 {
-    return t->pieceReplication != NULL;
+    return t->rarity.counts != NULL;
 }
 
 static void
 replicationFree (Torrent * t)
 {
-    tr_free (t->pieceReplication);
-    t->pieceReplication = NULL;
-    t->pieceReplicationSize = 0;
+    if (replicationExists (t))
+        tr_rarityDestruct (&t->rarity);
 }
 
 static void
 replicationNew (Torrent * t)
 {
-    tr_piece_index_t piece_i;
-    const tr_piece_index_t piece_count = t->tor->info.pieceCount;
+    int i;
     tr_peer ** peers = (tr_peer**) tr_ptrArrayBase (&t->peers);
     const int peer_count = tr_ptrArraySize (&t->peers);
 
     assert (!replicationExists (t));
 
-    t->pieceReplicationSize = piece_count;
-    t->pieceReplication = tr_new0 (uint16_t, piece_count);
-
-    for (piece_i=0; piece_i<piece_count; ++piece_i)
-    {
-        int peer_i;
-        uint16_t r = 0;
-
-        for (peer_i=0; peer_i<peer_count; ++peer_i)
-            if (tr_bitfieldHas (&peers[peer_i]->have, piece_i))
-                ++r;
+    tr_rarityConstruct (&t->rarity, t->tor->info.pieceCount);
 
-        t->pieceReplication[piece_i] = r;
-    }
+    for (i=0; i<peer_count; ++i)
+        tr_rarityAddBitfield (&t->rarity, &peers[i]->have, NULL, NULL);
 }
 
 static void
@@ -505,6 +494,8 @@ torrentFree (void * vt)
 
     tr_free (t->requests);
     tr_free (t->pieces);
+    tr_pieceListDestruct (&t->pieceList);
+    tr_bitfieldDestruct (&t->wantedPieces);
     tr_free (t);
 }
 
@@ -724,9 +715,11 @@ tr_peerMgrSetUtpFailed (tr_torrent *tor, const tr_address *addr, bool failed)
 ***    This is list is used for (a) cancelling requests that have been pending
 ***    for too long and (b) avoiding duplicate requests before endgame.
 ***
-*** 2. Torrent::pieces, an array of "struct weighted_piece" which lists the
-***    pieces that we want to request. It's used to decide which blocks to
-***    return next when tr_peerMgrGetBlockRequests () is called.
+*** 2. Torrent::pieceList, a tr_piece_list of the pieces that we want to
+***    request, ordered by pieceWeight (). It's used to decide which blocks
+***    to return next when tr_peerMgrGetBlockRequests () is called.
+***    Its weights are kept current piece by piece as requests, blocks,
+***    and HAVEs come and go, so it never needs to be re-sorted wholesale.
 **/
 
 /**
@@ -925,90 +918,35 @@ updateEndgame (Torrent * t)
 static inline void
 invalidatePieceSorting (Torrent * t)
 {
-    t->pieceSortState = PIECES_UNSORTED;
-}
-
-static const tr_torrent * weightTorrent;
-
-static const uint16_t * weightReplication;
-
-static void
-setComparePieceByWeightTorrent (Torrent * t)
-{
-    if (!replicationExists (t))
-        replicationNew (t);
-
-    weightTorrent = t->tor;
-    weightReplication = t->pieceReplication;
+    t->pieceListIsValid = false;
 }
 
 /* we try to create a "weight" s.t. high-priority pieces come before others,
- * and that partially-complete pieces come before empty ones. */
-static int
-comparePieceByWeight (const void * va, const void * vb)
+ * and that partially-complete pieces come before empty ones.
+ * The keys are packed most-significant first so that comparing two
+ * weights compares the keys in order. */
+static uint64_t
+pieceWeight (const Torrent * t, tr_piece_index_t piece)
 {
-    const struct weighted_piece * a = va;
-    const struct weighted_piece * b = vb;
-    int ia, ib, missing, pending;
-    const tr_torrent * tor = weightTorrent;
-    const uint16_t * rep = weightReplication;
+    int blocks, missing, pending, rarity;
+    const tr_torrent * tor = t->tor;
+    const struct weighted_piece * p = t->pieces + piece;
 
     /* primary key: weight */
-    missing = tr_cpMissingBlocksInPiece (&tor->completion, a->index);
-    pending = a->requestCount;
-    ia = missing > pending ? missing - pending : (tor->blockCountInPiece + pending);
-    missing = tr_cpMissingBlocksInPiece (&tor->completion, b->index);
-    pending = b->requestCount;
-    ib = missing > pending ? missing - pending : (tor->blockCountInPiece + pending);
-    if (ia < ib) return -1;
-    if (ia > ib) return 1;
-
-    /* secondary key: higher priorities go first */
-    ia = tor->info.pieces[a->index].priority;
-    ib = tor->info.pieces[b->index].priority;
-    if (ia > ib) return -1;
-    if (ia < ib) return 1;
-
-    /* tertiary key: rarest first. */
-    ia = rep[a->index];
-    ib = rep[b->index];
-    if (ia < ib) return -1;
-    if (ia > ib) return 1;
+    missing = tr_cpMissingBlocksInPiece (&tor->completion, piece);
+    pending = p->requestCount;
+    blocks = missing > pending ? missing - pending : (tor->blockCountInPiece + pending);
+    blocks = MIN (blocks, 0xFFFFF);
 
-    /* quaternary key: random */
-    if (a->salt < b->salt) return -1;
-    if (a->salt > b->salt) return 1;
+    /* secondary key: higher priorities go first.
+     * tertiary key: rarest first. */
+    rarity = tr_rarityGetPartial (&t->rarity, piece);
 
-    /* okay, they're equal */
-    return 0;
-}
-
-static int
-comparePieceByIndex (const void * va, const void * vb)
-{
-    const struct weighted_piece * a = va;
-    const struct weighted_piece * b = vb;
-    if (a->index < b->index) return -1;
-    if (a->index > b->index) return 1;
-    return 0;
-}
-
-static void
-pieceListSort (Torrent * t, enum piece_sort_state state)
-{
-    assert (state==PIECES_SORTED_BY_INDEX
-         || state==PIECES_SORTED_BY_WEIGHT);
-
-
-    if (state == PIECES_SORTED_BY_WEIGHT)
-    {
-        setComparePieceByWeightTorrent (t);
-        qsort (t->pieces, t->pieceCount, sizeof (struct weighted_piece), comparePieceByWeight);
-    }
-    else
-        qsort (t->pieces, t->pieceCount, sizeof (struct weighted_piece), comparePieceByIndex);
-
-    t->pieceSortState = state;
+    /* quaternary key: random */
+    return ((uint64_t)blocks << 30)
+         | ((uint64_t)(TR_PRI_HIGH - tor->info.piecePriority[piece]) << 28)
+         | ((uint64_t)rarity << 12)
+         | (uint64_t)(p->salt & 0xFFF);
 }
 
 /**
@@ -1022,12 +960,16 @@ pieceListSort (Torrent * t, enum piece_sort_state state)
 static void
 assertWeightedPiecesAreSorted (Torrent * t)
 {
-    if (!t->endgame)
+    if (!t->endgame && t->pieceListIsValid)
     {
-        int i;
-        setComparePieceByWeightTorrent (t);
-        for (i=0; i<t->pieceCount-1; ++i)
-            assert (comparePieceByWeight (&t->pieces[i], &t->pieces[i+1]) <= 0);
+        tr_piece_index_t prev = tr_pieceListFirst (&t->pieceList);
+        tr_piece_index_t piece;
+
+        if (prev != TR_PIECE_LIST_END)
+            for (piece=tr_pieceListNext (&t->pieceList, prev);
+                 piece!=TR_PIECE_LIST_END;
+                 prev=piece, piece=tr_pieceListNext (&t->pieceList, piece))
+                assert (pieceWeight (t, prev) <= pieceWeight (t, piece));
     }
 }
 static void
@@ -1039,167 +981,121 @@ assertReplicationCountIsExact (Torrent * t)
      * a bug report should be filled to the faulty client. */
 
     size_t piece_i;
-    const uint16_t * rep = t->pieceReplication;
-    const size_t piece_count = t->pieceReplicationSize;
+    const size_t piece_count = t->tor->info.pieceCount;
     const tr_peer ** peers = (const tr_peer**) tr_ptrArrayBase (&t->peers);
     const int peer_count = tr_ptrArraySize (&t->peers);
 
-    assert (piece_count == t->tor->info.pieceCount);
-
     for (piece_i=0; piece_i<piece_count; ++piece_i)
     {
         int peer_i;
-        uint16_t r = 0;
+        int r = 0;
 
         for (peer_i=0; peer_i<peer_count; ++peer_i)
-            if (tr_bitsetHas (&peers[peer_i]->have, piece_i))
+            if (tr_bitfieldHas (&peers[peer_i]->have, piece_i))
                 ++r;
 
-        assert (rep[piece_i] == r);
+        assert (tr_rarityGet (&t->rarity, piece_i) == r);
     }
 }
 #endif
 
-static struct weighted_piece *
-pieceListLookup (Torrent * t, tr_piece_index_t index)
+static void
+pieceListFree (Torrent * t)
 {
-    int i;
-
-    for (i=0; i<t->pieceCount; ++i)
-        if (t->pieces[i].index == index)
-            return &t->pieces[i];
+    tr_free (t->pieces);
+    t->pieces = NULL;
+    tr_pieceListDestruct (&t->pieceList);
+    tr_bitfieldDestruct (&t->wantedPieces);
+    invalidatePieceSorting (t);
+}
 
-    return NULL;
+static inline bool
+pieceListWantsPiece (const tr_torrent * tor, const tr_info * inf, tr_piece_index_t piece)
+{
+    return !inf->pieceDnd[piece] && !tr_cpPieceIsComplete (&tor->completion, piece);
 }
 
 static void
 pieceListRebuild (Torrent * t)
 {
+    tr_piece_index_t i;
+    tr_piece_index_t n = 0;
+    tr_piece_index_t * pieces;
+    uint64_t * weights;
+    bool * wanted;
+    const tr_torrent * tor = t->tor;
+    const tr_info * inf = tr_torrentInfo (tor);
+
+    if (!tr_torrentHasMetadata (tor))
+        return;
+
+    /* magnet links don't know their piece count up front */
+    if ((t->pieces != NULL) && (t->pieceList.nodeCount != inf->pieceCount))
+        pieceListFree (t);
 
-    if (!tr_torrentIsSeed (t->tor))
+    if (t->pieces == NULL)
     {
-        tr_piece_index_t i;
-        tr_piece_index_t * pool;
-        tr_piece_index_t poolCount = 0;
-        const tr_torrent * tor = t->tor;
-        const tr_info * inf = tr_torrentInfo (tor);
-        struct weighted_piece * pieces;
-        int pieceCount;
+        /* seeds don't request anything, so don't bother */
+        if (tr_torrentIsSeed (tor))
+            return;
 
-        /* build the new list */
-        pool = tr_new (tr_piece_index_t, inf->pieceCount);
+        t->pieces = tr_new (struct weighted_piece, inf->pieceCount);
         for (i=0; i<inf->pieceCount; ++i)
-            if (!inf->pieces[i].dnd)
-                if (!tr_cpPieceIsComplete (&tor->completion, i))
-                    pool[poolCount++] = i;
-        pieceCount = poolCount;
-        pieces = tr_new0 (struct weighted_piece, pieceCount);
-        for (i=0; i<poolCount; ++i) {
-            struct weighted_piece * piece = pieces + i;
-            piece->index = pool[i];
-            piece->requestCount = 0;
-            piece->salt = tr_cryptoWeakRandInt (4096);
+        {
+            t->pieces[i].requestCount = 0;
+            t->pieces[i].salt = tr_cryptoWeakRandInt (4096);
         }
 
-        /* if we already had a list of pieces, merge it into
-         * the new list so we don't lose its requestCounts */
-        if (t->pieces != NULL)
-        {
-            struct weighted_piece * o = t->pieces;
-            struct weighted_piece * oend = o + t->pieceCount;
-            struct weighted_piece * n = pieces;
-            struct weighted_piece * nend = n + pieceCount;
-
-            pieceListSort (t, PIECES_SORTED_BY_INDEX);
-
-            while (o!=oend && n!=nend) {
-                if (o->index < n->index)
-                    ++o;
-                else if (o->index > n->index)
-                    ++n;
-                else
-                    *n++ = *o++;
-            }
+        tr_pieceListConstruct (&t->pieceList, inf->pieceCount);
+    }
 
-            tr_free (t->pieces);
-        }
+    if (!replicationExists (t))
+        replicationNew (t);
 
-        t->pieces = pieces;
-        t->pieceCount = pieceCount;
+    /* the request counts live in t->pieces, so they survive this.
+     * Listing the pieces in their old order first makes the sort cheap,
+     * since most pieces keep their relative order across a rebuild */
+    pieces = tr_new (tr_piece_index_t, inf->pieceCount);
+    weights = tr_new (uint64_t, inf->pieceCount);
+    for (i=tr_pieceListFirst (&t->pieceList); i!=TR_PIECE_LIST_END; i=tr_pieceListNext (&t->pieceList, i))
+        if (pieceListWantsPiece (tor, inf, i))
+            pieces[n++] = i;
+    for (i=0; i<inf->pieceCount; ++i)
+        if (!tr_pieceListHas (&t->pieceList, i) && pieceListWantsPiece (tor, inf, i))
+            pieces[n++] = i;
+    for (i=0; i<n; ++i)
+        weights[i] = pieceWeight (t, pieces[i]);
+    tr_pieceListAssign (&t->pieceList, pieces, weights, n);
+    tr_free (weights);
 
-        pieceListSort (t, PIECES_SORTED_BY_WEIGHT);
+    tr_bitfieldDestruct (&t->wantedPieces);
+    tr_bitfieldConstruct (&t->wantedPieces, inf->pieceCount);
+    wanted = tr_new0 (bool, inf->pieceCount);
+    for (i=0; i<n; ++i)
+        wanted[pieces[i]] = true;
+    tr_bitfieldSetFromFlags (&t->wantedPieces, wanted, inf->pieceCount);
+    tr_free (wanted);
+    tr_free (pieces);
 
-        /* cleanup */
-        tr_free (pool);
-    }
+    t->pieceListIsValid = true;
 }
 
 static void
 pieceListRemovePiece (Torrent * t, tr_piece_index_t piece)
 {
-    struct weighted_piece * p;
-
-    if ((p = pieceListLookup (t, piece)))
+    if (t->pieces != NULL)
     {
-        const int pos = p - t->pieces;
-
-        tr_removeElementFromArray (t->pieces,
-                                   pos,
-                                   sizeof (struct weighted_piece),
-                                   t->pieceCount--);
-
-        if (t->pieceCount == 0)
-        {
-            tr_free (t->pieces);
-            t->pieces = NULL;
-        }
+        tr_pieceListRemove (&t->pieceList, piece);
+        tr_bitfieldRem (&t->wantedPieces, piece);
     }
 }
 
+/* call this when one of the piece's weight keys changes */
 static void
-pieceListResortPiece (Torrent * t, struct weighted_piece * p)
+pieceListResortPiece (Torrent * t, tr_piece_index_t piece)
 {
-    int pos;
-    bool isSorted = true;
-
-    if (p == NULL)
-        return;
-
-    /* is the torrent already sorted? */
-    pos = p - t->pieces;
-    setComparePieceByWeightTorrent (t);
-    if (isSorted && (pos > 0) && (comparePieceByWeight (p-1, p) > 0))
-        isSorted = false;
-    if (isSorted && (pos < t->pieceCount - 1) && (comparePieceByWeight (p, p+1) > 0))
-        isSorted = false;
-
-    if (t->pieceSortState != PIECES_SORTED_BY_WEIGHT)
-    {
-       pieceListSort (t, PIECES_SORTED_BY_WEIGHT);
-       isSorted = true;
-    }
-
-    /* if it's not sorted, move it around */
-    if (!isSorted)
-    {
-        bool exact;
-        const struct weighted_piece tmp = *p;
-
-        tr_removeElementFromArray (t->pieces,
-                                   pos,
-                                   sizeof (struct weighted_piece),
-                                   t->pieceCount--);
-
-        pos = tr_lowerBound (&tmp, t->pieces, t->pieceCount,
-                             sizeof (struct weighted_piece),
-                             comparePieceByWeight, &exact);
-
-        memmove (&t->pieces[pos + 1],
-                 &t->pieces[pos],
-                 sizeof (struct weighted_piece) * (t->pieceCount++ - pos));
-
-        t->pieces[pos] = tmp;
-    }
+    if (t->pieceListIsValid && tr_pieceListHas (&t->pieceList, piece))
+        tr_pieceListSet (&t->pieceList, piece, pieceWeight (t, piece));
 
     assertWeightedPiecesAreSorted (t);
 }
@@ -1207,13 +1103,12 @@ pieceListResortPiece (Torrent * t, struct weighted_piece * p)
 static void
 pieceListRemoveRequest (Torrent * t, tr_block_index_t block)
 {
-    struct weighted_piece * p;
     const tr_piece_index_t index = tr_torBlockPiece (t->tor, block);
 
-    if (((p = pieceListLookup (t, index))) && (p->requestCount > 0))
+    if ((t->pieces != NULL) && (t->pieces[index].requestCount > 0))
     {
-        --p->requestCount;
-        pieceListResortPiece (t, p);
+        --t->pieces[index].requestCount;
+        pieceListResortPiece (t, index);
     }
 }
 
@@ -1225,57 +1120,43 @@ pieceListRemoveRequest (Torrent * t, tr_block_index_t block)
 ****/
 
 /**
- * Increase the replication count of this piece and sort it if the
- * piece list is already sorted
+ * Increase the replication count of this piece and re-weight it
  */
 static void
 tr_incrReplicationOfPiece (Torrent * t, const size_t index)
 {
     assert (replicationExists (t));
-    assert (t->pieceReplicationSize == t->tor->info.pieceCount);
 
     /* One more replication of this piece is present in the swarm */
-    ++t->pieceReplication[index];
+    tr_rarityAddPiece (&t->rarity, index);
 
-    /* we only resort the piece if the list is already sorted */
-    if (t->pieceSortState == PIECES_SORTED_BY_WEIGHT)
-        pieceListResortPiece (t, pieceListLookup (t, index));
+    pieceListResortPiece (t, index);
 }
 
-/**
- * Increases the replication count of pieces present in the bitfield
- */
 static void
-tr_incrReplicationFromBitfield (Torrent * t, const tr_bitfield * b)
+resortPieceFunc (tr_piece_index_t piece, void * vt)
 {
-    size_t i;
-    uint16_t * rep = t->pieceReplication;
-    const size_t n = t->tor->info.pieceCount;
-
-    assert (replicationExists (t));
-
-    for (i=0; i<n; ++i)
-        if (tr_bitfieldHas (b, i))
-            ++rep[i];
-
-    if (t->pieceSortState == PIECES_SORTED_BY_WEIGHT)
-        invalidatePieceSorting (t);
+    pieceListResortPiece (vt, piece);
 }
 
 /**
- * Increase the replication count of every piece
+ * Increases the replication count of pieces present in the bitfield
  */
 static void
-tr_incrReplication (Torrent * t)
+tr_incrReplicationFromBitfield (Torrent * t, const tr_bitfield * b)
 {
-    int i;
-    const int n = t->pieceReplicationSize;
+    /* when a bitfield covers much of the torrent, one rebuild
+     * is cheaper than re-weighting its pieces one at a time.
+     * Seeds don't change any piece's rank, so they need neither */
+    const bool isSeed = tr_bitfieldHasAll (b);
+    const bool resort = tr_bitfieldCountTrueBits (b) * 4 < t->tor->info.pieceCount;
 
     assert (replicationExists (t));
-    assert (t->pieceReplicationSize == t->tor->info.pieceCount);
 
-    for (i=0; i<n; ++i)
-        ++t->pieceReplication[i];
+    tr_rarityAddBitfield (&t->rarity, b, resort ? resortPieceFunc : NULL, t);
+
+    if (!isSeed && !resort)
+        invalidatePieceSorting (t);
 }
 
 /**
@@ -1284,26 +1165,15 @@ tr_incrReplication (Torrent * t)
 static void
 tr_decrReplicationFromBitfield (Torrent * t, const tr_bitfield * b)
 {
-    int i;
-    const int n = t->pieceReplicationSize;
+    const bool isSeed = tr_bitfieldHasAll (b);
+    const bool resort = tr_bitfieldCountTrueBits (b) * 4 < t->tor->info.pieceCount;
 
     assert (replicationExists (t));
-    assert (t->pieceReplicationSize == t->tor->info.pieceCount);
 
-    if (tr_bitfieldHasAll (b))
-    {
-        for (i=0; i<n; ++i)
-            --t->pieceReplication[i];
-    }
-    else if (!tr_bitfieldHasNone (b))
-    {
-        for (i=0; i<n; ++i)
-            if (tr_bitfieldHas (b, i))
-                --t->pieceReplication[i];
+    tr_rarityRemoveBitfield (&t->rarity, b, resort ? resortPieceFunc : NULL, t);
 
-        if (t->pieceSortState == PIECES_SORTED_BY_WEIGHT)
-            invalidatePieceSorting (t);
-    }
+    if (!isSeed && !resort)
+        invalidatePieceSorting (t);
 }
 
 /**
@@ -1328,8 +1198,10 @@ tr_peerMgrGetNextRequests (tr_torrent           * tor,
 {
     int i;
     int got;
+    int touchedCount;
     Torrent * t;
-    struct weighted_piece * pieces;
+    tr_piece_index_t piece;
+    tr_piece_index_t * touched;
     const tr_bitfield * const have = &peer->have;
 
     /* sanity clause */
@@ -1343,30 +1215,41 @@ tr_peerMgrGetNextRequests (tr_torrent           * tor,
     t = tor->torrentPeers;
 
     /* prep the pieces list */
-    if (t->pieces == NULL)
+    if (!t->pieceListIsValid)
         pieceListRebuild (t);
 
-    if (t->pieceSortState != PIECES_SORTED_BY_WEIGHT)
-        pieceListSort (t, PIECES_SORTED_BY_WEIGHT);
+    /* don't walk the whole list for a peer that has nothing we want */
+    if ((t->pieces == NULL) || !tr_bitfieldIntersects (have, &t->wantedPieces))
+    {
+        *numgot = 0;
+        return;
+    }
 
     assertReplicationCountIsExact (t);
     assertWeightedPiecesAreSorted (t);
 
     updateEndgame (t);
-    pieces = t->pieces;
-    for (i=0; i<t->pieceCount && got<numwant; ++i)
+
+    /* every piece we request from adds at least one to `got' */
+    touchedCount = 0;
+    touched = tr_new (tr_piece_index_t, numwant);
+
+    for (piece=tr_pieceListFirst (&t->pieceList);
+         piece!=TR_PIECE_LIST_END && got<numwant;
+         piece=tr_pieceListNext (&t->pieceList, piece))
     {
-        struct weighted_piece * p = pieces + i;
+        struct weighted_piece * p = t->pieces + piece;
 
         /* if the peer has this piece that we want... */
-        if (tr_bitfieldHas (have, p->index))
+        if (tr_bitfieldHas (have, piece))
         {
             tr_block_index_t b;
             tr_block_index_t first;
             tr_block_index_t last;
+            const int16_t oldRequestCount = p->requestCount;
             tr_ptrArray peerArr = TR_PTR_ARRAY_INIT;
 
-            tr_torGetPieceBlockRange (tor, p->index, &first, &last);
+            tr_torGetPieceBlockRange (tor, piece, &first, &last);
 
             for (b=first; b<=last && (got<numwant || (get_intervals && setme[2*got-1] == b-1)); ++b)
             {
@@ -1423,39 +1306,19 @@ tr_peerMgrGetNextRequests (tr_torrent           * tor,
                 ++p->requestCount;
             }
 
+            if (p->requestCount != oldRequestCount)
+                touched[touchedCount++] = piece;
+
             tr_ptrArrayDestruct (&peerArr, NULL);
         }
     }
 
-    /* In most cases we've just changed the weights of a small number of pieces.
-     * So rather than qsort ()ing the entire array, it's faster to apply an
-     * adaptive insertion sort algorithm. */
-    if (got > 0)
-    {
-        /* not enough requests || last piece modified */
-        if (i == t->pieceCount) --i;
-
-        setComparePieceByWeightTorrent (t);
-        while (--i >= 0)
-        {
-            bool exact;
-
-            /* relative position! */
-            const int newpos = tr_lowerBound (&t->pieces[i], &t->pieces[i + 1],
-                                              t->pieceCount - (i + 1),
-                                              sizeof (struct weighted_piece),
-                                              comparePieceByWeight, &exact);
-            if (newpos > 0)
-            {
-                const struct weighted_piece piece = t->pieces[i];
-                memmove (&t->pieces[i],
-                         &t->pieces[i + 1],
-                         sizeof (struct weighted_piece) * (newpos));
-                t->pieces[i + newpos] = piece;
-            }
-        }
-    }
+    /* we've changed the weights of the pieces we requested from.
+     * Moving them mid-walk would upset the iteration, so do it now */
+    for (i=0; i<touchedCount; ++i)
+        pieceListResortPiece (t, touched[i]);
 
+    tr_free (touched);
     assertWeightedPiecesAreSorted (t);
     *numgot = got;
 }
@@ -1687,7 +1550,7 @@ peerCallbackFunc (tr_peer * peer, const tr_peer_event * e, void * vt)
 
         case TR_PEER_CLIENT_GOT_HAVE_ALL:
             if (replicationExists (t)) {
-                tr_incrReplication (t);
+                tr_incrReplicationFromBitfield (t, &peer->have);
                 assertReplicationCountIsExact (t);
             }
             break;
@@ -1791,7 +1654,7 @@ peerCallbackFunc (tr_peer * peer, const tr_peer_event * e, void * vt)
             else
             {
                 tr_cpBlockAdd (&tor->completion, block);
-                pieceListResortPiece (t, pieceListLookup (t, e->pieceIndex));
+                pieceListResortPiece (t, e->pieceIndex);
                 tr_torrentSetDirty (tor);
 
                 if (tr_cpPieceIsComplete (&tor->completion, e->pieceIndex))
@@ -1812,6 +1675,7 @@ peerCallbackFunc (tr_peer * peer, const tr_peer_event * e, void * vt)
                     if (!ok)
                     {
                         gotBadPiece (t, p);
+                        pieceListResortPiece (t, p);
                     }
                     else
                     {
@@ -1831,6 +1695,10 @@ peerCallbackFunc (tr_peer * peer, const tr_peer_event * e, void * vt)
                             tr_announcerAddBytes (tor, TR_ANN_DOWN, n);
                         }
 
+                        /* before telling the peers, so that they can
+                         * see whether they still have anything we want */
+                        pieceListRemovePiece (t, p);
+
                         peerCount = tr_ptrArraySize (&t->peers);
                         peers = (tr_peer**) tr_ptrArrayBase (&t->peers);
                         for (i=0; i<peerCount; ++i)
@@ -1845,8 +1713,6 @@ peerCallbackFunc (tr_peer * peer, const tr_peer_event * e, void * vt)
                                 }
                             }
                         }
-
-                        pieceListRemovePiece (t, p);
                     }
                 }
 
@@ -2435,7 +2301,7 @@ tr_peerMgrStartTorrent (tr_torrent * tor)
 
     t->isRunning = true;
     t->maxPeers = t->tor->maxConnectedPeers;
-    t->pieceSortState = PIECES_UNSORTED;
+    invalidatePieceSorting (t);
 
     rechokePulse (0, 0, t->manager);
 }
@@ -2583,6 +2449,31 @@ tr_peerMgrTorrentAvailability (const tr_torrent  * tor,
     }
 }
 
+int
+tr_peerMgrPieceReplication (const tr_torrent * tor, tr_piece_index_t piece)
+{
+    int i;
+    int n;
+    int replication = 0;
+    const Torrent * t = tor->torrentPeers;
+    const tr_peer ** peers;
+
+    assert (tr_isTorrent (tor));
+    assert (piece < tor->info.pieceCount);
+
+    /* the piece list keeps a tally while we're downloading */
+    if (replicationExists (t) && (piece < t->rarity.pieceCount))
+        return tr_rarityGet (&t->rarity, piece);
+
+    n = tr_ptrArraySize (&t->peers);
+    peers = (const tr_peer**) tr_ptrArrayBase (&t->peers);
+    for (i=0; i<n; ++i)
+        if (tr_bitfieldHas (&peers[i]->have, piece))
+            ++replication;
+
+    return replication;
+}
+
 static bool
 peerIsSeed (const tr_peer * peer)
 {
@@ -2602,6 +2493,7 @@ tr_peerMgrGetDesiredAvailable (const tr_torrent * tor)
     size_t i;
     size_t n;
     uint64_t desiredAvailable;
+    const tr_piece_index_t * unavailable;
     const Torrent * t = tor->torrentPeers;
 
     /* common shortcuts... */
@@ -2622,15 +2514,15 @@ tr_peerMgrGetDesiredAvailable (const tr_torrent * tor)
                 return tr_cpLeftUntilDone (&tor->completion);
     }
 
-    if (!t->pieceReplication || !t->pieceReplicationSize)
+    if (!replicationExists (t) || (t->rarity.pieceCount != tor->info.pieceCount))
         return 0;
 
-    /* do it the hard way */
-
-    desiredAvailable = 0;
-    for (i=0, n=MIN (tor->info.pieceCount, t->pieceReplicationSize); i<n; ++i)
-        if (!tor->info.pieces[i].dnd && (t->pieceReplication[i] > 0))
-            desiredAvailable += tr_cpMissingBytesInPiece (&t->tor->completion, i);
+    /* everything we want, minus what nobody has */
+    desiredAvailable = tr_cpLeftUntilDone (&tor->completion);
+    unavailable = tr_rarityGetBucket (&t->rarity, 0, &n);
+    for (i=0; i<n; ++i)
+        if (!tor->info.pieceDnd[unavailable[i]])
+            desiredAvailable -= tr_cpMissingBytesInPiece (&tor->completion, unavailable[i]);
 
     assert (desiredAvailable <= tor->info.totalSize);
     return desiredAvailable;
@@ -2774,6 +2666,8 @@ tr_peerMgrPeerStats (const tr_torrent * tor, int * setmeCount)
 
       stat->pendingReqsToPeer   = peer->pendingReqsToPeer;
       stat->pendingReqsToClient = peer->pendingReqsToClient;
+      stat->desiredReqsToPeer   = tr_peerMsgsGetDesiredRequestCount (peer->msgs);
+      stat->rtt_msec            = tr_peerIoGetRTT_msec (peer->io);
 
       pch = stat->flagStr;
       if (stat->isUTP) *pch++ = 'T';
@@ -2819,12 +2713,10 @@ tr_peerMgrClearInterest (tr_torrent * tor)
 
 /* does this peer have any pieces that we want? */
 static bool
-isPeerInteresting (tr_torrent     * const tor,
-                   const bool     * const piece_is_interesting,
-                   const tr_peer  * const peer)
+isPeerInteresting (tr_torrent        * const tor,
+                   const tr_bitfield * const interesting,
+                   const tr_peer     * const peer)
 {
-  tr_piece_index_t i, n;
-
   /* these cases should have already been handled by the calling code... */
   assert (!tr_torrentIsSeed (tor));
   assert (tr_torrentIsPieceTransferAllowed (tor, TR_PEER_TO_CLIENT));
@@ -2832,11 +2724,22 @@ isPeerInteresting (tr_torrent     * const tor,
   if (peerIsSeed (peer))
     return true;
 
-  for (i=0, n=tor->info.pieceCount; i<n; ++i)
-    if (piece_is_interesting[i] && tr_bitfieldHas (&peer->have, i))
-      return true;
+  return tr_bitfieldIntersects (&peer->have, interesting);
+}
 
-  return false;
+bool
+tr_peerMgrPeerIsInteresting (tr_torrent * tor, const tr_peer * peer)
+{
+    const Torrent * t = tor->torrentPeers;
+
+    if (tr_torrentIsSeed (tor))
+        return false;
+
+    /* until the piece list is built, we can't say */
+    if ((t->pieces == NULL) || !t->pieceListIsValid)
+        return true;
+
+    return tr_bitfieldIntersects (&peer->have, &t->wantedPieces);
 }
 
 typedef enum
@@ -2955,20 +2858,24 @@ rechokeDownloads (Torrent * t)
     if (peerCount > 0)
     {
         bool * piece_is_interesting;
+        tr_bitfield interesting;
         const tr_torrent * const tor = t->tor;
         const int n = tor->info.pieceCount;
 
         /* build a bitfield of interesting pieces... */
         piece_is_interesting = tr_new (bool, n);
         for (i=0; i<n; i++)
-            piece_is_interesting[i] = !tor->info.pieces[i].dnd && !tr_cpPieceIsComplete (&tor->completion, i);
+            piece_is_interesting[i] = !tor->info.pieceDnd[i] && !tr_cpPieceIsComplete (&tor->completion, i);
+        tr_bitfieldConstruct (&interesting, n);
+        tr_bitfieldSetFromFlags (&interesting, piece_is_interesting, n);
+        tr_free (piece_is_interesting);
 
         /* decide WHICH peers to be interested in (based on their cancel-to-block ratio) */
         for (i=0; i<peerCount; ++i)
         {
             tr_peer * peer = tr_ptrArrayNth (&t->peers, i);
 
-            if (!isPeerInteresting (t->tor, piece_is_interesting, peer))
+            if (!isPeerInteresting (t->tor, &interesting, peer))
             {
                 tr_peerMsgsSetInterested (peer->msgs, false);
             }
@@ -3000,7 +2907,7 @@ rechokeDownloads (Torrent * t)
 
         }
 
-        tr_free (piece_is_interesting);
+        tr_bitfieldDestruct (&interesting);
     }
 
     /* now that we know which & how many peers to be interested in... update the peer interest */
@@ -3634,10 +3541,6 @@ bandwidthPulse (int foo UNUSED, short bar UNUSED, void * vmgr)
     /* FIXME: this next line probably isn't necessary... */
     pumpAllPeers (mgr);
 
-    /* allocate bandwidth to the peers */
-    tr_bandwidthAllocate (&session->bandwidth, TR_UP, BANDWIDTH_PERIOD_MSEC);
-    tr_bandwidthAllocate (&session->bandwidth, TR_DOWN, BANDWIDTH_PERIOD_MSEC);
-
     /* torrent upkeep */
     tor = NULL;
     while ((tor = tr_torrentNext (session, tor)))
@@ -232,6 +232,10 @@ void tr_peerMgrTorrentAvailability (const tr_torrent   * tor,
 
 uint64_t tr_peerMgrGetDesiredAvailable (const tr_torrent * tor);
 
+/* how many connected peers have this piece */
+int tr_peerMgrPieceReplication (const tr_torrent * tor,
+                                tr_piece_index_t   piece);
+
 void tr_peerMgrOnTorrentGotMetainfo (tr_torrent * tor);
 
 void tr_peerMgrOnBlocklistChanged (tr_peerMgr * manager);
@@ -255,6 +259,9 @@ unsigned int tr_peerGetPieceSpeed_Bps (const tr_peer    * peer,
 
 void tr_peerMgrClearInterest (tr_torrent * tor);
 
+/** @return false if we know that the peer has nothing we want */
+bool tr_peerMgrPeerIsInteresting (tr_torrent * tor, const tr_peer * peer);
+
 /* @} */
 
 #endif
@@ -24,6 +24,7 @@
 #include "cache.h"
 #include "completion.h"
 #include "crypto.h" /* tr_sha1 () */
+#include "inout.h" /* tr_ioAddFileSegments () */
 #include "peer-io.h"
 #include "peer-mgr.h"
 #include "peer-msgs.h"
@@ -78,6 +79,15 @@ enum
 
     METADATA_REQQ           = 64,
 
+    /* keep enough requests in flight to cover this many round trips,
+     * so the pipeline can double each time the peer keeps up with it */
+    REQUEST_PIPELINE_RTTS   = 2,
+
+    /* floor on the pipeline's length in time, so that low-latency peers
+     * still have requests queued while they read blocks from disk and
+     * while our own bandwidth timers and uTP ticks come around */
+    REQUEST_PIPELINE_MIN_MSEC = 500,
+
     /* used in lowering the outMessages queue period */
     IMMEDIATE_PRIORITY_INTERVAL_SECS = 0,
     HIGH_PRIORITY_INTERVAL_SECS = 2,
@@ -160,8 +170,16 @@ struct tr_peermsgs
 
     int             desiredRequestCount;
 
+    /* the peer's round-trip time, or -1 if it's unknown. For TCP peers,
+     * reading it is a getsockopt (), so it's only refreshed on the
+     * periodic pulse rather than each time desiredRequestCount is */
+    int             rtt_msec;
+
     int             prefetchCount;
 
+    /* blocks we're sending the peer that are still being read from disk */
+    int             pendingReads;
+
     /* how long the outMessages batch should be allowed to grow before
      * it's flushed -- some messages (like requests >:) should be sent
      * very quickly; others aren't as urgent. */
@@ -664,10 +682,14 @@ sendInterest (tr_peermsgs * msgs, bool clientIsInterested)
     dbgOutMessageLen (msgs);
 }
 
+/* Becoming interested is left to the peer-mgr's rechoke, which
+ * decides how many peers to be interested in. But once a peer has
+ * nothing we want, there's no point waiting for that to say so. */
 static void
-updateInterest (tr_peermsgs * msgs UNUSED)
+updateInterest (tr_peermsgs * msgs)
 {
-    /* FIXME -- might need to poke the mgr on startup */
+    if (msgs->peer->clientIsInterested && !tr_peerMgrPeerIsInteresting (msgs->torrent, msgs->peer))
+        sendInterest (msgs, false);
 }
 
 void
@@ -1285,6 +1307,11 @@ messageLengthIsCorrect (const tr_peermsgs * msg, uint8_t id, uint32_t len)
     }
 }
 
+static int peerPulse (void * vmsgs);
+static void flushOutput (tr_peermsgs * msgs, time_t now);
+static void requestBlocks (tr_peermsgs * msgs, int numwant);
+static void updateDesiredRequestCount (tr_peermsgs * msgs);
+
 static int clientGotBlock (tr_peermsgs *               msgs,
                            struct evbuffer *           block,
                            const struct peer_request * req);
@@ -1343,12 +1370,26 @@ readBtPiece (tr_peermsgs      * msgs,
         /* cleanup */
         req->length = 0;
         msgs->state = AWAITING_BT_LENGTH;
+
+        /* the pipeline is only a round trip or two deep, so top it up
+         * and send the requests as blocks arrive instead of waiting
+         * for the next pulse. This uses the RTT from the last pulse,
+         * and only asks the piece picker if there's room */
+        if (!err)
+        {
+            updateDesiredRequestCount (msgs);
+
+            if (msgs->peer->pendingReqsToPeer < msgs->desiredRequestCount)
+            {
+                requestBlocks (msgs, msgs->desiredRequestCount - msgs->peer->pendingReqsToPeer);
+                flushOutput (msgs, tr_time ());
+            }
+        }
+
         return err ? READ_ERR : READ_NOW;
     }
 }
 
-static void updateDesiredRequestCount (tr_peermsgs * msgs);
-
 static int
 readBtMessage (tr_peermsgs * msgs, struct evbuffer * inbuf, size_t inlen)
 {
@@ -1436,6 +1477,13 @@ readBtMessage (tr_peermsgs * msgs, struct evbuffer * inbuf, size_t inlen)
             tr_peerIoReadUint32 (msgs->peer->io, inbuf, &r.length);
             dbgmsg (msgs, "got Request: %u:%u->%u", r.index, r.offset, r.length);
             peerMadeRequest (msgs, &r);
+
+            /* peers that pipeline only a round trip's worth of requests
+             * leave us idle between them, so if there's room to send a
+             * block, start on this one now rather than at the next pulse */
+            if (tr_peerIoGetWriteBufferSpace (msgs->peer->io, tr_time_msec ())
+                    >= msgs->torrent->blockSize * (1 + msgs->pendingReads))
+                flushOutput (msgs, tr_time ());
             break;
         }
 
@@ -1597,8 +1645,6 @@ clientGotBlock (tr_peermsgs                * msgs,
     return 0;
 }
 
-static int peerPulse (void * vmsgs);
-
 static void
 didWrite (tr_peerIo * io UNUSED, size_t bytesWritten, int wasPieceData, void * vmsgs)
 {
@@ -1663,6 +1709,12 @@ tr_peerMsgsIsReadingBlock (const tr_peermsgs * msgs, tr_block_index_t block)
                                msgs->incoming.blockReq.offset);
 }
 
+int
+tr_peerMsgsGetDesiredRequestCount (const tr_peermsgs * msgs)
+{
+    return msgs->desiredRequestCount;
+}
+
 /**
 ***
 **/
@@ -1675,17 +1727,18 @@ updateDesiredRequestCount (tr_peermsgs * msgs)
     /* there are lots of reasons we might not want to request any blocks... */
     if (tr_torrentIsSeed (torrent) || !tr_torrentHasMetadata (torrent)
                                     || msgs->peer->clientIsChoked
-                                    || !msgs->peer->clientIsInterested)
+                                    || !msgs->peer->clientIsInterested
+                                    || tr_cacheIsBacklogged (torrent->session->cache))
     {
         msgs->desiredRequestCount = 0;
     }
     else
     {
         int estimatedBlocksInPeriod;
+        int pipeline_msec;
         unsigned int rate_Bps;
         unsigned int irate_Bps;
         const int floor = 4;
-        const int seconds = REQUEST_BUF_SECS;
         const uint64_t now = tr_time_msec ();
 
         /* Get the rate limit we should use.
@@ -1699,10 +1752,19 @@ updateDesiredRequestCount (tr_peermsgs * msgs)
 	    tr_sessionGetActiveSpeedLimit_Bps (torrent->session, TR_PEER_TO_CLIENT, &irate_Bps))
                 rate_Bps = MIN (rate_Bps, irate_Bps);
 
+        /* keep the bandwidth-delay product in flight: the peer's rate
+         * times the round-trip time. If we can't learn the round-trip
+         * time, fall back to buffering REQUEST_BUF_SECS' worth */
+        if (msgs->rtt_msec < 0)
+            pipeline_msec = REQUEST_BUF_SECS * 1000;
+        else
+            pipeline_msec = MAX (REQUEST_PIPELINE_MIN_MSEC,
+                                 msgs->rtt_msec * REQUEST_PIPELINE_RTTS);
+
         /* use this desired rate to figure out how
          * many requests we should send to this peer */
-        estimatedBlocksInPeriod = (rate_Bps * seconds) / torrent->blockSize;
-        msgs->desiredRequestCount = MAX (floor, estimatedBlocksInPeriod);
+        estimatedBlocksInPeriod = ((uint64_t)rate_Bps * pipeline_msec) / (1000u * torrent->blockSize);
+        msgs->desiredRequestCount = floor + estimatedBlocksInPeriod;
 
         /* honor the peer's maximum request count, if specified */
         if (msgs->reqq > 0)
@@ -1746,15 +1808,12 @@ updateMetadataRequests (tr_peermsgs * msgs, time_t now)
 }
 
 static void
-updateBlockRequests (tr_peermsgs * msgs)
+requestBlocks (tr_peermsgs * msgs, int numwant)
 {
-    if (tr_torrentIsPieceTransferAllowed (msgs->torrent, TR_PEER_TO_CLIENT)
-        && (msgs->desiredRequestCount > 0)
-        && (msgs->peer->pendingReqsToPeer <= (msgs->desiredRequestCount * 0.66)))
+    if (tr_torrentIsPieceTransferAllowed (msgs->torrent, TR_PEER_TO_CLIENT))
     {
         int i;
         int n;
-        const int numwant = msgs->desiredRequestCount - msgs->peer->pendingReqsToPeer;
         tr_block_index_t * blocks = tr_new (tr_block_index_t, numwant);
 
         tr_peerMgrGetNextRequests (msgs->torrent, msgs->peer, numwant, blocks, &n, false);
@@ -1770,6 +1829,85 @@ updateBlockRequests (tr_peermsgs * msgs)
     }
 }
 
+static void
+updateBlockRequests (tr_peermsgs * msgs)
+{
+    if ((msgs->desiredRequestCount > 0)
+        && (msgs->peer->pendingReqsToPeer <= (msgs->desiredRequestCount * 0.66)))
+        requestBlocks (msgs, msgs->desiredRequestCount - msgs->peer->pendingReqsToPeer);
+}
+
+static void
+onBlockRead (void              * vmsgs,
+             int                 err,
+             tr_piece_index_t    piece,
+             uint32_t            offset,
+             uint32_t            length,
+             const uint8_t     * data)
+{
+    tr_peermsgs * msgs = vmsgs;
+    struct peer_request req;
+
+    --msgs->pendingReads;
+
+    req.index = piece;
+    req.offset = offset;
+    req.length = length;
+
+    if (err)
+    {
+        if (tr_peerIoSupportsFEXT (msgs->peer->io))
+            protocolSendReject (msgs, &req);
+    }
+    else
+    {
+        const time_t now = tr_time ();
+        const uint32_t msglen = 4 + 1 + 4 + 4 + length;
+        struct evbuffer * out = evbuffer_new ();
+
+        evbuffer_expand (out, msglen);
+        evbuffer_add_uint32 (out, sizeof (uint8_t) + 2 * sizeof (uint32_t) + length);
+        evbuffer_add_uint8 (out, BT_PIECE);
+        evbuffer_add_uint32 (out, piece);
+        evbuffer_add_uint32 (out, offset);
+        evbuffer_add (out, data, length);
+
+        dbgmsg (msgs, "sending block %u:%u->%u", piece, offset, length);
+        assert (evbuffer_get_length (out) == msglen);
+        tr_peerIoWriteBuf (msgs->peer->io, out, true);
+        msgs->clientSentAnythingAt = now;
+        tr_historyAdd (&msgs->peer->blocksSentToPeer, now, 1);
+
+        evbuffer_free (out);
+    }
+}
+
+/* send a block to a plaintext peer without copying it through userspace.
+ * this only works for blocks that are already resident; for anything
+ * else it returns nonzero, and the caller reads the block asynchronously */
+static int
+sendBlockFromFile (tr_peermsgs * msgs, const struct peer_request * req, time_t now)
+{
+    int err;
+    struct evbuffer * out = evbuffer_new ();
+
+    evbuffer_add_uint32 (out, sizeof (uint8_t) + 2 * sizeof (uint32_t) + req->length);
+    evbuffer_add_uint8 (out, BT_PIECE);
+    evbuffer_add_uint32 (out, req->index);
+    evbuffer_add_uint32 (out, req->offset);
+
+    if (!(err = tr_ioAddFileSegments (msgs->torrent, req->index, req->offset, req->length, out)))
+    {
+        dbgmsg (msgs, "sending block %u:%u->%u from file", req->index, req->offset, req->length);
+        tr_peerIoWriteBuf (msgs->peer->io, out, true);
+        msgs->clientSentAnythingAt = now;
+        tr_historyAdd (&msgs->peer->blocksSentToPeer, now, 1);
+    }
+
+    evbuffer_free (out);
+    return err;
+}
+
 static size_t
 fillOutputBuffer (tr_peermsgs * msgs, time_t now)
 {
@@ -1788,7 +1926,10 @@ fillOutputBuffer (tr_peermsgs * msgs, time_t now)
         dbgmsg (msgs, "started an outMessages batch (length is %zu)", evbuffer_get_length (msgs->outMessages));
         msgs->outMessagesBatchedAt = now;
     }
-    else if (haveMessages && ((now - msgs->outMessagesBatchedAt) >= msgs->outMessagesBatchPeriod))
+
+    /* a fresh batch of immediate-priority messages, such as requests,
+     * goes out right away rather than waiting for the next pulse */
+    if (haveMessages && ((now - msgs->outMessagesBatchedAt) >= msgs->outMessagesBatchPeriod))
     {
         const size_t len = evbuffer_get_length (msgs->outMessages);
         /* flush the protocol messages */
@@ -1870,7 +2011,7 @@ fillOutputBuffer (tr_peermsgs * msgs, time_t now)
     ***  Data Blocks
     **/
 
-    if ((tr_peerIoGetWriteBufferSpace (msgs->peer->io, now) >= msgs->torrent->blockSize)
+    if ((tr_peerIoGetWriteBufferSpace (msgs->peer->io, now) >= msgs->torrent->blockSize * (1 + msgs->pendingReads))
         && popNextRequest (msgs, &req))
     {
         --msgs->prefetchCount;
@@ -1878,51 +2019,35 @@ fillOutputBuffer (tr_peermsgs * msgs, time_t now)
         if (requestIsValid (msgs, &req)
             && tr_cpPieceIsComplete (&msgs->torrent->completion, req.index))
         {
-            int err;
-            const uint32_t msglen = 4 + 1 + 4 + 4 + req.length;
-            struct evbuffer * out;
-            struct evbuffer_iovec iovec[1];
-
-            out = evbuffer_new ();
-            evbuffer_expand (out, msglen);
-
-            evbuffer_add_uint32 (out, sizeof (uint8_t) + 2 * sizeof (uint32_t) + req.length);
-            evbuffer_add_uint8 (out, BT_PIECE);
-            evbuffer_add_uint32 (out, req.index);
-            evbuffer_add_uint32 (out, req.offset);
-
-            evbuffer_reserve_space (out, req.length, iovec, 1);
-            err = tr_cacheReadBlock (getSession (msgs)->cache, msgs->torrent, req.index, req.offset, req.length, iovec[0].iov_base);
-            iovec[0].iov_len = req.length;
-            evbuffer_commit_space (out, iovec, 1);
-
             /* check the piece if it needs checking... */
-            if (!err && tr_torrentPieceNeedsCheck (msgs->torrent, req.index))
-                if ((err = !tr_torrentCheckPiece (msgs->torrent, req.index)))
-                    tr_torrentSetLocalError (msgs->torrent, _("Please Verify Local Data! Piece #%zu is corrupt."), (size_t)req.index);
-
-            if (err)
+            if (tr_torrentPieceNeedsCheck (msgs->torrent, req.index)
+                && !tr_torrentCheckPiece (msgs->torrent, req.index))
             {
+                tr_torrentSetLocalError (msgs->torrent, _("Please Verify Local Data! Piece #%zu is corrupt."), (size_t)req.index);
+
                 if (fext)
                     protocolSendReject (msgs, &req);
+
+                bytesWritten = 0;
+                msgs = NULL;
             }
-            else
+            else if (tr_peerIoSupportsSendfile (msgs->peer->io)
+                     && !tr_cacheHasBlock (getSession (msgs)->cache, msgs->torrent, req.index, req.offset)
+                     && !sendBlockFromFile (msgs, &req, now))
             {
-                const size_t n = evbuffer_get_length (out);
-                dbgmsg (msgs, "sending block %u:%u->%u", req.index, req.offset, req.length);
-                assert (n == msglen);
-                tr_peerIoWriteBuf (msgs->peer->io, out, true);
-                bytesWritten += n;
-                msgs->clientSentAnythingAt = now;
-                tr_historyAdd (&msgs->peer->blocksSentToPeer, tr_time (), 1);
+                bytesWritten += req.length;
             }
-
-            evbuffer_free (out);
-
-            if (err)
+            else
             {
-                bytesWritten = 0;
-                msgs = NULL;
+                /* cold blocks go through the reader threads, which also
+                 * leaves them in the page cache for the next request.
+                 * onBlockRead () sends the block once it's off the disk.
+                 * count it here so that peerPulse () keeps filling the buffer */
+                ++msgs->pendingReads;
+                bytesWritten += req.length;
+                tr_cacheReadBlockAsync (getSession (msgs)->cache, msgs->torrent,
+                                        req.index, req.offset, req.length,
+                                        onBlockRead, msgs);
             }
         }
         else if (fext) /* peer needs a reject message */
@@ -1950,6 +2075,14 @@ fillOutputBuffer (tr_peermsgs * msgs, time_t now)
     return bytesWritten;
 }
 
+static void
+flushOutput (tr_peermsgs * msgs, time_t now)
+{
+    for (;;)
+        if (fillOutputBuffer (msgs, now) < 1)
+            break;
+}
+
 static int
 peerPulse (void * vmsgs)
 {
@@ -1962,9 +2095,7 @@ peerPulse (void * vmsgs)
         updateMetadataRequests (msgs, now);
     }
 
-    for (;;)
-        if (fillOutputBuffer (msgs, now) < 1)
-            break;
+    flushOutput (msgs, now);
 
     return true; /* loop forever */
 }
@@ -1973,7 +2104,12 @@ void
 tr_peerMsgsPulse (tr_peermsgs * msgs)
 {
     if (msgs != NULL)
+    {
+        if (tr_isPeerIo (msgs->peer->io))
+            msgs->rtt_msec = tr_peerIoGetRTT_msec (msgs->peer->io);
+
         peerPulse (msgs);
+    }
 }
 
 static void
@@ -2381,6 +2517,7 @@ tr_peerMsgsNew (struct tr_torrent    * torrent,
     }
 
     tr_peerIoSetIOFuncs (m->peer->io, canRead, didWrite, gotError, m);
+    m->rtt_msec = tr_peerIoGetRTT_msec (m->peer->io);
     updateDesiredRequestCount (m);
 
     return m;
@@ -2391,6 +2528,9 @@ tr_peerMsgsFree (tr_peermsgs* msgs)
 {
     if (msgs)
     {
+        if (msgs->pendingReads > 0)
+            tr_cacheCancelReads (getSession (msgs)->cache, msgs);
+
         if (msgs->pexTimer != NULL)
             event_free (msgs->pexTimer);
 
@@ -41,6 +41,10 @@ void         tr_peerMsgsSetChoke (tr_peermsgs *, bool peerIsChoked);
 
 int          tr_peerMsgsIsReadingBlock (const tr_peermsgs * msgs, tr_block_index_t block);
 
+/** @brief how many requests we want in flight to this peer, sized from
+    its piece speed and round-trip time */
+int          tr_peerMsgsGetDesiredRequestCount (const tr_peermsgs * msgs);
+
 void         tr_peerMsgsSetInterested (tr_peermsgs *, bool clientIsInterested);
 
 void         tr_peerMsgsHave (tr_peermsgs * msgs,
@@ -0,0 +1,456 @@
+#include <stdio.h> /* fprintf () */
+#include <stdlib.h> /* qsort () */
+#include <string.h> /* strcmp (), memmove () */
+
+#include "transmission.h"
+#include "crypto.h" /* tr_cryptoWeakRandInt () */
+#include "piece-list.h"
+#include "utils.h" /* tr_time_msec (), tr_lowerBound () */
+
+#include "libtransmission-test.h"
+
+/***
+****  A brute-force model to check tr_piece_list against
+***/
+
+struct model_piece
+{
+    tr_piece_index_t index;
+    uint64_t weight;
+};
+
+static int
+compareModelPieces (const void * va, const void * vb)
+{
+    const struct model_piece * a = va;
+    const struct model_piece * b = vb;
+
+    if (a->weight != b->weight)
+        return a->weight < b->weight ? -1 : 1;
+    if (a->index != b->index)
+        return a->index < b->index ? -1 : 1;
+    return 0;
+}
+
+/* walk the list and make sure it holds exactly the model's pieces, in order */
+static int
+checkAgainstModel (const tr_piece_list * list, const bool * has, const uint64_t * weights, tr_piece_index_t n)
+{
+    tr_piece_index_t i;
+    tr_piece_index_t piece;
+    tr_piece_index_t count = 0;
+    struct model_piece * expected = tr_new (struct model_piece, n);
+
+    for (i=0; i<n; ++i)
+    {
+        check (tr_pieceListHas (list, i) == has[i]);
+
+        if (has[i])
+        {
+            expected[count].index = i;
+            expected[count].weight = weights[i];
+            ++count;
+        }
+    }
+
+    qsort (expected, count, sizeof (struct model_piece), compareModelPieces);
+    check_int_eq (count, tr_pieceListSize (list));
+
+    for (i=0, piece=tr_pieceListFirst (list); piece!=TR_PIECE_LIST_END; ++i, piece=tr_pieceListNext (list, piece))
+    {
+        check (i < count);
+        check_int_eq (expected[i].index, piece);
+    }
+    check_int_eq (count, i);
+
+    tr_free (expected);
+    return 0;
+}
+
+static int
+test_empty (void)
+{
+    tr_piece_list list;
+
+    tr_pieceListConstruct (&list, 10);
+    check_int_eq (0, tr_pieceListSize (&list));
+    check_int_eq (TR_PIECE_LIST_END, tr_pieceListFirst (&list));
+    check (!tr_pieceListHas (&list, 3));
+    check (!tr_pieceListHas (&list, 10));
+
+    /* removing a piece that isn't there is harmless */
+    tr_pieceListRemove (&list, 3);
+    check_int_eq (0, tr_pieceListSize (&list));
+
+    tr_pieceListSet (&list, 3, 100);
+    check_int_eq (1, tr_pieceListSize (&list));
+    check_int_eq (3, tr_pieceListFirst (&list));
+    check_int_eq (TR_PIECE_LIST_END, tr_pieceListNext (&list, 3));
+
+    tr_pieceListClear (&list);
+    check_int_eq (0, tr_pieceListSize (&list));
+    check (!tr_pieceListHas (&list, 3));
+    check_int_eq (TR_PIECE_LIST_END, tr_pieceListFirst (&list));
+
+    tr_pieceListDestruct (&list);
+    return 0;
+}
+
+static int
+test_order (void)
+{
+    int ret;
+    tr_piece_index_t i;
+    const tr_piece_index_t n = 300;
+    tr_piece_list list;
+    bool has[300];
+    uint64_t weights[300];
+
+    tr_pieceListConstruct (&list, n);
+    memset (has, 0, sizeof (has));
+
+    /* ties are broken by piece index */
+    for (i=0; i<n; ++i)
+    {
+        has[i] = true;
+        weights[i] = i % 7;
+        tr_pieceListSet (&list, i, weights[i]);
+    }
+    if ((ret = checkAgainstModel (&list, has, weights, n)))
+        return ret;
+
+    /* a mix of small nudges, big moves, removals, and re-insertions */
+    for (i=0; i<5000; ++i)
+    {
+        const tr_piece_index_t piece = tr_cryptoWeakRandInt (n);
+
+        switch (tr_cryptoWeakRandInt (4))
+        {
+            case 0:
+                has[piece] = false;
+                tr_pieceListRemove (&list, piece);
+                break;
+
+            case 1:
+                weights[piece] = tr_cryptoWeakRandInt (1000);
+                has[piece] = true;
+                tr_pieceListSet (&list, piece, weights[piece]);
+                break;
+
+            default:
+                if (has[piece])
+                {
+                    weights[piece] += tr_cryptoWeakRandInt (3);
+                    weights[piece] -= weights[piece] ? 1 : 0;
+                    tr_pieceListSet (&list, piece, weights[piece]);
+                }
+                break;
+        }
+
+        if ((i % 250) == 0)
+            if ((ret = checkAgainstModel (&list, has, weights, n)))
+                return ret;
+    }
+
+    if ((ret = checkAgainstModel (&list, has, weights, n)))
+        return ret;
+
+    tr_pieceListDestruct (&list);
+    return 0;
+}
+
+static int
+test_assign (void)
+{
+    int ret;
+    tr_piece_index_t i;
+    tr_piece_index_t count = 0;
+    const tr_piece_index_t n = 300;
+    tr_piece_list list;
+    bool has[300];
+    uint64_t weights[300];
+    tr_piece_index_t pieces[300];
+    uint64_t assigned[300];
+
+    tr_pieceListConstruct (&list, n);
+    memset (has, 0, sizeof (has));
+
+    /* the old contents get replaced */
+    tr_pieceListSet (&list, 0, 5);
+    tr_pieceListSet (&list, 1, 5);
+
+    /* assign every third piece, in no particular order */
+    for (i=n; i-- > 0; )
+    {
+        weights[i] = tr_cryptoWeakRandInt (50);
+        if ((i % 3) == 0)
+        {
+            has[i] = true;
+            pieces[count] = i;
+            assigned[count] = weights[i];
+            ++count;
+        }
+    }
+    tr_pieceListAssign (&list, pieces, assigned, count);
+    if ((ret = checkAgainstModel (&list, has, weights, n)))
+        return ret;
+
+    /* the tree it builds should hold up under further changes */
+    for (i=0; i<2000; ++i)
+    {
+        const tr_piece_index_t piece = tr_cryptoWeakRandInt (n);
+
+        if (tr_cryptoWeakRandInt (3) == 0)
+        {
+            has[piece] = false;
+            tr_pieceListRemove (&list, piece);
+        }
+        else
+        {
+            has[piece] = true;
+            weights[piece] = tr_cryptoWeakRandInt (50);
+            tr_pieceListSet (&list, piece, weights[piece]);
+        }
+    }
+    if ((ret = checkAgainstModel (&list, has, weights, n)))
+        return ret;
+
+    tr_pieceListAssign (&list, pieces, assigned, 0);
+    check_int_eq (0, tr_pieceListSize (&list));
+    check_int_eq (TR_PIECE_LIST_END, tr_pieceListFirst (&list));
+
+    tr_pieceListDestruct (&list);
+    return 0;
+}
+
+/***
+****  Benchmark: run with --benchmark
+****
+****  Simulates the replication churn that peer-mgr's request list sees
+****  from peers joining with bitfields and sending HAVEs, with a request
+****  walk over the head of the list after every few events.
+***/
+
+enum
+{
+    BENCH_PIECES = 100000,
+    BENCH_PEERS = 200,
+    BENCH_HAVES = 100000,
+    BENCH_EVENTS_PER_WALK = 8,
+    BENCH_WALK_LENGTH = 64
+};
+
+static uint16_t * benchRep;
+static int16_t * benchSalt;
+
+static uint64_t
+benchWeight (tr_piece_index_t piece)
+{
+    return ((uint64_t)benchRep[piece] << 12) | (uint64_t)benchSalt[piece];
+}
+
+static int
+compareBenchPieces (const void * va, const void * vb)
+{
+    const tr_piece_index_t a = *(const tr_piece_index_t*)va;
+    const tr_piece_index_t b = *(const tr_piece_index_t*)vb;
+    const uint64_t wa = benchWeight (a);
+    const uint64_t wb = benchWeight (b);
+
+    if (wa != wb)
+        return wa < wb ? -1 : 1;
+    return a < b ? -1 : (a > b);
+}
+
+/* the old approach: a sorted array that's re-sorted when a bitfield
+ * arrives, and whose pieces are found by linear search and moved
+ * with memmove () when a HAVE arrives */
+static uint64_t
+benchSortedArray (const tr_piece_index_t * events, int eventCount, uint64_t * checksum)
+{
+    int e;
+    bool sorted = false;
+    tr_piece_index_t * pieces = tr_new (tr_piece_index_t, BENCH_PIECES);
+    const uint64_t begin = tr_time_msec ();
+
+    for (e=0; e<BENCH_PIECES; ++e)
+        pieces[e] = e;
+
+    for (e=0; e<eventCount; ++e)
+    {
+        const tr_piece_index_t ev = events[e];
+
+        if (ev == TR_PIECE_LIST_END) /* a peer's bitfield */
+        {
+            tr_piece_index_t i;
+            for (i=0; i<BENCH_PIECES; i+=2)
+                ++benchRep[i];
+            sorted = false;
+        }
+        else if (sorted) /* a HAVE */
+        {
+            int pos;
+            bool exact;
+            tr_piece_index_t tmp;
+
+            for (pos=0; pieces[pos]!=ev; ++pos) { }
+            ++benchRep[ev];
+            tmp = pieces[pos];
+            memmove (pieces+pos, pieces+pos+1, sizeof (tr_piece_index_t) * (BENCH_PIECES-pos-1));
+            pos = tr_lowerBound (&tmp, pieces, BENCH_PIECES-1, sizeof (tr_piece_index_t), compareBenchPieces, &exact);
+            memmove (pieces+pos+1, pieces+pos, sizeof (tr_piece_index_t) * (BENCH_PIECES-1-pos));
+            pieces[pos] = tmp;
+        }
+        else
+        {
+            ++benchRep[ev];
+        }
+
+        if ((e % BENCH_EVENTS_PER_WALK) == 0)
+        {
+            int i;
+
+            if (!sorted)
+            {
+                qsort (pieces, BENCH_PIECES, sizeof (tr_piece_index_t), compareBenchPieces);
+                sorted = true;
+            }
+
+            for (i=0; i<BENCH_WALK_LENGTH; ++i)
+                *checksum += pieces[i];
+        }
+    }
+
+    tr_free (pieces);
+    return tr_time_msec () - begin;
+}
+
+static uint64_t
+benchPieceList (const tr_piece_index_t * events, int eventCount, uint64_t * checksum)
+{
+    int e;
+    tr_piece_index_t i;
+    tr_piece_list list;
+    bool valid = false;
+    tr_piece_index_t * pieces = tr_new (tr_piece_index_t, BENCH_PIECES);
+    uint64_t * weights = tr_new (uint64_t, BENCH_PIECES);
+    const uint64_t begin = tr_time_msec ();
+
+    tr_pieceListConstruct (&list, BENCH_PIECES);
+    for (i=0; i<BENCH_PIECES; ++i)
+        pieces[i] = i;
+
+    for (e=0; e<eventCount; ++e)
+    {
+        const tr_piece_index_t ev = events[e];
+
+        /* like peer-mgr, re-weight the whole list only once after
+         * a big bitfield, rather than once per piece it touches */
+        if (ev == TR_PIECE_LIST_END)
+        {
+            for (i=0; i<BENCH_PIECES; i+=2)
+                ++benchRep[i];
+            valid = false;
+        }
+        else
+        {
+            ++benchRep[ev];
+            if (valid)
+                tr_pieceListSet (&list, ev, benchWeight (ev));
+        }
+
+        if ((e % BENCH_EVENTS_PER_WALK) == 0)
+        {
+            int n;
+            tr_piece_index_t piece;
+
+            if (!valid)
+            {
+                /* like peer-mgr, start from the old order */
+                for (i=0, piece=tr_pieceListFirst (&list); piece!=TR_PIECE_LIST_END; ++i, piece=tr_pieceListNext (&list, piece))
+                    pieces[i] = piece;
+                for (i=0; i<BENCH_PIECES; ++i)
+                    weights[i] = benchWeight (pieces[i]);
+                tr_pieceListAssign (&list, pieces, weights, BENCH_PIECES);
+                valid = true;
+            }
+
+            for (n=0, piece=tr_pieceListFirst (&list); n<BENCH_WALK_LENGTH; ++n, piece=tr_pieceListNext (&list, piece))
+                *checksum += piece;
+        }
+    }
+
+    tr_pieceListDestruct (&list);
+    tr_free (weights);
+    tr_free (pieces);
+    return tr_time_msec () - begin;
+}
+
+static void
+benchmark_run (const char * label, const tr_piece_index_t * events, int eventCount)
+{
+    uint64_t msecArray;
+    uint64_t msecList;
+    uint64_t sumArray = 0;
+    uint64_t sumList = 0;
+
+    memset (benchRep, 0, sizeof (uint16_t) * BENCH_PIECES);
+    msecArray = benchSortedArray (events, eventCount, &sumArray);
+
+    memset (benchRep, 0, sizeof (uint16_t) * BENCH_PIECES);
+    msecList = benchPieceList (events, eventCount, &sumList);
+
+    fprintf (stderr, "%-22s sorted array %6" PRIu64 " msec, tr_piece_list %6" PRIu64 " msec\n",
+             label, msecArray, msecList);
+
+    if (sumArray != sumList)
+        fprintf (stderr, "warning: the two walks disagree\n");
+}
+
+static void
+benchmark_churn (void)
+{
+    int i;
+    const int eventCount = BENCH_PEERS + BENCH_HAVES;
+    tr_piece_index_t * events = tr_new (tr_piece_index_t, eventCount);
+
+    benchRep = tr_new0 (uint16_t, BENCH_PIECES);
+    benchSalt = tr_new (int16_t, BENCH_PIECES);
+    for (i=0; i<BENCH_PIECES; ++i)
+        benchSalt[i] = tr_cryptoWeakRandInt (4096);
+
+    fprintf (stderr, "%d pieces, %d HAVEs, %d bitfields, a %d-piece walk every %d events\n",
+             BENCH_PIECES, BENCH_HAVES, BENCH_PEERS, BENCH_WALK_LENGTH, BENCH_EVENTS_PER_WALK);
+
+    /* HAVEs only */
+    for (i=0; i<BENCH_HAVES; ++i)
+        events[i] = tr_cryptoWeakRandInt (BENCH_PIECES);
+    benchmark_run ("HAVEs:", events, BENCH_HAVES);
+
+    /* interleave the peers' bitfields among the HAVEs */
+    for (i=0; i<eventCount; ++i)
+        if ((i % (eventCount / BENCH_PEERS)) == 0)
+            events[i] = TR_PIECE_LIST_END;
+        else
+            events[i] = tr_cryptoWeakRandInt (BENCH_PIECES);
+    benchmark_run ("HAVEs + bitfields:", events, eventCount);
+
+    tr_free (benchSalt);
+    tr_free (benchRep);
+    tr_free (events);
+}
+
+int
+main (int argc, char ** argv)
+{
+    int ret;
+    const testFunc tests[] = { test_empty, test_order, test_assign };
+
+    if ((ret = runTests (tests, NUM_TESTS (tests))))
+        return ret;
+
+    if ((argc > 1) && !strcmp (argv[1], "--benchmark"))
+        benchmark_churn ();
+
+    return 0;
+}
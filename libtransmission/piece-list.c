@@ -0,0 +1,385 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+#include <stdlib.h> /* qsort () */
+
+#include "transmission.h"
+#include "piece-list.h"
+#include "utils.h"
+
+struct tr_piece_list_node
+{
+    uint64_t          weight;
+    tr_piece_index_t  left;
+    tr_piece_index_t  right;
+    tr_piece_index_t  parent;
+    bool              isMember;
+};
+
+#define NONE TR_PIECE_LIST_END
+
+/* A treap needs heap priorities that are unrelated to its keys.
+ * Rather than store a random number in every node, hash the piece
+ * index with murmur3's finalizer, which is a bijection and so never
+ * gives two pieces the same priority. */
+static inline uint32_t
+getHeapPriority (tr_piece_index_t piece)
+{
+    uint32_t h = piece;
+
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
+}
+
+static inline bool
+isLess (const tr_piece_list * list, tr_piece_index_t a, tr_piece_index_t b)
+{
+    const uint64_t wa = list->nodes[a].weight;
+    const uint64_t wb = list->nodes[b].weight;
+
+    return (wa < wb) || ((wa == wb) && (a < b));
+}
+
+/* swap x with its parent, keeping the in-order sequence intact */
+static void
+rotateUp (tr_piece_list * list, tr_piece_index_t x)
+{
+    struct tr_piece_list_node * nodes = list->nodes;
+    const tr_piece_index_t p = nodes[x].parent;
+    const tr_piece_index_t g = nodes[p].parent;
+
+    if (nodes[p].left == x)
+    {
+        nodes[p].left = nodes[x].right;
+        if (nodes[x].right != NONE)
+            nodes[nodes[x].right].parent = p;
+        nodes[x].right = p;
+    }
+    else
+    {
+        nodes[p].right = nodes[x].left;
+        if (nodes[x].left != NONE)
+            nodes[nodes[x].left].parent = p;
+        nodes[x].left = p;
+    }
+
+    nodes[p].parent = x;
+    nodes[x].parent = g;
+
+    if (g == NONE)
+        list->root = x;
+    else if (nodes[g].left == p)
+        nodes[g].left = x;
+    else
+        nodes[g].right = x;
+}
+
+static void
+insertNode (tr_piece_list * list, tr_piece_index_t piece, uint64_t weight)
+{
+    struct tr_piece_list_node * nodes = list->nodes;
+    tr_piece_index_t parent = NONE;
+    tr_piece_index_t walk = list->root;
+    const uint32_t priority = getHeapPriority (piece);
+
+    nodes[piece].weight = weight;
+    nodes[piece].left = NONE;
+    nodes[piece].right = NONE;
+    nodes[piece].isMember = true;
+
+    /* add it as a leaf... */
+    while (walk != NONE)
+    {
+        parent = walk;
+        walk = isLess (list, piece, walk) ? nodes[walk].left : nodes[walk].right;
+    }
+
+    nodes[piece].parent = parent;
+    if (parent == NONE)
+        list->root = piece;
+    else if (isLess (list, piece, parent))
+        nodes[parent].left = piece;
+    else
+        nodes[parent].right = piece;
+
+    /* ...then float it up to where its priority belongs */
+    while ((nodes[piece].parent != NONE)
+        && (getHeapPriority (nodes[piece].parent) < priority))
+        rotateUp (list, piece);
+
+    ++list->size;
+}
+
+static void
+removeNode (tr_piece_list * list, tr_piece_index_t piece)
+{
+    struct tr_piece_list_node * nodes = list->nodes;
+    tr_piece_index_t parent;
+
+    /* sink it down to a leaf... */
+    for (;;)
+    {
+        tr_piece_index_t child;
+        const tr_piece_index_t left = nodes[piece].left;
+        const tr_piece_index_t right = nodes[piece].right;
+
+        if (left == NONE && right == NONE)
+            break;
+
+        if (left == NONE)
+            child = right;
+        else if (right == NONE)
+            child = left;
+        else
+            child = getHeapPriority (left) > getHeapPriority (right) ? left : right;
+
+        rotateUp (list, child);
+    }
+
+    /* ...then snip it off */
+    parent = nodes[piece].parent;
+    if (parent == NONE)
+        list->root = NONE;
+    else if (nodes[parent].left == piece)
+        nodes[parent].left = NONE;
+    else
+        nodes[parent].right = NONE;
+
+    nodes[piece].isMember = false;
+    --list->size;
+}
+
+static tr_piece_index_t
+getPrev (const tr_piece_list * list, tr_piece_index_t piece)
+{
+    const struct tr_piece_list_node * nodes = list->nodes;
+
+    if (nodes[piece].left != NONE)
+    {
+        piece = nodes[piece].left;
+        while (nodes[piece].right != NONE)
+            piece = nodes[piece].right;
+        return piece;
+    }
+
+    while ((nodes[piece].parent != NONE) && (nodes[nodes[piece].parent].left == piece))
+        piece = nodes[piece].parent;
+
+    return nodes[piece].parent;
+}
+
+/***
+****
+***/
+
+void
+tr_pieceListConstruct (tr_piece_list * list, tr_piece_index_t pieceCount)
+{
+    list->nodes = tr_new (struct tr_piece_list_node, pieceCount);
+    list->nodeCount = pieceCount;
+    tr_pieceListClear (list);
+}
+
+void
+tr_pieceListDestruct (tr_piece_list * list)
+{
+    tr_free (list->nodes);
+    list->nodes = NULL;
+    list->nodeCount = 0;
+    list->size = 0;
+    list->root = NONE;
+}
+
+void
+tr_pieceListClear (tr_piece_list * list)
+{
+    tr_piece_index_t i;
+
+    for (i=0; i<list->nodeCount; ++i)
+        list->nodes[i].isMember = false;
+
+    list->size = 0;
+    list->root = NONE;
+}
+
+struct sort_entry
+{
+    uint64_t weight;
+    tr_piece_index_t piece;
+};
+
+static int
+compareSortEntries (const void * va, const void * vb)
+{
+    const struct sort_entry * a = va;
+    const struct sort_entry * b = vb;
+
+    if (a->weight != b->weight)
+        return a->weight < b->weight ? -1 : 1;
+    if (a->piece != b->piece)
+        return a->piece < b->piece ? -1 : 1;
+    return 0;
+}
+
+void
+tr_pieceListAssign (tr_piece_list          * list,
+                    const tr_piece_index_t * pieces,
+                    const uint64_t         * weights,
+                    tr_piece_index_t         n)
+{
+    tr_piece_index_t i;
+    tr_piece_index_t depth = 0;
+    tr_piece_index_t * stack;
+    struct sort_entry * sorted;
+    struct tr_piece_list_node * nodes = list->nodes;
+
+    tr_pieceListClear (list);
+
+    if (n == 0)
+        return;
+
+    sorted = tr_new (struct sort_entry, n);
+    for (i=0; i<n; ++i)
+    {
+        assert (pieces[i] < list->nodeCount);
+        sorted[i].weight = weights[i];
+        sorted[i].piece = pieces[i];
+    }
+    qsort (sorted, n, sizeof (struct sort_entry), compareSortEntries);
+
+    /* build the treap from the sorted pieces in one pass. The stack holds
+     * the rightmost spine; each piece becomes the right child of the last
+     * spine node that outranks it, adopting whatever it outranks as its
+     * left subtree */
+    stack = tr_new (tr_piece_index_t, n);
+    for (i=0; i<n; ++i)
+    {
+        const tr_piece_index_t piece = sorted[i].piece;
+        const uint32_t priority = getHeapPriority (piece);
+        tr_piece_index_t last = NONE;
+
+        assert (!nodes[piece].isMember);
+
+        nodes[piece].weight = sorted[i].weight;
+        nodes[piece].right = NONE;
+        nodes[piece].isMember = true;
+
+        while ((depth > 0) && (getHeapPriority (stack[depth-1]) < priority))
+            last = stack[--depth];
+
+        nodes[piece].left = last;
+        if (last != NONE)
+            nodes[last].parent = piece;
+
+        if (depth > 0)
+        {
+            nodes[piece].parent = stack[depth-1];
+            nodes[stack[depth-1]].right = piece;
+        }
+        else
+        {
+            nodes[piece].parent = NONE;
+        }
+
+        stack[depth++] = piece;
+    }
+
+    list->root = stack[0];
+    list->size = n;
+
+    tr_free (stack);
+    tr_free (sorted);
+}
+
+bool
+tr_pieceListHas (const tr_piece_list * list, tr_piece_index_t piece)
+{
+    return (piece < list->nodeCount) && list->nodes[piece].isMember;
+}
+
+void
+tr_pieceListSet (tr_piece_list * list, tr_piece_index_t piece, uint64_t weight)
+{
+    struct tr_piece_list_node * node;
+
+    assert (piece < list->nodeCount);
+
+    node = list->nodes + piece;
+
+    if (node->isMember)
+    {
+        tr_piece_index_t prev;
+        tr_piece_index_t next;
+
+        if (node->weight == weight)
+            return;
+
+        /* most changes are small nudges that don't reorder anything,
+         * so check the neighbors before doing any real work */
+        prev = getPrev (list, piece);
+        next = tr_pieceListNext (list, piece);
+        node->weight = weight;
+        if (((prev == NONE) || isLess (list, prev, piece))
+            && ((next == NONE) || isLess (list, piece, next)))
+            return;
+
+        removeNode (list, piece);
+    }
+
+    insertNode (list, piece, weight);
+}
+
+void
+tr_pieceListRemove (tr_piece_list * list, tr_piece_index_t piece)
+{
+    if (tr_pieceListHas (list, piece))
+        removeNode (list, piece);
+}
+
+tr_piece_index_t
+tr_pieceListFirst (const tr_piece_list * list)
+{
+    tr_piece_index_t piece = list->root;
+
+    if (piece != NONE)
+        while (list->nodes[piece].left != NONE)
+            piece = list->nodes[piece].left;
+
+    return piece;
+}
+
+tr_piece_index_t
+tr_pieceListNext (const tr_piece_list * list, tr_piece_index_t piece)
+{
+    const struct tr_piece_list_node * nodes = list->nodes;
+
+    assert (tr_pieceListHas (list, piece));
+
+    if (nodes[piece].right != NONE)
+    {
+        piece = nodes[piece].right;
+        while (nodes[piece].left != NONE)
+            piece = nodes[piece].left;
+        return piece;
+    }
+
+    while ((nodes[piece].parent != NONE) && (nodes[nodes[piece].parent].right == piece))
+        piece = nodes[piece].parent;
+
+    return nodes[piece].parent;
+}
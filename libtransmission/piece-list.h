@@ -0,0 +1,94 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_PIECE_LIST_H
+#define TR_PIECE_LIST_H
+
+#include "transmission.h"
+
+/**
+ * @addtogroup utils Utilities
+ * @{
+ */
+
+/**
+ * An ordered set of a torrent's piece indices, each with a weight that
+ * the caller computes. Pieces are kept sorted by weight, lowest first,
+ * and ties are broken by piece index.
+ *
+ * This is a treap whose nodes are indexed by piece, so looking up a piece
+ * is O(1), while adding, removing, or re-weighting a single piece is
+ * O(log n) expected. That lets peer-mgr keep its request list sorted as
+ * HAVEs and requests trickle in, instead of re-sorting the whole list.
+ */
+typedef struct tr_piece_list
+{
+    /* these are PRIVATE IMPLEMENTATION details included for composition only.
+     * Don't access these directly! */
+
+    struct tr_piece_list_node * nodes;
+    tr_piece_index_t            nodeCount;
+    tr_piece_index_t            size;
+    tr_piece_index_t            root;
+}
+tr_piece_list;
+
+/** @brief returned by tr_pieceListFirst () and tr_pieceListNext () at the end of the list */
+#define TR_PIECE_LIST_END ((tr_piece_index_t)-1)
+
+/** @brief initialize an empty list that can hold pieces [0...pieceCount) */
+void tr_pieceListConstruct (tr_piece_list * list, tr_piece_index_t pieceCount);
+
+void tr_pieceListDestruct (tr_piece_list * list);
+
+/** @brief remove every piece from the list */
+void tr_pieceListClear (tr_piece_list * list);
+
+/**
+ * @brief replace the list's contents with these pieces and weights.
+ *
+ * This sorts once and builds the tree in a single pass, so it's much
+ * cheaper than calling tr_pieceListSet () for every piece when most
+ * of the weights have changed at once.
+ */
+void tr_pieceListAssign (tr_piece_list          * list,
+                         const tr_piece_index_t * pieces,
+                         const uint64_t         * weights,
+                         tr_piece_index_t         n);
+
+bool tr_pieceListHas (const tr_piece_list * list, tr_piece_index_t piece);
+
+/** @brief add the piece with the given weight, or move it if it's already in the list */
+void tr_pieceListSet (tr_piece_list * list, tr_piece_index_t piece, uint64_t weight);
+
+/** @brief remove the piece from the list. It's not an error if it isn't there */
+void tr_pieceListRemove (tr_piece_list * list, tr_piece_index_t piece);
+
+/** @return the lowest-weighted piece, or TR_PIECE_LIST_END if the list is empty */
+tr_piece_index_t tr_pieceListFirst (const tr_piece_list * list);
+
+/** @return the piece after this one, or TR_PIECE_LIST_END */
+tr_piece_index_t tr_pieceListNext (const tr_piece_list * list, tr_piece_index_t piece);
+
+static inline tr_piece_index_t
+tr_pieceListSize (const tr_piece_list * list)
+{
+    return list->size;
+}
+
+/* @} */
+
+#endif
@@ -3,6 +3,7 @@
 #include <string.h> /* memcmp() */
 
 #include "transmission.h"
+#include "platform.h" /* tr_lock */
 #include "ptrarray.h"
 #include "quark.h"
 #include "utils.h" /* tr_memdup(), tr_strndup() */
@@ -50,6 +51,9 @@ static const struct tr_key_struct my_static[] =
   { "blocks", 6 },
   { "bytesCompleted", 14 },
   { "cache-size-mb", 13 },
+  { "cachedBytes", 11 },
+  { "cachedPieces", 12 },
+  { "changed-since", 13 },
   { "clientIsChoked", 14 },
   { "clientIsInterested", 18 },
   { "clientName", 10 },
@@ -71,6 +75,7 @@ static const struct tr_key_struct my_static[] =
   { "dateCreated", 11 },
   { "delete-local-data", 17 },
   { "desiredAvailable", 16 },
+  { "desiredReqsToPeer", 17 },
   { "destination", 11 },
   { "dht-enabled", 11 },
   { "display-name", 12 },
@@ -100,8 +105,11 @@ static const struct tr_key_struct my_static[] =
   { "error", 5 },
   { "errorString", 11 },
   { "eta", 3 },
+  { "evictions", 9 },
   { "failure reason", 14 },
   { "fields", 6 },
+  { "file-cache-stats", 16 },
+  { "fileLimit", 9 },
   { "fileStats", 9 },
   { "filename", 8 },
   { "files", 5 },
@@ -127,6 +135,8 @@ static const struct tr_key_struct my_static[] =
   { "have", 4 },
   { "haveUnchecked", 13 },
   { "haveValid", 9 },
+  { "hitBytes", 8 },
+  { "hits", 4 },
   { "honorsSessionLimits", 19 },
   { "host", 4 },
   { "id", 2 },
@@ -169,6 +179,7 @@ static const struct tr_key_struct my_static[] =
   { "leecherCount", 12 },
   { "leftUntilDone", 13 },
   { "length", 6 },
+  { "load-threads", 12 },
   { "location", 8 },
   { "lpd-enabled", 11 },
   { "m", 1 },
@@ -192,16 +203,20 @@ static const struct tr_key_struct my_static[] =
   { "method", 6 },
   { "min interval", 12 },
   { "min_request_interval", 20 },
+  { "missBytes", 9 },
+  { "misses", 6 },
   { "move", 4 },
   { "msg_type", 8 },
   { "mtimes", 6 },
   { "name", 4 },
   { "name.utf-8", 10 },
+  { "newConnections", 14 },
   { "nextAnnounceTime", 16 },
   { "nextScrapeTime", 14 },
   { "nodes", 5 },
   { "nodes6", 6 },
   { "open-dialog-dir", 15 },
+  { "openFiles", 9 },
   { "p", 1 },
   { "path", 4 },
   { "path.utf-8", 10 },
@@ -226,6 +241,7 @@ static const struct tr_key_struct my_static[] =
   { "peersFrom", 9 },
   { "peersGettingFromUs", 18 },
   { "peersSendingToUs", 16 },
+  { "pendingReqsToPeer", 17 },
   { "percentDone", 11 },
   { "pex-enabled", 11 },
   { "piece", 5 },
@@ -261,6 +277,8 @@ static const struct tr_key_struct my_static[] =
   { "ratio-limit", 11 },
   { "ratio-limit-enabled", 19 },
   { "ratio-mode", 10 },
+  { "read-cache-size-mb", 18 },
+  { "read-cache-stats", 16 },
   { "recent-download-dir-1", 21 },
   { "recent-download-dir-2", 21 },
   { "recent-download-dir-3", 21 },
@@ -275,7 +293,10 @@ static const struct tr_key_struct my_static[] =
   { "removed", 7 },
   { "rename-partial-files", 20 },
   { "reqq", 4 },
+  { "requests", 8 },
   { "result", 6 },
+  { "reusedRequests", 14 },
+  { "revision", 8 },
   { "rpc-authentication-required", 27 },
   { "rpc-bind-address", 16 },
   { "rpc-enabled", 11 },
@@ -287,6 +308,7 @@ static const struct tr_key_struct my_static[] =
   { "rpc-version-minimum", 19 },
   { "rpc-whitelist", 13 },
   { "rpc-whitelist-enabled", 21 },
+  { "rtt", 3 },
   { "scrape", 6 },
   { "scrape-paused-torrents-enabled", 30 },
   { "scrapeState", 11 },
@@ -319,6 +341,7 @@ static const struct tr_key_struct my_static[] =
   { "size-bytes", 10 },
   { "size-units", 10 },
   { "sizeWhenDone", 12 },
+  { "snapshot-enabled", 16 },
   { "sort-mode", 9 },
   { "sort-reversed", 13 },
   { "speed", 5 },
@@ -381,11 +404,14 @@ static const struct tr_key_struct my_static[] =
   { "ut_recommend", 12 },
   { "utp-enabled", 11 },
   { "v", 1 },
+  { "verify-threads", 14 },
   { "version", 7 },
   { "wanted", 6 },
   { "warning message", 15 },
   { "watch-dir", 9 },
   { "watch-dir-enabled", 17 },
+  { "web-connections-per-host", 24 },
+  { "web-stats", 9 },
   { "webseeds", 8 },
   { "webseedsSendingToUs", 19 }
 };
@@ -419,6 +445,28 @@ compareKeys (const void * va, const void * vb)
 
 static tr_ptrArray my_runtime = TR_PTR_ARRAY_INIT_STATIC;
 
+/* parsing benc and json adds runtime quarks for unknown keys, and that
+ * can happen on several threads at once, e.g. when loading torrents
+ * at startup. The static keys never change, so they don't need it. */
+static tr_lock * runtime_lock = NULL;
+
+void
+tr_quark_init (void)
+{
+  if (runtime_lock == NULL)
+    runtime_lock = tr_lockNew ();
+}
+
+/* creating the lock here is only safe while there's one thread,
+ * which is why tr_sessionInit () calls tr_quark_init () up front */
+static tr_lock *
+getRuntimeLock (void)
+{
+  tr_quark_init ();
+
+  return runtime_lock;
+}
+
 bool
 tr_quark_lookup (const void * str, size_t len, tr_quark * setme)
 {
@@ -441,20 +489,27 @@ tr_quark_lookup (const void * str, size_t len, tr_quark * setme)
     }
 
   /* was it added during runtime? */
-  if (!success && !tr_ptrArrayEmpty(&my_runtime))
+  if (!success)
     {
-      size_t i;
-      struct tr_key_struct ** runtime = (struct tr_key_struct **) tr_ptrArrayBase (&my_runtime);
-      const size_t n_runtime = tr_ptrArraySize (&my_runtime);
-      for (i=0; i<n_runtime; ++i)
+      tr_lockLock (getRuntimeLock ());
+
+      if (!tr_ptrArrayEmpty(&my_runtime))
         {
-          if (compareKeys (&tmp, runtime[i]) == 0)
+          size_t i;
+          struct tr_key_struct ** runtime = (struct tr_key_struct **) tr_ptrArrayBase (&my_runtime);
+          const size_t n_runtime = tr_ptrArraySize (&my_runtime);
+          for (i=0; i<n_runtime; ++i)
             {
-              *setme = TR_N_KEYS + i;
-              success = true;
-              break;
+              if (compareKeys (&tmp, runtime[i]) == 0)
+                {
+                  *setme = TR_N_KEYS + i;
+                  success = true;
+                  break;
+                }
             }
         }
+
+      tr_lockUnlock (getRuntimeLock ());
     }
 
   return success;
@@ -484,7 +539,14 @@ tr_quark_new (const void * str, size_t len)
     len = strlen (str);
 
   if (!tr_quark_lookup (str, len, &ret))
-    ret = append_new_quark (str, len);
+    {
+      /* look again with the lock held, so that two threads
+         can't each append the same new key */
+      tr_lockLock (getRuntimeLock ());
+      if (!tr_quark_lookup (str, len, &ret))
+        ret = append_new_quark (str, len);
+      tr_lockUnlock (getRuntimeLock ());
+    }
 
   return ret;
 }
@@ -495,9 +557,15 @@ tr_quark_get_string (tr_quark q, size_t * len)
   const struct tr_key_struct * tmp;
 
   if (q < TR_N_KEYS)
-    tmp = &my_static[q];
+    {
+      tmp = &my_static[q];
+    }
   else
-    tmp = tr_ptrArrayNth (&my_runtime, q-TR_N_KEYS);
+    {
+      tr_lockLock (getRuntimeLock ());
+      tmp = tr_ptrArrayNth (&my_runtime, q-TR_N_KEYS);
+      tr_lockUnlock (getRuntimeLock ());
+    }
 
   if (len != NULL)
     *len = tmp->len;
@@ -60,6 +60,9 @@ enum
   TR_KEY_blocks,
   TR_KEY_bytesCompleted,
   TR_KEY_cache_size_mb,
+  TR_KEY_cachedBytes,
+  TR_KEY_cachedPieces,
+  TR_KEY_changed_since,
   TR_KEY_clientIsChoked,
   TR_KEY_clientIsInterested,
   TR_KEY_clientName,
@@ -81,6 +84,7 @@ enum
   TR_KEY_dateCreated,
   TR_KEY_delete_local_data,
   TR_KEY_desiredAvailable,
+  TR_KEY_desiredReqsToPeer,
   TR_KEY_destination,
   TR_KEY_dht_enabled,
   TR_KEY_display_name,
@@ -110,8 +114,11 @@ enum
   TR_KEY_error,
   TR_KEY_errorString,
   TR_KEY_eta,
+  TR_KEY_evictions,
   TR_KEY_failure_reason,
   TR_KEY_fields,
+  TR_KEY_file_cache_stats,
+  TR_KEY_fileLimit,
   TR_KEY_fileStats,
   TR_KEY_filename,
   TR_KEY_files,
@@ -137,6 +144,8 @@ enum
   TR_KEY_have,
   TR_KEY_haveUnchecked,
   TR_KEY_haveValid,
+  TR_KEY_hitBytes,
+  TR_KEY_hits,
   TR_KEY_honorsSessionLimits,
   TR_KEY_host,
   TR_KEY_id,
@@ -179,6 +188,7 @@ enum
   TR_KEY_leecherCount,
   TR_KEY_leftUntilDone,
   TR_KEY_length,
+  TR_KEY_load_threads,
   TR_KEY_location,
   TR_KEY_lpd_enabled,
   TR_KEY_m,
@@ -202,16 +212,20 @@ enum
   TR_KEY_method,
   TR_KEY_min_interval,
   TR_KEY_min_request_interval,
+  TR_KEY_missBytes,
+  TR_KEY_misses,
   TR_KEY_move,
   TR_KEY_msg_type,
   TR_KEY_mtimes,
   TR_KEY_name,
   TR_KEY_name_utf_8,
+  TR_KEY_newConnections,
   TR_KEY_nextAnnounceTime,
   TR_KEY_nextScrapeTime,
   TR_KEY_nodes,
   TR_KEY_nodes6,
   TR_KEY_open_dialog_dir,
+  TR_KEY_openFiles,
   TR_KEY_p,
   TR_KEY_path,
   TR_KEY_path_utf_8,
@@ -236,6 +250,7 @@ enum
   TR_KEY_peersFrom,
   TR_KEY_peersGettingFromUs,
   TR_KEY_peersSendingToUs,
+  TR_KEY_pendingReqsToPeer,
   TR_KEY_percentDone,
   TR_KEY_pex_enabled,
   TR_KEY_piece,
@@ -271,6 +286,8 @@ enum
   TR_KEY_ratio_limit,
   TR_KEY_ratio_limit_enabled,
   TR_KEY_ratio_mode,
+  TR_KEY_read_cache_size_mb,
+  TR_KEY_read_cache_stats,
   TR_KEY_recent_download_dir_1,
   TR_KEY_recent_download_dir_2,
   TR_KEY_recent_download_dir_3,
@@ -285,7 +302,10 @@ enum
   TR_KEY_removed,
   TR_KEY_rename_partial_files,
   TR_KEY_reqq,
+  TR_KEY_requests,
   TR_KEY_result,
+  TR_KEY_reusedRequests,
+  TR_KEY_revision,
   TR_KEY_rpc_authentication_required,
   TR_KEY_rpc_bind_address,
   TR_KEY_rpc_enabled,
@@ -297,6 +317,7 @@ enum
   TR_KEY_rpc_version_minimum,
   TR_KEY_rpc_whitelist,
   TR_KEY_rpc_whitelist_enabled,
+  TR_KEY_rtt,
   TR_KEY_scrape,
   TR_KEY_scrape_paused_torrents_enabled,
   TR_KEY_scrapeState,
@@ -329,6 +350,7 @@ enum
   TR_KEY_size_bytes,
   TR_KEY_size_units,
   TR_KEY_sizeWhenDone,
+  TR_KEY_snapshot_enabled,
   TR_KEY_sort_mode,
   TR_KEY_sort_reversed,
   TR_KEY_speed,
@@ -391,11 +413,14 @@ enum
   TR_KEY_ut_recommend,
   TR_KEY_utp_enabled,
   TR_KEY_v,
+  TR_KEY_verify_threads,
   TR_KEY_version,
   TR_KEY_wanted,
   TR_KEY_warning_message,
   TR_KEY_watch_dir,
   TR_KEY_watch_dir_enabled,
+  TR_KEY_web_connections_per_host,
+  TR_KEY_web_stats,
   TR_KEY_webseeds,
   TR_KEY_webseedsSendingToUs,
   TR_N_KEYS
@@ -420,5 +445,12 @@ const char * tr_quark_get_string (const tr_quark quark, size_t * len);
  */
 tr_quark tr_quark_new (const void * str, size_t len);
 
+/**
+ * Set up the lock that guards quarks created at runtime. tr_sessionInit ()
+ * calls this before it starts any threads; programs that use quarks
+ * from a single thread don't need to.
+ */
+void tr_quark_init (void);
+
 
 #endif
@@ -0,0 +1,230 @@
+#include <stdio.h> /* fprintf () */
+#include <string.h> /* strcmp () */
+
+#include "transmission.h"
+#include "bitfield.h"
+#include "crypto.h" /* tr_cryptoWeakRandInt () */
+#include "rarity.h"
+#include "utils.h" /* tr_time_msec () */
+
+#include "libtransmission-test.h"
+
+enum
+{
+    PIECE_COUNT = 203, /* not a multiple of 8 or 64 */
+    PEER_COUNT = 24
+};
+
+static void
+randomBitfield (tr_bitfield * b, int percent)
+{
+    size_t i;
+
+    tr_bitfieldConstruct (b, PIECE_COUNT);
+    for (i=0; i<PIECE_COUNT; ++i)
+        if ((int)tr_cryptoWeakRandInt (100) < percent)
+            tr_bitfieldAdd (b, i);
+}
+
+/* compare against a brute-force count, and make sure the buckets
+ * hold every piece exactly once, each in the right bucket */
+static int
+checkRarity (const tr_rarity * r, tr_bitfield * peers, const bool * connected)
+{
+    int i;
+    int availability;
+    size_t seen = 0;
+    tr_piece_index_t piece;
+
+    for (piece=0; piece<PIECE_COUNT; ++piece)
+    {
+        int expected = 0;
+
+        for (i=0; i<PEER_COUNT; ++i)
+            if (connected[i] && tr_bitfieldHas (&peers[i], piece))
+                ++expected;
+
+        check_int_eq (expected, tr_rarityGet (r, piece));
+    }
+
+    for (availability=0; availability<=PEER_COUNT; ++availability)
+    {
+        size_t j;
+        size_t n;
+        const tr_piece_index_t * bucket = tr_rarityGetBucket (r, availability, &n);
+
+        for (j=0; j<n; ++j)
+            check_int_eq (availability, tr_rarityGet (r, bucket[j]));
+
+        seen += n;
+    }
+
+    check_int_eq (PIECE_COUNT, seen);
+    return 0;
+}
+
+static void
+countFunc (tr_piece_index_t piece UNUSED, void * vcount)
+{
+    ++*(size_t*)vcount;
+}
+
+static int
+test_rarity (void)
+{
+    int i;
+    int ret;
+    tr_rarity r;
+    size_t calls;
+    tr_bitfield peers[PEER_COUNT];
+    bool connected[PEER_COUNT];
+
+    tr_rarityConstruct (&r, PIECE_COUNT);
+    memset (connected, 0, sizeof (connected));
+
+    /* a mix of sparse, dense, empty, and full bitfields */
+    for (i=0; i<PEER_COUNT; ++i)
+    {
+        randomBitfield (&peers[i], (i * 17) % 101);
+        if ((i % 7) == 0)
+            tr_bitfieldSetHasAll (&peers[i]);
+        if ((i % 11) == 5)
+            tr_bitfieldSetHasNone (&peers[i]);
+    }
+
+    for (i=0; i<PEER_COUNT; ++i)
+    {
+        calls = 0;
+        connected[i] = true;
+        tr_rarityAddBitfield (&r, &peers[i], countFunc, &calls);
+
+        /* seeds are tallied without touching any pieces */
+        if (tr_bitfieldHasAll (&peers[i]))
+            check_int_eq (0, calls);
+        else
+            check_int_eq (tr_bitfieldCountTrueBits (&peers[i]), calls);
+
+        if ((ret = checkRarity (&r, peers, connected)))
+            return ret;
+    }
+
+    /* HAVEs */
+    for (i=0; i<500; ++i)
+    {
+        const int peer = tr_cryptoWeakRandInt (PEER_COUNT);
+        const tr_piece_index_t piece = tr_cryptoWeakRandInt (PIECE_COUNT);
+
+        if (!tr_bitfieldHas (&peers[peer], piece))
+        {
+            tr_bitfieldAdd (&peers[peer], piece);
+            tr_rarityAddPiece (&r, piece);
+        }
+    }
+    if ((ret = checkRarity (&r, peers, connected)))
+        return ret;
+
+    /* a peer that filled in its bitfield with HAVEs was counted piece by
+     * piece, but it still needs to come out right when it disconnects */
+    for (i=0; i<PIECE_COUNT; ++i)
+    {
+        if (!tr_bitfieldHas (&peers[1], i))
+        {
+            tr_bitfieldAdd (&peers[1], i);
+            tr_rarityAddPiece (&r, i);
+        }
+    }
+    check (tr_bitfieldHasAll (&peers[1]));
+    if ((ret = checkRarity (&r, peers, connected)))
+        return ret;
+
+    /* disconnect them in a different order */
+    for (i=PEER_COUNT; i-- > 0; )
+    {
+        tr_rarityRemoveBitfield (&r, &peers[i], NULL, NULL);
+        connected[i] = false;
+        if ((ret = checkRarity (&r, peers, connected)))
+            return ret;
+    }
+
+    for (i=0; i<PEER_COUNT; ++i)
+        tr_bitfieldDestruct (&peers[i]);
+    tr_rarityDestruct (&r);
+    return 0;
+}
+
+/***
+****  Benchmark: run with --benchmark
+****
+****  A connect storm: hundreds of peers with sparse bitfields connect,
+****  exchange HAVEs, and disconnect again.
+***/
+
+enum
+{
+    BENCH_PIECES = 100000,
+    BENCH_PEERS = 400,
+    BENCH_PERCENT = 5
+};
+
+static void
+benchmark_connect_storm (void)
+{
+    int i;
+    size_t j;
+    uint64_t begin;
+    tr_rarity r;
+    tr_bitfield * peers = tr_new (tr_bitfield, BENCH_PEERS);
+    uint16_t * naive = tr_new0 (uint16_t, BENCH_PIECES);
+
+    for (i=0; i<BENCH_PEERS; ++i)
+    {
+        tr_bitfieldConstruct (&peers[i], BENCH_PIECES);
+        for (j=0; j<BENCH_PIECES; ++j)
+            if ((int)tr_cryptoWeakRandInt (100) < BENCH_PERCENT)
+                tr_bitfieldAdd (&peers[i], j);
+    }
+
+    fprintf (stderr, "%d pieces, %d peers each with %d%% of the pieces connect and disconnect\n",
+             BENCH_PIECES, BENCH_PEERS, BENCH_PERCENT);
+
+    /* the old way: test every bit of every bitfield */
+    begin = tr_time_msec ();
+    for (i=0; i<BENCH_PEERS; ++i)
+        for (j=0; j<BENCH_PIECES; ++j)
+            if (tr_bitfieldHas (&peers[i], j))
+                ++naive[j];
+    for (i=0; i<BENCH_PEERS; ++i)
+        for (j=0; j<BENCH_PIECES; ++j)
+            if (tr_bitfieldHas (&peers[i], j))
+                --naive[j];
+    fprintf (stderr, "%-12s %6" PRIu64 " msec\n", "per-bit", tr_time_msec () - begin);
+
+    begin = tr_time_msec ();
+    tr_rarityConstruct (&r, BENCH_PIECES);
+    for (i=0; i<BENCH_PEERS; ++i)
+        tr_rarityAddBitfield (&r, &peers[i], NULL, NULL);
+    for (i=0; i<BENCH_PEERS; ++i)
+        tr_rarityRemoveBitfield (&r, &peers[i], NULL, NULL);
+    tr_rarityDestruct (&r);
+    fprintf (stderr, "%-12s %6" PRIu64 " msec\n", "tr_rarity", tr_time_msec () - begin);
+
+    for (i=0; i<BENCH_PEERS; ++i)
+        tr_bitfieldDestruct (&peers[i]);
+    tr_free (naive);
+    tr_free (peers);
+}
+
+int
+main (int argc, char ** argv)
+{
+    int ret;
+    const testFunc tests[] = { test_rarity };
+
+    if ((ret = runTests (tests, NUM_TESTS (tests))))
+        return ret;
+
+    if ((argc > 1) && !strcmp (argv[1], "--benchmark"))
+        benchmark_connect_storm ();
+
+    return 0;
+}
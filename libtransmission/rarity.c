@@ -0,0 +1,203 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+#include <stdlib.h> /* realloc () */
+#include <string.h> /* memset () */
+
+#include "transmission.h"
+#include "rarity.h"
+#include "utils.h"
+
+enum
+{
+    MAX_COUNT = 0xFFFF
+};
+
+static void
+swapPositions (tr_rarity * r, tr_piece_index_t a, tr_piece_index_t b)
+{
+    const tr_piece_index_t pa = r->order[a];
+    const tr_piece_index_t pb = r->order[b];
+
+    r->order[a] = pb;
+    r->order[b] = pa;
+    r->positions[pb] = a;
+    r->positions[pa] = b;
+}
+
+/* Moving a piece up one bucket is a swap with the last piece in its
+ * bucket, followed by moving the next bucket's start down by one. */
+static void
+incrPiece (tr_rarity * r, tr_piece_index_t piece)
+{
+    const int c = r->counts[piece];
+
+    if (c == MAX_COUNT)
+        return;
+
+    if (c + 1 == r->bucketCount)
+    {
+        if (r->bucketCount + 1 >= r->bucketAlloc)
+        {
+            r->bucketAlloc *= 2;
+            r->bucketStarts = tr_renew (tr_piece_index_t, r->bucketStarts, r->bucketAlloc);
+        }
+
+        r->bucketStarts[++r->bucketCount] = r->pieceCount;
+    }
+
+    swapPositions (r, r->positions[piece], r->bucketStarts[c+1] - 1);
+    --r->bucketStarts[c+1];
+    ++r->counts[piece];
+}
+
+/* the mirror image of incrPiece () */
+static void
+decrPiece (tr_rarity * r, tr_piece_index_t piece)
+{
+    const int c = r->counts[piece];
+
+    /* a peer that sent us duplicate HAVEs can make this happen */
+    if (c == 0)
+        return;
+
+    swapPositions (r, r->positions[piece], r->bucketStarts[c]);
+    ++r->bucketStarts[c];
+    --r->counts[piece];
+
+    while ((r->bucketCount > 1) && (r->bucketStarts[r->bucketCount-1] == r->pieceCount))
+        --r->bucketCount;
+}
+
+/* Visit each set bit in the bitfield. Peers' bitfields are often
+ * sparse, so let tr_bitfieldFindNextSet () skip over the gaps a word
+ * at a time rather than testing every piece in turn. */
+static void
+updateFromBits (tr_rarity         * r,
+                const tr_bitfield * b,
+                bool                add,
+                tr_rarity_func      func,
+                void              * user_data)
+{
+    size_t piece;
+    const size_t n = MIN (b->bit_count, r->pieceCount);
+
+    for (piece=tr_bitfieldFindNextSet (b, 0); piece<n; piece=tr_bitfieldFindNextSet (b, piece+1))
+    {
+        if (add)
+            incrPiece (r, piece);
+        else
+            decrPiece (r, piece);
+
+        if (func != NULL)
+            func (piece, user_data);
+    }
+}
+
+/***
+****
+***/
+
+void
+tr_rarityConstruct (tr_rarity * r, tr_piece_index_t pieceCount)
+{
+    tr_piece_index_t i;
+
+    r->pieceCount = pieceCount;
+    r->seedCount = 0;
+    r->counts = tr_new0 (uint16_t, pieceCount);
+    r->order = tr_new (tr_piece_index_t, pieceCount);
+    r->positions = tr_new (tr_piece_index_t, pieceCount);
+    for (i=0; i<pieceCount; ++i)
+        r->order[i] = r->positions[i] = i;
+
+    /* everything starts out in bucket 0 */
+    r->bucketAlloc = 8;
+    r->bucketCount = 1;
+    r->bucketStarts = tr_new (tr_piece_index_t, r->bucketAlloc);
+    r->bucketStarts[0] = 0;
+    r->bucketStarts[1] = pieceCount;
+}
+
+void
+tr_rarityDestruct (tr_rarity * r)
+{
+    tr_free (r->bucketStarts);
+    tr_free (r->positions);
+    tr_free (r->order);
+    tr_free (r->counts);
+    memset (r, 0, sizeof (tr_rarity));
+}
+
+void
+tr_rarityAddPiece (tr_rarity * r, tr_piece_index_t piece)
+{
+    assert (piece < r->pieceCount);
+
+    incrPiece (r, piece);
+}
+
+void
+tr_rarityAddBitfield (tr_rarity         * r,
+                      const tr_bitfield * b,
+                      tr_rarity_func      func,
+                      void              * user_data)
+{
+    if (tr_bitfieldHasAll (b))
+        ++r->seedCount;
+    else if (!tr_bitfieldHasNone (b))
+        updateFromBits (r, b, true, func, user_data);
+}
+
+void
+tr_rarityRemoveBitfield (tr_rarity         * r,
+                         const tr_bitfield * b,
+                         tr_rarity_func      func,
+                         void              * user_data)
+{
+    if (tr_bitfieldHasAll (b))
+    {
+        /* A peer that filled in its bitfield with HAVEs was counted
+         * piece by piece rather than as a seed. Either way, every
+         * piece loses one and the pieces' order doesn't change. */
+        if (r->seedCount > 0)
+        {
+            --r->seedCount;
+        }
+        else
+        {
+            tr_piece_index_t i;
+            for (i=0; i<r->pieceCount; ++i)
+                decrPiece (r, i);
+        }
+    }
+    else if (!tr_bitfieldHasNone (b))
+    {
+        updateFromBits (r, b, false, func, user_data);
+    }
+}
+
+const tr_piece_index_t *
+tr_rarityGetBucket (const tr_rarity * r, int availability, size_t * setme_count)
+{
+    const int c = availability - r->seedCount;
+
+    if ((c < 0) || (c >= r->bucketCount))
+    {
+        *setme_count = 0;
+        return NULL;
+    }
+
+    *setme_count = r->bucketStarts[c+1] - r->bucketStarts[c];
+    return r->order + r->bucketStarts[c];
+}
@@ -0,0 +1,118 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_RARITY_H
+#define TR_RARITY_H
+
+#include "transmission.h"
+#include "bitfield.h"
+
+/**
+ * @addtogroup utils Utilities
+ * @{
+ */
+
+/**
+ * Tracks how many connected peers have each of a torrent's pieces,
+ * for the rarest-first policy.
+ *
+ * Pieces are kept grouped into buckets by availability, so that moving
+ * a piece when a peer sends a HAVE is O(1), and the pieces of a given
+ * availability can be listed without looking at the others. Seeds are
+ * kept as a single tally, so a HAVE_ALL doesn't touch any pieces at all.
+ */
+typedef struct tr_rarity
+{
+    /* these are PRIVATE IMPLEMENTATION details included for composition only.
+     * Don't access these directly! */
+
+    /* how many non-seed peers have each piece */
+    uint16_t         * counts;
+
+    /* the pieces, sorted by counts[] */
+    tr_piece_index_t * order;
+
+    /* where each piece is in order[] */
+    tr_piece_index_t * positions;
+
+    /* bucket i is order[bucketStarts[i]...bucketStarts[i+1]) */
+    tr_piece_index_t * bucketStarts;
+    int                bucketCount;
+    int                bucketAlloc;
+
+    tr_piece_index_t   pieceCount;
+    int                seedCount;
+}
+tr_rarity;
+
+/** @brief called for each piece whose availability a bitfield changed */
+typedef void (*tr_rarity_func)(tr_piece_index_t piece, void * user_data);
+
+void tr_rarityConstruct (tr_rarity * rarity, tr_piece_index_t pieceCount);
+
+void tr_rarityDestruct (tr_rarity * rarity);
+
+/** @brief a peer has told us it has this piece */
+void tr_rarityAddPiece (tr_rarity * rarity, tr_piece_index_t piece);
+
+/**
+ * @brief a peer has told us it has these pieces.
+ *
+ * A full bitfield is tallied as a seed. Otherwise, func is called
+ * for each piece in the bitfield after its count is updated.
+ * func may be NULL.
+ */
+void tr_rarityAddBitfield (tr_rarity         * rarity,
+                           const tr_bitfield * bitfield,
+                           tr_rarity_func      func,
+                           void              * user_data);
+
+/** @brief a peer that had these pieces has gone away */
+void tr_rarityRemoveBitfield (tr_rarity         * rarity,
+                              const tr_bitfield * bitfield,
+                              tr_rarity_func      func,
+                              void              * user_data);
+
+/** @return how many connected peers have this piece */
+static inline int
+tr_rarityGet (const tr_rarity * rarity, tr_piece_index_t piece)
+{
+    return rarity->counts[piece] + rarity->seedCount;
+}
+
+/**
+ * @return how many connected non-seeds have this piece.
+ * This orders pieces the same way tr_rarityGet () does, but
+ * doesn't change when seeds come and go.
+ */
+static inline int
+tr_rarityGetPartial (const tr_rarity * rarity, tr_piece_index_t piece)
+{
+    return rarity->counts[piece];
+}
+
+/**
+ * @brief list the pieces that exactly `availability' peers have
+ * @return the pieces, in no particular order. They're valid
+ *         until the tr_rarity is next changed.
+ */
+const tr_piece_index_t * tr_rarityGetBucket (const tr_rarity * rarity,
+                                             int               availability,
+                                             size_t          * setme_count);
+
+/* @} */
+
+#endif
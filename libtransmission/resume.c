@@ -21,6 +21,7 @@
 #include "platform.h" /* tr_getResumeDir () */
 #include "resume.h"
 #include "session.h"
+#include "snapshot.h"
 #include "torrent.h"
 #include "utils.h" /* tr_buildPath */
 #include "variant.h"
@@ -31,15 +32,21 @@ enum
 };
 
 static char*
-getResumeFilename (const tr_torrent * tor)
+getResumeFilenameFromInfo (const tr_session * session, const tr_info * info)
 {
-    char * base = tr_metainfoGetBasename (tr_torrentInfo (tor));
+    char * base = tr_metainfoGetBasename (info);
     char * filename = tr_strdup_printf ("%s" TR_PATH_DELIMITER_STR "%s.resume",
-                                        tr_getResumeDir (tor->session), base);
+                                        tr_getResumeDir (session), base);
     tr_free (base);
     return filename;
 }
 
+static char*
+getResumeFilename (const tr_torrent * tor)
+{
+    return getResumeFilenameFromInfo (tor->session, tr_torrentInfo (tor));
+}
+
 /***
 ****
 ***/
@@ -370,8 +377,8 @@ saveProgress (tr_variant * dict, tr_torrent * tor)
     l = tr_variantDictAddList (prog, TR_KEY_time_checked, inf->fileCount);
     for (fi=0; fi<inf->fileCount; ++fi)
     {
-        const tr_piece * p;
-        const tr_piece * pend;
+        const time_t * p;
+        const time_t * pend;
         time_t oldest_nonzero = now;
         time_t newest = 0;
         bool has_zero = false;
@@ -379,14 +386,14 @@ saveProgress (tr_variant * dict, tr_torrent * tor)
         const tr_file * f = &inf->files[fi];
 
         /* get the oldest and newest nonzero timestamps for pieces in this file */
-        for (p=&inf->pieces[f->firstPiece], pend=&inf->pieces[f->lastPiece]; p!=pend; ++p)
+        for (p=&inf->pieceTimeChecked[f->firstPiece], pend=&inf->pieceTimeChecked[f->lastPiece]; p!=pend; ++p)
         {
-            if (!p->timeChecked)
+            if (!*p)
                 has_zero = true;
-            else if (oldest_nonzero > p->timeChecked)
-                oldest_nonzero = p->timeChecked;
-            if (newest < p->timeChecked)
-                newest = p->timeChecked;
+            else if (oldest_nonzero > *p)
+                oldest_nonzero = *p;
+            if (newest < *p)
+                newest = *p;
         }
 
         /* If some of a file's pieces have been checked more recently than
@@ -406,8 +413,8 @@ saveProgress (tr_variant * dict, tr_torrent * tor)
             const int offset = oldest_nonzero - 1;
             tr_variant * ll = tr_variantListAddList (l, 2 + f->lastPiece - f->firstPiece);
             tr_variantListAddInt (ll, offset);
-            for (p=&inf->pieces[f->firstPiece], pend=&inf->pieces[f->lastPiece]+1; p!=pend; ++p)
-                tr_variantListAddInt (ll, p->timeChecked ? p->timeChecked - offset : 0);
+            for (p=&inf->pieceTimeChecked[f->firstPiece], pend=&inf->pieceTimeChecked[f->lastPiece]+1; p!=pend; ++p)
+                tr_variantListAddInt (ll, *p ? *p - offset : 0);
         }
     }
 
@@ -428,7 +435,7 @@ loadProgress (tr_variant * dict, tr_torrent * tor)
     const tr_info * inf = tr_torrentInfo (tor);
 
     for (i=0, n=inf->pieceCount; i<n; ++i)
-        inf->pieces[i].timeChecked = 0;
+        inf->pieceTimeChecked[i] = 0;
 
     if (tr_variantDictFindDict (dict, TR_KEY_progress, &prog))
     {
@@ -459,15 +466,15 @@ loadProgress (tr_variant * dict, tr_torrent * tor)
             {
                 tr_variant * b = tr_variantListChild (l, fi);
                 const tr_file * f = &inf->files[fi];
-                tr_piece * p = &inf->pieces[f->firstPiece];
-                const tr_piece * pend = &inf->pieces[f->lastPiece]+1;
+                time_t * p = &inf->pieceTimeChecked[f->firstPiece];
+                const time_t * pend = &inf->pieceTimeChecked[f->lastPiece]+1;
 
                 if (tr_variantIsInt (b))
                 {
                     int64_t t;
                     tr_variantGetInt (b, &t);
                     for (; p!=pend; ++p)
-                        p->timeChecked = (time_t)t;
+                        *p = (time_t)t;
                 }
                 else if (tr_variantIsList (b))
                 {
@@ -481,7 +488,7 @@ loadProgress (tr_variant * dict, tr_torrent * tor)
                     {
                         int64_t t = 0;
                         tr_variantGetInt (tr_variantListChild (b, i+1), &t);
-                        inf->pieces[f->firstPiece+i].timeChecked = (time_t)(t ? t + offset : 0);
+                        inf->pieceTimeChecked[f->firstPiece+i] = (time_t)(t ? t + offset : 0);
                     }
                 }
             }
@@ -501,13 +508,13 @@ loadProgress (tr_variant * dict, tr_torrent * tor)
                 if (tr_variantGetInt (tr_variantListChild (l, fi), &t))
                 {
                     const tr_file * f = &inf->files[fi];
-                    tr_piece * p = &inf->pieces[f->firstPiece];
-                    const tr_piece * pend = &inf->pieces[f->lastPiece];
+                    time_t * p = &inf->pieceTimeChecked[f->firstPiece];
+                    const time_t * pend = &inf->pieceTimeChecked[f->lastPiece];
                     const time_t mtime = tr_torrentGetFileMTime (tor, fi);
                     const time_t timeChecked = mtime==t ? mtime : 0;
 
                     for (; p!=pend; ++p)
-                        p->timeChecked = timeChecked;
+                        *p = timeChecked;
                 }
             }
         }
@@ -597,46 +604,65 @@ tr_torrentSaveResume (tr_torrent * tor)
     filename = getResumeFilename (tor);
     if ((err = tr_variantToFile (&top, TR_VARIANT_FMT_BENC, filename)))
         tr_torrentSetLocalError (tor, "Unable to save resume file: %s", tr_strerror (err));
+    else if (tor->session->snapshot != NULL)
+        tr_snapshotSave (tor->session->snapshot, tor, filename);
     tr_free (filename);
 
     tr_variantFree (&top);
 }
 
 static uint64_t
-loadFromFile (tr_torrent * tor, uint64_t fieldsToLoad)
+loadFromFile (tr_torrent * tor, uint64_t fieldsToLoad, tr_torrent_preload * preload)
 {
     size_t len;
     int64_t  i;
     const char * str;
     char * filename;
-    tr_variant top;
+    tr_variant fromFile;
+    tr_variant * top = NULL;
     bool boolVal;
     uint64_t fieldsLoaded = 0;
     const bool wasDirty = tor->isDirty;
 
     assert (tr_isTorrent (tor));
 
+    if ((preload != NULL) && (preload->resumeRecord != NULL))
+    {
+        fieldsLoaded = tr_snapshotLoadResume (tor, fieldsToLoad, preload->resumeRecord);
+        tr_tordbg (tor, "%s", "Read resume data from the snapshot");
+        tor->isDirty = wasDirty;
+        return fieldsLoaded;
+    }
+
+    if ((preload != NULL) && preload->hasResume)
+        top = &preload->resume;
+
     filename = getResumeFilename (tor);
 
-    if (tr_variantFromFile (&top, TR_VARIANT_FMT_BENC, filename))
+    if (top == NULL)
     {
-        tr_tordbg (tor, "Couldn't read \"%s\"", filename);
+        if (tr_variantFromFileArena (&fromFile, TR_VARIANT_FMT_BENC, filename))
+        {
+            tr_tordbg (tor, "Couldn't read \"%s\"", filename);
 
-        tr_free (filename);
-        return fieldsLoaded;
+            tr_free (filename);
+            return fieldsLoaded;
+        }
+
+        top = &fromFile;
     }
 
     tr_tordbg (tor, "Read resume file \"%s\"", filename);
 
     if ((fieldsToLoad & TR_FR_CORRUPT)
-      && tr_variantDictFindInt (&top, TR_KEY_corrupt, &i))
+      && tr_variantDictFindInt (top, TR_KEY_corrupt, &i))
     {
         tor->corruptPrev = i;
         fieldsLoaded |= TR_FR_CORRUPT;
     }
 
     if ((fieldsToLoad & (TR_FR_PROGRESS | TR_FR_DOWNLOAD_DIR))
-      && (tr_variantDictFindStr (&top, TR_KEY_destination, &str, &len))
+      && (tr_variantDictFindStr (top, TR_KEY_destination, &str, &len))
       && (str && *str))
     {
         tr_free (tor->downloadDir);
@@ -645,7 +671,7 @@ loadFromFile (tr_torrent * tor, uint64_t fieldsToLoad)
     }
 
     if ((fieldsToLoad & (TR_FR_PROGRESS | TR_FR_INCOMPLETE_DIR))
-      && (tr_variantDictFindStr (&top, TR_KEY_incomplete_dir, &str, &len))
+      && (tr_variantDictFindStr (top, TR_KEY_incomplete_dir, &str, &len))
       && (str && *str))
     {
         tr_free (tor->incompleteDir);
@@ -654,70 +680,70 @@ loadFromFile (tr_torrent * tor, uint64_t fieldsToLoad)
     }
 
     if ((fieldsToLoad & TR_FR_DOWNLOADED)
-      && tr_variantDictFindInt (&top, TR_KEY_downloaded, &i))
+      && tr_variantDictFindInt (top, TR_KEY_downloaded, &i))
     {
         tor->downloadedPrev = i;
         fieldsLoaded |= TR_FR_DOWNLOADED;
     }
 
     if ((fieldsToLoad & TR_FR_UPLOADED)
-      && tr_variantDictFindInt (&top, TR_KEY_uploaded, &i))
+      && tr_variantDictFindInt (top, TR_KEY_uploaded, &i))
     {
         tor->uploadedPrev = i;
         fieldsLoaded |= TR_FR_UPLOADED;
     }
 
     if ((fieldsToLoad & TR_FR_MAX_PEERS)
-      && tr_variantDictFindInt (&top, TR_KEY_max_peers, &i))
+      && tr_variantDictFindInt (top, TR_KEY_max_peers, &i))
     {
         tor->maxConnectedPeers = i;
         fieldsLoaded |= TR_FR_MAX_PEERS;
     }
 
     if ((fieldsToLoad & TR_FR_RUN)
-      && tr_variantDictFindBool (&top, TR_KEY_paused, &boolVal))
+      && tr_variantDictFindBool (top, TR_KEY_paused, &boolVal))
     {
         tor->isRunning = !boolVal;
         fieldsLoaded |= TR_FR_RUN;
     }
 
     if ((fieldsToLoad & TR_FR_ADDED_DATE)
-      && tr_variantDictFindInt (&top, TR_KEY_added_date, &i))
+      && tr_variantDictFindInt (top, TR_KEY_added_date, &i))
     {
         tor->addedDate = i;
         fieldsLoaded |= TR_FR_ADDED_DATE;
     }
 
     if ((fieldsToLoad & TR_FR_DONE_DATE)
-      && tr_variantDictFindInt (&top, TR_KEY_done_date, &i))
+      && tr_variantDictFindInt (top, TR_KEY_done_date, &i))
     {
         tor->doneDate = i;
         fieldsLoaded |= TR_FR_DONE_DATE;
     }
 
     if ((fieldsToLoad & TR_FR_ACTIVITY_DATE)
-      && tr_variantDictFindInt (&top, TR_KEY_activity_date, &i))
+      && tr_variantDictFindInt (top, TR_KEY_activity_date, &i))
     {
         tr_torrentSetActivityDate (tor, i);
         fieldsLoaded |= TR_FR_ACTIVITY_DATE;
     }
 
     if ((fieldsToLoad & TR_FR_TIME_SEEDING)
-      && tr_variantDictFindInt (&top, TR_KEY_seeding_time_seconds, &i))
+      && tr_variantDictFindInt (top, TR_KEY_seeding_time_seconds, &i))
     {
         tor->secondsSeeding = i;
         fieldsLoaded |= TR_FR_TIME_SEEDING;
     }
 
     if ((fieldsToLoad & TR_FR_TIME_DOWNLOADING)
-      && tr_variantDictFindInt (&top, TR_KEY_downloading_time_seconds, &i))
+      && tr_variantDictFindInt (top, TR_KEY_downloading_time_seconds, &i))
     {
         tor->secondsDownloading = i;
         fieldsLoaded |= TR_FR_TIME_DOWNLOADING;
     }
 
     if ((fieldsToLoad & TR_FR_BANDWIDTH_PRIORITY)
-      && tr_variantDictFindInt (&top, TR_KEY_bandwidth_priority, &i)
+      && tr_variantDictFindInt (top, TR_KEY_bandwidth_priority, &i)
       && tr_isPriority (i))
     {
         tr_torrentSetPriority (tor, i);
@@ -725,32 +751,33 @@ loadFromFile (tr_torrent * tor, uint64_t fieldsToLoad)
     }
 
     if (fieldsToLoad & TR_FR_PEERS)
-        fieldsLoaded |= loadPeers (&top, tor);
+        fieldsLoaded |= loadPeers (top, tor);
 
     if (fieldsToLoad & TR_FR_FILE_PRIORITIES)
-        fieldsLoaded |= loadFilePriorities (&top, tor);
+        fieldsLoaded |= loadFilePriorities (top, tor);
 
     if (fieldsToLoad & TR_FR_PROGRESS)
-        fieldsLoaded |= loadProgress (&top, tor);
+        fieldsLoaded |= loadProgress (top, tor);
 
     if (fieldsToLoad & TR_FR_DND)
-        fieldsLoaded |= loadDND (&top, tor);
+        fieldsLoaded |= loadDND (top, tor);
 
     if (fieldsToLoad & TR_FR_SPEEDLIMIT)
-        fieldsLoaded |= loadSpeedLimits (&top, tor);
+        fieldsLoaded |= loadSpeedLimits (top, tor);
 
     if (fieldsToLoad & TR_FR_RATIOLIMIT)
-        fieldsLoaded |= loadRatioLimits (&top, tor);
+        fieldsLoaded |= loadRatioLimits (top, tor);
 
     if (fieldsToLoad & TR_FR_IDLELIMIT)
-        fieldsLoaded |= loadIdleLimits (&top, tor);
+        fieldsLoaded |= loadIdleLimits (top, tor);
 
     /* loading the resume file triggers of a lot of changes,
      * but none of them needs to trigger a re-saving of the
      * same resume information... */
     tor->isDirty = wasDirty;
 
-    tr_variantFree (&top);
+    if (top == &fromFile)
+        tr_variantFree (&fromFile);
     tr_free (filename);
     return fieldsLoaded;
 }
@@ -801,9 +828,10 @@ useFallbackFields (tr_torrent * tor, uint64_t fields, const tr_ctor * ctor)
 }
 
 uint64_t
-tr_torrentLoadResume (tr_torrent *    tor,
-                      uint64_t        fieldsToLoad,
-                      const tr_ctor * ctor)
+tr_torrentLoadResume (tr_torrent         * tor,
+                      uint64_t             fieldsToLoad,
+                      const tr_ctor      * ctor,
+                      tr_torrent_preload * preload)
 {
     uint64_t ret = 0;
 
@@ -811,7 +839,7 @@ tr_torrentLoadResume (tr_torrent *    tor,
 
     ret |= useManditoryFields (tor, fieldsToLoad, ctor);
     fieldsToLoad &= ~ret;
-    ret |= loadFromFile (tor, fieldsToLoad);
+    ret |= loadFromFile (tor, fieldsToLoad, preload);
     fieldsToLoad &= ~ret;
     ret |= useFallbackFields (tor, fieldsToLoad, ctor);
 
@@ -819,9 +847,27 @@ tr_torrentLoadResume (tr_torrent *    tor,
 }
 
 void
-tr_torrentRemoveResume (const tr_torrent * tor)
+tr_torrentPreloadResume (const tr_session   * session,
+                         tr_torrent_preload * preload)
+{
+    char * filename = getResumeFilenameFromInfo (session, &preload->info);
+
+    if (session->snapshot != NULL)
+        preload->resumeRecord = tr_snapshotGetResume (session->snapshot, &preload->info, filename);
+
+    if (preload->resumeRecord == NULL)
+        preload->hasResume = !tr_variantFromFileArena (&preload->resume, TR_VARIANT_FMT_BENC, filename);
+
+    tr_free (filename);
+}
+
+void
+tr_torrentRemoveResume (tr_torrent * tor)
 {
     char * filename = getResumeFilename (tor);
     unlink (filename);
     tr_free (filename);
+
+    if (tor->session->snapshot != NULL)
+        tr_snapshotRemove (tor->session->snapshot, tor);
 }
@@ -41,15 +41,29 @@ enum
     TR_FR_TIME_DOWNLOADING    = (1 << 19)
 };
 
+struct tr_torrent_preload;
+
+/**
+ * Returns a bitwise-or'ed set of the loaded resume data.
+ * If preload is NULL, the resume file is read from disk.
+ */
+uint64_t tr_torrentLoadResume (tr_torrent                * tor,
+                               uint64_t                    fieldsToLoad,
+                               const tr_ctor             * ctor,
+                               struct tr_torrent_preload * preload);
+
 /**
- * Returns a bitwise-or'ed set of the loaded resume data
+ * Reads the resume data of a torrent that hasn't been created yet,
+ * for tr_torrentLoadResume ()'s preload argument: from the session's
+ * snapshot if it has a current copy, or else from the .resume file.
+ * This doesn't touch the session's state, so it's safe to call from
+ * any thread.
  */
-uint64_t tr_torrentLoadResume (tr_torrent *    tor,
-                               uint64_t        fieldsToLoad,
-                               const tr_ctor * ctor);
+void     tr_torrentPreloadResume (const tr_session          * session,
+                                  struct tr_torrent_preload * preload);
 
 void     tr_torrentSaveResume (tr_torrent * tor);
 
-void     tr_torrentRemoveResume (const tr_torrent * tor);
+void     tr_torrentRemoveResume (tr_torrent * tor);
 
 #endif
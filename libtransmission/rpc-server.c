@@ -339,9 +339,11 @@ add_response (struct evhttp_request * req, struct tr_rpc_server * server,
     }
     else
     {
-        int state;
-        struct evbuffer_iovec iovec[1];
-        void * content_ptr = evbuffer_pullup (content, -1);
+        int i;
+        int n;
+        int state = Z_OK;
+        struct evbuffer_iovec * segments;
+        struct evbuffer * gzipped = evbuffer_new ();
         const size_t content_len = evbuffer_get_length (content);
 
         if (!server->isStreamInitialized)
@@ -363,36 +365,58 @@ add_response (struct evhttp_request * req, struct tr_rpc_server * server,
             deflateInit2 (&server->stream, compressionLevel, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY);
         }
 
-        server->stream.next_in = content_ptr;
-        server->stream.avail_in = content_len;
-
-        /* allocate space for the raw data and call deflate () just once --
-         * we won't use the deflated data if it's longer than the raw data,
-         * so it's okay to let deflate () run out of output buffer space */
-        evbuffer_reserve_space (out, content_len, iovec, 1);
-        server->stream.next_out = iovec[0].iov_base;
-        server->stream.avail_out = iovec[0].iov_len;
-        state = deflate (&server->stream, Z_FINISH);
+        /* deflate the content one evbuffer segment at a time, into
+         * fixed-size pieces of output, instead of pulling it up into
+         * one contiguous block and reserving that much space again
+         * for the output */
+        n = evbuffer_peek (content, -1, NULL, NULL, 0);
+        segments = tr_new (struct evbuffer_iovec, MAX (n, 1));
+        evbuffer_peek (content, -1, NULL, segments, n);
 
-        if (state == Z_STREAM_END)
+        for (i=0; (state == Z_OK) && (i < MAX (n, 1)); ++i)
         {
-            iovec[0].iov_len -= server->stream.avail_out;
+            const int flush = i+1 >= n ? Z_FINISH : Z_NO_FLUSH;
+
+            server->stream.next_in = n ? segments[i].iov_base : NULL;
+            server->stream.avail_in = n ? segments[i].iov_len : 0;
+
+            do
+            {
+                struct evbuffer_iovec iovec[1];
+
+                evbuffer_reserve_space (gzipped, 1024*64, iovec, 1);
+                server->stream.next_out = iovec[0].iov_base;
+                server->stream.avail_out = iovec[0].iov_len;
+                state = deflate (&server->stream, flush);
+                iovec[0].iov_len -= server->stream.avail_out;
+                evbuffer_commit_space (gzipped, iovec, 1);
+            }
+            while ((state == Z_OK) && (server->stream.avail_out == 0));
 
+            /* not an error -- just an empty segment */
+            if ((state == Z_BUF_ERROR) && (flush == Z_NO_FLUSH))
+                state = Z_OK;
+        }
+
+        /* we won't use the deflated data if it's longer than the raw data */
+        if ((state == Z_STREAM_END) && (evbuffer_get_length (gzipped) < content_len))
+        {
 #if 0
             fprintf (stderr, "compressed response is %.2f of original (raw==%zu bytes; compressed==%zu)\n",
-                           (double)evbuffer_get_length (out)/content_len,
-                             content_len, evbuffer_get_length (out));
+                           (double)evbuffer_get_length (gzipped)/content_len,
+                             content_len, evbuffer_get_length (gzipped));
 #endif
             evhttp_add_header (req->output_headers,
                                "Content-Encoding", "gzip");
+            evbuffer_add_buffer (out, gzipped);
         }
         else
         {
-            memcpy (iovec[0].iov_base, content_ptr, content_len);
-            iovec[0].iov_len = content_len;
+            evbuffer_add_buffer (out, content);
         }
 
-        evbuffer_commit_space (out, iovec, 1);
+        tr_free (segments);
+        evbuffer_free (gzipped);
         deflateReset (&server->stream);
     }
 #endif
@@ -1,4 +1,12 @@
+#include <stdio.h> /* fprintf () */
+#include <stdlib.h> /* mkdtemp () */
+#include <string.h> /* strcmp () */
+
+#include <event2/buffer.h>
+
 #include "transmission.h"
+#include "crypto.h" /* tr_cryptoRandBuf () */
+#include "platform.h" /* tr_threadNew () */
 #include "rpcimpl.h"
 #include "utils.h"
 #include "variant.h"
@@ -57,4 +65,386 @@ test_list (void)
     return 0;
 }
 
-MAIN_SINGLE_TEST (test_list)
+/***
+****
+***/
+
+/* add a paused magnet torrent with a random info hash */
+static tr_torrent *
+addMagnet (tr_session * session, char * setmeHashString)
+{
+    tr_ctor * ctor;
+    tr_torrent * tor;
+    uint8_t hash[SHA_DIGEST_LENGTH];
+    char * magnet;
+
+    tr_cryptoRandBuf (hash, sizeof (hash));
+    tr_sha1_to_hex (setmeHashString, hash);
+    magnet = tr_strdup_printf ("magnet:?xt=urn:btih:%s", setmeHashString);
+
+    ctor = tr_ctorNew (session);
+    tr_ctorSetMetainfoFromMagnetLink (ctor, magnet);
+    tr_ctorSetPaused (ctor, TR_FORCE, true);
+    tor = tr_torrentNew (ctor, NULL);
+    tr_ctorFree (ctor);
+    tr_free (magnet);
+
+    return tor;
+}
+
+struct response_data
+{
+    bool done;
+    tr_variant top;
+};
+
+static void
+onResponse (tr_session * session UNUSED, struct evbuffer * response, void * vdata)
+{
+    struct response_data * data = vdata;
+
+    if (tr_variantFromJson (&data->top, evbuffer_pullup (response, -1), evbuffer_get_length (response)))
+        tr_variantInitDict (&data->top, 0);
+
+    data->done = true;
+}
+
+/* run a torrent-get for the given fields and return its "arguments" */
+static tr_variant *
+torrentGet (tr_session * session, const char ** fields, int n, int64_t since, tr_variant * top)
+{
+    int i;
+    int len;
+    char * json;
+    tr_variant request;
+    tr_variant * args;
+    tr_variant * list;
+    struct response_data data;
+
+    tr_variantInitDict (&request, 2);
+    tr_variantDictAddStr (&request, TR_KEY_method, "torrent-get");
+    args = tr_variantDictAddDict (&request, TR_KEY_arguments, 2);
+    list = tr_variantDictAddList (args, TR_KEY_fields, n);
+    for (i=0; i<n; ++i)
+        tr_variantListAddStr (list, fields[i]);
+    if (since >= 0)
+        tr_variantDictAddInt (args, TR_KEY_changed_since, since);
+    json = tr_variantToStr (&request, TR_VARIANT_FMT_JSON_LEAN, &len);
+    tr_variantFree (&request);
+
+    data.done = false;
+    tr_rpc_request_exec_json (session, json, len, onResponse, &data);
+    while (!data.done)
+        tr_wait_msec (1);
+    tr_free (json);
+
+    *top = data.top;
+    if (!tr_variantDictFindDict (top, TR_KEY_arguments, &args))
+        args = NULL;
+    return args;
+}
+
+static int
+test_changed_since (void)
+{
+    int64_t i;
+    int64_t revision;
+    int64_t revision2;
+    tr_variant top;
+    tr_variant * args;
+    tr_variant * torrents;
+    tr_variant * removed;
+    tr_variant * d;
+    tr_torrent * tor;
+    tr_torrent * tor2;
+    tr_session * session;
+    char hashString[SHA_DIGEST_LENGTH*2 + 1];
+    const char * fields[] = { "id", "hashString", "downloadLimit" };
+    char config_dir[] = "/tmp/transmission-rpc-test-XXXXXX";
+
+    check (mkdtemp (config_dir) != NULL);
+    session = libttest_session_init (config_dir, NULL);
+    tor = addMagnet (session, hashString);
+    tor2 = addMagnet (session, hashString);
+    check (tor != NULL);
+    check (tor2 != NULL);
+
+    /* a plain request gets everything, and a revision */
+    args = torrentGet (session, fields, 3, -1, &top);
+    check (args != NULL);
+    check (tr_variantDictFindList (args, TR_KEY_torrents, &torrents));
+    check_int_eq (2, tr_variantListSize (torrents));
+    check (!tr_variantDictFindList (args, TR_KEY_removed, &removed));
+    check (tr_variantDictFindInt (args, TR_KEY_revision, &revision));
+    tr_variantFree (&top);
+
+    /* nothing's changed since then */
+    args = torrentGet (session, fields, 3, revision, &top);
+    check (tr_variantDictFindList (args, TR_KEY_torrents, &torrents));
+    check_int_eq (0, tr_variantListSize (torrents));
+    check (tr_variantDictFindList (args, TR_KEY_removed, &removed));
+    check_int_eq (0, tr_variantListSize (removed));
+    check (tr_variantDictFindInt (args, TR_KEY_revision, &revision2));
+    check_int_eq (revision, revision2);
+    tr_variantFree (&top);
+
+    /* only the changed field comes back, along with the id */
+    tr_torrentSetSpeedLimit_KBps (tor, TR_DOWN, 42);
+    args = torrentGet (session, fields, 3, revision, &top);
+    check (tr_variantDictFindList (args, TR_KEY_torrents, &torrents));
+    check_int_eq (1, tr_variantListSize (torrents));
+    d = tr_variantListChild (torrents, 0);
+    check (tr_variantDictFindInt (d, TR_KEY_id, &i));
+    check_int_eq (tr_torrentId (tor), i);
+    check (tr_variantDictFindInt (d, TR_KEY_downloadLimit, &i));
+    check_int_eq (42, i);
+    check (tr_variantDictFind (d, TR_KEY_hashString) == NULL);
+    check (tr_variantDictFindInt (args, TR_KEY_revision, &revision2));
+    check (revision2 > revision);
+    tr_variantFree (&top);
+
+    /* the old revision still sees the change after a newer one's been handed out */
+    args = torrentGet (session, fields, 3, revision, &top);
+    check (tr_variantDictFindList (args, TR_KEY_torrents, &torrents));
+    check_int_eq (1, tr_variantListSize (torrents));
+    tr_variantFree (&top);
+
+    /* removed torrents are listed */
+    i = tr_torrentId (tor2);
+    tr_torrentRemove (tor2, false, NULL);
+    while (tr_torrentFindFromId (session, i) != NULL)
+        tr_wait_msec (1);
+    args = torrentGet (session, fields, 3, revision2, &top);
+    check (tr_variantDictFindList (args, TR_KEY_torrents, &torrents));
+    check_int_eq (0, tr_variantListSize (torrents));
+    check (tr_variantDictFindList (args, TR_KEY_removed, &removed));
+    check_int_eq (1, tr_variantListSize (removed));
+    check (tr_variantGetInt (tr_variantListChild (removed, 0), &revision));
+    check_int_eq (i, revision);
+    tr_variantFree (&top);
+
+    /* a revision that wasn't handed out gets a full reply */
+    args = torrentGet (session, fields, 3, 1, &top);
+    check (tr_variantDictFindList (args, TR_KEY_torrents, &torrents));
+    check_int_eq (1, tr_variantListSize (torrents));
+    check (tr_variantDictFind (tr_variantListChild (torrents, 0), TR_KEY_hashString) != NULL);
+    check (!tr_variantDictFindList (args, TR_KEY_removed, &removed));
+    tr_variantFree (&top);
+
+    tr_sessionClose (session);
+    libttest_rm_rf (config_dir);
+    return 0;
+}
+
+/***
+****  tr_torrentStatSnapshot () from another thread
+***/
+
+struct snapshot_reader
+{
+    tr_session * session;
+    int id;
+    volatile bool stop;
+    volatile bool done;
+    volatile bool removed;
+    int found;
+    int foundAfterRemove;
+    int notFound;
+    int wrongId;
+};
+
+static void
+snapshotReaderFunc (void * vreader)
+{
+    tr_stat st;
+    struct snapshot_reader * reader = vreader;
+
+    while (!reader->stop)
+    {
+        /* sample this first: if it's set, the torrent's gone for good */
+        const bool removed = reader->removed;
+
+        if (!tr_torrentStatSnapshot (reader->session, reader->id, &st))
+            ++reader->notFound;
+        else if (st.id != reader->id)
+            ++reader->wrongId;
+        else if (removed)
+            ++reader->foundAfterRemove;
+        else
+            ++reader->found;
+    }
+
+    reader->done = true;
+}
+
+static int
+test_stat_snapshot (void)
+{
+    int id;
+    tr_stat st;
+    tr_torrent * tor;
+    tr_torrent * tor2;
+    tr_session * session;
+    struct snapshot_reader reader;
+    char hashString[SHA_DIGEST_LENGTH*2 + 1];
+    char config_dir[] = "/tmp/transmission-rpc-test-XXXXXX";
+
+    check (mkdtemp (config_dir) != NULL);
+    session = libttest_session_init (config_dir, NULL);
+    tor = addMagnet (session, hashString);
+    tor2 = addMagnet (session, hashString);
+    check (tor != NULL);
+    check (tor2 != NULL);
+    id = tr_torrentId (tor);
+
+    /* the first call has an answer, without waiting for the timer */
+    memset (&st, 0, sizeof (st));
+    check (tr_torrentStatSnapshot (session, id, &st));
+    check_int_eq (id, st.id);
+    check (!tr_torrentStatSnapshot (session, -1, &st));
+
+    /* read it from another thread while the torrent is removed */
+    memset (&reader, 0, sizeof (reader));
+    reader.session = session;
+    reader.id = id;
+    tr_threadNew (snapshotReaderFunc, &reader);
+    while (reader.found == 0)
+        tr_wait_msec (1);
+    tr_torrentRemove (tor, false, NULL);
+    while (tr_torrentFindFromId (session, id) != NULL)
+        tr_wait_msec (1);
+    reader.removed = true;
+    while (reader.notFound == 0)
+        tr_wait_msec (1);
+    reader.stop = true;
+    while (!reader.done)
+        tr_wait_msec (1);
+
+    check (reader.found > 0);
+    check (reader.notFound > 0);
+    check_int_eq (0, reader.foundAfterRemove);
+    check_int_eq (0, reader.wrongId);
+
+    /* the other torrent's still there */
+    check (!tr_torrentStatSnapshot (session, id, &st));
+    check (tr_torrentStatSnapshot (session, tr_torrentId (tor2), &st));
+    check_int_eq (tr_torrentId (tor2), st.id);
+
+    tr_sessionClose (session);
+    libttest_rm_rf (config_dir);
+    return 0;
+}
+
+/***
+****  Benchmark: run with --benchmark
+***/
+
+static void
+onBenchmarkResponse (tr_session * session UNUSED, struct evbuffer * response UNUSED, void * vdone)
+{
+    *(bool*)vdone = true;
+}
+
+/* the wall time of a torrent-get for every torrent, listed by id or by hash */
+static double
+time_torrent_get (tr_session * session, const tr_variant * ids)
+{
+    int i;
+    int len;
+    char * json;
+    uint64_t msec;
+    tr_variant request;
+    tr_variant * args;
+    tr_variant * list;
+    const int n = tr_variantListSize (ids);
+    const int passes = 5;
+
+    tr_variantInitDict (&request, 2);
+    tr_variantDictAddStr (&request, TR_KEY_method, "torrent-get");
+    args = tr_variantDictAddDict (&request, TR_KEY_arguments, 2);
+    tr_variantListAddStr (tr_variantDictAddList (args, TR_KEY_fields, 1), "id");
+    list = tr_variantDictAddList (args, TR_KEY_ids, n);
+    for (i=0; i<n; ++i)
+    {
+        int64_t id;
+        const char * str;
+        tr_variant * child = tr_variantListChild ((tr_variant*)ids, i);
+
+        if (tr_variantGetInt (child, &id))
+            tr_variantListAddInt (list, id);
+        else if (tr_variantGetStr (child, &str, NULL))
+            tr_variantListAddStr (list, str);
+    }
+    json = tr_variantToStr (&request, TR_VARIANT_FMT_JSON_LEAN, &len);
+    tr_variantFree (&request);
+
+    msec = tr_time_msec ();
+    for (i=0; i<passes; ++i)
+    {
+        bool done = false;
+        tr_rpc_request_exec_json (session, json, len, onBenchmarkResponse, &done);
+        while (!done)
+            tr_wait_msec (1);
+    }
+    msec = tr_time_msec () - msec;
+
+    tr_free (json);
+    return msec / (double)passes;
+}
+
+static void
+benchmark_torrent_get (void)
+{
+    int i;
+    int n;
+    tr_session * session;
+    tr_variant ids;
+    tr_variant hashes;
+    char config_dir[] = "/tmp/transmission-rpc-test-XXXXXX";
+
+    if (mkdtemp (config_dir) == NULL)
+        return;
+
+    session = libttest_session_init (config_dir, NULL);
+
+    tr_variantInitList (&ids, 0);
+    tr_variantInitList (&hashes, 0);
+
+    for (i=0, n=1000; n<=8000; n*=2)
+    {
+        for (; i<n; ++i)
+        {
+            tr_torrent * tor;
+            char hashString[SHA_DIGEST_LENGTH*2 + 1];
+
+            if ((tor = addMagnet (session, hashString)))
+            {
+                tr_variantListAddInt (&ids, tr_torrentId (tor));
+                tr_variantListAddStr (&hashes, hashString);
+            }
+        }
+
+        fprintf (stderr, "%5d torrents: torrent-get by id %8.2f ms, by hash %8.2f ms\n",
+                 n, time_torrent_get (session, &ids), time_torrent_get (session, &hashes));
+    }
+
+    tr_variantFree (&hashes);
+    tr_variantFree (&ids);
+    tr_sessionClose (session);
+    libttest_rm_rf (config_dir);
+}
+
+int
+main (int argc, char ** argv)
+{
+    int ret;
+    const testFunc tests[] = { test_list, test_changed_since, test_stat_snapshot };
+
+    if ((ret = runTests (tests, NUM_TESTS (tests))))
+        return ret;
+
+    if ((argc > 1) && !strcmp (argv[1], "--benchmark"))
+        benchmark_torrent_get ();
+
+    return 0;
+}
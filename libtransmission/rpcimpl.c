@@ -14,7 +14,7 @@
 #include <ctype.h> /* isdigit */
 #include <errno.h>
 #include <stdlib.h> /* strtol */
-#include <string.h> /* strcmp */
+#include <string.h> /* strcmp, memset */
 #include <unistd.h> /* unlink */
 
 #ifdef HAVE_ZLIB
@@ -24,6 +24,7 @@
 #include <event2/buffer.h>
 
 #include "transmission.h"
+#include "cache.h"
 #include "completion.h"
 #include "fdlimit.h"
 #include "rpcimpl.h"
@@ -34,7 +35,7 @@
 #include "version.h"
 #include "web.h"
 
-#define RPC_VERSION     14
+#define RPC_VERSION     15
 #define RPC_VERSION_MIN 1
 
 #define RECENTLY_ACTIVE_SECONDS 60
@@ -67,6 +68,10 @@ notify (tr_session * session,
 {
     tr_rpc_callback_status status = 0;
 
+    /* don't make torrent-get wait a second to see the change */
+    if ((tor != NULL) && session->statSnapshots.isEnabled)
+        tr_torrentPublishStat (tor);
+
     if (session->rpc_func)
         status = session->rpc_func (session, type, tor,
                                     session->rpc_func_user_data);
@@ -527,6 +532,7 @@ addPeers (tr_torrent * tor, tr_variant * list)
         tr_variantDictAddStr  (d, TR_KEY_clientName, peer->client);
         tr_variantDictAddBool (d, TR_KEY_clientIsChoked, peer->clientIsChoked);
         tr_variantDictAddBool (d, TR_KEY_clientIsInterested, peer->clientIsInterested);
+        tr_variantDictAddInt  (d, TR_KEY_desiredReqsToPeer, peer->desiredReqsToPeer);
         tr_variantDictAddStr  (d, TR_KEY_flagStr, peer->flagStr);
         tr_variantDictAddBool (d, TR_KEY_isDownloadingFrom, peer->isDownloadingFrom);
         tr_variantDictAddBool (d, TR_KEY_isEncrypted, peer->isEncrypted);
@@ -535,10 +541,12 @@ addPeers (tr_torrent * tor, tr_variant * list)
         tr_variantDictAddBool (d, TR_KEY_isUTP, peer->isUTP);
         tr_variantDictAddBool (d, TR_KEY_peerIsChoked, peer->peerIsChoked);
         tr_variantDictAddBool (d, TR_KEY_peerIsInterested, peer->peerIsInterested);
+        tr_variantDictAddInt  (d, TR_KEY_pendingReqsToPeer, peer->pendingReqsToPeer);
         tr_variantDictAddInt  (d, TR_KEY_port, peer->port);
         tr_variantDictAddReal (d, TR_KEY_progress, peer->progress);
         tr_variantDictAddInt  (d, TR_KEY_rateToClient, toSpeedBytes (peer->rateToClient_KBps));
         tr_variantDictAddInt  (d, TR_KEY_rateToPeer, toSpeedBytes (peer->rateToPeer_KBps));
+        tr_variantDictAddInt  (d, TR_KEY_rtt, peer->rtt_msec);
     }
 
     tr_torrentPeersFree (peers, peerCount);
@@ -872,58 +880,275 @@ addInfo (tr_torrent * tor, tr_variant * d, tr_variant * fields)
 {
   const int n = tr_variantListSize (fields);
 
-  tr_variantInitDict (d, n);
+  tr_variantInitDictArena (d, n);
 
   if (n > 0)
     {
       int i;
+      tr_stat st;
       const tr_info const * inf = tr_torrentInfo (tor);
-      const tr_stat const * st = tr_torrentStat ((tr_torrent*)tor);
+
+      /* the once-a-second copy, rather than working out every
+         torrent's stats again for each request */
+      if (!tr_torrentStatSnapshot (tor->session, tr_torrentId (tor), &st))
+        st = *tr_torrentStat (tor);
 
       for (i=0; i<n; ++i)
         {
           size_t len;
           const char * str;
           if (tr_variantGetStr (tr_variantListChild (fields, i), &str, &len))
-            addField (tor, inf, st, d, tr_quark_new (str, len));
+            addField (tor, inf, &st, d, tr_quark_new (str, len));
+        }
+    }
+}
+
+/***
+****  "changed-since"
+****
+****  Most torrent-get fields (rates, progress, peers...) change without
+****  any single place in libtransmission to notice it, so instead each
+****  torrent remembers a fingerprint of every field the last time it was
+****  built for RPC, along with the revision in which it last changed.
+****  A client that passes back the "revision" from its previous reply
+****  only gets the torrents and fields that changed since then.
+***/
+
+struct tr_rpc_field_state
+{
+    tr_quark key;
+    uint64_t hash;
+    int64_t revision;
+};
+
+/* FNV-1a */
+static uint64_t
+hashBytes (uint64_t h, const void * vbytes, size_t len)
+{
+    const uint8_t * bytes = vbytes;
+
+    while (len--) {
+        h ^= *bytes++;
+        h *= 1099511628211ull;
+    }
+
+    return h;
+}
+
+static uint64_t
+hashVariant (uint64_t h, tr_variant * v)
+{
+    size_t len;
+    const char * str;
+    int64_t i;
+    double d;
+    bool b;
+    tr_quark key;
+    tr_variant * child;
+
+    if (tr_variantIsDict (v)) {
+        int n = 0;
+        h = hashBytes (h, "d", 1);
+        while (tr_variantDictChild (v, n++, &key, &child)) {
+            h = hashBytes (h, &key, sizeof (key));
+            h = hashVariant (h, child);
         }
+    } else if (tr_variantIsList (v)) {
+        int n = 0;
+        h = hashBytes (h, "l", 1);
+        while ((child = tr_variantListChild (v, n++)))
+            h = hashVariant (h, child);
+    } else if (tr_variantIsString (v) && tr_variantGetStr (v, &str, &len)) {
+        h = hashBytes (h, "s", 1);
+        h = hashBytes (h, &len, sizeof (len));
+        h = hashBytes (h, str, len);
+    } else if (tr_variantIsReal (v) && tr_variantGetReal (v, &d)) {
+        h = hashBytes (h, "r", 1);
+        h = hashBytes (h, &d, sizeof (d));
+    } else if (tr_variantIsBool (v) && tr_variantGetBool (v, &b)) {
+        h = hashBytes (h, "b", 1);
+        h = hashBytes (h, &b, sizeof (b));
+    } else if (tr_variantGetInt (v, &i)) {
+        h = hashBytes (h, "i", 1);
+        h = hashBytes (h, &i, sizeof (i));
+    }
+
+    return h;
+}
+
+static int
+compareFieldState (const void * va, const void * vb)
+{
+    const tr_quark a = *(const tr_quark*) va;
+    const tr_quark b = ((const struct tr_rpc_field_state*) vb)->key;
+
+    if (a < b) return -1;
+    if (a > b) return 1;
+    return 0;
+}
+
+static struct tr_rpc_field_state *
+getFieldState (tr_torrent * tor, tr_quark key)
+{
+    bool exact;
+    struct tr_rpc_field_state * state;
+    const int pos = tr_lowerBound (&key, tor->rpcFields, tor->rpcFieldCount,
+                                   sizeof (struct tr_rpc_field_state),
+                                   compareFieldState, &exact);
+
+    if (!exact) {
+        tor->rpcFields = tr_renew (struct tr_rpc_field_state, tor->rpcFields, tor->rpcFieldCount + 1);
+        memmove (tor->rpcFields + pos + 1, tor->rpcFields + pos,
+                 sizeof (struct tr_rpc_field_state) * (tor->rpcFieldCount - pos));
+        ++tor->rpcFieldCount;
+        state = tor->rpcFields + pos;
+        state->key = key;
+        state->hash = 0;
+        state->revision = -1;
     }
+
+    return tor->rpcFields + pos;
 }
 
+/**
+ * Fingerprint the fields in `d', giving any that differ from the last time
+ * they were built the revision `revision'. If `since' isn't negative, remove
+ * the fields from `d' that haven't changed since then.
+ *
+ * @return true if any of the fields changed in this revision
+ */
+static bool
+filterFields (tr_torrent * tor, tr_variant * d, int64_t revision, int64_t since)
+{
+    int i;
+    int n = 0;
+    tr_quark key;
+    tr_variant * child;
+    bool changed = false;
+
+    while (tr_variantDictChild (d, n, &key, &child))
+        ++n;
+
+    /* walk backwards because tr_variantDictRemove () moves the last child */
+    for (i=n-1; i>=0; --i)
+    {
+        struct tr_rpc_field_state * state;
+        uint64_t hash;
+
+        if (!tr_variantDictChild (d, i, &key, &child))
+            continue;
+
+        state = getFieldState (tor, key);
+        hash = hashVariant (14695981039346656037ull, child);
+        if ((state->revision < 0) || (state->hash != hash)) {
+            state->hash = hash;
+            state->revision = revision;
+            changed = true;
+        }
+
+        if ((since >= 0) && (state->revision <= since))
+            tr_variantDictRemove (d, key);
+    }
+
+    return changed;
+}
+
+/* torrent-get writes its "arguments" straight to the response's JSON,
+ * so that only one torrent's fields need to be held as a tr_variant
+ * at a time instead of the whole list of torrents */
 static const char*
 torrentGet (tr_session               * session,
-            tr_variant                  * args_in,
-            tr_variant                  * args_out,
-            struct tr_rpc_idle_data  * idle_data UNUSED)
+            tr_variant               * args_in,
+            tr_json_writer           * args_out)
 {
     int           i, torrentCount;
     tr_torrent ** torrents = getTorrents (session, args_in, &torrentCount);
-    tr_variant *     list = tr_variantDictAddList (args_out, TR_KEY_torrents, torrentCount);
-    tr_variant *     fields;
+    tr_variant    tmp;
+    tr_variant *  fields;
     const char *  msg = NULL;
     const char *  strVal;
+    int64_t       since = -1;
+    bool          anyChanged = false;
+    const int64_t revision = session->rpcRevision + 1;
 
-    assert (idle_data == NULL);
+    tr_jsonWriterBeginDict (args_out);
 
-    if (tr_variantDictFindStr (args_in, TR_KEY_ids, &strVal, NULL) && !strcmp (strVal, "recently-active")) {
+    if (tr_variantDictFindInt (args_in, TR_KEY_changed_since, &since)) {
+        /* a revision we didn't hand out gets a full reply without "removed" */
+        if ((since < session->rpcRevisionFirst) || (since > session->rpcRevision))
+            since = -1;
+        else {
+            int n = 0;
+            tr_variant * d;
+            tr_variantInitList (&tmp, 0);
+            while ((d = tr_variantListChild (&session->removedTorrents, n++))) {
+                int64_t intVal;
+                if (tr_variantDictFindInt (d, TR_KEY_revision, &intVal) && (intVal > since)) {
+                    tr_variantDictFindInt (d, TR_KEY_id, &intVal);
+                    tr_variantListAddInt (&tmp, intVal);
+                }
+            }
+            tr_jsonWriterKey (args_out, TR_KEY_removed);
+            tr_jsonWriterAdd (args_out, &tmp);
+            tr_variantFree (&tmp);
+        }
+    }
+    else if (tr_variantDictFindStr (args_in, TR_KEY_ids, &strVal, NULL) && !strcmp (strVal, "recently-active")) {
         int n = 0;
         tr_variant * d;
         const time_t now = tr_time ();
         const int interval = RECENTLY_ACTIVE_SECONDS;
-        tr_variant * removed_out = tr_variantDictAddList (args_out, TR_KEY_removed, 0);
+        tr_variantInitList (&tmp, 0);
         while ((d = tr_variantListChild (&session->removedTorrents, n++))) {
             int64_t intVal;
             if (tr_variantDictFindInt (d, TR_KEY_date, &intVal) && (intVal >= now - interval)) {
                 tr_variantDictFindInt (d, TR_KEY_id, &intVal);
-                tr_variantListAddInt (removed_out, intVal);
+                tr_variantListAddInt (&tmp, intVal);
             }
         }
+        tr_jsonWriterKey (args_out, TR_KEY_removed);
+        tr_jsonWriterAdd (args_out, &tmp);
+        tr_variantFree (&tmp);
     }
 
+    tr_jsonWriterKey (args_out, TR_KEY_torrents);
+    tr_jsonWriterBeginList (args_out);
+
     if (!tr_variantDictFindList (args_in, TR_KEY_fields, &fields))
         msg = "no fields specified";
-    else for (i = 0; i < torrentCount; ++i)
-        addInfo (torrents[i], tr_variantListAdd (list), fields);
+    else for (i = 0; i < torrentCount; ++i) {
+        tr_quark key;
+        tr_variant * child;
+        tr_torrent * tor = torrents[i];
+        bool skip = false;
+
+        addInfo (tor, &tmp, fields);
+
+        if (filterFields (tor, &tmp, revision, since))
+            anyChanged = true;
+
+        /* the client needs the id to know which torrent changed */
+        if (since >= 0) {
+            if (!tr_variantDictChild (&tmp, 0, &key, &child))
+                skip = true;
+            else if (!tr_variantDictFind (&tmp, TR_KEY_id))
+                tr_variantDictAddInt (&tmp, TR_KEY_id, tr_torrentId (tor));
+        }
+
+        if (!skip)
+            tr_jsonWriterAdd (args_out, &tmp);
+        tr_variantFree (&tmp);
+    }
+
+    tr_jsonWriterEnd (args_out);
+
+    if (anyChanged)
+        session->rpcRevision = revision;
+    tr_variantInitInt (&tmp, session->rpcRevision);
+    tr_jsonWriterKey (args_out, TR_KEY_revision);
+    tr_jsonWriterAdd (args_out, &tmp);
+
+    tr_jsonWriterEnd (args_out);
 
     tr_free (torrents);
     return msg;
@@ -1788,6 +2013,9 @@ sessionStats (tr_session               * session,
     tr_variant * d;
     tr_session_stats currentStats = { 0.0f, 0, 0, 0, 0, 0 };
     tr_session_stats cumulativeStats = { 0.0f, 0, 0, 0, 0, 0 };
+    tr_fd_stats fileStats;
+    tr_cache_stats cacheStats;
+    tr_web_stats webStats;
     tr_torrent * tor = NULL;
 
     assert (idle_data == NULL);
@@ -1821,6 +2049,30 @@ sessionStats (tr_session               * session,
     tr_variantDictAddInt (d, TR_KEY_sessionCount, currentStats.sessionCount);
     tr_variantDictAddInt (d, TR_KEY_uploadedBytes, currentStats.uploadedBytes);
 
+    tr_fdGetStats (session, &fileStats);
+    d = tr_variantDictAddDict (args_out, TR_KEY_file_cache_stats, 5);
+    tr_variantDictAddInt (d, TR_KEY_evictions, fileStats.evictions);
+    tr_variantDictAddInt (d, TR_KEY_fileLimit, fileStats.fileLimit);
+    tr_variantDictAddInt (d, TR_KEY_hits, fileStats.hits);
+    tr_variantDictAddInt (d, TR_KEY_misses, fileStats.misses);
+    tr_variantDictAddInt (d, TR_KEY_openFiles, fileStats.openFiles);
+
+    tr_cacheGetStats (session->cache, &cacheStats);
+    d = tr_variantDictAddDict (args_out, TR_KEY_read_cache_stats, 6);
+    tr_variantDictAddInt (d, TR_KEY_cachedBytes, cacheStats.read_cache_bytes);
+    tr_variantDictAddInt (d, TR_KEY_cachedPieces, cacheStats.read_cache_pieces);
+    tr_variantDictAddInt (d, TR_KEY_hitBytes, cacheStats.read_hit_bytes);
+    tr_variantDictAddInt (d, TR_KEY_hits, cacheStats.read_hits);
+    tr_variantDictAddInt (d, TR_KEY_missBytes, cacheStats.read_miss_bytes);
+    tr_variantDictAddInt (d, TR_KEY_misses, cacheStats.read_misses);
+
+    if (!tr_webGetStats (session, &webStats))
+        memset (&webStats, 0, sizeof (webStats));
+    d = tr_variantDictAddDict (args_out, TR_KEY_web_stats, 3);
+    tr_variantDictAddInt (d, TR_KEY_newConnections, webStats.connectionCount);
+    tr_variantDictAddInt (d, TR_KEY_requests, webStats.requestCount);
+    tr_variantDictAddInt (d, TR_KEY_reusedRequests, webStats.reusedCount);
+
     return NULL;
 }
 
@@ -1912,34 +2164,38 @@ sessionClose (tr_session               * session,
 
 typedef const char* (*handler)(tr_session*, tr_variant*, tr_variant*, struct tr_rpc_idle_data *);
 
+/* an immediate handler that writes its own "arguments" */
+typedef const char* (*stream_handler)(tr_session*, tr_variant*, tr_json_writer*);
+
 static struct method
 {
-    const char *  name;
-    bool          immediate;
-    handler       func;
+    const char *    name;
+    bool            immediate;
+    handler         func;
+    stream_handler  stream_func;
 }
 methods[] =
 {
-    { "port-test",             false, portTest            },
-    { "blocklist-update",      false, blocklistUpdate     },
-    { "session-close",         true,  sessionClose        },
-    { "session-get",           true,  sessionGet          },
-    { "session-set",           true,  sessionSet          },
-    { "session-stats",         true,  sessionStats        },
-    { "torrent-add",           false, torrentAdd          },
-    { "torrent-get",           true,  torrentGet          },
-    { "torrent-remove",        true,  torrentRemove       },
-    { "torrent-set",           true,  torrentSet          },
-    { "torrent-set-location",  true,  torrentSetLocation  },
-    { "torrent-start",         true,  torrentStart        },
-    { "torrent-start-now",     true,  torrentStartNow     },
-    { "torrent-stop",          true,  torrentStop         },
-    { "torrent-verify",        true,  torrentVerify       },
-    { "torrent-reannounce",    true,  torrentReannounce   },
-    { "queue-move-top",        true,  queueMoveTop        },
-    { "queue-move-up",         true,  queueMoveUp         },
-    { "queue-move-down",       true,  queueMoveDown       },
-    { "queue-move-bottom",     true,  queueMoveBottom     }
+    { "port-test",             false, portTest,            NULL },
+    { "blocklist-update",      false, blocklistUpdate,     NULL },
+    { "session-close",         true,  sessionClose,        NULL },
+    { "session-get",           true,  sessionGet,          NULL },
+    { "session-set",           true,  sessionSet,          NULL },
+    { "session-stats",         true,  sessionStats,        NULL },
+    { "torrent-add",           false, torrentAdd,          NULL },
+    { "torrent-get",           true,  NULL,                torrentGet },
+    { "torrent-remove",        true,  torrentRemove,       NULL },
+    { "torrent-set",           true,  torrentSet,          NULL },
+    { "torrent-set-location",  true,  torrentSetLocation,  NULL },
+    { "torrent-start",         true,  torrentStart,        NULL },
+    { "torrent-start-now",     true,  torrentStartNow,     NULL },
+    { "torrent-stop",          true,  torrentStop,         NULL },
+    { "torrent-verify",        true,  torrentVerify,       NULL },
+    { "torrent-reannounce",    true,  torrentReannounce,   NULL },
+    { "queue-move-top",        true,  queueMoveTop,        NULL },
+    { "queue-move-up",         true,  queueMoveUp,         NULL },
+    { "queue-move-down",       true,  queueMoveDown,       NULL },
+    { "queue-move-bottom",     true,  queueMoveBottom,     NULL }
 };
 
 static void
@@ -1994,6 +2250,35 @@ request_exec (tr_session             * session,
 
         tr_variantFree (&response);
     }
+    else if (methods[i].stream_func != NULL)
+    {
+        int64_t tag;
+        tr_variant tmp;
+        tr_json_writer writer;
+        struct evbuffer * buf = evbuffer_new ();
+
+        /* write the same keys, in the same order, as the branch below */
+        tr_jsonWriterInit (&writer, buf);
+        tr_jsonWriterBeginDict (&writer);
+        tr_jsonWriterKey (&writer, TR_KEY_arguments);
+        result = (*methods[i].stream_func)(session, args_in, &writer);
+        if (result == NULL)
+            result = "success";
+        tr_variantInitStr (&tmp, result, -1);
+        tr_jsonWriterKey (&writer, TR_KEY_result);
+        tr_jsonWriterAdd (&writer, &tmp);
+        tr_variantFree (&tmp);
+        if (tr_variantDictFindInt (request, TR_KEY_tag, &tag)) {
+            tr_variantInitInt (&tmp, tag);
+            tr_jsonWriterKey (&writer, TR_KEY_tag);
+            tr_jsonWriterAdd (&writer, &tmp);
+        }
+        tr_jsonWriterEnd (&writer);
+        evbuffer_add (buf, "\n", 1);
+
+      (*callback)(session, buf, callback_user_data);
+        evbuffer_free (buf);
+    }
     else if (methods[i].immediate)
     {
         int64_t tag;
@@ -2001,7 +2286,7 @@ request_exec (tr_session             * session,
         tr_variant * args_out;
         struct evbuffer * buf;
 
-        tr_variantInitDict (&response, 3);
+        tr_variantInitDictArena (&response, 3);
         args_out = tr_variantDictAddDict (&response, TR_KEY_arguments, 0);
         result = (*methods[i].func)(session, args_in, args_out, NULL);
         if (result == NULL)
@@ -2045,7 +2330,7 @@ tr_rpc_request_exec_json (tr_session            * session,
     if (request_len < 0)
         request_len = strlen (request_json);
 
-    have_content = !tr_variantFromJson (&top, request_json, request_len);
+    have_content = !tr_variantFromBufArena (&top, TR_VARIANT_FMT_JSON, request_json, request_len, NULL, NULL);
     request_exec (session, have_content ? &top : NULL, callback, callback_user_data);
 
     if (have_content)
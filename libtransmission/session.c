@@ -35,13 +35,16 @@
 #include "crypto.h"
 #include "fdlimit.h"
 #include "list.h"
+#include "metainfo.h" /* tr_metainfoFree () */
 #include "net.h"
 #include "peer-io.h"
 #include "peer-mgr.h"
 #include "platform.h" /* tr_lock, tr_getTorrentDir (), tr_getFreeSpace () */
 #include "port-forwarding.h"
+#include "ptrarray.h"
 #include "rpc-server.h"
 #include "session.h"
+#include "snapshot.h"
 #include "stats.h"
 #include "torrent.h"
 #include "tr-dht.h" /* tr_dhtUpkeep () */
@@ -64,6 +67,9 @@ enum
     DEFAULT_CACHE_SIZE_MB = 4,
     DEFAULT_PREFETCH_ENABLED = true,
 #endif
+    DEFAULT_VERIFY_THREADS = 1,
+    DEFAULT_LOAD_THREADS = 4,
+    DEFAULT_WEB_CONNECTIONS_PER_HOST = 8,
     SAVE_INTERVAL_SECS = 360
 };
 
@@ -307,10 +313,11 @@ tr_sessionGetDefaultSettings (tr_variant * d)
 {
     assert (tr_variantIsDict (d));
 
-    tr_variantDictReserve (d, 62);
+    tr_variantDictReserve (d, 68);
     tr_variantDictAddBool (d, TR_KEY_blocklist_enabled,               false);
     tr_variantDictAddStr  (d, TR_KEY_blocklist_url,                   "http://www.example.com/blocklist");
     tr_variantDictAddInt  (d, TR_KEY_cache_size_mb,                   DEFAULT_CACHE_SIZE_MB);
+    tr_variantDictAddInt  (d, TR_KEY_read_cache_size_mb,              0);
     tr_variantDictAddBool (d, TR_KEY_dht_enabled,                     true);
     tr_variantDictAddBool (d, TR_KEY_utp_enabled,                     true);
     tr_variantDictAddBool (d, TR_KEY_lpd_enabled,                     false);
@@ -366,6 +373,10 @@ tr_sessionGetDefaultSettings (tr_variant * d)
     tr_variantDictAddBool (d, TR_KEY_speed_limit_up_enabled,          false);
     tr_variantDictAddInt  (d, TR_KEY_umask,                           022);
     tr_variantDictAddInt  (d, TR_KEY_upload_slots_per_torrent,        14);
+    tr_variantDictAddInt  (d, TR_KEY_verify_threads,                  DEFAULT_VERIFY_THREADS);
+    tr_variantDictAddInt  (d, TR_KEY_load_threads,                    DEFAULT_LOAD_THREADS);
+    tr_variantDictAddBool (d, TR_KEY_snapshot_enabled,                false);
+    tr_variantDictAddInt  (d, TR_KEY_web_connections_per_host,        DEFAULT_WEB_CONNECTIONS_PER_HOST);
     tr_variantDictAddStr  (d, TR_KEY_bind_address_ipv4,               TR_DEFAULT_BIND_ADDRESS_IPV4);
     tr_variantDictAddStr  (d, TR_KEY_bind_address_ipv6,               TR_DEFAULT_BIND_ADDRESS_IPV6);
     tr_variantDictAddBool (d, TR_KEY_start_added_torrents,            true);
@@ -377,10 +388,11 @@ tr_sessionGetSettings (tr_session * s, tr_variant * d)
 {
   assert (tr_variantIsDict (d));
 
-  tr_variantDictReserve (d, 63);
+  tr_variantDictReserve (d, 67);
   tr_variantDictAddBool (d, TR_KEY_blocklist_enabled,            tr_blocklistIsEnabled (s));
   tr_variantDictAddStr  (d, TR_KEY_blocklist_url,                tr_blocklistGetURL (s));
   tr_variantDictAddInt  (d, TR_KEY_cache_size_mb,                tr_sessionGetCacheLimit_MB (s));
+  tr_variantDictAddInt  (d, TR_KEY_read_cache_size_mb,           tr_sessionGetReadCacheLimit_MB (s));
   tr_variantDictAddBool (d, TR_KEY_dht_enabled,                  s->isDHTEnabled);
   tr_variantDictAddBool (d, TR_KEY_utp_enabled,                  s->isUTPEnabled);
   tr_variantDictAddBool (d, TR_KEY_lpd_enabled,                  s->isLPDEnabled);
@@ -437,6 +449,10 @@ tr_sessionGetSettings (tr_session * s, tr_variant * d)
   tr_variantDictAddBool (d, TR_KEY_speed_limit_up_enabled,       tr_sessionIsSpeedLimited (s, TR_UP));
   tr_variantDictAddInt  (d, TR_KEY_umask,                        s->umask);
   tr_variantDictAddInt  (d, TR_KEY_upload_slots_per_torrent,     s->uploadSlotsPerTorrent);
+  tr_variantDictAddInt  (d, TR_KEY_verify_threads,               s->verifyThreads);
+  tr_variantDictAddInt  (d, TR_KEY_load_threads,                 s->loadThreads);
+  tr_variantDictAddBool (d, TR_KEY_snapshot_enabled,             s->snapshot != NULL);
+  tr_variantDictAddInt  (d, TR_KEY_web_connections_per_host,     s->webConnectionsPerHost);
   tr_variantDictAddStr  (d, TR_KEY_bind_address_ipv4,            tr_address_to_string (&s->public_ipv4->addr));
   tr_variantDictAddStr  (d, TR_KEY_bind_address_ipv6,            tr_address_to_string (&s->public_ipv6->addr));
   tr_variantDictAddBool (d, TR_KEY_start_added_torrents,         !tr_sessionGetPaused (s));
@@ -582,17 +598,23 @@ tr_sessionInit (const char  * tag,
 
     tr_timeUpdate (time (NULL));
 
+    /* the torrent preload workers may be the first to add runtime quarks */
+    tr_quark_init ();
+
     /* initialize the bare skeleton of the session object */
     session = tr_new0 (tr_session, 1);
     session->udp_socket = -1;
     session->udp6_socket = -1;
     session->lock = tr_lockNew ();
+    session->statSnapshots.lock = tr_lockNew ();
     session->cache = tr_cacheNew (1024*1024*2);
     session->tag = tr_strdup (tag);
     session->magicNumber = SESSION_MAGIC_NUMBER;
     tr_bandwidthConstruct (&session->bandwidth, session, NULL);
     tr_peerIdInit (session->peer_id);
     tr_variantInitList (&session->removedTorrents, 0);
+    /* don't reuse any revision an earlier run could have handed out */
+    session->rpcRevisionFirst = session->rpcRevision = tr_time_msec ();
 
     /* nice to start logging at the very beginning */
     if (tr_variantDictFindInt (clientSettings, TR_KEY_message_level, &i))
@@ -650,6 +672,9 @@ onNowTimer (int foo UNUSED, short bar UNUSED, void * vsession)
             else
                 ++tor->secondsDownloading;
         }
+
+        if (session->statSnapshots.isEnabled)
+            tr_torrentPublishStat (tor);
     }
 
     /**
@@ -698,6 +723,8 @@ tr_sessionInitImpl (void * vdata)
 
     tr_setConfigDir (session, data->configDir);
 
+    tr_fdInit (session);
+
     session->peerMgr = tr_peerMgrNew (session);
 
     session->shared = tr_sharedInit (session);
@@ -743,6 +770,26 @@ tr_sessionInitImpl (void * vdata)
 static void turtleBootstrap (tr_session *, struct tr_turtle_info *);
 static void setPeerPort (tr_session * session, tr_port port);
 
+static void
+setSnapshotEnabled (tr_session * session, bool enabled)
+{
+    if (enabled && (session->snapshot == NULL))
+    {
+        tr_torrent * tor = NULL;
+
+        session->snapshot = tr_snapshotOpen (session);
+
+        /* torrents that are already loaded get added on their next save */
+        while ((tor = tr_torrentNext (session, tor)))
+            tor->snapshotHasInfo = false;
+    }
+    else if (!enabled && (session->snapshot != NULL))
+    {
+        tr_snapshotClose (session->snapshot);
+        session->snapshot = NULL;
+    }
+}
+
 static void
 sessionSetImpl (void * vdata)
 {
@@ -771,6 +818,8 @@ sessionSetImpl (void * vdata)
     /* misc features */
     if (tr_variantDictFindInt (settings, TR_KEY_cache_size_mb, &i))
         tr_sessionSetCacheLimit_MB (session, i);
+    if (tr_variantDictFindInt (settings, TR_KEY_read_cache_size_mb, &i))
+        tr_sessionSetReadCacheLimit_MB (session, i);
     if (tr_variantDictFindInt (settings, TR_KEY_peer_limit_per_torrent, &i))
         tr_sessionSetPeerLimitPerTorrent (session, i);
     if (tr_variantDictFindBool (settings, TR_KEY_pex_enabled, &boolVal))
@@ -793,6 +842,8 @@ sessionSetImpl (void * vdata)
         tr_blocklistSetEnabled (session, boolVal);
     if (tr_variantDictFindStr (settings, TR_KEY_blocklist_url, &str, NULL))
         tr_blocklistSetURL (session, str);
+    if (tr_variantDictFindInt (settings, TR_KEY_web_connections_per_host, &i))
+        session->webConnectionsPerHost = MAX (0, i);
     if (tr_variantDictFindBool (settings, TR_KEY_start_added_torrents, &boolVal))
         tr_sessionSetPaused (session, !boolVal);
     if (tr_variantDictFindBool (settings, TR_KEY_trash_original_torrent_files, &boolVal))
@@ -815,6 +866,12 @@ sessionSetImpl (void * vdata)
     /* files and directories */
     if (tr_variantDictFindBool (settings, TR_KEY_prefetch_enabled, &boolVal))
         session->isPrefetchEnabled = boolVal;
+    if (tr_variantDictFindInt (settings, TR_KEY_verify_threads, &i))
+        session->verifyThreads = MAX (1, i);
+    if (tr_variantDictFindInt (settings, TR_KEY_load_threads, &i))
+        session->loadThreads = MAX (1, i);
+    if (tr_variantDictFindBool (settings, TR_KEY_snapshot_enabled, &boolVal))
+        setSnapshotEnabled (session, boolVal);
     if (tr_variantDictFindInt (settings, TR_KEY_preallocation, &i))
         session->preallocationMode = i;
     if (tr_variantDictFindStr (settings, TR_KEY_download_dir, &str, NULL))
@@ -1774,6 +1831,9 @@ sessionCloseImpl (void * vsession)
         tr_torrentFree (torrents[i]);
     tr_free (torrents);
 
+    /* the torrents have saved their resume data one last time */
+    setSnapshotEnabled (session, false);
+
     /* Close the announcer *after* closing the torrents
        so that all the &event=stopped messages will be
        queued to be sent by tr_announcerClose () */
@@ -1802,6 +1862,9 @@ sessionCloseImpl (void * vsession)
     tr_statsClose (session);
     tr_peerMgrFree (session->peerMgr);
 
+    /* session->bandwidth outlives the event loop, but its wake timer can't */
+    tr_bandwidthClearWaiters (&session->bandwidth);
+
     closeBlocklists (session);
 
     tr_fdClose (session);
@@ -1817,6 +1880,12 @@ deadlineReached (const time_t deadline)
 
 #define SHUTDOWN_MAX_SECONDS 20
 
+static void metainfoLookupEntryFree (void * entry);
+
+static void metainfoLookupAdd (tr_ptrArray * lookup,
+                               const char  * hashString,
+                               const char  * filename);
+
 void
 tr_sessionClose (tr_session * session)
 {
@@ -1873,10 +1942,15 @@ tr_sessionClose (tr_session * session)
     tr_bandwidthDestruct (&session->bandwidth);
     tr_bitfieldDestruct (&session->turtle.minutes);
     tr_lockFree (session->lock);
+    tr_lockFree (session->statSnapshots.lock);
+    tr_free (session->statSnapshots.stats);
     if (session->metainfoLookup) {
-        tr_variantFree (session->metainfoLookup);
+        tr_ptrArrayDestruct (session->metainfoLookup, metainfoLookupEntryFree);
         tr_free (session->metainfoLookup);
     }
+    tr_free (session->torrentsById);
+    tr_free (session->torrentsByHash);
+    tr_free (session->torrentsByObfuscatedHash);
     tr_free (session->torrentDoneScript);
     tr_free (session->tag);
     tr_free (session->configDir);
@@ -1896,24 +1970,28 @@ struct sessionLoadTorrentsData
     int * setmeCount;
     tr_torrent ** torrents;
     bool done;
+
+    /* the .torrent files in the torrents dir, and what was read from them */
+    char ** filenames;
+    tr_torrent_preload * preloads;
+    bool * isPreloaded;
+    size_t fileCount;
+
+    /* the preload workers take files in turn, guarded by this lock */
+    tr_lock * lock;
+    size_t nextFile;
+    int workerCount;
 };
 
 static void
-sessionLoadTorrents (void * vdata)
+listTorrentFiles (struct sessionLoadTorrentsData * data)
 {
-    int i;
-    int n = 0;
+    size_t i = 0;
     struct stat sb;
     DIR * odir = NULL;
-    tr_list * l = NULL;
     tr_list * list = NULL;
-    struct sessionLoadTorrentsData * data = vdata;
     const char * dirname = tr_getTorrentDir (data->session);
 
-    assert (tr_isSession (data->session));
-
-    tr_ctorSetSave (data->ctor, false); /* since we already have them */
-
     if (!stat (dirname, &sb)
       && S_ISDIR (sb.st_mode)
       && ((odir = opendir (dirname))))
@@ -1923,26 +2001,113 @@ sessionLoadTorrents (void * vdata)
         {
             if (tr_str_has_suffix (d->d_name, ".torrent"))
             {
-                tr_torrent * tor;
-                char * path = tr_buildPath (dirname, d->d_name, NULL);
-                tr_ctorSetMetainfoFromFile (data->ctor, path);
-                if ((tor = tr_torrentNew (data->ctor, NULL)))
-                {
-                    tr_list_prepend (&list, tor);
-                    ++n;
-                }
-                tr_free (path);
+                tr_list_prepend (&list, tr_buildPath (dirname, d->d_name, NULL));
+                ++data->fileCount;
             }
         }
         closedir (odir);
     }
 
-    data->torrents = tr_new (tr_torrent *, n);
-    for (i = 0, l = list; l != NULL; l = l->next)
-        data->torrents[i++] = (tr_torrent*) l->data;
-    assert (i == n);
+    data->filenames = tr_new (char*, data->fileCount);
+    data->preloads = tr_new0 (tr_torrent_preload, data->fileCount);
+    data->isPreloaded = tr_new0 (bool, data->fileCount);
+    while (list != NULL)
+        data->filenames[i++] = tr_list_pop_front (&list);
+    assert (i == data->fileCount);
+}
+
+/* parsing a .torrent file, and hashing its info dict, is most of the
+ * work of loading it. Do that for several torrents at once, and leave
+ * the libtransmission thread free in the meantime. */
+static void
+preloadThreadFunc (void * vdata)
+{
+    struct sessionLoadTorrentsData * data = vdata;
+
+    for (;;)
+    {
+        size_t i;
+
+        tr_lockLock (data->lock);
+        i = data->nextFile++;
+        tr_lockUnlock (data->lock);
+
+        if (i >= data->fileCount)
+            break;
+
+        data->isPreloaded[i] = tr_torrentPreload (data->session,
+                                                  data->filenames[i],
+                                                  &data->preloads[i]);
+    }
+
+    tr_lockLock (data->lock);
+    --data->workerCount;
+    tr_lockUnlock (data->lock);
+}
+
+static void
+preloadTorrents (struct sessionLoadTorrentsData * data)
+{
+    int i;
+    bool done = false;
+
+    data->lock = tr_lockNew ();
+    data->workerCount = MIN (data->session->loadThreads, (int)data->fileCount);
+    data->workerCount = MAX (data->workerCount, 1);
+
+    /* this thread would only be waiting, so it's one of the workers too */
+    for (i=1; i<data->workerCount; ++i)
+        tr_threadNew (preloadThreadFunc, data);
+    preloadThreadFunc (data);
 
-    tr_list_free (&list, NULL);
+    while (!done)
+    {
+        tr_lockLock (data->lock);
+        done = data->workerCount == 0;
+        tr_lockUnlock (data->lock);
+
+        if (!done)
+            tr_wait_msec (10);
+    }
+
+    tr_lockFree (data->lock);
+}
+
+static void
+sessionLoadTorrents (void * vdata)
+{
+    size_t i;
+    int n = 0;
+    struct sessionLoadTorrentsData * data = vdata;
+    tr_session * session = data->session;
+
+    assert (tr_isSession (session));
+
+    tr_ctorSetSave (data->ctor, false); /* since we already have them */
+
+    /* the preloads already parsed every .torrent file in the directory,
+     * so build the hash -> filename lookup from them instead of parsing
+     * everything again in metainfoLookupInit () */
+    if (session->metainfoLookup == NULL)
+        session->metainfoLookup = tr_new0 (tr_ptrArray, 1);
+
+    data->torrents = tr_new (tr_torrent *, data->fileCount);
+
+    for (i=0; i<data->fileCount; ++i)
+    {
+        if (data->isPreloaded[i])
+        {
+            tr_torrent * tor;
+            tr_torrent_preload * preload = &data->preloads[i];
+
+            metainfoLookupAdd (session->metainfoLookup,
+                               preload->info.hashString,
+                               data->filenames[i]);
+
+            if ((tor = tr_torrentNewFromPreload (data->ctor, preload, NULL)))
+                data->torrents[n++] = tor;
+        }
+    }
 
     if (n)
         tr_inf (_("Loaded %d torrents"), n);
@@ -1958,18 +2123,30 @@ tr_sessionLoadTorrents (tr_session * session,
                         tr_ctor    * ctor,
                         int        * setmeCount)
 {
+    size_t i;
     struct sessionLoadTorrentsData data;
 
+    memset (&data, 0, sizeof (data));
     data.session = session;
     data.ctor = ctor;
     data.setmeCount = setmeCount;
-    data.torrents = NULL;
-    data.done = false;
+
+    listTorrentFiles (&data);
+    preloadTorrents (&data);
 
     tr_runInEventThread (session, sessionLoadTorrents, &data);
     while (!data.done)
         tr_wait_msec (100);
 
+    for (i=0; i<data.fileCount; ++i)
+    {
+        tr_torrentPreloadFree (&data.preloads[i]);
+        tr_free (data.filenames[i]);
+    }
+    tr_free (data.isPreloaded);
+    tr_free (data.preloads);
+    tr_free (data.filenames);
+
     return data.torrents;
 }
 
@@ -2131,6 +2308,22 @@ tr_sessionGetCacheLimit_MB (const tr_session * session)
     return toMemMB (tr_cacheGetLimit (session->cache));
 }
 
+void
+tr_sessionSetReadCacheLimit_MB (tr_session * session, int max_bytes)
+{
+    assert (tr_isSession (session));
+
+    tr_cacheSetReadLimit (session->cache, toMemBytes (max_bytes));
+}
+
+int
+tr_sessionGetReadCacheLimit_MB (const tr_session * session)
+{
+    assert (tr_isSession (session));
+
+    return toMemMB (tr_cacheGetReadLimit (session->cache));
+}
+
 /***
 ****
 ***/
@@ -2373,6 +2566,60 @@ tr_blocklistGetURL (const tr_session * session)
 ****
 ***/
 
+/* The lookup used to be a tr_variant dict keyed by quarks, but that
+ * made every hash string a permanent quark, and both adding and finding
+ * a key were linear searches. That adds up with thousands of torrents. */
+struct metainfo_lookup_entry
+{
+    char hashString[2*SHA_DIGEST_LENGTH+1];
+    char * filename;
+};
+
+static int
+compareLookupEntries (const void * va, const void * vb)
+{
+    const struct metainfo_lookup_entry * a = va;
+    const struct metainfo_lookup_entry * b = vb;
+
+    return strcmp (a->hashString, b->hashString);
+}
+
+static void
+metainfoLookupEntryFree (void * ventry)
+{
+    struct metainfo_lookup_entry * entry = ventry;
+
+    tr_free (entry->filename);
+    tr_free (entry);
+}
+
+static void
+metainfoLookupAdd (tr_ptrArray * lookup,
+                   const char  * hashString,
+                   const char  * filename)
+{
+    bool exact;
+    int pos;
+    struct metainfo_lookup_entry key;
+
+    tr_strlcpy (key.hashString, hashString, sizeof (key.hashString));
+    pos = tr_ptrArrayLowerBound (lookup, &key, compareLookupEntries, &exact);
+
+    if (exact)
+    {
+        struct metainfo_lookup_entry * entry = tr_ptrArrayNth (lookup, pos);
+        tr_free (entry->filename);
+        entry->filename = tr_strdup (filename);
+    }
+    else
+    {
+        struct metainfo_lookup_entry * entry = tr_new (struct metainfo_lookup_entry, 1);
+        memcpy (entry->hashString, key.hashString, sizeof (entry->hashString));
+        entry->filename = tr_strdup (filename);
+        tr_ptrArrayInsert (lookup, entry, pos);
+    }
+}
+
 static void
 metainfoLookupInit (tr_session * session)
 {
@@ -2380,14 +2627,13 @@ metainfoLookupInit (tr_session * session)
     const char * dirname = tr_getTorrentDir (session);
     DIR *        odir = NULL;
     tr_ctor *    ctor = NULL;
-    tr_variant * lookup;
+    tr_ptrArray * lookup;
     int n = 0;
 
     assert (tr_isSession (session));
 
     /* walk through the directory and find the mappings */
-    lookup = tr_new0 (tr_variant, 1);
-    tr_variantInitDict (lookup, 0);
+    lookup = tr_new0 (tr_ptrArray, 1);
     ctor = tr_ctorNew (session);
     tr_ctorSetSave (ctor, false); /* since we already have them */
     if (!stat (dirname, &sb) && S_ISDIR (sb.st_mode) && ((odir = opendir (dirname))))
@@ -2403,7 +2649,8 @@ metainfoLookupInit (tr_session * session)
                 if (!tr_torrentParse (ctor, &inf))
                 {
                     ++n;
-                    tr_variantDictAddStr (lookup, tr_quark_new(inf.hashString,-1), path);
+                    metainfoLookupAdd (lookup, inf.hashString, path);
+                    tr_metainfoFree (&inf);
                 }
                 tr_free (path);
             }
@@ -2420,11 +2667,15 @@ const char*
 tr_sessionFindTorrentFile (const tr_session * session,
                            const char       * hashString)
 {
-    const char * filename = NULL;
+    struct metainfo_lookup_entry key;
+    const struct metainfo_lookup_entry * entry;
+
     if (!session->metainfoLookup)
         metainfoLookupInit ((tr_session*)session);
-    tr_variantDictFindStr (session->metainfoLookup, tr_quark_new(hashString,-1), &filename, NULL);
-    return filename;
+
+    tr_strlcpy (key.hashString, hashString, sizeof (key.hashString));
+    entry = tr_ptrArrayFindSorted (session->metainfoLookup, &key, compareLookupEntries);
+    return entry ? entry->filename : NULL;
 }
 
 void
@@ -2437,7 +2688,7 @@ tr_sessionSetTorrentFile (tr_session * session,
      * in that same directory, we don't need to do anything here if the
      * lookup table hasn't been built yet */
     if (session->metainfoLookup)
-        tr_variantDictAddStr (session->metainfoLookup, tr_quark_new(hashString,-1), filename);
+        metainfoLookupAdd (session->metainfoLookup, hashString, filename);
 }
 
 /***
@@ -56,6 +56,7 @@ struct tr_announcer_udp;
 struct tr_bindsockets;
 struct tr_cache;
 struct tr_fdInfo;
+struct tr_snapshot;
 
 typedef void (tr_web_config_func)(tr_session * session, void * curl_pointer, const char * url, void * user_data);
 
@@ -118,8 +119,29 @@ struct tr_session
     bool                         deleteSourceTorrent;
     bool                         scrapePausedTorrents;
 
+    /* the copies of tr_stat that tr_torrentStatSnapshot () reads,
+       sorted by torrent id. see torrent.c */
+    struct tr_stat_snapshots
+    {
+        struct tr_lock * lock;
+        tr_stat        * stats;
+        int              count;
+        int              alloc;
+
+        /* set once a client asks for a snapshot,
+           and once the table's first been filled */
+        bool             isEnabled;
+        bool             isFilled;
+    }
+    statSnapshots;
+
     tr_variant                   removedTorrents;
 
+    /* the oldest and newest revisions handed out by RPC's torrent-get.
+       see "changed-since" in rpcimpl.c */
+    int64_t                      rpcRevisionFirst;
+    int64_t                      rpcRevision;
+
     bool                         stalledEnabled;
     bool                         queueEnabled[2];
     int                          queueSize[2];
@@ -149,6 +171,15 @@ struct tr_session
 
     int                          uploadSlotsPerTorrent;
 
+    /* how many threads may hash pieces during a recheck */
+    int                          verifyThreads;
+
+    /* how many threads read .torrent and .resume files at startup */
+    int                          loadThreads;
+
+    /* how many connections web.c may open to one host, or 0 for no limit */
+    int                          webConnectionsPerHost;
+
     /* The UDP sockets used for the DHT and uTP. */
     tr_port                      udp_port;
     int                          udp_socket;
@@ -177,6 +208,13 @@ struct tr_session
     int                          torrentCount;
     tr_torrent *                 torrentList;
 
+    /* torrentList hashed by id, info hash, and obfuscated info hash.
+       torrentBucketCount is zero or a power of two */
+    tr_torrent **                torrentsById;
+    tr_torrent **                torrentsByHash;
+    tr_torrent **                torrentsByObfuscatedHash;
+    size_t                       torrentBucketCount;
+
     char *                       torrentDoneScript;
 
     char *                       tag;
@@ -196,6 +234,9 @@ struct tr_session
 
     struct tr_cache *            cache;
 
+    /* NULL unless "snapshot-enabled" is set. see snapshot.h */
+    struct tr_snapshot *         snapshot;
+
     struct tr_lock *             lock;
 
     struct tr_web *              web;
@@ -209,7 +250,8 @@ struct tr_session
     struct tr_announcer        * announcer;
     struct tr_announcer_udp    * announcer_udp;
 
-    tr_variant                 * metainfoLookup;
+    /* hash string -> .torrent filename, sorted by hash string */
+    struct tr_ptrArray         * metainfoLookup;
 
     struct event               * nowTimer;
     struct event               * saveTimer;
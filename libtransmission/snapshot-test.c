@@ -0,0 +1,564 @@
+#include <stdio.h> /* fopen () */
+#include <stdlib.h> /* mkdtemp () */
+#include <string.h> /* memcmp () */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h> /* truncate () */
+#include <utime.h>
+
+#include "transmission.h"
+#include "completion.h"
+#include "metainfo.h" /* tr_metainfoGetBasename () */
+#include "platform.h" /* tr_getResumeDir () */
+#include "resume.h"
+#include "session.h"
+#include "snapshot.h"
+#include "torrent.h"
+#include "utils.h"
+
+#include "libtransmission-test.h"
+
+enum
+{
+    PIECE_SIZE = 32 * 1024,
+    PIECE_COUNT = 8,
+
+    /* see snapshot.c */
+    HEADER_SIZE = 16,
+    MIN_GARBAGE_BYTES = (1024 * 1024),
+    RECORD_RESUME = 2,
+
+    /* where struct snapshot_resume's blocksMode is in a resume record */
+    BLOCKS_MODE_OFFSET = 32 + 140
+};
+
+/***
+****  Fixture: a session with a torrent, and a tr_snapshot of our own.
+****  The session's own snapshot stays off so that it doesn't write
+****  the same file.
+***/
+
+struct fixture
+{
+    tr_session * session;
+    tr_torrent * tor;
+    tr_snapshot * snapshot;
+    char * snapshotFilename;
+    char * resumeFilename;
+    char config_dir[64];
+};
+
+/* like setSnapshotEnabled (): a torrent that's already loaded
+   gets its metainfo added on its next save */
+static void
+openSnapshot (struct fixture * f)
+{
+    f->snapshot = tr_snapshotOpen (f->session);
+    f->tor->snapshotHasInfo = false;
+}
+
+static void
+closeSnapshot (struct fixture * f)
+{
+    tr_snapshotClose (f->snapshot);
+    f->snapshot = NULL;
+}
+
+static bool
+fixtureInit (struct fixture * f)
+{
+    char * base;
+
+    memset (f, 0, sizeof (struct fixture));
+    tr_strlcpy (f->config_dir, "/tmp/transmission-snapshot-test-XXXXXX", sizeof (f->config_dir));
+    if (mkdtemp (f->config_dir) == NULL)
+        return false;
+
+    f->session = libttest_session_init (f->config_dir, NULL);
+    f->tor = libttest_torrent_init (f->session, PIECE_SIZE, PIECE_COUNT);
+    f->snapshotFilename = tr_buildPath (f->config_dir, "torrents.snapshot", NULL);
+
+    if (f->tor == NULL)
+        return false;
+
+    base = tr_metainfoGetBasename (tr_torrentInfo (f->tor));
+    f->resumeFilename = tr_strdup_printf ("%s" TR_PATH_DELIMITER_STR "%s.resume",
+                                          tr_getResumeDir (f->session), base);
+    tr_free (base);
+
+    openSnapshot (f);
+    return true;
+}
+
+static void
+fixtureFree (struct fixture * f)
+{
+    if (f->snapshot != NULL)
+        tr_snapshotClose (f->snapshot);
+
+    tr_sessionClose (f->session);
+    libttest_rm_rf (f->config_dir);
+    tr_free (f->resumeFilename);
+    tr_free (f->snapshotFilename);
+}
+
+static void
+reopen (struct fixture * f)
+{
+    closeSnapshot (f);
+    openSnapshot (f);
+}
+
+static size_t
+fileSize (const char * filename)
+{
+    struct stat sb;
+
+    return stat (filename, &sb) ? 0 : (size_t) sb.st_size;
+}
+
+/* the torrent is only touched from the libtransmission thread */
+
+static void
+saveImpl (void * vf)
+{
+    struct fixture * f = vf;
+
+    tr_torrentSaveResume (f->tor);
+    tr_snapshotSave (f->snapshot, f->tor, f->resumeFilename);
+}
+
+static void
+save (struct fixture * f)
+{
+    libttest_run_in_event_thread (f->session, saveImpl, f);
+}
+
+static void
+removeImpl (void * vf)
+{
+    struct fixture * f = vf;
+
+    tr_snapshotRemove (f->snapshot, f->tor);
+}
+
+static bool
+hasInfo (const struct fixture * f)
+{
+    int len;
+    tr_info inf;
+    const bool found = tr_snapshotGetInfo (f->snapshot, tr_torrentInfo (f->tor)->torrent, &inf, &len);
+
+    if (found)
+        tr_metainfoFree (&inf);
+
+    return found;
+}
+
+static const tr_snapshot_record *
+getResume (const struct fixture * f)
+{
+    return tr_snapshotGetResume (f->snapshot, tr_torrentInfo (f->tor), f->resumeFilename);
+}
+
+/* overwrites `len' bytes at `offset' in the file */
+static void
+patchFile (const char * filename, long offset, const void * data, size_t len)
+{
+    FILE * fp = fopen (filename, "r+b");
+
+    fseek (fp, offset, SEEK_SET);
+    fwrite (data, 1, len, fp);
+    fclose (fp);
+}
+
+/***
+****
+***/
+
+struct resume_state
+{
+    uint64_t downloaded;
+    uint64_t uploaded;
+    uint64_t corrupt;
+    time_t addedDate;
+    time_t doneDate;
+    int secondsSeeding;
+    double ratioLimit;
+    tr_ratiolimit ratioMode;
+    unsigned int speedLimitUp;
+    bool useSpeedLimitUp;
+    tr_priority_t priority;
+    tr_priority_t filePriority;
+    int maxPeers;
+    bool hasPiece0;
+    bool hasPiece1;
+};
+
+static void
+getState (const tr_torrent * tor, struct resume_state * st)
+{
+    st->downloaded = tor->downloadedPrev + tor->downloadedCur;
+    st->uploaded = tor->uploadedPrev + tor->uploadedCur;
+    st->corrupt = tor->corruptPrev + tor->corruptCur;
+    st->addedDate = tor->addedDate;
+    st->doneDate = tor->doneDate;
+    st->secondsSeeding = tor->secondsSeeding;
+    st->ratioLimit = tr_torrentGetRatioLimit (tor);
+    st->ratioMode = tr_torrentGetRatioMode (tor);
+    st->speedLimitUp = tr_torrentGetSpeedLimit_Bps (tor, TR_UP);
+    st->useSpeedLimitUp = tr_torrentUsesSpeedLimit (tor, TR_UP);
+    st->priority = tr_torrentGetPriority (tor);
+    st->filePriority = tor->info.files[0].priority;
+    st->maxPeers = tor->maxConnectedPeers;
+    st->hasPiece0 = tr_cpPieceIsComplete (&tor->completion, 0);
+    st->hasPiece1 = tr_cpPieceIsComplete (&tor->completion, 1);
+}
+
+static void
+setState (tr_torrent * tor, int n)
+{
+    tr_file_index_t file = 0;
+
+    tor->downloadedPrev = 1000 * n;
+    tor->uploadedPrev = 2000 * n;
+    tor->corruptPrev = 30 * n;
+    tor->downloadedCur = tor->uploadedCur = tor->corruptCur = 0;
+    tor->addedDate = 1000000 + n;
+    tor->doneDate = 2000000 + n;
+    tor->secondsSeeding = 40 * n;
+    tr_torrentSetRatioLimit (tor, 1.5 * n);
+    tr_torrentSetRatioMode (tor, n % 2 ? TR_RATIOLIMIT_SINGLE : TR_RATIOLIMIT_UNLIMITED);
+    tr_torrentSetSpeedLimit_Bps (tor, TR_UP, 1024 * n);
+    tr_torrentUseSpeedLimit (tor, TR_UP, n % 2);
+    tr_torrentSetPriority (tor, n % 2 ? TR_PRI_HIGH : TR_PRI_LOW);
+    tr_torrentSetFilePriorities (tor, &file, 1, n % 2 ? TR_PRI_LOW : TR_PRI_HIGH);
+    tor->maxConnectedPeers = 10 + n;
+
+    /* so the blocks are saved as a raw bitfield */
+    if (n % 2)
+        tr_cpPieceRem (&tor->completion, 0);
+    else
+        tr_cpPieceAdd (&tor->completion, 0);
+}
+
+struct round_trip
+{
+    struct fixture * f;
+    const tr_snapshot_record * rec;
+    struct resume_state saved;
+    struct resume_state loaded;
+    uint64_t fieldsLoaded;
+};
+
+static void
+setStateAndSaveImpl (void * vrt)
+{
+    struct round_trip * rt = vrt;
+
+    setState (rt->f->tor, 1);
+    getState (rt->f->tor, &rt->saved);
+    saveImpl (rt->f);
+}
+
+static void
+loadResumeImpl (void * vrt)
+{
+    struct round_trip * rt = vrt;
+
+    setState (rt->f->tor, 2);
+    rt->fieldsLoaded = tr_snapshotLoadResume (rt->f->tor, ~(uint64_t)0, rt->rec);
+    getState (rt->f->tor, &rt->loaded);
+}
+
+static int
+test_save_and_reopen (void)
+{
+    int len;
+    tr_info inf;
+    struct fixture f;
+    struct round_trip rt;
+    const tr_info * tinf;
+    uint8_t hashes[PIECE_COUNT * SHA_DIGEST_LENGTH];
+    uint8_t expectedHashes[PIECE_COUNT * SHA_DIGEST_LENGTH];
+
+    check (fixtureInit (&f));
+    tinf = tr_torrentInfo (f.tor);
+
+    memset (&rt, 0, sizeof (rt));
+    rt.f = &f;
+    libttest_run_in_event_thread (f.session, setStateAndSaveImpl, &rt);
+    reopen (&f);
+
+    /* the metainfo */
+    check (tr_snapshotGetInfo (f.snapshot, tinf->torrent, &inf, &len));
+    check (!memcmp (tinf->hash, inf.hash, SHA_DIGEST_LENGTH));
+    check_streq (tinf->hashString, inf.hashString);
+    check_streq (tinf->name, inf.name);
+    check_streq (tinf->torrent, inf.torrent);
+    check_int_eq (tinf->totalSize, inf.totalSize);
+    check_int_eq (tinf->pieceSize, inf.pieceSize);
+    check_int_eq (tinf->pieceCount, inf.pieceCount);
+    check_int_eq (tinf->fileCount, inf.fileCount);
+    check_streq (tinf->files[0].name, inf.files[0].name);
+    check_int_eq (tinf->files[0].length, inf.files[0].length);
+    check_int_eq (tinf->isPrivate, inf.isPrivate);
+    check_int_eq (f.tor->infoDictLength, len);
+    tr_metainfoFree (&inf);
+
+    check (tr_metainfoGetPieceHashes (tinf, expectedHashes));
+    check (tr_snapshotGetPieceHashes (f.snapshot, tinf, hashes));
+    check (!memcmp (expectedHashes, hashes, sizeof (hashes)));
+
+    /* the resume data */
+    check ((rt.rec = getResume (&f)) != NULL);
+    libttest_run_in_event_thread (f.session, loadResumeImpl, &rt);
+    check (rt.fieldsLoaded & TR_FR_PROGRESS);
+    check (rt.fieldsLoaded & TR_FR_SPEEDLIMIT);
+    check_int_eq (rt.saved.downloaded, rt.loaded.downloaded);
+    check_int_eq (rt.saved.uploaded, rt.loaded.uploaded);
+    check_int_eq (rt.saved.corrupt, rt.loaded.corrupt);
+    check_int_eq (rt.saved.addedDate, rt.loaded.addedDate);
+    check_int_eq (rt.saved.doneDate, rt.loaded.doneDate);
+    check_int_eq (rt.saved.secondsSeeding, rt.loaded.secondsSeeding);
+    check_int_eq ((int)(rt.saved.ratioLimit * 100), (int)(rt.loaded.ratioLimit * 100));
+    check_int_eq (rt.saved.ratioMode, rt.loaded.ratioMode);
+    check_int_eq (rt.saved.speedLimitUp, rt.loaded.speedLimitUp);
+    check_int_eq (rt.saved.useSpeedLimitUp, rt.loaded.useSpeedLimitUp);
+    check_int_eq (rt.saved.priority, rt.loaded.priority);
+    check_int_eq (rt.saved.filePriority, rt.loaded.filePriority);
+    check_int_eq (rt.saved.maxPeers, rt.loaded.maxPeers);
+    check (!rt.loaded.hasPiece0);
+    check (rt.loaded.hasPiece1);
+
+    fixtureFree (&f);
+    return 0;
+}
+
+static int
+test_truncated_record (void)
+{
+    size_t goodSize;
+    struct fixture f;
+    const uint32_t partial[4] = { RECORD_RESUME, 4096, 0, 0 };
+
+    check (fixtureInit (&f));
+    save (&f);
+    closeSnapshot (&f);
+
+    /* a crash in the middle of appending a record */
+    goodSize = fileSize (f.snapshotFilename);
+    patchFile (f.snapshotFilename, goodSize, partial, sizeof (partial));
+    check_int_eq (goodSize + sizeof (partial), fileSize (f.snapshotFilename));
+
+    /* the records before it are still good, and the tail is cut off */
+    openSnapshot (&f);
+    check (hasInfo (&f));
+    check (getResume (&f) != NULL);
+    check_int_eq (goodSize, fileSize (f.snapshotFilename));
+
+    /* and if the cut is inside the resume record, that record's gone
+       but the metainfo before it is still there */
+    closeSnapshot (&f);
+    check (!truncate (f.snapshotFilename, goodSize - 8));
+    openSnapshot (&f);
+    check (hasInfo (&f));
+    check (getResume (&f) == NULL);
+
+    fixtureFree (&f);
+    return 0;
+}
+
+static int
+test_wrong_magic_or_version (void)
+{
+    struct fixture f;
+    const char badMagic = 'X';
+    const uint32_t badVersion = 99;
+
+    check (fixtureInit (&f));
+    save (&f);
+    closeSnapshot (&f);
+
+    patchFile (f.snapshotFilename, 0, &badMagic, 1);
+    openSnapshot (&f);
+    check (!hasInfo (&f));
+    check (getResume (&f) == NULL);
+
+    /* it's started over with just a header */
+    check_int_eq (HEADER_SIZE, fileSize (f.snapshotFilename));
+
+    save (&f);
+    reopen (&f);
+    check (hasInfo (&f));
+    closeSnapshot (&f);
+
+    patchFile (f.snapshotFilename, 8, &badVersion, sizeof (badVersion));
+    openSnapshot (&f);
+    check (!hasInfo (&f));
+    check_int_eq (HEADER_SIZE, fileSize (f.snapshotFilename));
+
+    fixtureFree (&f);
+    return 0;
+}
+
+static int
+test_changed_torrent_file (void)
+{
+    struct stat sb;
+    struct utimbuf times;
+    struct fixture f;
+    uint8_t hashes[PIECE_COUNT * SHA_DIGEST_LENGTH];
+    const char * torrentFilename;
+
+    check (fixtureInit (&f));
+    torrentFilename = tr_torrentInfo (f.tor)->torrent;
+    save (&f);
+    reopen (&f);
+    check (hasInfo (&f));
+    check (tr_snapshotGetPieceHashes (f.snapshot, tr_torrentInfo (f.tor), hashes));
+
+    /* the .torrent file changed since the snapshot copied it */
+    check (!stat (torrentFilename, &sb));
+    times.actime = sb.st_atime;
+    times.modtime = sb.st_mtime + 10;
+    check (!utime (torrentFilename, &times));
+    check (!hasInfo (&f));
+    check (!tr_snapshotGetPieceHashes (f.snapshot, tr_torrentInfo (f.tor), hashes));
+
+    /* and the same for the .resume file */
+    check (getResume (&f) != NULL);
+    check (!stat (f.resumeFilename, &sb));
+    times.actime = sb.st_atime;
+    times.modtime = sb.st_mtime + 10;
+    check (!utime (f.resumeFilename, &times));
+    check (getResume (&f) == NULL);
+
+    fixtureFree (&f);
+    return 0;
+}
+
+static int
+test_removed_record (void)
+{
+    struct fixture f;
+
+    check (fixtureInit (&f));
+    save (&f);
+    save (&f);
+    libttest_run_in_event_thread (f.session, removeImpl, &f);
+    reopen (&f);
+
+    /* the removal hides every record before it */
+    check (!hasInfo (&f));
+    check (getResume (&f) == NULL);
+
+    /* but not the ones after it */
+    save (&f);
+    reopen (&f);
+    check (hasInfo (&f));
+    check (getResume (&f) != NULL);
+
+    fixtureFree (&f);
+    return 0;
+}
+
+static int
+test_compact_while_open (void)
+{
+    int i;
+    size_t size = 0;
+    size_t biggest = 0;
+    bool shrank = false;
+    struct fixture f;
+
+    check (fixtureInit (&f));
+    save (&f);
+    reopen (&f);
+
+    /* every save appends a resume record and makes the last one garbage.
+       once there's more than MIN_GARBAGE_BYTES of it, the file is
+       rewritten without closing the snapshot */
+    for (i=0; i<100000 && !shrank; ++i)
+    {
+        save (&f);
+        size = fileSize (f.snapshotFilename);
+        shrank = size < biggest;
+        biggest = MAX (biggest, size);
+    }
+
+    /* the save that took it past the limit was compacted right away,
+       so the biggest size seen is one record short of it */
+    check (shrank);
+    check (biggest >= MIN_GARBAGE_BYTES - 4096);
+    check (size < MIN_GARBAGE_BYTES);
+
+    /* the open snapshot's index still points into the old file, which
+       stays mapped, and the snapshot still takes saves */
+    check (hasInfo (&f));
+    save (&f);
+    reopen (&f);
+    check (hasInfo (&f));
+    check (getResume (&f) != NULL);
+
+    fixtureFree (&f);
+    return 0;
+}
+
+/* returns the offset of the file's first record of the given type */
+static long
+findRecord (const char * filename, uint32_t type)
+{
+    long offset = HEADER_SIZE;
+    uint32_t head[2]; /* tr_snapshot_record's type and length */
+    FILE * fp = fopen (filename, "rb");
+
+    while (!fseek (fp, offset, SEEK_SET) && (fread (head, sizeof (head), 1, fp) == 1) && (head[1] > 0))
+    {
+        if (head[0] == type)
+            break;
+        offset += head[1];
+    }
+
+    fclose (fp);
+    return head[0] == type ? offset : -1;
+}
+
+static int
+test_unknown_blocks_mode (void)
+{
+    long offset;
+    struct fixture f;
+    const uint32_t badMode = 7;
+
+    check (fixtureInit (&f));
+    save (&f);
+    closeSnapshot (&f);
+
+    /* a resume record whose blocks are neither raw, all, nor none */
+    check ((offset = findRecord (f.snapshotFilename, RECORD_RESUME)) > 0);
+    patchFile (f.snapshotFilename, offset + BLOCKS_MODE_OFFSET, &badMode, sizeof (badMode));
+
+    /* isn't offered to tr_snapshotLoadResume () */
+    openSnapshot (&f);
+    check (hasInfo (&f));
+    check (getResume (&f) == NULL);
+
+    fixtureFree (&f);
+    return 0;
+}
+
+int
+main (void)
+{
+    const testFunc tests[] = { test_save_and_reopen,
+                               test_truncated_record,
+                               test_wrong_magic_or_version,
+                               test_changed_torrent_file,
+                               test_removed_record,
+                               test_compact_while_open,
+                               test_unknown_blocks_mode };
+
+    return runTests (tests, NUM_TESTS (tests));
+}
@@ -0,0 +1,1330 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h> /* rename () */
+#include <stdlib.h> /* bsearch (), qsort () */
+#include <string.h>
+
+#include <unistd.h> /* close (), unlink (), write () */
+
+#ifndef WIN32
+ #include <sys/mman.h>
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include <event2/buffer.h>
+
+#include "transmission.h"
+#include "completion.h"
+#include "crypto.h" /* tr_sha1_to_hex () */
+#include "metainfo.h" /* tr_metainfoFree () */
+#include "platform.h" /* tr_getTorrentDir () */
+#include "resume.h" /* TR_FR_* */
+#include "session.h"
+#include "snapshot.h"
+#include "torrent.h"
+#include "utils.h"
+
+#ifndef O_BINARY
+ #define O_BINARY 0
+#endif
+
+#define SNAPSHOT_FILENAME "torrents.snapshot"
+
+static const char snapshot_magic[8] = { 'T', 'R', 'S', 'N', 'A', 'P', '\0', '\0' };
+
+enum
+{
+    SNAPSHOT_VERSION = 1,
+
+    /* a snapshot written on a machine with another byte order is ignored */
+    SNAPSHOT_BYTE_ORDER = 0x01020304,
+
+    /* rewrite the file while it's open once its garbage outweighs
+     * the live records, and is at least this big */
+    MIN_GARBAGE_BYTES = (1024 * 1024),
+
+    RECORD_INFO = 1,
+    RECORD_RESUME = 2,
+    RECORD_REMOVED = 3,
+
+    BLOCKS_RAW = 0,
+    BLOCKS_ALL = 1,
+    BLOCKS_NONE = 2
+};
+
+/***
+****  File format
+****
+****  A snapshot_header, followed by records. Every record starts with a
+****  tr_snapshot_record and its length is a multiple of 8, so the fixed-size
+****  body after the header and the sections that the body points to are
+****  all aligned. Offsets are from the start of the record, and a string
+****  offset of zero means NULL. Integers are in the host's byte order.
+***/
+
+struct snapshot_header
+{
+    char      magic[8];
+    uint32_t  version;
+    uint32_t  byteOrder;
+};
+
+struct tr_snapshot_record
+{
+    uint32_t  type;
+    uint32_t  length;
+    uint8_t   hash[SHA_DIGEST_LENGTH];
+    uint32_t  reserved;
+};
+
+/* the body of a RECORD_INFO */
+struct snapshot_info
+{
+    int64_t   torrentMTime;
+    uint64_t  torrentSize;
+    uint64_t  totalSize;
+    int64_t   dateCreated;
+    uint32_t  pieceSize;
+    uint32_t  pieceCount;
+    uint32_t  fileCount;
+    uint32_t  trackerCount;
+    uint32_t  webseedCount;
+    uint32_t  infoDictLength;
+    uint32_t  isPrivate;
+    uint32_t  isMultifile;
+    uint32_t  basename;      /* the .torrent file's name, for lookups */
+    uint32_t  name;
+    uint32_t  comment;
+    uint32_t  creator;
+    uint32_t  files;         /* struct snapshot_file[fileCount] */
+    uint32_t  trackers;      /* struct snapshot_tracker[trackerCount] */
+    uint32_t  webseeds;      /* uint32_t[webseedCount] string offsets */
+    uint32_t  pieces;        /* uint8_t[pieceCount][SHA_DIGEST_LENGTH] */
+};
+
+struct snapshot_file
+{
+    uint64_t  length;
+    uint32_t  name;
+    uint32_t  reserved;
+};
+
+struct snapshot_tracker
+{
+    int32_t   tier;
+    uint32_t  id;
+    uint32_t  announce;
+    uint32_t  scrape;
+};
+
+/* the body of a RECORD_RESUME */
+struct snapshot_resume
+{
+    int64_t   resumeMTime;
+    uint64_t  resumeSize;
+    uint64_t  downloaded;
+    uint64_t  uploaded;
+    uint64_t  corrupt;
+    int64_t   addedDate;
+    int64_t   doneDate;
+    int64_t   activityDate;
+    int64_t   secondsSeeding;
+    int64_t   secondsDownloading;
+    double    ratioLimit;
+    uint32_t  speedLimitUp_Bps;
+    uint32_t  speedLimitDown_Bps;
+    uint32_t  useSpeedLimitUp;
+    uint32_t  useSpeedLimitDown;
+    uint32_t  useSessionLimits;
+    int32_t   ratioMode;
+    int32_t   idleMode;
+    uint32_t  idleLimit;
+    uint32_t  maxPeers;
+    int32_t   bandwidthPriority;
+    uint32_t  isPaused;
+    uint32_t  fileCount;
+    uint32_t  pieceCount;
+    uint32_t  blocksMode;    /* BLOCKS_RAW, _ALL, or _NONE */
+    uint32_t  blocksLength;
+    uint32_t  downloadDir;
+    uint32_t  incompleteDir;
+    uint32_t  filePriorities; /* int8_t[fileCount] */
+    uint32_t  fileDND;       /* int8_t[fileCount] */
+    uint32_t  timeChecked;   /* int64_t[pieceCount] */
+    uint32_t  blocks;        /* uint8_t[blocksLength] of the block bitfield */
+    uint32_t  reserved;
+};
+
+/***
+****
+***/
+
+struct snapshot_entry
+{
+    const tr_snapshot_record  * info;
+    const tr_snapshot_record  * resume;
+    const char                * basename;
+};
+
+struct tr_snapshot
+{
+    char                    * filename;
+    char                    * torrentDir;
+
+    /* appends records to the file */
+    int                       fd;
+
+    /* how big the file is now, and how much of that was live records
+     * when it was last indexed. everything appended since then is
+     * counted as garbage until the next indexing says otherwise */
+    size_t                    fileLength;
+    size_t                    liveLength;
+
+    /* the file as it was when it was last indexed.
+     * WIN32 has no mmap (), so there it's a copy in memory */
+    uint8_t                 * map;
+    size_t                    mapLength;
+
+    /* the newest records for each torrent in map, sorted by hash */
+    struct snapshot_entry   * entries;
+    size_t                    entryCount;
+
+    /* the same entries, sorted by basename */
+    struct snapshot_entry  ** byName;
+
+    /* true if map has garbage or a partially-written record */
+    bool                      needsCompact;
+};
+
+/* returns `count' items of `size' bytes at `offset' in the record,
+ * or NULL if they don't fit inside it */
+static const void*
+recordGet (const tr_snapshot_record * rec, uint32_t offset, size_t size, size_t count)
+{
+    if ((offset < sizeof (tr_snapshot_record)) || (offset > rec->length))
+        return NULL;
+
+    if (count && (size > (rec->length - offset) / count))
+        return NULL;
+
+    return (const uint8_t*)rec + offset;
+}
+
+static const void*
+recordBody (const tr_snapshot_record * rec, size_t size)
+{
+    return recordGet (rec, sizeof (tr_snapshot_record), size, 1);
+}
+
+/* returns true if offset is zero or a nul-terminated string inside the record */
+static bool
+recordGetString (const tr_snapshot_record * rec, uint32_t offset, const char ** setme)
+{
+    const char * str = NULL;
+
+    if (offset != 0)
+    {
+        if ((str = recordGet (rec, offset, 1, 1)) == NULL)
+            return false;
+
+        if (memchr (str, '\0', rec->length - offset) == NULL)
+            return false;
+    }
+
+    *setme = str;
+    return true;
+}
+
+/***
+****  Indexing
+***/
+
+static int
+compareRecordsByHash (const void * va, const void * vb)
+{
+    const tr_snapshot_record * a = *(const tr_snapshot_record**) va;
+    const tr_snapshot_record * b = *(const tr_snapshot_record**) vb;
+    const int ret = memcmp (a->hash, b->hash, SHA_DIGEST_LENGTH);
+
+    if (ret)
+        return ret;
+
+    /* keep a torrent's records in the order they were written */
+    return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+static int
+compareEntriesByName (const void * va, const void * vb)
+{
+    const struct snapshot_entry * a = *(const struct snapshot_entry**) va;
+    const struct snapshot_entry * b = *(const struct snapshot_entry**) vb;
+
+    return strcmp (a->basename, b->basename);
+}
+
+static bool
+isUsableInfo (const tr_snapshot_record * rec, const char ** setmeBasename)
+{
+    const struct snapshot_info * body = recordBody (rec, sizeof (struct snapshot_info));
+
+    return (body != NULL)
+        && recordGetString (rec, body->basename, setmeBasename)
+        && (*setmeBasename != NULL);
+}
+
+static bool
+isUsableResume (const tr_snapshot_record * rec, const tr_snapshot_record * info)
+{
+    const struct snapshot_info * ibody = recordBody (info, sizeof (struct snapshot_info));
+    const struct snapshot_resume * body = recordBody (rec, sizeof (struct snapshot_resume));
+
+    return (body != NULL)
+        && (body->fileCount == ibody->fileCount)
+        && (body->pieceCount == ibody->pieceCount);
+}
+
+static void
+snapshotUnmap (tr_snapshot * s)
+{
+    if (s->map != NULL)
+    {
+#ifdef WIN32
+        tr_free (s->map);
+#else
+        munmap (s->map, s->mapLength);
+#endif
+    }
+
+    tr_free (s->byName);
+    tr_free (s->entries);
+
+    s->map = NULL;
+    s->mapLength = 0;
+    s->entries = NULL;
+    s->entryCount = 0;
+    s->byName = NULL;
+    s->liveLength = 0;
+    s->needsCompact = false;
+}
+
+/* find the newest records of each torrent. A torrent's metainfo is
+ * written once and its resume data on every save, so the newest resume
+ * record may be newer than the newest info record, but a RECORD_REMOVED
+ * makes every older record garbage. */
+static void
+snapshotIndex (tr_snapshot * s)
+{
+    size_t i;
+    size_t n = 0;
+    size_t alloc = 0;
+    size_t liveBytes = 0;
+    size_t offset = sizeof (struct snapshot_header);
+    const tr_snapshot_record ** records = NULL;
+    const struct snapshot_header * header = (const struct snapshot_header*) s->map;
+
+    if ((s->mapLength < sizeof (struct snapshot_header))
+      || memcmp (header->magic, snapshot_magic, sizeof (snapshot_magic))
+      || (header->version != SNAPSHOT_VERSION)
+      || (header->byteOrder != SNAPSHOT_BYTE_ORDER))
+    {
+        if (s->mapLength > 0)
+            tr_inf (_("Ignoring snapshot \"%s\" from another version"), s->filename);
+        s->needsCompact = s->mapLength > 0;
+        return;
+    }
+
+    while (offset + sizeof (tr_snapshot_record) <= s->mapLength)
+    {
+        const tr_snapshot_record * rec = (const tr_snapshot_record*)(s->map + offset);
+
+        if ((rec->length < sizeof (tr_snapshot_record))
+          || (rec->length % 8)
+          || (rec->length > s->mapLength - offset))
+            break;
+
+        if (n == alloc)
+        {
+            alloc = alloc ? alloc * 2 : 256;
+            records = tr_renew (const tr_snapshot_record*, records, alloc);
+        }
+
+        records[n++] = rec;
+        offset += rec->length;
+    }
+
+    /* a record that was only partly written when we crashed */
+    if (offset != s->mapLength)
+        s->needsCompact = true;
+
+    qsort (records, n, sizeof (const tr_snapshot_record*), compareRecordsByHash);
+
+    s->entries = tr_new (struct snapshot_entry, n);
+    for (i=0; i<n; )
+    {
+        size_t j;
+        const char * basename = NULL;
+        const tr_snapshot_record * info = NULL;
+        const tr_snapshot_record * resume = NULL;
+
+        for (j=i; j<n && !memcmp (records[j]->hash, records[i]->hash, SHA_DIGEST_LENGTH); ++j)
+        {
+            switch (records[j]->type)
+            {
+                case RECORD_INFO: info = records[j]; break;
+                case RECORD_RESUME: resume = records[j]; break;
+                default: info = resume = NULL; break;
+            }
+        }
+
+        if ((info != NULL) && !isUsableInfo (info, &basename))
+            info = NULL;
+
+        if ((resume != NULL) && ((info == NULL) || !isUsableResume (resume, info)))
+            resume = NULL;
+
+        if (info != NULL)
+        {
+            struct snapshot_entry * e = &s->entries[s->entryCount++];
+            e->info = info;
+            e->resume = resume;
+            e->basename = basename;
+            liveBytes += info->length + (resume ? resume->length : 0);
+        }
+
+        i = j;
+    }
+
+    s->liveLength = sizeof (struct snapshot_header) + liveBytes;
+    if (s->liveLength != s->mapLength)
+        s->needsCompact = true;
+
+    s->byName = tr_new (struct snapshot_entry*, s->entryCount);
+    for (i=0; i<s->entryCount; ++i)
+        s->byName[i] = &s->entries[i];
+    qsort (s->byName, s->entryCount, sizeof (struct snapshot_entry*), compareEntriesByName);
+
+    tr_free (records);
+}
+
+static void
+snapshotMap (tr_snapshot * s)
+{
+    struct stat sb;
+#ifdef WIN32
+    size_t len;
+    uint8_t * map;
+#else
+    int fd;
+    void * map;
+#endif
+
+    snapshotUnmap (s);
+
+    if (stat (s->filename, &sb) || (sb.st_size == 0))
+        return;
+
+#ifdef WIN32
+    /* tr_loadFile () logs its own errors */
+    if ((map = tr_loadFile (s->filename, &len)) == NULL)
+        return;
+
+    s->map = map;
+    s->mapLength = len;
+#else
+    if ((fd = open (s->filename, O_RDONLY | O_BINARY)) == -1)
+    {
+        tr_err (_("Couldn't read \"%1$s\": %2$s"), s->filename, tr_strerror (errno));
+        return;
+    }
+
+    map = mmap (NULL, (size_t) sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close (fd);
+
+    if (map == MAP_FAILED)
+    {
+        tr_err (_("Couldn't read \"%1$s\": %2$s"), s->filename, tr_strerror (errno));
+        return;
+    }
+
+    s->map = map;
+    s->mapLength = (size_t) sb.st_size;
+#endif
+
+    snapshotIndex (s);
+}
+
+/***
+****  Writing
+***/
+
+static bool
+writeAll (int fd, const void * data, size_t len)
+{
+    const uint8_t * walk = data;
+
+    while (len > 0)
+    {
+        const ssize_t n = write (fd, walk, len);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        walk += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+/* rewrite the file with only the newest records of each torrent */
+static void
+snapshotCompact (tr_snapshot * s)
+{
+    int fd;
+    size_t i;
+    bool ok;
+    struct snapshot_header header;
+    char * tmp = tr_strdup_printf ("%s.tmp", s->filename);
+
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, snapshot_magic, sizeof (snapshot_magic));
+    header.version = SNAPSHOT_VERSION;
+    header.byteOrder = SNAPSHOT_BYTE_ORDER;
+
+    fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0600);
+    ok = (fd != -1) && writeAll (fd, &header, sizeof (header));
+
+    for (i=0; ok && i<s->entryCount; ++i)
+    {
+        struct stat sb;
+        const struct snapshot_entry * e = &s->entries[i];
+        char * path = tr_buildPath (s->torrentDir, e->basename, NULL);
+
+        /* skip torrents whose .torrent file was removed behind our back */
+        if (!stat (path, &sb))
+        {
+            ok = writeAll (fd, e->info, e->info->length);
+            if (ok && (e->resume != NULL))
+                ok = writeAll (fd, e->resume, e->resume->length);
+        }
+
+        tr_free (path);
+    }
+
+    if (!ok)
+        tr_err (_("Couldn't save \"%1$s\": %2$s"), tmp, tr_strerror (errno));
+
+    if (fd != -1)
+        close (fd);
+
+#ifdef WIN32
+    if (ok && !MoveFileEx (tmp, s->filename, MOVEFILE_REPLACE_EXISTING))
+#else
+    if (ok && rename (tmp, s->filename))
+#endif
+    {
+        tr_err (_("Couldn't save \"%1$s\": %2$s"), s->filename, tr_strerror (errno));
+        ok = false;
+    }
+
+    if (!ok)
+        unlink (tmp);
+
+    tr_free (tmp);
+}
+
+/* compact the file while the session is running. The index that
+ * tr_snapshotGetInfo () and friends search is left alone because other
+ * threads may be reading it. It keeps pointing into the old file,
+ * which stays mapped after the new one is renamed over it. */
+static void
+snapshotCompactLive (tr_snapshot * s)
+{
+    struct stat sb;
+    tr_snapshot tmp;
+
+    memset (&tmp, 0, sizeof (tmp));
+    tmp.filename = s->filename;
+    tmp.torrentDir = s->torrentDir;
+    tmp.fd = -1;
+
+    close (s->fd);
+
+    snapshotMap (&tmp);
+    if (tmp.map != NULL)
+        snapshotCompact (&tmp);
+    snapshotUnmap (&tmp);
+
+    s->fd = open (s->filename, O_WRONLY | O_APPEND | O_BINARY);
+    if (s->fd == -1)
+        tr_err (_("Couldn't save \"%1$s\": %2$s"), s->filename, tr_strerror (errno));
+
+    /* if it didn't work, wait for as much garbage again before retrying */
+    s->fileLength = s->liveLength = stat (s->filename, &sb) ? 0 : (size_t) sb.st_size;
+}
+
+static void
+snapshotCheckGarbage (tr_snapshot * s)
+{
+    const size_t garbage = s->fileLength - s->liveLength;
+
+    if ((s->fd != -1) && (garbage >= MIN_GARBAGE_BYTES) && (garbage > s->liveLength))
+        snapshotCompactLive (s);
+}
+
+static void
+padRecord (struct evbuffer * rec)
+{
+    static const uint8_t zeroes[8] = { 0 };
+    const size_t len = evbuffer_get_length (rec);
+
+    evbuffer_add (rec, zeroes, (8 - (len % 8)) % 8);
+}
+
+/* appends `len' bytes to the record, padded so the next section is
+ * aligned, and returns their offset from the start of the record */
+static uint32_t
+addSection (struct evbuffer * rec, const void * data, size_t len)
+{
+    const uint32_t offset = evbuffer_get_length (rec);
+
+    evbuffer_add (rec, data, len);
+    padRecord (rec);
+    return offset;
+}
+
+static uint32_t
+addString (struct evbuffer * rec, const char * str)
+{
+    return str ? addSection (rec, str, strlen (str) + 1) : 0;
+}
+
+/* reserves room at the front of the record for its header and body */
+static void
+startRecord (struct evbuffer * rec, size_t bodyLength)
+{
+    struct evbuffer_iovec iovec;
+    const size_t n = sizeof (tr_snapshot_record) + bodyLength;
+
+    evbuffer_reserve_space (rec, n, &iovec, 1);
+    memset (iovec.iov_base, 0, n);
+    iovec.iov_len = n;
+    evbuffer_commit_space (rec, &iovec, 1);
+}
+
+static bool
+appendRecord (tr_snapshot      * s,
+              struct evbuffer  * rec,
+              uint32_t           type,
+              const uint8_t    * hash,
+              const void       * body,
+              size_t             bodyLength)
+{
+    bool ok;
+    tr_snapshot_record header;
+    uint8_t * walk = evbuffer_pullup (rec, -1);
+
+    memset (&header, 0, sizeof (header));
+    header.type = type;
+    header.length = evbuffer_get_length (rec);
+    memcpy (header.hash, hash, SHA_DIGEST_LENGTH);
+
+    assert ((header.length % 8) == 0);
+
+    memcpy (walk, &header, sizeof (header));
+    if (bodyLength > 0)
+        memcpy (walk + sizeof (header), body, bodyLength);
+
+    if (!(ok = writeAll (s->fd, walk, header.length)))
+        tr_err (_("Couldn't save \"%1$s\": %2$s"), s->filename, tr_strerror (errno));
+
+    s->fileLength += header.length;
+    return ok;
+}
+
+static bool
+appendInfo (tr_snapshot * s, const tr_torrent * tor)
+{
+    bool ok;
+    int i;
+    tr_file_index_t fi;
+    struct stat sb;
+    struct snapshot_info body;
+    uint8_t * hashes = NULL;
+    struct evbuffer * rec;
+    struct snapshot_file * files;
+    struct snapshot_tracker * trackers;
+    uint32_t * webseeds;
+    const char * basename;
+    const tr_info * inf = tr_torrentInfo (tor);
+
+    if ((inf->torrent == NULL) || stat (inf->torrent, &sb))
+        return false;
+
+    /* stopped torrents don't keep their piece hashes in memory */
+    if (inf->pieceHashes == NULL)
+    {
+        hashes = tr_new (uint8_t, (size_t)inf->pieceCount * SHA_DIGEST_LENGTH);
+        if (!tr_metainfoGetPieceHashes (inf, hashes))
+        {
+            tr_free (hashes);
+            return false;
+        }
+    }
+
+    basename = strrchr (inf->torrent, TR_PATH_DELIMITER);
+
+    memset (&body, 0, sizeof (body));
+    body.torrentMTime = sb.st_mtime;
+    body.torrentSize = sb.st_size;
+    body.totalSize = inf->totalSize;
+    body.dateCreated = inf->dateCreated;
+    body.pieceSize = inf->pieceSize;
+    body.pieceCount = inf->pieceCount;
+    body.fileCount = inf->fileCount;
+    body.trackerCount = inf->trackerCount;
+    body.webseedCount = inf->webseedCount;
+    body.infoDictLength = tor->infoDictLength;
+    body.isPrivate = inf->isPrivate;
+    body.isMultifile = inf->isMultifile;
+
+    rec = evbuffer_new ();
+    startRecord (rec, sizeof (body));
+
+    body.basename = addString (rec, basename ? basename + 1 : inf->torrent);
+    body.name = addString (rec, inf->name);
+    body.comment = addString (rec, inf->comment);
+    body.creator = addString (rec, inf->creator);
+
+    files = tr_new0 (struct snapshot_file, inf->fileCount);
+    for (fi=0; fi<inf->fileCount; ++fi)
+    {
+        files[fi].length = inf->files[fi].length;
+        files[fi].name = addString (rec, inf->files[fi].name);
+    }
+    body.files = addSection (rec, files, sizeof (struct snapshot_file) * inf->fileCount);
+    tr_free (files);
+
+    trackers = tr_new0 (struct snapshot_tracker, inf->trackerCount);
+    for (i=0; i<inf->trackerCount; ++i)
+    {
+        trackers[i].tier = inf->trackers[i].tier;
+        trackers[i].id = inf->trackers[i].id;
+        trackers[i].announce = addString (rec, inf->trackers[i].announce);
+        trackers[i].scrape = addString (rec, inf->trackers[i].scrape);
+    }
+    body.trackers = addSection (rec, trackers, sizeof (struct snapshot_tracker) * inf->trackerCount);
+    tr_free (trackers);
+
+    webseeds = tr_new0 (uint32_t, inf->webseedCount);
+    for (i=0; i<inf->webseedCount; ++i)
+        webseeds[i] = addString (rec, inf->webseeds[i]);
+    body.webseeds = addSection (rec, webseeds, sizeof (uint32_t) * inf->webseedCount);
+    tr_free (webseeds);
+
+    body.pieces = addSection (rec, hashes ? hashes : inf->pieceHashes,
+                              (size_t)inf->pieceCount * SHA_DIGEST_LENGTH);
+    tr_free (hashes);
+
+    ok = appendRecord (s, rec, RECORD_INFO, inf->hash, &body, sizeof (body));
+    evbuffer_free (rec);
+    return ok;
+}
+
+static bool
+appendResume (tr_snapshot * s, const tr_torrent * tor, const char * resumeFilename)
+{
+    bool ok;
+    struct stat sb;
+    tr_file_index_t fi;
+    tr_piece_index_t pi;
+    struct snapshot_resume body;
+    struct evbuffer * rec;
+    int8_t * fileBytes;
+    int64_t * times;
+    const tr_info * inf = tr_torrentInfo (tor);
+    const tr_bitfield * blocks = &tor->completion.blockBitfield;
+
+    if (stat (resumeFilename, &sb))
+        return false;
+
+    memset (&body, 0, sizeof (body));
+    body.resumeMTime = sb.st_mtime;
+    body.resumeSize = sb.st_size;
+    body.downloaded = tor->downloadedPrev + tor->downloadedCur;
+    body.uploaded = tor->uploadedPrev + tor->uploadedCur;
+    body.corrupt = tor->corruptPrev + tor->corruptCur;
+    body.addedDate = tor->addedDate;
+    body.doneDate = tor->doneDate;
+    body.activityDate = tor->activityDate;
+    body.secondsSeeding = tor->secondsSeeding;
+    body.secondsDownloading = tor->secondsDownloading;
+    body.ratioLimit = tr_torrentGetRatioLimit (tor);
+    body.speedLimitUp_Bps = tr_torrentGetSpeedLimit_Bps (tor, TR_UP);
+    body.speedLimitDown_Bps = tr_torrentGetSpeedLimit_Bps (tor, TR_DOWN);
+    body.useSpeedLimitUp = tr_torrentUsesSpeedLimit (tor, TR_UP);
+    body.useSpeedLimitDown = tr_torrentUsesSpeedLimit (tor, TR_DOWN);
+    body.useSessionLimits = tr_torrentUsesSessionLimits (tor);
+    body.ratioMode = tr_torrentGetRatioMode (tor);
+    body.idleMode = tr_torrentGetIdleMode (tor);
+    body.idleLimit = tr_torrentGetIdleLimit (tor);
+    body.maxPeers = tor->maxConnectedPeers;
+    body.bandwidthPriority = tr_torrentGetPriority (tor);
+    body.isPaused = !tor->isRunning;
+    body.fileCount = inf->fileCount;
+    body.pieceCount = inf->pieceCount;
+
+    rec = evbuffer_new ();
+    startRecord (rec, sizeof (body));
+
+    body.downloadDir = addString (rec, tor->downloadDir);
+    body.incompleteDir = addString (rec, tor->incompleteDir);
+
+    fileBytes = tr_new (int8_t, inf->fileCount);
+    for (fi=0; fi<inf->fileCount; ++fi)
+        fileBytes[fi] = inf->files[fi].priority;
+    body.filePriorities = addSection (rec, fileBytes, inf->fileCount);
+    for (fi=0; fi<inf->fileCount; ++fi)
+        fileBytes[fi] = inf->files[fi].dnd ? 1 : 0;
+    body.fileDND = addSection (rec, fileBytes, inf->fileCount);
+    tr_free (fileBytes);
+
+    times = tr_new (int64_t, inf->pieceCount);
+    for (pi=0; pi<inf->pieceCount; ++pi)
+        times[pi] = inf->pieceTimeChecked[pi];
+    body.timeChecked = addSection (rec, times, sizeof (int64_t) * inf->pieceCount);
+    tr_free (times);
+
+    if (tr_bitfieldHasAll (blocks))
+        body.blocksMode = BLOCKS_ALL;
+    else if (tr_bitfieldHasNone (blocks))
+        body.blocksMode = BLOCKS_NONE;
+    else {
+        size_t byteCount = 0;
+        uint8_t * raw = tr_bitfieldGetRaw (blocks, &byteCount);
+        body.blocksMode = BLOCKS_RAW;
+        body.blocksLength = byteCount;
+        body.blocks = addSection (rec, raw, byteCount);
+        tr_free (raw);
+    }
+
+    ok = appendRecord (s, rec, RECORD_RESUME, inf->hash, &body, sizeof (body));
+    evbuffer_free (rec);
+    return ok;
+}
+
+/***
+****  Reading
+***/
+
+static int
+compareHashToEntry (const void * hash, const void * ventry)
+{
+    const struct snapshot_entry * entry = ventry;
+
+    return memcmp (hash, entry->info->hash, SHA_DIGEST_LENGTH);
+}
+
+static int
+compareNameToEntry (const void * name, const void * ventry)
+{
+    const struct snapshot_entry * entry = *(const struct snapshot_entry**) ventry;
+
+    return strcmp (name, entry->basename);
+}
+
+/* the piece hashes aren't copied; see tr_snapshotGetPieceHashes () */
+static bool
+infoFromRecord (const tr_snapshot_record * rec, tr_info * inf)
+{
+    uint32_t i;
+    const uint32_t * webseeds;
+    const struct snapshot_file * files;
+    const struct snapshot_tracker * trackers;
+    const char * name;
+    const char * comment;
+    const char * creator;
+    const struct snapshot_info * body = recordBody (rec, sizeof (struct snapshot_info));
+
+    memcpy (inf->hash, rec->hash, SHA_DIGEST_LENGTH);
+    tr_sha1_to_hex (inf->hashString, inf->hash);
+    inf->totalSize = body->totalSize;
+    inf->dateCreated = body->dateCreated;
+    inf->pieceSize = body->pieceSize;
+    inf->isPrivate = body->isPrivate != 0;
+    inf->isMultifile = body->isMultifile != 0;
+
+    if (!recordGetString (rec, body->name, &name) || (name == NULL)
+      || !recordGetString (rec, body->comment, &comment)
+      || !recordGetString (rec, body->creator, &creator))
+        return false;
+
+    inf->name = tr_strdup (name);
+    inf->comment = tr_strdup (comment);
+    inf->creator = tr_strdup (creator);
+
+    files = recordGet (rec, body->files, sizeof (struct snapshot_file), body->fileCount);
+    if ((files == NULL) || (body->fileCount == 0))
+        return false;
+    inf->fileCount = body->fileCount;
+    inf->files = tr_new0 (tr_file, inf->fileCount);
+    for (i=0; i<body->fileCount; ++i)
+    {
+        if (!recordGetString (rec, files[i].name, &name) || (name == NULL))
+            return false;
+        inf->files[i].length = files[i].length;
+        inf->files[i].name = tr_strdup (name);
+    }
+
+    trackers = recordGet (rec, body->trackers, sizeof (struct snapshot_tracker), body->trackerCount);
+    if (trackers == NULL)
+        return false;
+    inf->trackerCount = body->trackerCount;
+    inf->trackers = tr_new0 (tr_tracker_info, inf->trackerCount);
+    for (i=0; i<body->trackerCount; ++i)
+    {
+        const char * announce;
+        const char * scrape;
+        if (!recordGetString (rec, trackers[i].announce, &announce) || (announce == NULL)
+          || !recordGetString (rec, trackers[i].scrape, &scrape))
+            return false;
+        inf->trackers[i].tier = trackers[i].tier;
+        inf->trackers[i].id = trackers[i].id;
+        inf->trackers[i].announce = tr_strdup (announce);
+        inf->trackers[i].scrape = tr_strdup (scrape);
+    }
+
+    webseeds = recordGet (rec, body->webseeds, sizeof (uint32_t), body->webseedCount);
+    if (webseeds == NULL)
+        return false;
+    inf->webseedCount = body->webseedCount;
+    inf->webseeds = tr_new0 (char*, inf->webseedCount);
+    for (i=0; i<body->webseedCount; ++i)
+    {
+        if (!recordGetString (rec, webseeds[i], &name) || (name == NULL))
+            return false;
+        inf->webseeds[i] = tr_strdup (name);
+    }
+
+    if ((recordGet (rec, body->pieces, SHA_DIGEST_LENGTH, body->pieceCount) == NULL)
+      || (body->pieceSize == 0)
+      || ((uint64_t) body->pieceCount != (body->totalSize + body->pieceSize - 1) / body->pieceSize))
+        return false;
+    inf->pieceCount = body->pieceCount;
+
+    return true;
+}
+
+static bool
+isCompleteResume (const tr_snapshot_record * rec)
+{
+    const char * str;
+    const struct snapshot_resume * body = recordBody (rec, sizeof (struct snapshot_resume));
+
+    return recordGetString (rec, body->downloadDir, &str)
+        && recordGetString (rec, body->incompleteDir, &str)
+        && (recordGet (rec, body->filePriorities, 1, body->fileCount) != NULL)
+        && (recordGet (rec, body->fileDND, 1, body->fileCount) != NULL)
+        && (recordGet (rec, body->timeChecked, sizeof (int64_t), body->pieceCount) != NULL)
+        && ((body->blocksMode == BLOCKS_ALL)
+            || (body->blocksMode == BLOCKS_NONE)
+            || ((body->blocksMode == BLOCKS_RAW)
+                && (recordGet (rec, body->blocks, 1, body->blocksLength) != NULL)));
+}
+
+bool
+tr_snapshotGetInfo (const tr_snapshot * s,
+                    const char        * torrentFilename,
+                    tr_info           * setme,
+                    int               * setmeInfoDictLength)
+{
+    struct stat sb;
+    struct snapshot_entry ** found;
+    const struct snapshot_info * body;
+    const char * basename = strrchr (torrentFilename, TR_PATH_DELIMITER);
+
+    basename = basename ? basename + 1 : torrentFilename;
+    found = bsearch (basename, s->byName, s->entryCount,
+                     sizeof (struct snapshot_entry*), compareNameToEntry);
+    if (found == NULL)
+        return false;
+
+    body = recordBody ((*found)->info, sizeof (struct snapshot_info));
+    if (stat (torrentFilename, &sb)
+      || (sb.st_mtime != body->torrentMTime)
+      || ((uint64_t) sb.st_size != body->torrentSize))
+        return false;
+
+    memset (setme, 0, sizeof (tr_info));
+    if (!infoFromRecord ((*found)->info, setme))
+    {
+        tr_metainfoFree (setme);
+        return false;
+    }
+
+    setme->torrent = tr_strdup (torrentFilename);
+    *setmeInfoDictLength = body->infoDictLength;
+    return true;
+}
+
+bool
+tr_snapshotGetPieceHashes (const tr_snapshot * s,
+                           const tr_info     * info,
+                           uint8_t           * setme)
+{
+    struct stat sb;
+    const uint8_t * pieces;
+    const struct snapshot_entry * found;
+    const struct snapshot_info * body;
+
+    found = bsearch (info->hash, s->entries, s->entryCount,
+                     sizeof (struct snapshot_entry), compareHashToEntry);
+    if (found == NULL)
+        return false;
+
+    body = recordBody (found->info, sizeof (struct snapshot_info));
+    if ((body->pieceCount != info->pieceCount)
+      || (info->torrent == NULL)
+      || stat (info->torrent, &sb)
+      || (sb.st_mtime != body->torrentMTime)
+      || ((uint64_t) sb.st_size != body->torrentSize))
+        return false;
+
+    pieces = recordGet (found->info, body->pieces, SHA_DIGEST_LENGTH, body->pieceCount);
+    if (pieces == NULL)
+        return false;
+
+    memcpy (setme, pieces, (size_t)body->pieceCount * SHA_DIGEST_LENGTH);
+    return true;
+}
+
+const tr_snapshot_record *
+tr_snapshotGetResume (const tr_snapshot * s,
+                      const tr_info     * info,
+                      const char        * resumeFilename)
+{
+    struct stat sb;
+    const struct snapshot_entry * found;
+    const struct snapshot_resume * body;
+
+    found = bsearch (info->hash, s->entries, s->entryCount,
+                     sizeof (struct snapshot_entry), compareHashToEntry);
+    if ((found == NULL) || (found->resume == NULL))
+        return NULL;
+
+    body = recordBody (found->resume, sizeof (struct snapshot_resume));
+    if ((body->fileCount != info->fileCount)
+      || (body->pieceCount != info->pieceCount)
+      || !isCompleteResume (found->resume))
+        return NULL;
+
+    if (stat (resumeFilename, &sb)
+      || (sb.st_mtime != body->resumeMTime)
+      || ((uint64_t) sb.st_size != body->resumeSize))
+        return NULL;
+
+    return found->resume;
+}
+
+uint64_t
+tr_snapshotLoadResume (tr_torrent               * tor,
+                       uint64_t                   fieldsToLoad,
+                       const tr_snapshot_record * rec)
+{
+    uint64_t fieldsLoaded = 0;
+    const tr_info * inf = tr_torrentInfo (tor);
+    const struct snapshot_resume * body = recordBody (rec, sizeof (struct snapshot_resume));
+    const char * str;
+
+    assert (body->fileCount == inf->fileCount);
+    assert (body->pieceCount == inf->pieceCount);
+
+    if (fieldsToLoad & TR_FR_CORRUPT)
+    {
+        tor->corruptPrev = body->corrupt;
+        fieldsLoaded |= TR_FR_CORRUPT;
+    }
+
+    if ((fieldsToLoad & (TR_FR_PROGRESS | TR_FR_DOWNLOAD_DIR))
+      && recordGetString (rec, body->downloadDir, &str)
+      && (str && *str))
+    {
+        tr_free (tor->downloadDir);
+        tor->downloadDir = tr_strdup (str);
+        fieldsLoaded |= TR_FR_DOWNLOAD_DIR;
+    }
+
+    if ((fieldsToLoad & (TR_FR_PROGRESS | TR_FR_INCOMPLETE_DIR))
+      && recordGetString (rec, body->incompleteDir, &str)
+      && (str && *str))
+    {
+        tr_free (tor->incompleteDir);
+        tor->incompleteDir = tr_strdup (str);
+        fieldsLoaded |= TR_FR_INCOMPLETE_DIR;
+    }
+
+    if (fieldsToLoad & TR_FR_DOWNLOADED)
+    {
+        tor->downloadedPrev = body->downloaded;
+        fieldsLoaded |= TR_FR_DOWNLOADED;
+    }
+
+    if (fieldsToLoad & TR_FR_UPLOADED)
+    {
+        tor->uploadedPrev = body->uploaded;
+        fieldsLoaded |= TR_FR_UPLOADED;
+    }
+
+    if (fieldsToLoad & TR_FR_MAX_PEERS)
+    {
+        tor->maxConnectedPeers = body->maxPeers;
+        fieldsLoaded |= TR_FR_MAX_PEERS;
+    }
+
+    if (fieldsToLoad & TR_FR_RUN)
+    {
+        tor->isRunning = !body->isPaused;
+        fieldsLoaded |= TR_FR_RUN;
+    }
+
+    if (fieldsToLoad & TR_FR_ADDED_DATE)
+    {
+        tor->addedDate = body->addedDate;
+        fieldsLoaded |= TR_FR_ADDED_DATE;
+    }
+
+    if (fieldsToLoad & TR_FR_DONE_DATE)
+    {
+        tor->doneDate = body->doneDate;
+        fieldsLoaded |= TR_FR_DONE_DATE;
+    }
+
+    if (fieldsToLoad & TR_FR_ACTIVITY_DATE)
+    {
+        tr_torrentSetActivityDate (tor, body->activityDate);
+        fieldsLoaded |= TR_FR_ACTIVITY_DATE;
+    }
+
+    if (fieldsToLoad & TR_FR_TIME_SEEDING)
+    {
+        tor->secondsSeeding = body->secondsSeeding;
+        fieldsLoaded |= TR_FR_TIME_SEEDING;
+    }
+
+    if (fieldsToLoad & TR_FR_TIME_DOWNLOADING)
+    {
+        tor->secondsDownloading = body->secondsDownloading;
+        fieldsLoaded |= TR_FR_TIME_DOWNLOADING;
+    }
+
+    if ((fieldsToLoad & TR_FR_BANDWIDTH_PRIORITY)
+      && tr_isPriority (body->bandwidthPriority))
+    {
+        tr_torrentSetPriority (tor, body->bandwidthPriority);
+        fieldsLoaded |= TR_FR_BANDWIDTH_PRIORITY;
+    }
+
+    if (fieldsToLoad & TR_FR_FILE_PRIORITIES)
+    {
+        tr_file_index_t i;
+        const int8_t * priorities = recordGet (rec, body->filePriorities, 1, body->fileCount);
+
+        for (i=0; i<inf->fileCount; ++i)
+            tr_torrentInitFilePriority (tor, i, priorities[i]);
+        fieldsLoaded |= TR_FR_FILE_PRIORITIES;
+    }
+
+    if (fieldsToLoad & TR_FR_DND)
+    {
+        const int8_t * dnd = recordGet (rec, body->fileDND, 1, body->fileCount);
+        tr_file_index_t * dl = tr_new (tr_file_index_t, inf->fileCount);
+        tr_file_index_t * notDl = tr_new (tr_file_index_t, inf->fileCount);
+        tr_file_index_t i, dlCount = 0, notDlCount = 0;
+
+        for (i=0; i<inf->fileCount; ++i)
+        {
+            if (dnd[i])
+                notDl[notDlCount++] = i;
+            else
+                dl[dlCount++] = i;
+        }
+
+        if (notDlCount)
+            tr_torrentInitFileDLs (tor, notDl, notDlCount, false);
+        if (dlCount)
+            tr_torrentInitFileDLs (tor, dl, dlCount, true);
+
+        tr_free (notDl);
+        tr_free (dl);
+        fieldsLoaded |= TR_FR_DND;
+    }
+
+    if (fieldsToLoad & TR_FR_PROGRESS)
+    {
+        tr_piece_index_t i;
+        struct tr_bitfield blocks = TR_BITFIELD_INIT;
+        const int64_t * times = recordGet (rec, body->timeChecked, sizeof (int64_t), body->pieceCount);
+
+        for (i=0; i<inf->pieceCount; ++i)
+            inf->pieceTimeChecked[i] = (time_t) times[i];
+
+        tr_bitfieldConstruct (&blocks, tor->blockCount);
+
+        if (body->blocksMode == BLOCKS_ALL)
+            tr_bitfieldSetHasAll (&blocks);
+        else if (body->blocksMode == BLOCKS_NONE)
+            tr_bitfieldSetHasNone (&blocks);
+        else
+            tr_bitfieldSetRaw (&blocks, recordGet (rec, body->blocks, 1, body->blocksLength),
+                               body->blocksLength, true);
+
+        tr_cpBlockInit (&tor->completion, &blocks);
+        tr_bitfieldDestruct (&blocks);
+        fieldsLoaded |= TR_FR_PROGRESS;
+    }
+
+    if (fieldsToLoad & TR_FR_SPEEDLIMIT)
+    {
+        tr_torrentSetSpeedLimit_Bps (tor, TR_UP, body->speedLimitUp_Bps);
+        tr_torrentSetSpeedLimit_Bps (tor, TR_DOWN, body->speedLimitDown_Bps);
+        tr_torrentUseSpeedLimit (tor, TR_UP, body->useSpeedLimitUp != 0);
+        tr_torrentUseSpeedLimit (tor, TR_DOWN, body->useSpeedLimitDown != 0);
+        tr_torrentUseSessionLimits (tor, body->useSessionLimits != 0);
+        fieldsLoaded |= TR_FR_SPEEDLIMIT;
+    }
+
+    if (fieldsToLoad & TR_FR_RATIOLIMIT)
+    {
+        tr_torrentSetRatioLimit (tor, body->ratioLimit);
+        tr_torrentSetRatioMode (tor, body->ratioMode);
+        fieldsLoaded |= TR_FR_RATIOLIMIT;
+    }
+
+    if (fieldsToLoad & TR_FR_IDLELIMIT)
+    {
+        tr_torrentSetIdleLimit (tor, body->idleLimit);
+        tr_torrentSetIdleMode (tor, body->idleMode);
+        fieldsLoaded |= TR_FR_IDLELIMIT;
+    }
+
+    return fieldsLoaded;
+}
+
+/***
+****
+***/
+
+tr_snapshot *
+tr_snapshotOpen (const tr_session * session)
+{
+    tr_snapshot * s = tr_new0 (tr_snapshot, 1);
+
+    s->filename = tr_buildPath (session->configDir, SNAPSHOT_FILENAME, NULL);
+    s->torrentDir = tr_strdup (tr_getTorrentDir (session));
+
+    snapshotMap (s);
+
+    /* we didn't get to compact it last time, e.g. because of a crash */
+    if (s->needsCompact)
+    {
+        snapshotCompact (s);
+        snapshotMap (s);
+    }
+
+    s->fd = open (s->filename, O_WRONLY | O_CREAT | O_APPEND | O_BINARY, 0600);
+    if (s->fd == -1)
+    {
+        tr_err (_("Couldn't save \"%1$s\": %2$s"), s->filename, tr_strerror (errno));
+    }
+    else if (s->mapLength == 0)
+    {
+        struct snapshot_header header;
+        memset (&header, 0, sizeof (header));
+        memcpy (header.magic, snapshot_magic, sizeof (snapshot_magic));
+        header.version = SNAPSHOT_VERSION;
+        header.byteOrder = SNAPSHOT_BYTE_ORDER;
+        if (!writeAll (s->fd, &header, sizeof (header)))
+        {
+            tr_err (_("Couldn't save \"%1$s\": %2$s"), s->filename, tr_strerror (errno));
+            close (s->fd);
+            s->fd = -1;
+        }
+        s->fileLength = s->liveLength = sizeof (header);
+    }
+    else
+    {
+        s->fileLength = s->mapLength;
+    }
+
+    tr_inf (_("Snapshot \"%s\" contains %zu torrents"), s->filename, s->entryCount);
+
+    return s;
+}
+
+void
+tr_snapshotClose (tr_snapshot * s)
+{
+    if (s->fd != -1)
+        close (s->fd);
+
+    /* reindex to pick up everything that was appended while we were open */
+    snapshotMap (s);
+    if (s->needsCompact)
+        snapshotCompact (s);
+    snapshotUnmap (s);
+
+    tr_free (s->torrentDir);
+    tr_free (s->filename);
+    tr_free (s);
+}
+
+void
+tr_snapshotSave (tr_snapshot * s,
+                 tr_torrent  * tor,
+                 const char  * resumeFilename)
+{
+    if ((s->fd == -1) || !tr_torrentHasMetadata (tor))
+        return;
+
+    if (!tor->snapshotHasInfo)
+        tor->snapshotHasInfo = appendInfo (s, tor);
+
+    if (tor->snapshotHasInfo)
+        appendResume (s, tor, resumeFilename);
+
+    snapshotCheckGarbage (s);
+}
+
+void
+tr_snapshotRemove (tr_snapshot * s,
+                   tr_torrent  * tor)
+{
+    if (s->fd != -1)
+    {
+        struct evbuffer * rec = evbuffer_new ();
+        startRecord (rec, 0);
+        appendRecord (s, rec, RECORD_REMOVED, tor->info.hash, NULL, 0);
+        evbuffer_free (rec);
+        snapshotCheckGarbage (s);
+    }
+
+    tor->snapshotHasInfo = false;
+}
@@ -0,0 +1,107 @@
+/*
+ * This file Copyright (C) Mnemosyne LLC
+ *
+ * This file is licensed by the GPL version 2. Works owned by the
+ * Transmission project are granted a special exemption to clause 2 (b)
+ * so that the bulk of its code can remain under the MIT license.
+ * This exemption does not extend to derived works not owned by
+ * the Transmission project.
+ *
+ * $Id$
+ */
+
+#ifndef __TRANSMISSION__
+ #error only libtransmission should #include this header.
+#endif
+
+#ifndef TR_SNAPSHOT_H
+#define TR_SNAPSHOT_H
+
+#include "transmission.h"
+
+/**
+ * @addtogroup file_io File IO
+ * @{
+ */
+
+/**
+ * A session-wide copy of the torrents' metainfo and resume data
+ * in a flat binary file that can be mapped into memory.
+ *
+ * Loading a torrent from the snapshot is a handful of memcpy ()s
+ * instead of parsing its .torrent and .resume files, so it's meant
+ * to make a cold start with many torrents faster. The .torrent and
+ * .resume files are still written as usual and stay authoritative:
+ * each record remembers the mtime and size of the file it mirrors,
+ * and is ignored once that file changes.
+ *
+ * The file is append-only while the session runs. tr_torrentSaveResume ()
+ * adds a state record for the torrent, plus a metainfo record the first
+ * time; older records for the same torrent become garbage, which is
+ * dropped when the snapshot is opened or closed, or sooner if there's
+ * more garbage than live records.
+ */
+typedef struct tr_snapshot tr_snapshot;
+
+/** @brief one torrent's resume data in the snapshot */
+typedef struct tr_snapshot_record tr_snapshot_record;
+
+tr_snapshot * tr_snapshotOpen (const tr_session * session);
+
+/** @brief compacts and closes the snapshot */
+void tr_snapshotClose (tr_snapshot * snapshot);
+
+/**
+ * @brief fill in a tr_info from the snapshot's copy of a .torrent file
+ *
+ * Returns false if there isn't a copy or if the .torrent file has changed
+ * since it was made. Safe to call from any thread.
+ */
+bool tr_snapshotGetInfo (const tr_snapshot * snapshot,
+                         const char        * torrentFilename,
+                         tr_info           * setme,
+                         int               * setmeInfoDictLength);
+
+/**
+ * @brief copy a torrent's piece hashes out of the snapshot
+ *
+ * tr_snapshotGetInfo () leaves tr_info.pieceHashes empty so that stopped
+ * torrents don't keep them in memory; this fetches them when they're needed.
+ * setme must hold info->pieceCount hashes. Returns false if there isn't a
+ * copy or if the .torrent file has changed since it was made.
+ */
+bool tr_snapshotGetPieceHashes (const tr_snapshot * snapshot,
+                                const tr_info     * info,
+                                uint8_t           * setme);
+
+/**
+ * @brief find the snapshot's copy of a torrent's .resume file
+ *
+ * Returns NULL if there isn't a copy or if the .resume file has changed
+ * since it was made. The record stays valid until the snapshot is closed.
+ * Safe to call from any thread.
+ */
+const tr_snapshot_record * tr_snapshotGetResume (const tr_snapshot * snapshot,
+                                                 const tr_info     * info,
+                                                 const char        * resumeFilename);
+
+/**
+ * @brief like tr_torrentLoadResume (), but from a tr_snapshotGetResume () record
+ * @return a bitwise-or'ed set of the loaded TR_FR_ fields
+ */
+uint64_t tr_snapshotLoadResume (tr_torrent               * tor,
+                                uint64_t                   fieldsToLoad,
+                                const tr_snapshot_record * record);
+
+/** @brief append the torrent's current state, after its .resume file was saved */
+void tr_snapshotSave (tr_snapshot * snapshot,
+                      tr_torrent  * tor,
+                      const char  * resumeFilename);
+
+/** @brief forget the torrent, e.g. when its .resume file is removed */
+void tr_snapshotRemove (tr_snapshot * snapshot,
+                        tr_torrent  * tor);
+
+/* @} */
+
+#endif
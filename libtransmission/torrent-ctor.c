@@ -92,7 +92,7 @@ tr_ctorSetMetainfo (tr_ctor *       ctor,
     int err;
 
     clearMetainfo (ctor);
-    err = tr_variantFromBenc (&ctor->metainfo, metainfo, len);
+    err = tr_variantFromBufArena (&ctor->metainfo, TR_VARIANT_FMT_BENC, metainfo, len, NULL, NULL);
     ctor->isSet_metainfo = !err;
     return err;
 }
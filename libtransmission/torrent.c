@@ -23,6 +23,7 @@
 #include <dirent.h>
 
 #include <assert.h>
+#include <ctype.h> /* isxdigit () */
 #include <math.h>
 #include <stdarg.h>
 #include <string.h> /* memcmp */
@@ -47,6 +48,7 @@
 #include "platform.h" /* TR_PATH_DELIMITER_STR */
 #include "ptrarray.h"
 #include "session.h"
+#include "snapshot.h"
 #include "torrent.h"
 #include "torrent-magnet.h"
 #include "trevent.h" /* tr_runInEventThread () */
@@ -85,28 +87,127 @@ tr_torrentId (const tr_torrent * tor)
     return tor->uniqueId;
 }
 
+/***
+****  The session's torrent lookup tables
+***/
+
+enum
+{
+    MIN_TORRENT_BUCKET_COUNT = 64
+};
+
+static inline size_t
+getIdBucket (const tr_session * session, int id)
+{
+    /* ids are handed out sequentially, so the low bits are spread evenly */
+    return (uint32_t)id & (session->torrentBucketCount - 1);
+}
+
+static inline size_t
+getHashBucket (const tr_session * session, const uint8_t * hash)
+{
+    uint32_t h;
+
+    /* any part of a SHA1 hash is as good a hash as any */
+    memcpy (&h, hash, sizeof (h));
+    return h & (session->torrentBucketCount - 1);
+}
+
+static void
+torrentIndexInsert (tr_session * session, tr_torrent * tor)
+{
+    size_t bucket;
+
+    bucket = getIdBucket (session, tor->uniqueId);
+    tor->nextWithIdBucket = session->torrentsById[bucket];
+    session->torrentsById[bucket] = tor;
+
+    bucket = getHashBucket (session, tor->info.hash);
+    tor->nextWithHashBucket = session->torrentsByHash[bucket];
+    session->torrentsByHash[bucket] = tor;
+
+    bucket = getHashBucket (session, tor->obfuscatedHash);
+    tor->nextWithObfuscatedHashBucket = session->torrentsByObfuscatedHash[bucket];
+    session->torrentsByObfuscatedHash[bucket] = tor;
+}
+
+/* rebuild the tables from session->torrentList */
+static void
+torrentIndexRehash (tr_session * session, size_t bucket_count)
+{
+    tr_torrent * tor = NULL;
+
+    tr_free (session->torrentsById);
+    tr_free (session->torrentsByHash);
+    tr_free (session->torrentsByObfuscatedHash);
+
+    session->torrentBucketCount = bucket_count;
+    session->torrentsById = tr_new0 (tr_torrent*, bucket_count);
+    session->torrentsByHash = tr_new0 (tr_torrent*, bucket_count);
+    session->torrentsByObfuscatedHash = tr_new0 (tr_torrent*, bucket_count);
+
+    while ((tor = tr_torrentNext (session, tor)))
+        torrentIndexInsert (session, tor);
+}
+
+/* call after tor has been added to session->torrentList */
+static void
+torrentIndexAdd (tr_session * session, tr_torrent * tor)
+{
+    if ((size_t)session->torrentCount > session->torrentBucketCount)
+        torrentIndexRehash (session, MAX (MIN_TORRENT_BUCKET_COUNT, session->torrentBucketCount * 2));
+    else
+        torrentIndexInsert (session, tor);
+}
+
+static void
+torrentIndexRemove (tr_session * session, tr_torrent * tor)
+{
+    tr_torrent ** walk;
+
+    walk = &session->torrentsById[getIdBucket (session, tor->uniqueId)];
+    while (*walk != tor)
+        walk = &(*walk)->nextWithIdBucket;
+    *walk = tor->nextWithIdBucket;
+
+    walk = &session->torrentsByHash[getHashBucket (session, tor->info.hash)];
+    while (*walk != tor)
+        walk = &(*walk)->nextWithHashBucket;
+    *walk = tor->nextWithHashBucket;
+
+    walk = &session->torrentsByObfuscatedHash[getHashBucket (session, tor->obfuscatedHash)];
+    while (*walk != tor)
+        walk = &(*walk)->nextWithObfuscatedHashBucket;
+    *walk = tor->nextWithObfuscatedHashBucket;
+}
+
 tr_torrent*
 tr_torrentFindFromId (tr_session * session, int id)
 {
     tr_torrent * tor = NULL;
 
-    while ((tor = tr_torrentNext (session, tor)))
-        if (tor->uniqueId == id)
-            return tor;
+    if (session->torrentBucketCount > 0)
+        for (tor=session->torrentsById[getIdBucket (session, id)]; tor!=NULL; tor=tor->nextWithIdBucket)
+            if (tor->uniqueId == id)
+                break;
 
-    return NULL;
+    return tor;
 }
 
 tr_torrent*
 tr_torrentFindFromHashString (tr_session *  session, const char * str)
 {
-    tr_torrent * tor = NULL;
+    int i;
+    uint8_t hash[SHA_DIGEST_LENGTH];
 
-    while ((tor = tr_torrentNext (session, tor)))
-        if (!evutil_ascii_strcasecmp (str, tor->info.hashString))
-            return tor;
+    for (i=0; i<SHA_DIGEST_LENGTH*2; ++i)
+        if (!isxdigit ((unsigned char)str[i]))
+            return NULL;
+    if (str[i] != '\0')
+        return NULL;
 
-    return NULL;
+    tr_hex_to_sha1 (hash, str);
+    return tr_torrentFindFromHash (session, hash);
 }
 
 tr_torrent*
@@ -114,12 +215,12 @@ tr_torrentFindFromHash (tr_session * session, const uint8_t * torrentHash)
 {
     tr_torrent * tor = NULL;
 
-    while ((tor = tr_torrentNext (session, tor)))
-        if (*tor->info.hash == *torrentHash)
+    if (session->torrentBucketCount > 0)
+        for (tor=session->torrentsByHash[getHashBucket (session, torrentHash)]; tor!=NULL; tor=tor->nextWithHashBucket)
             if (!memcmp (tor->info.hash, torrentHash, SHA_DIGEST_LENGTH))
-                return tor;
+                break;
 
-    return NULL;
+    return tor;
 }
 
 tr_torrent*
@@ -143,12 +244,12 @@ tr_torrentFindFromObfuscatedHash (tr_session * session,
 {
     tr_torrent * tor = NULL;
 
-    while ((tor = tr_torrentNext (session, tor)))
-        if (!memcmp (tor->obfuscatedHash, obfuscatedTorrentHash,
-                     SHA_DIGEST_LENGTH))
-            return tor;
+    if (session->torrentBucketCount > 0)
+        for (tor=session->torrentsByObfuscatedHash[getHashBucket (session, obfuscatedTorrentHash)]; tor!=NULL; tor=tor->nextWithObfuscatedHashBucket)
+            if (!memcmp (tor->obfuscatedHash, obfuscatedTorrentHash, SHA_DIGEST_LENGTH))
+                break;
 
-    return NULL;
+    return tor;
 }
 
 bool
@@ -679,7 +780,7 @@ tr_torrentInitFilePieces (tr_torrent * tor)
 #endif
 
     for (p=0; p<inf->pieceCount; ++p)
-        inf->pieces[p].priority = calculatePiecePriority (tor, p, firstFiles[p]);
+        inf->piecePriority[p] = calculatePiecePriority (tor, p, firstFiles[p]);
 
     tr_free (firstFiles);
 }
@@ -754,6 +855,10 @@ torrentInitFromInfo (tr_torrent * tor)
     t += tor->blockCountInLastPiece;
     assert (t == (uint64_t)tor->blockCount);
 
+    info->pieceTimeChecked = tr_new0 (time_t, info->pieceCount);
+    info->piecePriority = tr_new0 (int8_t, info->pieceCount);
+    info->pieceDnd = tr_new0 (int8_t, info->pieceCount);
+
     tr_cpConstruct (&tor->completion, tor);
 
     tr_torrentInitFilePieces (tor);
@@ -800,7 +905,7 @@ setLocalErrorIfFilesDisappeared (tr_torrent * tor)
 }
 
 static void
-torrentInit (tr_torrent * tor, const tr_ctor * ctor)
+torrentInit (tr_torrent * tor, const tr_ctor * ctor, tr_torrent_preload * preload)
 {
     int doStart;
     uint64_t loaded;
@@ -851,7 +956,7 @@ torrentInit (tr_torrent * tor, const tr_ctor * ctor)
                                                   overwritten by the resume file */
 
     torrentInitFromInfo (tor);
-    loaded = tr_torrentLoadResume (tor, ~0, ctor);
+    loaded = tr_torrentLoadResume (tor, ~0, ctor, preload);
     tor->completeness = tr_cpGetStatus (&tor->completion);
     setLocalErrorIfFilesDisappeared (tor);
 
@@ -894,6 +999,7 @@ torrentInit (tr_torrent * tor, const tr_ctor * ctor)
             it = it->next;
         it->next = tor;
     }
+    torrentIndexAdd (session, tor);
 
     /* if we don't have a local .torrent file already, assume the torrent is new */
     isNewTorrent = stat (tor->info.torrent, &st);
@@ -919,11 +1025,19 @@ torrentInit (tr_torrent * tor, const tr_ctor * ctor)
         tor->startAfterVerify = doStart;
         tr_torrentVerify (tor);
     }
-    else if (doStart)
+    else
     {
-        tr_torrentStart (tor);
+        /* the piece hashes that came with the metainfo aren't
+         * needed until the torrent is started or verified */
+        tr_torrentUnloadPieceHashes (tor);
+
+        if (doStart)
+            tr_torrentStart (tor);
     }
 
+    if (session->statSnapshots.isEnabled)
+        tr_torrentPublishStat (tor);
+
     tr_sessionUnlock (session);
 }
 
@@ -993,7 +1107,7 @@ tr_torrentNew (const tr_ctor * ctor, int * setmeError)
         tor->info = tmpInfo;
         if (hasInfo)
             tor->infoDictLength = len;
-        torrentInit (tor, ctor);
+        torrentInit (tor, ctor, NULL);
     }
     else
     {
@@ -1007,6 +1121,91 @@ tr_torrentNew (const tr_ctor * ctor, int * setmeError)
     return tor;
 }
 
+bool
+tr_torrentPreload (const tr_session   * session,
+                   const char         * filename,
+                   tr_torrent_preload * setme)
+{
+    int len = 0;
+    bool hasInfo = false;
+    bool didParse = false;
+    const tr_variant * metainfo;
+    tr_ctor * ctor;
+
+    memset (setme, 0, sizeof (tr_torrent_preload));
+
+    if ((session->snapshot != NULL)
+      && tr_snapshotGetInfo (session->snapshot, filename, &setme->info, &setme->infoDictLength))
+    {
+        setme->infoIsFromSnapshot = true;
+        tr_torrentPreloadResume (session, setme);
+        return true;
+    }
+
+    /* the metainfo is only needed long enough to build the tr_info */
+    ctor = tr_ctorNew (NULL);
+    if (!tr_ctorSetMetainfoFromFile (ctor, filename)
+      && !tr_ctorGetMetainfo (ctor, &metainfo))
+        didParse = tr_metainfoParse (session, metainfo, &setme->info, &hasInfo, &len);
+
+    tr_ctorFree (ctor);
+
+    if (didParse && hasInfo && !tr_getBlockSize (setme->info.pieceSize))
+    {
+        tr_metainfoFree (&setme->info);
+        didParse = false;
+    }
+
+    if (didParse)
+    {
+        if (hasInfo)
+            setme->infoDictLength = len;
+
+        tr_torrentPreloadResume (session, setme);
+    }
+
+    return didParse;
+}
+
+tr_torrent *
+tr_torrentNewFromPreload (const tr_ctor      * ctor,
+                          tr_torrent_preload * preload,
+                          int                * setmeError)
+{
+    tr_torrent * tor = NULL;
+
+    assert (ctor != NULL);
+    assert (tr_isSession (tr_ctorGetSession (ctor)));
+
+    if (tr_torrentExists (tr_ctorGetSession (ctor), preload->info.hash))
+    {
+        if (setmeError)
+            *setmeError = TR_PARSE_DUPLICATE;
+    }
+    else
+    {
+        tor = tr_new0 (tr_torrent, 1);
+        tor->info = preload->info;
+        tor->infoDictLength = preload->infoDictLength;
+        tor->snapshotHasInfo = preload->infoIsFromSnapshot;
+        memset (&preload->info, 0, sizeof (tr_info)); /* the torrent owns it now */
+        torrentInit (tor, ctor, preload);
+    }
+
+    return tor;
+}
+
+void
+tr_torrentPreloadFree (tr_torrent_preload * preload)
+{
+    tr_metainfoFree (&preload->info);
+
+    if (preload->hasResume)
+        tr_variantFree (&preload->resume);
+
+    memset (preload, 0, sizeof (tr_torrent_preload));
+}
+
 /**
 ***
 **/
@@ -1095,6 +1294,156 @@ tr_torrentStatCached (tr_torrent * tor)
          : tr_torrentStat (tor);
 }
 
+/***
+****  Stat snapshots
+****
+****  tr_torrentStatSnapshot () never touches a tr_torrent, so it's safe
+****  from any thread even while torrents are being removed. It copies
+****  from a session-owned table of tr_stats, keyed by torrent id, that
+****  the libtransmission thread refreshes once per second. The table's
+****  lock is only held long enough to find or replace one entry.
+***/
+
+/* the index of the first entry whose id is >= id */
+static int
+statSnapshotPos (const struct tr_stat_snapshots * snaps, int id)
+{
+  int lo = 0;
+  int hi = snaps->count;
+
+  while (lo < hi)
+    {
+      const int mid = lo + (hi - lo) / 2;
+
+      if (snaps->stats[mid].id < id)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return lo;
+}
+
+void
+tr_torrentPublishStat (tr_torrent * tor)
+{
+  int pos;
+  struct tr_stat_snapshots * snaps = &tor->session->statSnapshots;
+  const tr_stat * st = tr_torrentStat (tor);
+
+  tr_lockLock (snaps->lock);
+
+  pos = statSnapshotPos (snaps, st->id);
+  if ((pos == snaps->count) || (snaps->stats[pos].id != st->id))
+    {
+      if (snaps->count == snaps->alloc)
+        {
+          snaps->alloc = MAX (16, snaps->alloc * 2);
+          snaps->stats = tr_renew (tr_stat, snaps->stats, snaps->alloc);
+        }
+
+      memmove (snaps->stats + pos + 1, snaps->stats + pos,
+               sizeof (tr_stat) * (snaps->count - pos));
+      ++snaps->count;
+    }
+
+  snaps->stats[pos] = *st;
+
+  tr_lockUnlock (snaps->lock);
+}
+
+static void
+torrentUnpublishStat (tr_torrent * tor)
+{
+  int pos;
+  struct tr_stat_snapshots * snaps = &tor->session->statSnapshots;
+
+  tr_lockLock (snaps->lock);
+
+  pos = statSnapshotPos (snaps, tor->uniqueId);
+  if ((pos < snaps->count) && (snaps->stats[pos].id == tor->uniqueId))
+    {
+      --snaps->count;
+      memmove (snaps->stats + pos, snaps->stats + pos + 1,
+               sizeof (tr_stat) * (snaps->count - pos));
+    }
+
+  tr_lockUnlock (snaps->lock);
+}
+
+struct publish_all_data
+{
+  tr_session * session;
+  volatile bool done;
+};
+
+static void
+publishAllStats (void * vdata)
+{
+  tr_torrent * tor = NULL;
+  struct publish_all_data * data = vdata;
+  tr_session * session = data->session;
+
+  while ((tor = tr_torrentNext (session, tor)))
+    tr_torrentPublishStat (tor);
+
+  tr_lockLock (session->statSnapshots.lock);
+  session->statSnapshots.isFilled = true;
+  tr_lockUnlock (session->statSnapshots.lock);
+
+  data->done = true;
+}
+
+bool
+tr_torrentStatSnapshot (tr_session * session, int torrent_id, tr_stat * setme)
+{
+  int pos;
+  bool found;
+  bool doFill;
+  struct tr_stat_snapshots * snaps;
+
+  assert (tr_isSession (session));
+
+  snaps = &session->statSnapshots;
+
+  tr_lockLock (snaps->lock);
+  doFill = !snaps->isEnabled;
+  snaps->isEnabled = true;
+  tr_lockUnlock (snaps->lock);
+
+  /* the first caller fills the table for everyone, so that
+     no one gets an empty answer while waiting for the timer */
+  if (doFill)
+    {
+      struct publish_all_data data;
+
+      data.session = session;
+      data.done = false;
+      tr_runInEventThread (session, publishAllStats, &data);
+      while (!data.done)
+        tr_wait_msec (1);
+    }
+
+  for (;;)
+    {
+      tr_lockLock (snaps->lock);
+
+      if (snaps->isFilled)
+        break;
+
+      tr_lockUnlock (snaps->lock);
+      tr_wait_msec (1);
+    }
+
+  pos = statSnapshotPos (snaps, torrent_id);
+  found = (pos < snaps->count) && (snaps->stats[pos].id == torrent_id);
+  if (found)
+    *setme = snaps->stats[pos];
+
+  tr_lockUnlock (snaps->lock);
+  return found;
+}
+
 void
 tr_torrentSetVerifyState (tr_torrent * tor, tr_verify_state state)
 {
@@ -1168,7 +1517,7 @@ getVerifyProgress (const tr_torrent * tor)
       tr_piece_index_t checked = 0;
 
       for (i=0, n=tor->info.pieceCount; i!=n; ++i)
-        if (tor->info.pieces[i].timeChecked)
+        if (tor->info.pieceTimeChecked[i])
           ++checked;
 
       d = checked / (double)tor->info.pieceCount;
@@ -1506,6 +1855,10 @@ freeTorrent (tr_torrent * tor)
 
     tr_free (tor->downloadDir);
     tr_free (tor->incompleteDir);
+    tr_free (tor->rpcFields);
+
+    torrentUnpublishStat (tor);
+    torrentIndexRemove (session, tor);
 
     if (tor == session->torrentList)
         session->torrentList = tor->next;
@@ -1644,6 +1997,13 @@ torrentStart (tr_torrent * tor, bool bypass_queue)
     /* otherwise, start it now... */
     tr_sessionLock (tor->session);
 
+    /* the piece hashes are needed to check what we download */
+    if (!tr_torrentLoadPieceHashes (tor))
+    {
+        tr_sessionUnlock (tor->session);
+        return;
+    }
+
     /* allow finished torrents to be resumed */
     if (tr_torrentIsSeedRatioDone (tor)) {
         tr_torinf (tor, "%s", _("Restarted manually -- disabling its seed ratio"));
@@ -1677,26 +2037,45 @@ tr_torrentStartNow (tr_torrent * tor)
         torrentStart (tor, true);
 }
 
+struct recheck_done_data
+{
+    tr_session * session;
+    int torrent_id;
+};
+
 static void
-torrentRecheckDoneImpl (void * vtor)
+torrentRecheckDoneImpl (void * vdata)
 {
-    tr_torrent * tor = vtor;
-    assert (tr_isTorrent (tor));
+    struct recheck_done_data * data = vdata;
+    tr_torrent * tor = tr_torrentFindFromId (data->session, data->torrent_id);
 
-    tr_torrentRecheckCompleteness (tor);
+    /* the torrent may have been removed while this was queued */
+    if (tor != NULL)
+    {
+        tr_torrentRecheckCompleteness (tor);
 
-    if (tor->startAfterVerify) {
-        tor->startAfterVerify = false;
-        torrentStart (tor, false);
+        if (tor->startAfterVerify) {
+            tor->startAfterVerify = false;
+            torrentStart (tor, false);
+        }
+
+        tr_torrentUnloadPieceHashes (tor);
     }
+
+    tr_free (data);
 }
 
 static void
 torrentRecheckDoneCB (tr_torrent * tor)
 {
+    struct recheck_done_data * data;
+
     assert (tr_isTorrent (tor));
 
-    tr_runInEventThread (tor->session, torrentRecheckDoneImpl, tor);
+    data = tr_new (struct recheck_done_data, 1);
+    data->session = tor->session;
+    data->torrent_id = tor->uniqueId;
+    tr_runInEventThread (tor->session, torrentRecheckDoneImpl, data);
 }
 
 static void
@@ -1717,7 +2096,7 @@ verifyTorrent (void * vtor)
 
     tor->startAfterVerify = startAfter;
 
-    if (setLocalErrorIfFilesDisappeared (tor))
+    if (setLocalErrorIfFilesDisappeared (tor) || !tr_torrentLoadPieceHashes (tor))
         tor->startAfterVerify = false;
     else
         tr_verifyAdd (tor, torrentRecheckDoneCB);
@@ -1737,7 +2116,10 @@ tr_torrentSave (tr_torrent * tor)
 {
     assert (tr_isTorrent (tor));
 
-    if (tor->isDirty)
+    /* also save torrents that aren't in the snapshot yet, so that
+     * enabling it doesn't wait for every torrent to change */
+    if (tor->isDirty
+      || ((tor->session->snapshot != NULL) && !tor->snapshotHasInfo && tr_torrentHasMetadata (tor)))
     {
         tor->isDirty = false;
         tr_torrentSaveResume (tor);
@@ -1757,6 +2139,7 @@ stopTorrent (void * vtor)
   tr_verifyRemove (tor);
   torrentSetQueued (tor, false);
   tr_peerMgrStopTorrent (tor);
+  tr_torrentUnloadPieceHashes (tor);
   tr_announcerTorrentStopped (tor);
   tr_cacheFlushTorrent (tor->session->cache, tor);
 
@@ -1794,9 +2177,10 @@ closeTorrent (void * vtor)
 
     assert (tr_isTorrent (tor));
 
-    d = tr_variantListAddDict (&tor->session->removedTorrents, 2);
+    d = tr_variantListAddDict (&tor->session->removedTorrents, 3);
     tr_variantDictAddInt (d, TR_KEY_id, tor->uniqueId);
     tr_variantDictAddInt (d, TR_KEY_date, tr_time ());
+    tr_variantDictAddInt (d, TR_KEY_revision, ++tor->session->rpcRevision);
 
     tr_torinf (tor, "%s", _("Removing torrent"));
 
@@ -2104,7 +2488,7 @@ tr_torrentInitFilePriority (tr_torrent *    tor,
     file = &tor->info.files[fileIndex];
     file->priority = priority;
     for (i = file->firstPiece; i <= file->lastPiece; ++i)
-        tor->info.pieces[i].priority = calculatePiecePriority (tor, i, fileIndex);
+        tor->info.piecePriority[i] = calculatePiecePriority (tor, i, fileIndex);
 }
 
 void
@@ -2188,15 +2572,15 @@ setFileDND (tr_torrent * tor, tr_file_index_t fileIndex, int doDownload)
 
     if (firstPiece == lastPiece)
     {
-        tor->info.pieces[firstPiece].dnd = firstPieceDND && lastPieceDND;
+        tor->info.pieceDnd[firstPiece] = firstPieceDND && lastPieceDND;
     }
     else
     {
         tr_piece_index_t pp;
-        tor->info.pieces[firstPiece].dnd = firstPieceDND;
-        tor->info.pieces[lastPiece].dnd = lastPieceDND;
+        tor->info.pieceDnd[firstPiece] = firstPieceDND;
+        tor->info.pieceDnd[lastPiece] = lastPieceDND;
         for (pp = firstPiece + 1; pp < lastPiece; ++pp)
-            tor->info.pieces[pp].dnd = dnd;
+            tor->info.pieceDnd[pp] = dnd;
     }
 }
 
@@ -2412,7 +2796,7 @@ tr_torrentSetPieceChecked (tr_torrent * tor, tr_piece_index_t pieceIndex)
     assert (tr_isTorrent (tor));
     assert (pieceIndex < tor->info.pieceCount);
 
-    tor->info.pieces[pieceIndex].timeChecked = tr_time ();
+    tor->info.pieceTimeChecked[pieceIndex] = tr_time ();
 }
 
 void
@@ -2423,7 +2807,7 @@ tr_torrentSetChecked (tr_torrent * tor, time_t when)
     assert (tr_isTorrent (tor));
 
     for (i=0, n=tor->info.pieceCount; i!=n; ++i)
-        tor->info.pieces[i].timeChecked = when;
+        tor->info.pieceTimeChecked[i] = when;
 }
 
 bool
@@ -2440,6 +2824,44 @@ tr_torrentCheckPiece (tr_torrent * tor, tr_piece_index_t pieceIndex)
     return pass;
 }
 
+bool
+tr_torrentLoadPieceHashes (tr_torrent * tor)
+{
+    tr_info * inf = &tor->info;
+    uint8_t * hashes;
+
+    assert (tr_isTorrent (tor));
+
+    /* a magnet link without metadata has no pieces yet */
+    if ((inf->pieceHashes != NULL) || !tr_torrentHasMetadata (tor))
+        return true;
+
+    hashes = tr_new (uint8_t, (size_t)inf->pieceCount * SHA_DIGEST_LENGTH);
+
+    if (((tor->session->snapshot != NULL) && tr_snapshotGetPieceHashes (tor->session->snapshot, inf, hashes))
+      || tr_metainfoGetPieceHashes (inf, hashes))
+    {
+        inf->pieceHashes = hashes;
+        return true;
+    }
+
+    tr_free (hashes);
+    tr_torrentSetLocalError (tor, _("Couldn't read the piece checksums from \"%s\""), inf->torrent);
+    return false;
+}
+
+void
+tr_torrentUnloadPieceHashes (tr_torrent * tor)
+{
+    assert (tr_isTorrent (tor));
+
+    if (!tor->isRunning && (tor->verifyState == TR_VERIFY_NONE))
+    {
+        tr_free (tor->info.pieceHashes);
+        tor->info.pieceHashes = NULL;
+    }
+}
+
 time_t
 tr_torrentGetFileMTime (const tr_torrent * tor, tr_file_index_t i)
 {
@@ -2457,7 +2879,7 @@ tr_torrentPieceNeedsCheck (const tr_torrent * tor, tr_piece_index_t p)
     const tr_info * inf = tr_torrentInfo (tor);
 
     /* if we've never checked this piece, then it needs to be checked */
-    if (!inf->pieces[p].timeChecked)
+    if (!inf->pieceTimeChecked[p])
         return true;
 
     /* If we think we've completed one of the files in this piece,
@@ -2466,7 +2888,7 @@ tr_torrentPieceNeedsCheck (const tr_torrent * tor, tr_piece_index_t p)
     tr_ioFindFileLocation (tor, p, 0, &f, &unused);
     for (; f < inf->fileCount && pieceHasFile (p, &inf->files[f]); ++f)
         if (tr_cpFileIsComplete (&tor->completion, f))
-            if (tr_torrentGetFileMTime (tor, f) > inf->pieces[p].timeChecked)
+            if (tr_torrentGetFileMTime (tor, f) > inf->pieceTimeChecked[p])
                 return true;
 
     return false;
@@ -2561,6 +2983,9 @@ tr_torrentSetAnnounceList (tr_torrent             * tor,
 
             tr_metainfoFree (&tmpInfo);
             tr_variantToFile (&metainfo, TR_VARIANT_FMT_BENC, tor->info.torrent);
+
+            /* the snapshot's copy of the .torrent file is stale now */
+            tor->snapshotHasInfo = false;
         }
 
         /* cleanup */
@@ -2895,6 +3320,9 @@ setLocation (void * vdata)
         /* bad idea to move files while they're being verified... */
         tr_verifyRemove (tor);
 
+        /* ...or while the cache is still writing to them */
+        tr_cacheFlushTorrent (tor->session->cache, tor);
+
         /* try to move the files.
          * FIXME: there are still all kinds of nasty cases, like what
          * if the target directory runs out of space halfway through... */
@@ -2996,10 +3424,9 @@ tr_torrentFileCompleted (tr_torrent * tor, tr_file_index_t fileNum)
 {
     char * sub;
     const char * base;
+    tr_piece_index_t p;
     const tr_info * inf = &tor->info;
     const tr_file * f = &inf->files[fileNum];
-    tr_piece * p;
-    const tr_piece * pend;
     const time_t now = tr_time ();
 
     /* close the file so that we can reopen in read-only mode as needed */
@@ -3007,8 +3434,8 @@ tr_torrentFileCompleted (tr_torrent * tor, tr_file_index_t fileNum)
 
     /* now that the file is complete and closed, we can start watching its
      * mtime timestamp for changes to know if we need to reverify pieces */
-    for (p=&inf->pieces[f->firstPiece], pend=&inf->pieces[f->lastPiece]; p!=pend; ++p)
-        p->timeChecked = now;
+    for (p=f->firstPiece; p!=f->lastPiece; ++p)
+        inf->pieceTimeChecked[p] = now;
 
     /* if the torrent's current filename isn't the same as the one in the
      * metadata -- for example, if it had the ".part" suffix appended to
@@ -24,6 +24,7 @@
 
 struct tr_torrent_tiers;
 struct tr_magnet_info;
+struct tr_snapshot_record;
 
 /**
 ***  Package-visible ctor API
@@ -40,6 +41,49 @@ void        tr_ctorInitTorrentPriorities (const tr_ctor * ctor, tr_torrent * tor
 
 void        tr_ctorInitTorrentWanted (const tr_ctor * ctor, tr_torrent * tor);
 
+/**
+***  Loading saved torrents
+***
+***  Reading and parsing a torrent's .torrent and .resume files is the
+***  slow part of adding it, so tr_sessionLoadTorrents () does that for
+***  many torrents at once on worker threads with tr_torrentPreload (),
+***  leaving only tr_torrentNewFromPreload () for the libtransmission thread.
+***
+***  Every torrent, stopped or not, still gets its whole tr_info here,
+***  file list included. Only the piece hashes wait until they're needed;
+***  see tr_torrentLoadPieceHashes ().
+**/
+
+typedef struct tr_torrent_preload
+{
+    tr_info      info;
+    int          infoDictLength;
+
+    /* true if info came from the session's snapshot */
+    bool         infoIsFromSnapshot;
+
+    /* the resume data, if the snapshot has a current copy of it... */
+    const struct tr_snapshot_record * resumeRecord;
+
+    /* ...or else as read from the .resume file */
+    bool         hasResume;
+    tr_variant   resume;
+}
+tr_torrent_preload;
+
+/* Doesn't touch the session's state, so it's safe to call from any thread.
+ * Returns false if the .torrent file couldn't be read or parsed. */
+bool        tr_torrentPreload (const tr_session   * session,
+                               const char         * filename,
+                               tr_torrent_preload * setme);
+
+/* Like tr_torrentNew (), but takes its tr_info from the preload. */
+tr_torrent* tr_torrentNewFromPreload (const tr_ctor      * ctor,
+                                      tr_torrent_preload * preload,
+                                      int                * setmeError);
+
+void        tr_torrentPreloadFree (tr_torrent_preload * preload);
+
 /**
 ***
 **/
@@ -131,6 +175,10 @@ void             tr_torrentSetVerifyState (tr_torrent      * tor,
 
 tr_torrent_activity tr_torrentGetActivity (const tr_torrent * tor);
 
+/* refresh the copy of the torrent's tr_stat that
+   tr_torrentStatSnapshot () reads */
+void             tr_torrentPublishStat (tr_torrent * tor);
+
 struct tr_incomplete_metadata;
 
 /** @brief Torrent object */
@@ -250,6 +298,9 @@ struct tr_torrent
 
     bool                       infoDictOffsetIsCached;
 
+    /* true if the session's snapshot has a current copy of the .torrent file */
+    bool                       snapshotHasInfo;
+
     uint16_t                   maxConnectedPeers;
 
     tr_verify_state            verifyState;
@@ -259,6 +310,11 @@ struct tr_torrent
 
     tr_torrent *               next;
 
+    /* chains in the session's lookup tables */
+    tr_torrent *               nextWithIdBucket;
+    tr_torrent *               nextWithHashBucket;
+    tr_torrent *               nextWithObfuscatedHashBucket;
+
     int                        uniqueId;
 
     struct tr_bandwidth        bandwidth;
@@ -271,6 +327,11 @@ struct tr_torrent
     uint16_t                   idleLimitMinutes;
     tr_idlelimit               idleLimitMode;
     bool                       finishedSeedingByIdle;
+
+    /* fingerprints of the torrent-get fields last built for RPC,
+       sorted by key. see "changed-since" in rpcimpl.c */
+    struct tr_rpc_field_state * rpcFields;
+    int                        rpcFieldCount;
 };
 
 static inline tr_torrent*
@@ -428,6 +489,20 @@ bool tr_torrentPieceNeedsCheck (const tr_torrent * tor, tr_piece_index_t pieceIn
  */
 bool tr_torrentCheckPiece (tr_torrent * tor, tr_piece_index_t pieceIndex);
 
+/**
+ * @brief Make sure tor->info.pieceHashes is loaded
+ *
+ * They're read from the session's snapshot if it has a current copy,
+ * or else from the torrent's .torrent file.
+ * @return false, and sets a local error, if they couldn't be read
+ */
+bool tr_torrentLoadPieceHashes (tr_torrent * tor);
+
+/**
+ * @brief Free tor->info.pieceHashes unless the torrent is running or being verified
+ */
+void tr_torrentUnloadPieceHashes (tr_torrent * tor);
+
 time_t tr_torrentGetFileMTime (const tr_torrent * tor, tr_file_index_t i);
 
 uint64_t tr_torrentGetCurrentSizeOnDisk (const tr_torrent * tor);
@@ -70,6 +70,15 @@ UTP_Write (struct UTPSocket *socket, size_t count)
     return false;
 }
 
+uint32
+UTP_GetRTT (struct UTPSocket *socket)
+{
+    tr_nerr (MY_NAME, "UTP_GetRTT (%p) was called.", socket);
+    dbgmsg ("UTP_GetRTT (%p) was called.", socket);
+    assert (0); /* FIXME: this is too much for the long term, but probably needed in the short term */
+    return 0;
+}
+
 int tr_utpPacket (const unsigned char *buf UNUSED, size_t buflen UNUSED,
                  const struct sockaddr *from UNUSED, socklen_t fromlen UNUSED,
                  tr_session *ss UNUSED) { return -1; }
@@ -535,6 +535,11 @@ void  tr_sessionSetLPDEnabled (tr_session * session, bool enabled);
 void  tr_sessionSetCacheLimit_MB (tr_session * session, int mb);
 int   tr_sessionGetCacheLimit_MB (const tr_session * session);
 
+/** Size of the cache that keeps whole pieces that peers keep asking for.
+    Pieces held by few other peers are kept longest. 0 disables it. */
+void  tr_sessionSetReadCacheLimit_MB (tr_session * session, int mb);
+int   tr_sessionGetReadCacheLimit_MB (const tr_session * session);
+
 tr_encryption_mode tr_sessionGetEncryption (tr_session * session);
 void               tr_sessionSetEncryption (tr_session * session,
                                             tr_encryption_mode    mode);
@@ -1494,6 +1499,13 @@ typedef struct tr_peer_stat
 
     /* how many requests we've made and are currently awaiting a response for */
     int      pendingReqsToPeer;
+
+    /* how many requests we try to keep in flight to this peer:
+       its bandwidth-delay product, in blocks */
+    int      desiredReqsToPeer;
+
+    /* the smoothed round-trip time to this peer, or -1 if unknown */
+    int      rtt_msec;
 }
 tr_peer_stat;
 
@@ -1689,16 +1701,6 @@ typedef struct tr_file
 }
 tr_file;
 
-/** @brief a part of tr_info that represents a single piece of the torrent's content */
-typedef struct tr_piece
-{
-    time_t   timeChecked;              /* the last time we tested this piece */
-    uint8_t  hash[SHA_DIGEST_LENGTH];  /* pieces hash */
-    int8_t   priority;                 /* TR_PRI_HIGH, _NORMAL, or _LOW */
-    int8_t   dnd;                      /* "do not download" flag */
-}
-tr_piece;
-
 /** @brief information about a torrent that comes from its metainfo file */
 struct tr_info
 {
@@ -1716,7 +1718,17 @@ struct tr_info
     char             * comment;
     char             * creator;
     tr_file          * files;
-    tr_piece         * pieces;
+
+    /* per-piece state, indexed by piece. These are kept in separate
+       arrays so that loops over one of them stay in the cache. */
+    time_t           * pieceTimeChecked; /* the last time we tested the piece */
+    int8_t           * piecePriority;    /* TR_PRI_HIGH, _NORMAL, or _LOW */
+    int8_t           * pieceDnd;         /* "do not download" flag */
+
+    /* the pieces' SHA1 hashes, SHA_DIGEST_LENGTH bytes apiece.
+       A torrent only keeps these in memory while it's running or being
+       verified, so in libtransmission use tr_torrentLoadPieceHashes () */
+    uint8_t          * pieceHashes;
 
     /* these trackers are sorted by tier */
     tr_tracker_info  * trackers;
@@ -1968,6 +1980,17 @@ const tr_stat * tr_torrentStat (tr_torrent * torrent);
     reduce the CPU load if you're calling tr_torrentStat () frequently. */
 const tr_stat * tr_torrentStatCached (tr_torrent * torrent);
 
+/** Copy the statistics of the torrent with the given id, as of the last
+    second, into setme. Unlike tr_torrentStat (), this is safe to call from
+    any thread and doesn't hold up the libtransmission thread, so it's the
+    one to use when polling many torrents from a GUI thread. It never
+    touches the tr_torrent itself, so it's safe while torrents are removed.
+
+    The first call in a session waits while every torrent's statistics are
+    gathered; after that, they're refreshed once per second.
+    @return false if there's no torrent with that id */
+bool tr_torrentStatSnapshot (tr_session * session, int torrent_id, tr_stat * setme);
+
 /** @deprecated */
 void tr_torrentSetAddedDate (tr_torrent * torrent,
                              time_t       addedDate);
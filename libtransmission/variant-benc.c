@@ -155,7 +155,8 @@ int
 tr_variantParseBenc (const void    * buf_in,
                      const void    * bufend_in,
                      tr_variant    * top,
-                     const char   ** setme_end)
+                     const char   ** setme_end,
+                     struct tr_variant_arena * arena)
 {
   int err = 0;
   const uint8_t * buf = buf_in;
@@ -194,7 +195,7 @@ tr_variantParseBenc (const void    * buf_in,
 
           if ((v = get_node (&stack, &key, top, &err)))
             {
-              tr_variantInitList (v, 0);
+              tr_variantInitListIn (v, arena, 0);
               tr_ptrArrayAppend (&stack, v);
             }
         }
@@ -206,7 +207,7 @@ tr_variantParseBenc (const void    * buf_in,
 
           if ((v = get_node (&stack, &key, top, &err)))
             {
-              tr_variantInitDict (v, 0);
+              tr_variantInitDictIn (v, arena, 0);
               tr_ptrArrayAppend (&stack, v);
             }
         }
@@ -240,7 +241,7 @@ tr_variantParseBenc (const void    * buf_in,
           if (!key && !tr_ptrArrayEmpty(&stack) && tr_variantIsDict(tr_ptrArrayBack(&stack)))
             key = tr_quark_new (str, str_len);
           else if ((v = get_node (&stack, &key, top, &err)))
-            tr_variantInitStr (v, str, str_len);
+            tr_variantInitStrIn (v, v == top ? NULL : arena, str, str_len);
         }
       else /* invalid bencoded text... march past it */
         {
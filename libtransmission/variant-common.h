@@ -42,11 +42,19 @@ void tr_variantToBufBenc (const tr_variant * top, struct evbuffer * buf);
 
 void tr_variantInit (tr_variant * v, char type);
 
+/* like tr_variantInitStr (), tr_variantInitList () and tr_variantInitDict (),
+   but carve the memory out of `arena' if it isn't NULL */
+void tr_variantInitStrIn  (tr_variant * v, struct tr_variant_arena * arena, const void * str, int len);
+void tr_variantInitListIn (tr_variant * v, struct tr_variant_arena * arena, size_t reserve_count);
+void tr_variantInitDictIn (tr_variant * v, struct tr_variant_arena * arena, size_t reserve_count);
+
+/* if arena isn't NULL, the tree's containers and strings are built in it */
 int tr_jsonParse (const char    * source, /* Such as a filename. Only when logging an error */
                   const void    * vbuf,
                   size_t          len,
                   tr_variant    * setme_benc,
-                  const char   ** setme_end);
+                  const char   ** setme_end,
+                  struct tr_variant_arena * arena);
 
 /** @brief Private function that's exposed here only for unit tests */
 int tr_bencParseInt (const uint8_t *  buf,
@@ -61,10 +69,12 @@ int tr_bencParseStr (const uint8_t *  buf,
                      const uint8_t ** setme_str,
                      size_t *         setme_strlen);
 
+/* if arena isn't NULL, the tree's containers and strings are built in it */
 int tr_variantParseBenc (const void     * buf,
                          const void     * end,
                          tr_variant     * top,
-                         const char ** setme_end);
+                         const char ** setme_end,
+                         struct tr_variant_arena * arena);
 
 
 
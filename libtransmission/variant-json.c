@@ -47,6 +47,7 @@ struct json_wrapper_data
   struct evbuffer * strbuf;
   const char * source;
   tr_ptrArray stack;
+  struct tr_variant_arena * arena;
 };
 
 static tr_variant*
@@ -131,14 +132,14 @@ action_callback_PUSH (jsonsl_t                  jsn,
       case JSONSL_T_LIST:
         data->has_content = true;
         node = get_node (jsn);
-        tr_variantInitList (node, 0);
+        tr_variantInitListIn (node, data->arena, 0);
         tr_ptrArrayAppend (&data->stack, node);
         break;
 
       case JSONSL_T_OBJECT:
         data->has_content = true;
         node = get_node (jsn);
-        tr_variantInitDict (node, 0);
+        tr_variantInitDictIn (node, data->arena, 0);
         tr_ptrArrayAppend (&data->stack, node);
         break;
 
@@ -279,7 +280,8 @@ action_callback_POP (jsonsl_t                  jsn,
     {
       size_t len;
       const char * str = extract_string (jsn, state, &len, data->strbuf);
-      tr_variantInitStr (get_node (jsn), str, len);
+      tr_variant * node = get_node (jsn);
+      tr_variantInitStrIn (node, node == data->top ? NULL : data->arena, str, len);
       data->has_content = true;
     }
   else if (state->type == JSONSL_T_HKEY)
@@ -324,7 +326,8 @@ tr_jsonParse (const char     * source,
               const void     * vbuf,
               size_t           len,
               tr_variant     * setme_variant,
-              const char    ** setme_end)
+              const char    ** setme_end,
+              struct tr_variant_arena * arena)
 {
   int error;
   jsonsl_t jsn;
@@ -343,6 +346,7 @@ tr_jsonParse (const char     * source,
   data.top = setme_variant;
   data.stack = TR_PTR_ARRAY_INIT;
   data.source = source;
+  data.arena = arena;
   data.keybuf = evbuffer_new ();
   data.strbuf = evbuffer_new ();
 
@@ -618,8 +622,8 @@ static const struct VariantWalkFuncs walk_funcs = { jsonIntFunc,
                                                     jsonListBeginFunc,
                                                     jsonContainerEndFunc };
 
-void
-tr_variantToBufJson (const tr_variant * top, struct evbuffer * buf, bool lean)
+static void
+jsonWalk (const tr_variant * top, struct evbuffer * buf, bool lean)
 {
   struct jsonWalk data;
 
@@ -628,7 +632,96 @@ tr_variantToBufJson (const tr_variant * top, struct evbuffer * buf, bool lean)
   data.parents = NULL;
 
   tr_variantWalk (top, &walk_funcs, &data, true);
+}
+
+void
+tr_variantToBufJson (const tr_variant * top, struct evbuffer * buf, bool lean)
+{
+  jsonWalk (top, buf, lean);
 
   if (evbuffer_get_length (buf))
     evbuffer_add_printf (buf, "\n");
 }
+
+/****
+*****  tr_json_writer
+****/
+
+void
+tr_jsonWriterInit (tr_json_writer * writer, struct evbuffer * out)
+{
+  memset (writer, 0, sizeof (tr_json_writer));
+  writer->out = out;
+}
+
+/* separate this value from its older sibling, if any */
+static void
+jsonWriterBeginValue (tr_json_writer * w)
+{
+  if (w->afterKey)
+    {
+      w->afterKey = false;
+    }
+  else if (w->depth > 0)
+    {
+      if (w->hasChildren[w->depth - 1])
+        evbuffer_add (w->out, ",", 1);
+      w->hasChildren[w->depth - 1] = true;
+    }
+}
+
+static void
+jsonWriterBegin (tr_json_writer * w, char opener, char closer)
+{
+  assert (w->depth < (int)sizeof (w->closer));
+
+  jsonWriterBeginValue (w);
+  evbuffer_add (w->out, &opener, 1);
+  w->hasChildren[w->depth] = false;
+  w->closer[w->depth] = closer;
+  ++w->depth;
+}
+
+void
+tr_jsonWriterBeginDict (tr_json_writer * w)
+{
+  jsonWriterBegin (w, '{', '}');
+}
+
+void
+tr_jsonWriterBeginList (tr_json_writer * w)
+{
+  jsonWriterBegin (w, '[', ']');
+}
+
+void
+tr_jsonWriterEnd (tr_json_writer * w)
+{
+  assert (w->depth > 0);
+  assert (!w->afterKey);
+
+  --w->depth;
+  evbuffer_add (w->out, &w->closer[w->depth], 1);
+}
+
+void
+tr_jsonWriterKey (tr_json_writer * w, const tr_quark key)
+{
+  tr_variant tmp;
+
+  assert (w->depth > 0);
+  assert (w->closer[w->depth - 1] == '}');
+
+  jsonWriterBeginValue (w);
+  tr_variantInitQuark (&tmp, key);
+  jsonWalk (&tmp, w->out, true);
+  evbuffer_add (w->out, ":", 1);
+  w->afterKey = true;
+}
+
+void
+tr_jsonWriterAdd (tr_json_writer * w, const tr_variant * value)
+{
+  jsonWriterBeginValue (w);
+  jsonWalk (value, w->out, true);
+}
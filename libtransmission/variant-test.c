@@ -1,12 +1,15 @@
+#include <assert.h>
 #include <ctype.h> /* isspace () */
 #include <errno.h> /* EILSEQ */
+#include <stdio.h> /* fprintf () */
+#include <stdlib.h> /* malloc () */
 #include <string.h> /* strlen (), strncmp () */
 
 #include <event2/buffer.h>
 
 #define __LIBTRANSMISSION_VARIANT_MODULE___
 #include "transmission.h"
-#include "utils.h" /* tr_free */
+#include "utils.h" /* tr_free (), tr_time_msec () */
 #include "variant.h"
 #include "variant-common.h"
 
@@ -527,9 +530,219 @@ testParse2 (void)
   return 0;
 }
 
+static void
+buildTree (tr_variant * top, bool arena)
+{
+  int i;
+  tr_variant * list;
+  tr_variant * child;
+  const tr_quark key_list = tr_quark_new ("list", 4);
+  const tr_quark key_name = tr_quark_new ("name", 4);
+  const tr_quark key_drop = tr_quark_new ("drop", 4);
+
+  if (arena)
+    tr_variantInitDictArena (top, 0);
+  else
+    tr_variantInitDict (top, 0);
+
+  tr_variantDictAddStr (top, key_name, "a string too long for the inline buffer");
+  tr_variantDictAddStr (top, key_drop, "this one gets removed again");
+  list = tr_variantDictAddList (top, key_list, 0);
+  for (i=0; i<1000; ++i)
+    {
+      char buf[64];
+      child = tr_variantListAddDict (list, 0);
+      tr_snprintf (buf, sizeof (buf), "entry number %d of the list", i);
+      tr_variantDictAddStr (child, key_name, buf);
+      tr_variantDictAddInt (child, key_drop, i);
+      tr_variantListAddInt (tr_variantDictAddList (child, key_list, 1), i);
+    }
+
+  /* replacing and removing children must leave the tree consistent */
+  tr_variantDictAddStr (top, key_name, "a replacement that is also too long to inline");
+  tr_variantDictRemove (top, key_drop);
+}
+
+static int
+testArena (void)
+{
+  int err;
+  int len;
+  char * heapStr;
+  char * arenaStr;
+  tr_variant heap;
+  tr_variant arena;
+  const char * end;
+  static const char bad[] = "d4:name3:abc4:listli1ei2e";
+
+  /* trees built in an arena serialize the same as ones on the heap */
+  buildTree (&heap, false);
+  buildTree (&arena, true);
+  check (arena.val.l.arena != NULL);
+  heapStr = tr_variantToStr (&heap, TR_VARIANT_FMT_BENC, &len);
+  arenaStr = tr_variantToStr (&arena, TR_VARIANT_FMT_BENC, NULL);
+  check_streq (heapStr, arenaStr);
+  tr_free (arenaStr);
+  tr_variantFree (&arena);
+
+  /* ...and so do trees parsed into one */
+  err = tr_variantFromBufArena (&arena, TR_VARIANT_FMT_BENC, heapStr, len, NULL, &end);
+  check_int_eq (0, err);
+  check (end == heapStr + len);
+  arenaStr = tr_variantToStr (&arena, TR_VARIANT_FMT_BENC, NULL);
+  check_streq (heapStr, arenaStr);
+  tr_free (arenaStr);
+  tr_variantFree (&arena);
+  tr_free (heapStr);
+
+  heapStr = tr_variantToStr (&heap, TR_VARIANT_FMT_JSON_LEAN, &len);
+  err = tr_variantFromBufArena (&arena, TR_VARIANT_FMT_JSON, heapStr, len, NULL, NULL);
+  check_int_eq (0, err);
+  arenaStr = tr_variantToStr (&arena, TR_VARIANT_FMT_JSON_LEAN, NULL);
+  check_streq (heapStr, arenaStr);
+  tr_free (arenaStr);
+  tr_variantFree (&arena);
+  tr_free (heapStr);
+  tr_variantFree (&heap);
+
+  /* a failed parse leaves nothing behind to free */
+  err = tr_variantFromBufArena (&arena, TR_VARIANT_FMT_BENC, bad, strlen (bad), NULL, NULL);
+  check (err != 0);
+  tr_variantFree (&arena);
+
+  return 0;
+}
+
+/***
+****  Benchmark: run with --benchmark
+***/
+
+#ifdef __GLIBC__
+/* count heap allocations by wrapping glibc's allocator */
+extern void * __libc_malloc (size_t);
+extern void * __libc_calloc (size_t, size_t);
+extern void * __libc_realloc (void *, size_t);
+
+static size_t allocCount = 0;
+
+void *
+malloc (size_t size)
+{
+  ++allocCount;
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+  ++allocCount;
+  return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void * ptr, size_t size)
+{
+  ++allocCount;
+  return __libc_realloc (ptr, size);
+}
+#else
+static size_t allocCount = 0;
+#endif
+
+static void
+benchmark_parse (const char * name, tr_variant_fmt fmt, const char * buf, size_t len)
+{
+  int i;
+  int pass;
+  const int passes = 5;
+
+  for (i=0; i<2; ++i)
+    {
+      const bool arena = i == 1;
+      uint64_t msec = tr_time_msec ();
+      size_t allocs = allocCount;
+
+      for (pass=0; pass<passes; ++pass)
+        {
+          tr_variant top;
+          const int err = arena ? tr_variantFromBufArena (&top, fmt, buf, len, NULL, NULL)
+                                : tr_variantFromBuf (&top, fmt, buf, len, NULL, NULL);
+          assert (err == 0);
+          tr_variantFree (&top);
+        }
+
+      allocs = (allocCount - allocs) / passes;
+      msec = tr_time_msec () - msec;
+      fprintf (stderr, "%-8s %-6s %9zu allocations %8.1f ms\n",
+               name, arena ? "arena" : "heap", allocs, (double)msec / passes);
+    }
+}
+
+static void
+benchmark_variant (void)
+{
+  int i;
+  int len;
+  char * str;
+  tr_variant top;
+  tr_variant * info;
+  tr_variant * files;
+  tr_variant * ids;
+  const int fileCount = 100000;
+  const int idCount = 200000;
+
+  /* a multi-file .torrent of about 10 MB */
+  tr_variantInitDict (&top, 3);
+  tr_variantDictAddStr (&top, TR_KEY_announce, "http://tracker.example.com/announce");
+  tr_variantDictAddStr (&top, TR_KEY_comment, "synthetic torrent for benchmarking");
+  info = tr_variantDictAddDict (&top, TR_KEY_info, 4);
+  tr_variantDictAddStr (info, TR_KEY_name, "benchmark");
+  tr_variantDictAddInt (info, TR_KEY_piece_length, 1024 * 1024);
+  files = tr_variantDictAddList (info, TR_KEY_files, fileCount);
+  for (i=0; i<fileCount; ++i)
+    {
+      char buf[64];
+      tr_variant * file = tr_variantListAddDict (files, 2);
+      tr_variant * path = tr_variantDictAddList (file, TR_KEY_path, 2);
+      tr_variantDictAddInt (file, TR_KEY_length, 1000 + i);
+      tr_snprintf (buf, sizeof (buf), "directory-%04d", i / 100);
+      tr_variantListAddStr (path, buf);
+      tr_snprintf (buf, sizeof (buf), "some-file-name-%08d.dat", i);
+      tr_variantListAddStr (path, buf);
+    }
+  str = tr_new0 (char, 20 * 150000 + 1);
+  memset (str, 'x', 20 * 150000);
+  tr_variantDictAddStr (info, TR_KEY_pieces, str);
+  tr_free (str);
+  str = tr_variantToStr (&top, TR_VARIANT_FMT_BENC, &len);
+  tr_variantFree (&top);
+  fprintf (stderr, ".torrent is %d bytes\n", len);
+  benchmark_parse ("torrent", TR_VARIANT_FMT_BENC, str, len);
+  tr_free (str);
+
+  /* a torrent-set request naming a lot of torrents */
+  tr_variantInitDict (&top, 2);
+  tr_variantDictAddStr (&top, TR_KEY_method, "torrent-set");
+  info = tr_variantDictAddDict (&top, TR_KEY_arguments, 2);
+  ids = tr_variantDictAddList (info, TR_KEY_ids, idCount);
+  for (i=0; i<idCount; ++i)
+    {
+      char buf[48];
+      tr_snprintf (buf, sizeof (buf), "%040x", i);
+      tr_variantListAddStr (ids, buf);
+    }
+  tr_variantDictAddStr (info, TR_KEY_downloadDir, "/srv/downloads/somewhere");
+  str = tr_variantToStr (&top, TR_VARIANT_FMT_JSON_LEAN, &len);
+  tr_variantFree (&top);
+  fprintf (stderr, "RPC request is %d bytes\n", len);
+  benchmark_parse ("rpc", TR_VARIANT_FMT_JSON, str, len);
+  tr_free (str);
+}
+
 int
-main (void)
+main (int argc, char ** argv)
 {
+  int ret;
   static const testFunc tests[] = { testInt,
                                     testStr,
                                     testParse,
@@ -537,6 +750,14 @@ main (void)
                                     testMerge,
                                     testBool,
                                     testParse2,
+                                    testArena,
                                     testStackSmash };
-  return runTests (tests, NUM_TESTS (tests));
+
+  if ((ret = runTests (tests, NUM_TESTS (tests))))
+    return ret;
+
+  if ((argc > 1) && !strcmp (argv[1], "--benchmark"))
+    benchmark_variant ();
+
+  return 0;
 }
@@ -75,6 +75,110 @@ static const struct tr_variant_string STRING_INIT =
   .str.str = ""
 };
 
+/***
+****  Arena
+***/
+
+struct tr_variant_arena_block
+{
+  struct tr_variant_arena_block * next;
+  void * pad; /* keep the data after the header 16-byte aligned */
+};
+
+struct tr_variant_arena
+{
+  struct tr_variant_arena_block * blocks;
+  char * pos;
+  char * end;
+  char * last; /* the newest allocation, which can be grown in place */
+  size_t blockSize;
+};
+
+enum
+{
+  ARENA_ALIGN = 16,
+  ARENA_MIN_BLOCK_SIZE = 4096,
+  ARENA_MAX_BLOCK_SIZE = 1024 * 1024
+};
+
+static struct tr_variant_arena *
+arenaNew (void)
+{
+  struct tr_variant_arena * arena = tr_new0 (struct tr_variant_arena, 1);
+  arena->blockSize = ARENA_MIN_BLOCK_SIZE;
+  return arena;
+}
+
+static void
+arenaFree (struct tr_variant_arena * arena)
+{
+  while (arena->blocks != NULL)
+    {
+      struct tr_variant_arena_block * block = arena->blocks;
+      arena->blocks = block->next;
+      tr_free (block);
+    }
+
+  tr_free (arena);
+}
+
+static inline size_t
+arenaRound (size_t size)
+{
+  return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+static void *
+arenaAlloc (struct tr_variant_arena * arena, size_t size)
+{
+  char * ret;
+
+  size = arenaRound (size);
+
+  if ((size_t)(arena->end - arena->pos) < size)
+    {
+      /* start a new block, making each one bigger than the last */
+      const size_t n = MAX (arena->blockSize, size);
+      struct tr_variant_arena_block * block = tr_malloc (sizeof (struct tr_variant_arena_block) + n);
+
+      block->next = arena->blocks;
+      arena->blocks = block;
+      arena->pos = (char*)(block + 1);
+      arena->end = arena->pos + n;
+      arena->blockSize = MIN (arena->blockSize * 2, ARENA_MAX_BLOCK_SIZE);
+    }
+
+  ret = arena->pos;
+  arena->pos += size;
+  arena->last = ret;
+  return ret;
+}
+
+static void *
+arenaRealloc (struct tr_variant_arena * arena, void * old, size_t old_size, size_t new_size)
+{
+  void * ret;
+
+  if ((old != NULL) && (old == arena->last)
+                    && (arenaRound (new_size) <= (size_t)(arena->end - arena->last)))
+    {
+      arena->pos = arena->last + arenaRound (new_size);
+      ret = old;
+    }
+  else
+    {
+      ret = arenaAlloc (arena, new_size);
+      if (old != NULL)
+        memcpy (ret, old, MIN (old_size, new_size));
+    }
+
+  return ret;
+}
+
+/***
+****
+***/
+
 static void
 tr_variant_string_clear (struct tr_variant_string * str)
 {
@@ -95,6 +199,7 @@ tr_variant_string_get_string (const struct tr_variant_string * str)
       case TR_STRING_TYPE_BUF: ret = str->str.buf; break;
       case TR_STRING_TYPE_HEAP: ret = str->str.str; break;
       case TR_STRING_TYPE_QUARK: ret = str->str.str; break;
+      case TR_STRING_TYPE_ARENA: ret = str->str.str; break;
       default: ret = NULL;
     }
 
@@ -115,7 +220,8 @@ tr_variant_string_set_quark (struct tr_variant_string  * str,
 static void
 tr_variant_string_set_string (struct tr_variant_string  * str,
                               const char                * bytes,
-                              int                         len)
+                              int                         len,
+                              struct tr_variant_arena   * arena)
 {
   tr_variant_string_clear (str);
 
@@ -133,10 +239,10 @@ tr_variant_string_set_string (struct tr_variant_string  * str,
     }
   else
     {
-      char * tmp = tr_new (char, len+1);
+      char * tmp = arena ? arenaAlloc (arena, len+1) : tr_new (char, len+1);
       memcpy (tmp, bytes, len);
       tmp[len] = '\0';
-      str->type = TR_STRING_TYPE_HEAP;
+      str->type = arena ? TR_STRING_TYPE_ARENA : TR_STRING_TYPE_HEAP;
       str->str.str = tmp;
       str->len = len;
     }
@@ -393,8 +499,7 @@ tr_variantDictFindRaw (tr_variant      * dict,
 void
 tr_variantInitRaw (tr_variant * v, const void * src, size_t byteCount)
 {
-  tr_variantInit (v, TR_VARIANT_TYPE_STR);
-  tr_variant_string_set_string (&v->val.s, src, byteCount);
+  tr_variantInitStrIn (v, NULL, src, byteCount);
 }
 
 void
@@ -406,9 +511,15 @@ tr_variantInitQuark (tr_variant * v, const tr_quark q)
 
 void
 tr_variantInitStr (tr_variant * v, const void * str, int len)
+{
+  tr_variantInitStrIn (v, NULL, str, len);
+}
+
+void
+tr_variantInitStrIn (tr_variant * v, struct tr_variant_arena * arena, const void * str, int len)
 {
   tr_variantInit (v, TR_VARIANT_TYPE_STR);
-  tr_variant_string_set_string (&v->val.s, str, len);
+  tr_variant_string_set_string (&v->val.s, str, len, arena);
 }
 
 void
@@ -432,13 +543,6 @@ tr_variantInitInt (tr_variant * v, int64_t value)
   v->val.i = value;
 }
 
-void
-tr_variantInitList (tr_variant * v, size_t reserve_count)
-{
-  tr_variantInit (v, TR_VARIANT_TYPE_LIST);
-  tr_variantListReserve (v, reserve_count);
-}
-
 static void
 containerReserve (tr_variant * v, size_t count)
 {
@@ -453,11 +557,40 @@ containerReserve (tr_variant * v, size_t count)
       while (n < needed)
         n *= 2u;
 
-      v->val.l.vals = tr_renew (tr_variant, v->val.l.vals, n);
+      if (v->val.l.arena != NULL)
+        v->val.l.vals = arenaRealloc (v->val.l.arena, v->val.l.vals,
+                                      sizeof (tr_variant) * v->val.l.alloc,
+                                      sizeof (tr_variant) * n);
+      else
+        v->val.l.vals = tr_renew (tr_variant, v->val.l.vals, n);
       v->val.l.alloc = n;
     }
 }
 
+void
+tr_variantInitListIn (tr_variant * v, struct tr_variant_arena * arena, size_t reserve_count)
+{
+  tr_variantInit (v, TR_VARIANT_TYPE_LIST);
+  v->val.l.arena = arena;
+  if (reserve_count > 0)
+    containerReserve (v, reserve_count);
+}
+
+void
+tr_variantInitDictIn (tr_variant * v, struct tr_variant_arena * arena, size_t reserve_count)
+{
+  tr_variantInit (v, TR_VARIANT_TYPE_DICT);
+  v->val.l.arena = arena;
+  if (reserve_count > 0)
+    containerReserve (v, reserve_count);
+}
+
+void
+tr_variantInitList (tr_variant * v, size_t reserve_count)
+{
+  tr_variantInitListIn (v, NULL, reserve_count);
+}
+
 void
 tr_variantListReserve (tr_variant * list, size_t count)
 {
@@ -468,10 +601,17 @@ tr_variantListReserve (tr_variant * list, size_t count)
 void
 tr_variantInitDict (tr_variant * v, size_t reserve_count)
 {
-  tr_variantInit (v, TR_VARIANT_TYPE_DICT);
-  tr_variantDictReserve (v, reserve_count);
+  tr_variantInitDictIn (v, NULL, reserve_count);
+}
+
+void
+tr_variantInitDictArena (tr_variant * v, size_t reserve_count)
+{
+  tr_variantInitDictIn (v, arenaNew (), reserve_count);
+  v->val.l.ownsArena = true;
 }
 
+
 void
 tr_variantDictReserve (tr_variant  * dict,
                        size_t        reserve_count)
@@ -527,7 +667,7 @@ tr_variantListAddStr (tr_variant  * list,
                       const char  * val)
 {
   tr_variant * child = tr_variantListAdd (list);
-  tr_variantInitStr (child, val, -1);
+  tr_variantInitStrIn (child, list->val.l.arena, val, -1);
   return child;
 }
 
@@ -546,7 +686,7 @@ tr_variantListAddRaw (tr_variant  * list,
                       size_t        len)
 {
   tr_variant * child = tr_variantListAdd (list);
-  tr_variantInitRaw (child, val, len);
+  tr_variantInitStrIn (child, list->val.l.arena, val, len);
   return child;
 }
 
@@ -555,7 +695,7 @@ tr_variantListAddList (tr_variant  * list,
                        size_t        reserve_count)
 {
   tr_variant * child = tr_variantListAdd (list);
-  tr_variantInitList (child, reserve_count);
+  tr_variantInitListIn (child, list->val.l.arena, reserve_count);
   return child;
 }
 
@@ -564,7 +704,7 @@ tr_variantListAddDict (tr_variant  * list,
                        size_t        reserve_count)
 {
   tr_variant * child = tr_variantListAdd (list);
-  tr_variantInitDict (child, reserve_count);
+  tr_variantInitDictIn (child, list->val.l.arena, reserve_count);
   return child;
 }
 
@@ -656,7 +796,7 @@ tr_variantDictAddStr (tr_variant      * dict,
                       const char      * val)
 {
   tr_variant * child = dictFindOrAdd (dict, key, TR_VARIANT_TYPE_STR);
-  tr_variantInitStr (child, val, -1);
+  tr_variantInitStrIn (child, dict->val.l.arena, val, -1);
   return child;
 }
 
@@ -667,7 +807,7 @@ tr_variantDictAddRaw (tr_variant      * dict,
                       size_t            len)
 {
   tr_variant * child = dictFindOrAdd (dict, key, TR_VARIANT_TYPE_STR);
-  tr_variantInitRaw (child, src, len);
+  tr_variantInitStrIn (child, dict->val.l.arena, src, len);
   return child;
 }
 
@@ -677,7 +817,7 @@ tr_variantDictAddList (tr_variant     * dict,
                        size_t           reserve_count)
 {
   tr_variant * child = tr_variantDictAdd (dict, key);
-  tr_variantInitList (child, reserve_count);
+  tr_variantInitListIn (child, dict->val.l.arena, reserve_count);
   return child;
 }
 
@@ -687,7 +827,7 @@ tr_variantDictAddDict (tr_variant     * dict,
                        size_t           reserve_count)
 {
   tr_variant * child = tr_variantDictAdd (dict, key);
-  tr_variantInitDict (child, reserve_count);
+  tr_variantInitDictIn (child, dict->val.l.arena, reserve_count);
   return child;
 }
 
@@ -921,7 +1061,11 @@ freeStringFunc (const tr_variant * v, void * unused UNUSED)
 static void
 freeContainerEndFunc (const tr_variant * v, void * unused UNUSED)
 {
-  tr_free (v->val.l.vals);
+  /* this is the last node visited, so it's safe to free the arena now */
+  if (v->val.l.arena == NULL)
+    tr_free (v->val.l.vals);
+  else if (v->val.l.ownsArena)
+    arenaFree (v->val.l.arena);
 }
 
 static const struct VariantWalkFuncs freeWalkFuncs = { freeDummyFunc,
@@ -1229,10 +1373,11 @@ tr_variantToFile (const tr_variant  * v,
 ****
 ***/
 
-int
-tr_variantFromFile (tr_variant      * setme,
-                    tr_variant_fmt    fmt,
-                    const char      * filename)
+static int
+variantFromFile (tr_variant      * setme,
+                 tr_variant_fmt    fmt,
+                 const char      * filename,
+                 bool              use_arena)
 {
   int err;
   size_t buflen;
@@ -1244,6 +1389,8 @@ tr_variantFromFile (tr_variant      * setme,
 
   if (errno)
     err = errno;
+  else if (use_arena)
+    err = tr_variantFromBufArena (setme, fmt, buf, buflen, filename, NULL);
   else
     err = tr_variantFromBuf (setme, fmt, buf, buflen, filename, NULL);
 
@@ -1253,12 +1400,29 @@ tr_variantFromFile (tr_variant      * setme,
 }
 
 int
-tr_variantFromBuf (tr_variant      * setme,
-                   tr_variant_fmt    fmt,
-                   const void      * buf,
-                   size_t            buflen,
-                   const char      * optional_source,
-                   const char     ** setme_end)
+tr_variantFromFile (tr_variant      * setme,
+                    tr_variant_fmt    fmt,
+                    const char      * filename)
+{
+  return variantFromFile (setme, fmt, filename, false);
+}
+
+int
+tr_variantFromFileArena (tr_variant      * setme,
+                         tr_variant_fmt    fmt,
+                         const char      * filename)
+{
+  return variantFromFile (setme, fmt, filename, true);
+}
+
+static int
+variantFromBuf (tr_variant               * setme,
+                tr_variant_fmt             fmt,
+                const void               * buf,
+                size_t                     buflen,
+                const char               * optional_source,
+                const char              ** setme_end,
+                struct tr_variant_arena  * arena)
 {
   int err;
 
@@ -1266,13 +1430,54 @@ tr_variantFromBuf (tr_variant      * setme,
     {
       case TR_VARIANT_FMT_JSON:
       case TR_VARIANT_FMT_JSON_LEAN:
-        err = tr_jsonParse (optional_source, buf, buflen, setme, setme_end);
+        err = tr_jsonParse (optional_source, buf, buflen, setme, setme_end, arena);
         break;
 
       case TR_VARIANT_FMT_BENC:
-        err = tr_variantParseBenc (buf, ((const char*)buf)+buflen, setme, setme_end);
+        err = tr_variantParseBenc (buf, ((const char*)buf)+buflen, setme, setme_end, arena);
         break;
     }
 
   return err;
 }
+
+int
+tr_variantFromBuf (tr_variant      * setme,
+                   tr_variant_fmt    fmt,
+                   const void      * buf,
+                   size_t            buflen,
+                   const char      * optional_source,
+                   const char     ** setme_end)
+{
+  return variantFromBuf (setme, fmt, buf, buflen, optional_source, setme_end, NULL);
+}
+
+int
+tr_variantFromBufArena (tr_variant      * setme,
+                        tr_variant_fmt    fmt,
+                        const void      * buf,
+                        size_t            buflen,
+                        const char      * optional_source,
+                        const char     ** setme_end)
+{
+  struct tr_variant_arena * arena = arenaNew ();
+  const int err = variantFromBuf (setme, fmt, buf, buflen, optional_source, setme_end, arena);
+
+  if (!err && tr_variantIsContainer (setme))
+    {
+      setme->val.l.ownsArena = true;
+    }
+  else
+    {
+      /* the parsers don't build a scalar top-level variant in the arena */
+      if (err && tr_variantIsContainer (setme))
+        {
+          tr_variantFree (setme);
+          tr_variantInit (setme, 0);
+        }
+
+      arenaFree (arena);
+    }
+
+  return err;
+}
@@ -38,10 +38,13 @@ typedef enum
 {
   TR_STRING_TYPE_QUARK,
   TR_STRING_TYPE_HEAP,
-  TR_STRING_TYPE_BUF
+  TR_STRING_TYPE_BUF,
+  TR_STRING_TYPE_ARENA
 }
 tr_string_type;
 
+struct tr_variant_arena;
+
 /* these are PRIVATE IMPLEMENTATION details that should not be touched.
  * I'll probably change them just to break your code! HA HA HA!
  * it's included in the header for inlining and composition */
@@ -91,6 +94,11 @@ typedef struct tr_variant
           size_t alloc;
           size_t count;
           struct tr_variant * vals;
+
+          /* if not NULL, vals and the children's strings are carved
+             from this arena. see tr_variantInitDictArena () */
+          struct tr_variant_arena * arena;
+          bool ownsArena;
         } l;
     }
   val;
@@ -122,6 +130,36 @@ char* tr_variantToStr (const tr_variant * variant,
 struct evbuffer * tr_variantToBuf (const tr_variant * variant,
                                    tr_variant_fmt     fmt);
 
+/**
+ * Writes lean JSON a piece at a time, so that a large document doesn't
+ * have to exist as one tr_variant tree before it can be serialized.
+ * Keys and values are written in the order they're added.
+ */
+typedef struct tr_json_writer
+{
+  struct evbuffer * out;
+  int depth;
+  bool afterKey;
+  bool hasChildren[16];
+  char closer[16];
+}
+tr_json_writer;
+
+void tr_jsonWriterInit      (tr_json_writer * writer, struct evbuffer * out);
+
+void tr_jsonWriterBeginDict (tr_json_writer * writer);
+
+void tr_jsonWriterBeginList (tr_json_writer * writer);
+
+/** @brief ends the innermost dict or list */
+void tr_jsonWriterEnd       (tr_json_writer * writer);
+
+/** @brief the next value added to the current dict goes under this key */
+void tr_jsonWriterKey       (tr_json_writer * writer, const tr_quark key);
+
+/** @brief add a value, serialized as by TR_VARIANT_FMT_JSON_LEAN */
+void tr_jsonWriterAdd       (tr_json_writer * writer, const tr_variant * value);
+
 /* TR_VARIANT_FMT_JSON_LEAN and TR_VARIANT_FMT_JSON are equivalent here. */
 int tr_variantFromFile (tr_variant      * setme,
                         tr_variant_fmt    fmt,
@@ -135,6 +173,21 @@ int tr_variantFromBuf (tr_variant     * setme,
                        const char     * optional_source,
                        const char    ** setme_end);
 
+/* like tr_variantFromBuf (), but the tree is built in an arena.
+   see tr_variantInitDictArena () */
+int tr_variantFromBufArena (tr_variant     * setme,
+                            tr_variant_fmt   fmt,
+                            const void     * buf,
+                            size_t           buflen,
+                            const char     * optional_source,
+                            const char    ** setme_end);
+
+/* like tr_variantFromFile (), but the tree is built in an arena.
+   see tr_variantInitDictArena () */
+int tr_variantFromFileArena (tr_variant      * setme,
+                             tr_variant_fmt    fmt,
+                             const char      * filename);
+
 static inline int
 tr_variantFromBenc (tr_variant * setme,
                     const void * buf,
@@ -332,6 +385,19 @@ tr_variantIsDict (const tr_variant * v)
 void         tr_variantInitDict        (tr_variant       * initme,
                                         size_t             reserve_count);
 
+/**
+ * @brief like tr_variantInitDict (), but the tree is built in an arena
+ *
+ * The child containers and long strings of the dict -- and of the dicts
+ * and lists added to it -- are carved out of a few large blocks instead
+ * of being malloc ()ed one at a time, and tr_variantFree () on this
+ * top-level variant frees them all at once. Space taken by children that
+ * are removed or replaced isn't reused until then, so this suits trees
+ * that are built or parsed, read, and freed.
+ */
+void         tr_variantInitDictArena   (tr_variant       * initme,
+                                        size_t             reserve_count);
+
 void         tr_variantDictReserve     (tr_variant       * dict,
                                         size_t             reserve_count);
 
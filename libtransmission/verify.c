@@ -22,9 +22,12 @@
 
 #include "transmission.h"
 #include "completion.h"
+#include "crypto.h" /* tr_sha1_batch () */
 #include "fdlimit.h"
+#include "inout.h" /* tr_ioFindFileLocation () */
 #include "list.h"
-#include "platform.h" /* tr_lock () */
+#include "platform.h" /* tr_lock (), tr_threadNew () */
+#include "session.h"
 #include "torrent.h"
 #include "utils.h" /* tr_valloc (), tr_free () */
 #include "verify.h"
@@ -35,32 +38,128 @@
 
 enum
 {
-  MSEC_TO_SLEEP_PER_SECOND_DURING_VERIFY = 100
+  MSEC_TO_SLEEP_PER_SECOND_DURING_VERIFY = 100,
+
+  /* large torrents are split into spans of about this many bytes
+   * so that several verify workers can hash one torrent at once */
+  VERIFY_SPAN_BYTES = (1024 * 1024 * 64),
+
+  /* how far ahead of the hasher we ask the OS to read. The kernel
+   * fills these pages in the background while SHA1 runs on the
+   * current buffer, so disk and CPU stay busy at the same time */
+  VERIFY_READAHEAD_BYTES = (1024 * 1024),
+
+  /* upper bound on the memory used to hold a batch of whole pieces */
+  VERIFY_BATCH_BYTES = (1024 * 1024 * 16)
+};
+
+struct verify_span_stats
+{
+  uint64_t bytesRead;
+  uint64_t readMsec;
+  uint64_t hashMsec;
+};
+
+struct verify_node
+{
+  tr_torrent *         torrent;
+  tr_verify_done_cb    verify_done_cb;
+  uint64_t             current_size;
+
+  /* the first piece that hasn't been handed to a worker yet */
+  tr_piece_index_t     nextPiece;
+
+  /* how many workers are hashing pieces of this torrent right now */
+  int                  workerCount;
+
+  uint64_t             beginMsec;
+  struct verify_span_stats stats;
+  bool                 changed;
+  bool                 stopFlag;
 };
 
+static tr_list * verifyList = NULL; /* queued; no pieces handed out yet */
+static tr_list * activeList = NULL; /* at least one span handed out */
+static int workerCount = 0;
+static int workerLimit = 1;
+
+static tr_lock*
+getVerifyLock (void)
+{
+  static tr_lock * lock = NULL;
+
+  if (lock == NULL)
+    lock = tr_lockNew ();
+
+  return lock;
+}
+
+static tr_piece_index_t
+getPiecesPerSpan (const tr_torrent * tor)
+{
+  uint32_t n = 1;
+
+  /* magnet links don't know their piece size until they have metadata */
+  if (tor->info.pieceSize > 0)
+    n = VERIFY_SPAN_BYTES / tor->info.pieceSize;
+
+  return MAX (n, 1);
+}
+
+/* how many pieces to hash together in one tr_sha1_batch () call.
+ * Batching means holding whole pieces in memory, so it's only done
+ * when the CPU has a multi-buffer SHA1 and the pieces are small. */
+static int
+getBatchSize (const tr_torrent * tor)
+{
+  if (tr_sha1GetBackend () == TR_SHA1_BACKEND_OPENSSL)
+    return 1;
+
+  if (tor->info.pieceSize > VERIFY_BATCH_BYTES / TR_SHA1_BATCH_SIZE)
+    return 1;
+
+  return TR_SHA1_BATCH_SIZE;
+}
+
+/* hash pieces [firstPiece..lastPiece] and fold the results into
+ * the torrent's completion. Several workers may call this at the
+ * same time on disjoint spans of one torrent, so the updates to
+ * tr_completion are serialized by the verify lock. */
 static bool
-verifyTorrent (tr_torrent * tor, bool * stopFlag)
+verifyTorrent (tr_torrent               * tor,
+               tr_piece_index_t           firstPiece,
+               tr_piece_index_t           lastPiece,
+               bool                     * stopFlag,
+               struct verify_span_stats * stats)
 {
-  time_t end;
   SHA_CTX sha;
   int fd = -1;
-  int64_t filePos = 0;
+  int slot = 0;
+  uint64_t filePos;
+  uint64_t prefetchedTo = 0;
+  uint64_t msec;
   bool changed = 0;
-  bool hadPiece = 0;
   time_t lastSleptAt = 0;
   uint32_t piecePos = 0;
-  tr_file_index_t fileIndex = 0;
-  tr_file_index_t prevFileIndex = !fileIndex;
-  tr_piece_index_t pieceIndex = 0;
-  const time_t begin = tr_time ();
-  const size_t buflen = 1024 * 128; /* 128 KiB buffer */
-  uint8_t * buffer = tr_valloc (buflen);
+  tr_file_index_t fileIndex;
+  tr_file_index_t prevFileIndex;
+  tr_piece_index_t pieceIndex = firstPiece;
+  bool incomplete[TR_SHA1_BATCH_SIZE];
+  uint8_t hashes[TR_SHA1_BATCH_SIZE * SHA_DIGEST_LENGTH];
+  const size_t buflen = 1024 * 128; /* 128 KiB reads */
+  const int batchSize = getBatchSize (tor);
+  const uint8_t * pieceHashes = tor->info.pieceHashes; /* see tr_torrentVerify () */
+  uint8_t * buffer = tr_valloc (batchSize > 1 ? batchSize * tor->info.pieceSize : buflen);
+  const bool doSleep = workerLimit < 2;
+
+  assert (pieceHashes != NULL);
+
+  tr_ioFindFileLocation (tor, firstPiece, 0, &fileIndex, &filePos);
+  prevFileIndex = !fileIndex;
 
   SHA1_Init (&sha);
 
-  tr_tordbg (tor, "%s", "verifying torrent...");
-  tr_torrentSetChecked (tor, 0);
-  while (!*stopFlag && (pieceIndex < tor->info.pieceCount))
+  while (!*stopFlag && (pieceIndex <= lastPiece))
     {
       uint32_t leftInPiece;
       uint32_t bytesThisPass;
@@ -69,15 +168,16 @@ verifyTorrent (tr_torrent * tor, bool * stopFlag)
 
       /* if we're starting a new piece... */
       if (piecePos == 0)
-        hadPiece = tr_cpPieceIsComplete (&tor->completion, pieceIndex);
+        incomplete[slot] = false;
 
       /* if we're starting a new file... */
-      if (!filePos && (fd<0) && (fileIndex!=prevFileIndex))
+      if ((fd<0) && (fileIndex!=prevFileIndex))
         {
           char * filename = tr_torrentFindFile (tor, fileIndex);
           fd = filename == NULL ? -1 : tr_open_file_for_scanning (filename);
           tr_free (filename);
           prevFileIndex = fileIndex;
+          prefetchedTo = filePos;
         }
 
       /* figure out how much we can read this pass */
@@ -87,13 +187,52 @@ verifyTorrent (tr_torrent * tor, bool * stopFlag)
       bytesThisPass = MIN (bytesThisPass, buflen);
 
       /* read a bit */
-      if (fd >= 0)
+      if (bytesThisPass == 0)
+        {
+          /* empty file; nothing to read */
+        }
+      else if (fd < 0)
+        {
+          incomplete[slot] = true;
+        }
+      else
         {
-          const ssize_t numRead = tr_pread (fd, buffer, bytesThisPass, filePos);
-          if (numRead > 0)
+          ssize_t numRead;
+          uint8_t * dest = buffer;
+
+          /* when batching, pieces are read into their own slots
+           * and hashed together once the batch is full */
+          if (batchSize > 1)
+            dest += slot * tor->info.pieceSize + piecePos;
+
+          /* keep the readahead window full */
+          if ((prefetchedTo < file->length)
+                && (prefetchedTo < filePos + VERIFY_READAHEAD_BYTES))
+            {
+              const uint64_t end = MIN (file->length, filePos + buflen + VERIFY_READAHEAD_BYTES);
+              tr_prefetch (fd, prefetchedTo, end - prefetchedTo);
+              prefetchedTo = end;
+            }
+
+          msec = tr_time_msec ();
+          numRead = tr_pread (fd, dest, bytesThisPass, filePos);
+          stats->readMsec += tr_time_msec () - msec;
+
+          if (numRead <= 0)
+            {
+              incomplete[slot] = true;
+            }
+          else
             {
               bytesThisPass = (uint32_t)numRead;
-              SHA1_Update (&sha, buffer, bytesThisPass);
+              stats->bytesRead += bytesThisPass;
+
+              if (batchSize == 1)
+                {
+                  msec = tr_time_msec ();
+                  SHA1_Update (&sha, dest, bytesThisPass);
+                  stats->hashMsec += tr_time_msec () - msec;
+                }
 #if defined HAVE_POSIX_FADVISE && defined POSIX_FADV_DONTNEED
               posix_fadvise (fd, filePos, bytesThisPass, POSIX_FADV_DONTNEED);
 #endif
@@ -109,32 +248,65 @@ verifyTorrent (tr_torrent * tor, bool * stopFlag)
       /* if we're finishing a piece... */
       if (leftInPiece == 0)
         {
-          time_t now;
-          bool hasPiece;
-          uint8_t hash[SHA_DIGEST_LENGTH];
-
-          SHA1_Final (hash, &sha);
-          hasPiece = !memcmp (hash, tor->info.pieces[pieceIndex].hash, SHA_DIGEST_LENGTH);
-
-          if (hasPiece || hadPiece)
+          if (batchSize == 1)
             {
-              tr_torrentSetHasPiece (tor, pieceIndex, hasPiece);
-              changed |= hasPiece != hadPiece;
+              SHA1_Final (hashes, &sha);
+              SHA1_Init (&sha);
             }
 
-          tr_torrentSetPieceChecked (tor, pieceIndex);
-          now = tr_time ();
-          tor->anyDate = now;
-
-          /* sleeping even just a few msec per second goes a long
-           * way towards reducing IO load... */
-          if (lastSleptAt != now)
+          /* if we're finishing a batch... */
+          if ((++slot == batchSize) || (pieceIndex == lastPiece))
             {
-              lastSleptAt = now;
-              tr_wait_msec (MSEC_TO_SLEEP_PER_SECOND_DURING_VERIFY);
+              int i;
+              time_t now;
+              const tr_piece_index_t batchBegin = pieceIndex + 1 - slot;
+
+              if (batchSize > 1)
+                {
+                  size_t lens[TR_SHA1_BATCH_SIZE];
+                  const void * contents[TR_SHA1_BATCH_SIZE];
+
+                  for (i=0; i<slot; ++i)
+                    {
+                      contents[i] = buffer + i * tor->info.pieceSize;
+                      lens[i] = tr_torPieceCountBytes (tor, batchBegin + i);
+                    }
+
+                  msec = tr_time_msec ();
+                  tr_sha1_batch (hashes, slot, contents, lens);
+                  stats->hashMsec += tr_time_msec () - msec;
+                }
+
+              now = tr_time ();
+              tr_lockLock (getVerifyLock ());
+              for (i=0; i<slot; ++i)
+                {
+                  const tr_piece_index_t p = batchBegin + i;
+                  const bool hadPiece = tr_cpPieceIsComplete (&tor->completion, p);
+                  const bool hasPiece = !incomplete[i]
+                      && !memcmp (hashes + i*SHA_DIGEST_LENGTH, pieceHashes + (size_t)p*SHA_DIGEST_LENGTH, SHA_DIGEST_LENGTH);
+
+                  if (hasPiece || hadPiece)
+                    {
+                      tr_torrentSetHasPiece (tor, p, hasPiece);
+                      changed |= hasPiece != hadPiece;
+                    }
+                  tr_torrentSetPieceChecked (tor, p);
+                }
+              tor->anyDate = now;
+              tr_lockUnlock (getVerifyLock ());
+              slot = 0;
+
+              /* sleeping even just a few msec per second goes a long
+               * way towards reducing IO load... but if the user asked
+               * for several verify threads, they want throughput instead */
+              if (doSleep && (lastSleptAt != now))
+                {
+                  lastSleptAt = now;
+                  tr_wait_msec (MSEC_TO_SLEEP_PER_SECOND_DURING_VERIFY);
+                }
             }
 
-          SHA1_Init (&sha);
           pieceIndex++;
           piecePos = 0;
         }
@@ -157,12 +329,6 @@ verifyTorrent (tr_torrent * tor, bool * stopFlag)
     tr_close_file (fd);
   free (buffer);
 
-  /* stopwatch */
-  end = tr_time ();
-  tr_tordbg (tor, "Verification is done. It took %d seconds to verify %"PRIu64" bytes (%"PRIu64" bytes per second)",
-             (int)(end-begin), tor->info.totalSize,
-             (uint64_t)(tor->info.totalSize/ (1+ (end-begin))));
-
   return changed;
 }
 
@@ -170,13 +336,6 @@ verifyTorrent (tr_torrent * tor, bool * stopFlag)
 ****
 ***/
 
-struct verify_node
-{
-  tr_torrent *         torrent;
-  tr_verify_done_cb    verify_done_cb;
-  uint64_t             current_size;
-};
-
 static void
 fireCheckDone (tr_torrent * tor, tr_verify_done_cb verify_done_cb)
 {
@@ -186,61 +345,160 @@ fireCheckDone (tr_torrent * tor, tr_verify_done_cb verify_done_cb)
     verify_done_cb (tor);
 }
 
-static struct verify_node currentNode;
-static tr_list * verifyList = NULL;
-static tr_thread * verifyThread = NULL;
-static bool stopCurrent = false;
+/* called with the verify lock held, when the last span of a node that
+ * wasn't stopped has been hashed. The caller fires verify_done_cb */
+static void
+verifyNodeComplete (struct verify_node * node)
+{
+  tr_torrent * tor = node->torrent;
+  const struct verify_span_stats * st = &node->stats;
+  const uint64_t msec = MAX (1, tr_time_msec () - node->beginMsec);
+  const uint64_t busyMsec = MAX (1, st->readMsec + st->hashMsec);
+
+  assert (tr_isTorrent (tor));
+
+  /* if most of the workers' time went to waiting on reads, the
+   * recheck was disk-bound; otherwise SHA1 was the bottleneck */
+  tr_torinf (tor, "Verification is done. It took %.1f seconds to read %"PRIu64" bytes (%.1f MiB/s, %d%% of the time waiting on disk)",
+             msec / 1000.0, st->bytesRead,
+             (st->bytesRead / (1024.0 * 1024.0)) / (msec / 1000.0),
+             (int)((100 * st->readMsec) / busyMsec));
+
+  tr_torrentSetVerifyState (tor, TR_VERIFY_NONE);
+  if (node->changed)
+    tr_torrentSetDirty (tor);
+}
+
+/* called with the verify lock held, once the last worker is done with a node */
+static void
+verifyNodeFinish (struct verify_node * node)
+{
+  tr_torrent * tor = node->torrent;
+
+  assert (node->workerCount == 0);
+  assert (tr_isTorrent (tor));
 
-static tr_lock*
-getVerifyLock (void)
+  tr_list_remove_data (&activeList, node);
+  tr_torrentSetVerifyState (tor, TR_VERIFY_NONE);
+  tr_free (node);
+}
+
+/* called with the verify lock held.
+ * picks the next span of pieces for a worker to hash. Torrents that
+ * are already being verified are finished before new ones are begun. */
+static struct verify_node *
+verifyNodeClaimSpan (tr_piece_index_t * setmeFirst, tr_piece_index_t * setmeLast)
 {
-  static tr_lock * lock = NULL;
+  tr_list * l;
+  tr_torrent * tor;
+  struct verify_node * node = NULL;
 
-  if (lock == NULL)
-    lock = tr_lockNew ();
+  for (l=activeList; l!=NULL; l=l->next)
+    {
+      struct verify_node * n = l->data;
 
-  return lock;
+      if (!n->stopFlag && (n->nextPiece < n->torrent->info.pieceCount))
+        {
+          node = n;
+          break;
+        }
+    }
+
+  if ((node == NULL) && (verifyList != NULL))
+    {
+      node = tr_list_pop_front (&verifyList);
+      tr_list_append (&activeList, node);
+
+      tor = node->torrent;
+      tr_torinf (tor, "%s", _("Verifying torrent"));
+      tr_tordbg (tor, "%s", "verifying torrent...");
+      tr_torrentSetVerifyState (tor, TR_VERIFY_NOW);
+      tr_torrentSetChecked (tor, 0);
+      node->beginMsec = tr_time_msec ();
+    }
+
+  if (node != NULL)
+    {
+      tor = node->torrent;
+      *setmeFirst = node->nextPiece;
+      *setmeLast = node->nextPiece;
+
+      /* a magnet link without metadata has no pieces. Its one span is
+       * empty: the worker reads nothing and just finishes the node */
+      if (node->nextPiece < tor->info.pieceCount)
+        {
+          *setmeLast = MIN (node->nextPiece + getPiecesPerSpan (tor), tor->info.pieceCount) - 1;
+          node->nextPiece = *setmeLast + 1;
+        }
+
+      ++node->workerCount;
+    }
+
+  return node;
 }
 
 static void
 verifyThreadFunc (void * unused UNUSED)
 {
+  bool changed = false;
+  struct verify_span_stats stats;
+  struct verify_node * node = NULL;
+
   for (;;)
     {
-      int changed = 0;
-      tr_torrent * tor;
-      struct verify_node * node;
+      tr_piece_index_t first;
+      tr_piece_index_t last;
 
       tr_lockLock (getVerifyLock ());
-      stopCurrent = false;
-      node = (struct verify_node*) verifyList ? verifyList->data : NULL;
+
+      /* retire the span we just finished */
+      if (node != NULL)
+        {
+          if (changed)
+            node->changed = true;
+
+          node->stats.bytesRead += stats.bytesRead;
+          node->stats.readMsec += stats.readMsec;
+          node->stats.hashMsec += stats.hashMsec;
+
+          /* the last span is done. Like the single verify thread did, call
+           * verify_done_cb without the verify lock. The node keeps our
+           * workerCount reference until it returns, so tr_verifyRemove ()
+           * still waits for it */
+          if ((node->workerCount == 1) && !node->stopFlag
+              && (node->nextPiece >= node->torrent->info.pieceCount))
+            {
+              tr_torrent * tor = node->torrent;
+
+              verifyNodeComplete (node);
+              node->stopFlag = true;
+              tr_lockUnlock (getVerifyLock ());
+              fireCheckDone (tor, node->verify_done_cb);
+              tr_lockLock (getVerifyLock ());
+            }
+
+          if (--node->workerCount == 0)
+            if (node->stopFlag || (node->nextPiece >= node->torrent->info.pieceCount))
+              verifyNodeFinish (node);
+        }
+
+      node = verifyNodeClaimSpan (&first, &last);
       if (node == NULL)
         {
-          currentNode.torrent = NULL;
+          --workerCount;
           break;
         }
 
-      currentNode = *node;
-      tor = currentNode.torrent;
-      tr_list_remove_data (&verifyList, node);
-      tr_free (node);
       tr_lockUnlock (getVerifyLock ());
 
-      tr_torinf (tor, "%s", _("Verifying torrent"));
-      tr_torrentSetVerifyState (tor, TR_VERIFY_NOW);
-      changed = verifyTorrent (tor, &stopCurrent);
-      tr_torrentSetVerifyState (tor, TR_VERIFY_NONE);
-      assert (tr_isTorrent (tor));
+      memset (&stats, 0, sizeof (stats));
+      changed = false;
 
-      if (!stopCurrent)
-        {
-          if (changed)
-            tr_torrentSetDirty (tor);
-          fireCheckDone (tor, currentNode.verify_done_cb);
-        }
+      /* a magnet link without metadata has no pieces to check */
+      if (first < node->torrent->info.pieceCount)
+        changed = verifyTorrent (node->torrent, first, last, &node->stopFlag, &stats);
     }
 
-  verifyThread = NULL;
   tr_lockUnlock (getVerifyLock ());
 }
 
@@ -267,21 +525,31 @@ compareVerifyByPriorityAndSize (const void * va, const void * vb)
 void
 tr_verifyAdd (tr_torrent * tor, tr_verify_done_cb verify_done_cb)
 {
+  int spanCount;
   struct verify_node * node;
 
   assert (tr_isTorrent (tor));
   tr_torinf (tor, "%s", _("Queued for verification"));
 
-  node = tr_new (struct verify_node, 1);
+  node = tr_new0 (struct verify_node, 1);
   node->torrent = tor;
   node->verify_done_cb = verify_done_cb;
   node->current_size = tr_torrentGetCurrentSizeOnDisk (tor);
 
+  /* always at least one, so that a torrent with no pieces still gets
+     picked up by a worker and has its verify_done_cb called */
+  spanCount = (tor->info.pieceCount + getPiecesPerSpan (tor) - 1) / getPiecesPerSpan (tor);
+  spanCount = MAX (spanCount, 1);
+
   tr_lockLock (getVerifyLock ());
   tr_torrentSetVerifyState (tor, TR_VERIFY_WAIT);
   tr_list_insert_sorted (&verifyList, node, compareVerifyByPriorityAndSize);
-  if (verifyThread == NULL)
-    verifyThread = tr_threadNew (verifyThreadFunc, NULL);
+  workerLimit = MAX (1, tor->session->verifyThreads);
+  while ((workerCount < workerLimit) && (spanCount-- > 0))
+    {
+      ++workerCount;
+      tr_threadNew (verifyThreadFunc, NULL);
+    }
   tr_lockUnlock (getVerifyLock ());
 }
 
@@ -296,16 +564,24 @@ compareVerifyByTorrent (const void * va, const void * vb)
 void
 tr_verifyRemove (tr_torrent * tor)
 {
+  tr_list * l;
   tr_lock * lock = getVerifyLock ();
   tr_lockLock (lock);
 
   assert (tr_isTorrent (tor));
 
-  if (tor == currentNode.torrent)
+  l = tr_list_find (activeList, tor, compareVerifyByTorrent);
+  if (l != NULL)
     {
-      stopCurrent = true;
+      struct verify_node * node = l->data;
 
-      while (stopCurrent)
+      node->stopFlag = true;
+
+      if (node->workerCount == 0)
+        verifyNodeFinish (node);
+
+      /* wait for the workers to finish their spans */
+      while (tr_list_find (activeList, tor, compareVerifyByTorrent) != NULL)
         {
           tr_lockUnlock (lock);
           tr_wait_msec (100);
@@ -324,11 +600,22 @@ tr_verifyRemove (tr_torrent * tor)
 void
 tr_verifyClose (tr_session * session UNUSED)
 {
+  tr_list * l;
+  tr_list * next;
+
   tr_lockLock (getVerifyLock ());
 
-  stopCurrent = true;
+  for (l=activeList; l!=NULL; l=next)
+    {
+      struct verify_node * node = l->data;
+      next = l->next;
+
+      node->stopFlag = true;
+      if (node->workerCount == 0)
+        verifyNodeFinish (node);
+    }
+
   tr_list_free (&verifyList, tr_free);
 
   tr_lockUnlock (getVerifyLock ());
 }
-
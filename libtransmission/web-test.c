@@ -0,0 +1,274 @@
+#include <stdio.h> /* fprintf () */
+#include <stdlib.h> /* mkdtemp () */
+#include <string.h> /* strcmp () */
+
+#include <sys/types.h>
+#include <sys/socket.h> /* getsockname () */
+#include <netinet/in.h> /* struct sockaddr_in */
+
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include <event2/http.h>
+
+#include "transmission.h"
+#include "platform.h" /* tr_threadNew () */
+#include "utils.h"
+#include "variant.h"
+#include "web.h"
+
+#include "libtransmission-test.h"
+
+/***
+****  A stand-in tracker on the loopback interface, in its own thread
+***/
+
+static const char announce_response[] = "d8:intervali1800e5:peers0:e";
+
+struct tracker
+{
+    struct event_base * base;
+    struct evhttp * http;
+    int port;
+    int requestCount;
+    volatile bool ready;
+    volatile bool done;
+};
+
+static void
+onAnnounce (struct evhttp_request * req, void * vtracker)
+{
+    struct tracker * tracker = vtracker;
+    struct evbuffer * body = evbuffer_new ();
+
+    ++tracker->requestCount;
+    evbuffer_add (body, announce_response, sizeof (announce_response) - 1);
+    evhttp_send_reply (req, HTTP_OK, "OK", body);
+    evbuffer_free (body);
+}
+
+static void
+onTrackerTimer (evutil_socket_t fd UNUSED, short what UNUSED, void * vtracker)
+{
+    struct tracker * tracker = vtracker;
+
+    if (tracker->done)
+        event_base_loopbreak (tracker->base);
+}
+
+static void
+trackerThreadFunc (void * vtracker)
+{
+    struct sockaddr_in sin;
+    socklen_t len = sizeof (sin);
+    struct evhttp_bound_socket * sock;
+    struct event * timer;
+    struct tracker * tracker = vtracker;
+    const struct timeval interval = { 0, 50000 };
+
+    tracker->base = event_base_new ();
+    tracker->http = evhttp_new (tracker->base);
+    evhttp_set_cb (tracker->http, "/announce", onAnnounce, tracker);
+    sock = evhttp_bind_socket_with_handle (tracker->http, "127.0.0.1", 0);
+    getsockname (evhttp_bound_socket_get_fd (sock), (struct sockaddr*)&sin, &len);
+    tracker->port = ntohs (sin.sin_port);
+
+    /* poll for the done flag */
+    timer = event_new (tracker->base, -1, EV_PERSIST, onTrackerTimer, tracker);
+    event_add (timer, &interval);
+
+    tracker->ready = true;
+    event_base_dispatch (tracker->base);
+
+    event_free (timer);
+    evhttp_free (tracker->http);
+    event_base_free (tracker->base);
+    tracker->ready = false;
+}
+
+static void
+trackerStart (struct tracker * tracker)
+{
+    memset (tracker, 0, sizeof (struct tracker));
+    tr_threadNew (trackerThreadFunc, tracker);
+    while (!tracker->ready)
+        tr_wait_msec (10);
+}
+
+static void
+trackerStop (struct tracker * tracker)
+{
+    tracker->done = true;
+    while (tracker->ready)
+        tr_wait_msec (10);
+}
+
+/***
+****
+***/
+
+static tr_session *
+sessionNew (const char * config_dir, int connectionsPerHost)
+{
+    tr_session * session;
+    tr_variant settings;
+
+    tr_variantInitDict (&settings, 1);
+    tr_variantDictAddInt (&settings, TR_KEY_web_connections_per_host, connectionsPerHost);
+    session = libttest_session_init (config_dir, &settings);
+    tr_variantFree (&settings);
+
+    return session;
+}
+
+/* only touched in the session's event thread */
+struct results
+{
+    int doneCount;
+    int okCount;
+};
+
+static void
+onDone (tr_session   * session UNUSED,
+        bool           did_connect UNUSED,
+        bool           did_timeout UNUSED,
+        long           response_code,
+        const void   * response,
+        size_t         response_byte_count,
+        void         * vresults)
+{
+    struct results * results = vresults;
+
+    if ((response_code == 200)
+      && (response_byte_count == sizeof (announce_response) - 1)
+      && !memcmp (response, announce_response, response_byte_count))
+        ++results->okCount;
+
+    ++results->doneCount;
+}
+
+/* run n requests at once and wait for them to finish */
+static void
+runAnnounces (tr_session * session, const struct tracker * tracker,
+              int n, struct results * results)
+{
+    int i;
+    const time_t deadline = tr_time () + 60;
+
+    memset (results, 0, sizeof (struct results));
+
+    for (i=0; i<n; ++i)
+    {
+        char url[128];
+        tr_snprintf (url, sizeof (url), "http://127.0.0.1:%d/announce?n=%d", tracker->port, i);
+        tr_webRun (session, url, NULL, NULL, onDone, results);
+    }
+
+    while ((results->doneCount < n) && (tr_time () < deadline))
+        tr_wait_msec (1);
+}
+
+static int
+test_web_run (void)
+{
+    tr_session * session;
+    struct tracker tracker;
+    struct results results;
+    tr_web_stats stats;
+    char config_dir[] = "/tmp/transmission-web-test-XXXXXX";
+
+    check (mkdtemp (config_dir) != NULL);
+    trackerStart (&tracker);
+    session = sessionNew (config_dir, 4);
+
+    /* a lone request */
+    runAnnounces (session, &tracker, 1, &results);
+    check_int_eq (1, results.doneCount);
+    check_int_eq (1, results.okCount);
+
+    /* a burst of them, more than the announcer allows at once */
+    runAnnounces (session, &tracker, 100, &results);
+    check_int_eq (100, results.doneCount);
+    check_int_eq (100, results.okCount);
+    check_int_eq (101, tracker.requestCount);
+
+    /* the connections were kept alive and reused */
+    check (tr_webGetStats (session, &stats));
+    check_int_eq (101, stats.requestCount);
+    check (stats.connectionCount >= 1);
+    check_int_eq (101, stats.connectionCount + stats.reusedCount);
+#if LIBCURL_VERSION_NUM >= 0x071E00 /* CURLMOPT_MAX_HOST_CONNECTIONS */
+    check (stats.connectionCount <= 4);
+#endif
+
+    tr_sessionClose (session);
+    trackerStop (&tracker);
+    libttest_rm_rf (config_dir);
+    return 0;
+}
+
+/***
+****  Benchmark: run with --benchmark
+***/
+
+static void
+benchmark_announces (int connectionsPerHost)
+{
+    int n;
+    tr_session * session;
+    struct tracker tracker;
+    struct results results;
+    tr_web_stats stats;
+    char config_dir[] = "/tmp/transmission-web-test-XXXXXX";
+
+    if (mkdtemp (config_dir) == NULL)
+        return;
+
+    trackerStart (&tracker);
+    session = sessionNew (config_dir, connectionsPerHost);
+    fprintf (stderr, "web-connections-per-host: %d\n", connectionsPerHost);
+
+    /* the process' fd limit caps how many can be in flight at once */
+    for (n=64; n<=512; n*=2)
+    {
+        int pass;
+        int ok = 0;
+        const int passes = 8;
+        uint64_t msec = tr_time_msec ();
+
+        for (pass=0; pass<passes; ++pass)
+        {
+            runAnnounces (session, &tracker, n, &results);
+            ok += results.okCount;
+        }
+
+        msec = MAX (1, tr_time_msec () - msec);
+        fprintf (stderr, "%4d concurrent: %8.0f announces/s (%d of %d ok)\n",
+                 n, ok / (msec / 1000.0), ok, n * passes);
+    }
+
+    if (tr_webGetStats (session, &stats))
+        fprintf (stderr, "%" PRIu64 " requests, %" PRIu64 " connections opened, %" PRIu64 " reused\n",
+                 stats.requestCount, stats.connectionCount, stats.reusedCount);
+
+    tr_sessionClose (session);
+    trackerStop (&tracker);
+    libttest_rm_rf (config_dir);
+}
+
+int
+main (int argc, char ** argv)
+{
+    int ret;
+    const testFunc tests[] = { test_web_run };
+
+    if ((ret = runTests (tests, NUM_TESTS (tests))))
+        return ret;
+
+    if ((argc > 1) && !strcmp (argv[1], "--benchmark"))
+    {
+        benchmark_announces (8);
+        benchmark_announces (0);
+    }
+
+    return 0;
+}
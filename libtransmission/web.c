@@ -16,12 +16,14 @@
 #ifdef WIN32
   #include <ws2tcpip.h>
 #else
-  #include <sys/select.h>
+  #include <sys/socket.h> /* AF_UNIX */
 #endif
 
 #include <curl/curl.h>
 
 #include <event2/buffer.h>
+#include <event2/event.h>
+#include <event2/util.h> /* evutil_socketpair () */
 
 #include "transmission.h"
 #include "net.h" /* tr_address */
@@ -36,10 +38,19 @@
  #define USE_LIBCURL_SOCKOPT
 #endif
 
-enum
-{
-    THREADFUNC_MAX_SLEEP_MSEC = 1000,
-};
+#if LIBCURL_VERSION_NUM >= 0x071E00 /* CURLMOPT_MAX_HOST_CONNECTIONS was added in 7.30.0 */
+ #define USE_LIBCURL_MAX_HOST_CONNECTIONS
+#endif
+
+#if LIBCURL_VERSION_NUM >= 0x072B00 /* CURLPIPE_MULTIPLEX and CURLOPT_PIPEWAIT were added in 7.43.0 */
+ #define USE_LIBCURL_MULTIPLEX
+#endif
+
+#ifdef WIN32
+ #define WAKEUP_FAMILY AF_INET
+#else
+ #define WAKEUP_FAMILY AF_UNIX
+#endif
 
 #if 0
 #define dbgmsg(...) \
@@ -55,6 +66,15 @@ enum
     } while (0)
 #endif
 
+enum
+{
+    /* how many finished easy handles to keep for reuse */
+    MAX_IDLE_HANDLES = 32,
+
+    /* how many idle connections curl may keep alive, across all hosts */
+    MAX_CACHED_CONNECTIONS = 64
+};
+
 /***
 ****
 ***/
@@ -68,6 +88,7 @@ struct tr_web_task
     struct evbuffer * response;
     struct evbuffer * freebuf;
     char * url;
+    char * host;
     char * range;
     char * cookies;
     tr_session * session;
@@ -84,10 +105,20 @@ task_free (struct tr_web_task * task)
         evbuffer_free (task->freebuf);
     tr_free (task->cookies);
     tr_free (task->range);
+    tr_free (task->host);
     tr_free (task->url);
     tr_free (task);
 }
 
+/* a finished easy handle, waiting to be reused. curl keeps a TLS session
+   cache in each easy handle, so we try to reuse it with the same host */
+struct tr_web_idle_easy
+{
+    CURL * curl_easy;
+    char * host;
+    struct tr_web_idle_easy * next;
+};
+
 /***
 ****
 ***/
@@ -101,6 +132,26 @@ struct tr_web
     struct tr_web_task * tasks;
     tr_lock * taskLock;
     char * cookie_filename;
+    tr_session * session;
+
+    /* tr_webRun () and tr_webClose () write a byte to fds[1] to wake
+       the web thread. tasks are added with a 't', which is only sent
+       when the queue goes from empty to nonempty; the other bytes are
+       close modes, so that close_mode is only set by the web thread */
+    evutil_socket_t fds[2];
+
+    /* protected by taskLock */
+    tr_web_stats stats;
+
+    /* only touched by the web thread */
+    CURLM * multi;
+    int taskCount;
+    int connectionsPerHost;
+    int idleCount;
+    struct tr_web_idle_easy * idle;
+    struct event_base * base;
+    struct event * timer;
+    struct event * wakeEvent;
 };
 
 /***
@@ -153,14 +204,81 @@ getTimeoutFromURL (const struct tr_web_task * task)
     return timeout;
 }
 
+/* "host:port", or NULL if the url can't be parsed */
+static char *
+getHostKey (const char * url)
+{
+    int port;
+    char * host;
+    char * key = NULL;
+
+    if (!tr_urlParse (url, -1, NULL, &host, &port, NULL))
+    {
+        key = tr_strdup_printf ("%s:%d", host, port);
+        tr_free (host);
+    }
+
+    return key;
+}
+
+/* take an idle easy handle, preferably one that last talked to host */
+static CURL *
+getIdleEasy (struct tr_web * web, const char * host)
+{
+    CURL * e;
+    struct tr_web_idle_easy * idle;
+    struct tr_web_idle_easy ** walk = &web->idle;
+
+    if (web->idle == NULL)
+        return curl_easy_init ();
+
+    if (host != NULL)
+        for (; *walk != NULL; walk = &(*walk)->next)
+            if (((*walk)->host != NULL) && !strcmp ((*walk)->host, host))
+                break;
+
+    if (*walk == NULL)
+        walk = &web->idle;
+
+    idle = *walk;
+    *walk = idle->next;
+    --web->idleCount;
+
+    e = idle->curl_easy;
+    curl_easy_reset (e);
+    tr_free (idle->host);
+    tr_free (idle);
+    return e;
+}
+
+static void
+putIdleEasy (struct tr_web * web, CURL * e, const char * host)
+{
+    if (web->idleCount >= MAX_IDLE_HANDLES)
+    {
+        curl_easy_cleanup (e);
+    }
+    else
+    {
+        struct tr_web_idle_easy * idle = tr_new (struct tr_web_idle_easy, 1);
+        idle->curl_easy = e;
+        idle->host = tr_strdup (host);
+        idle->next = web->idle;
+        web->idle = idle;
+        ++web->idleCount;
+    }
+}
+
 static CURL *
 createEasy (tr_session * s, struct tr_web * web, struct tr_web_task * task)
 {
     bool is_default_value;
     const tr_address * addr;
-    CURL * e = task->curl_easy = curl_easy_init ();
+    CURL * e;
 
+    task->host = getHostKey (task->url);
     task->timeout_secs = getTimeoutFromURL (task);
+    e = task->curl_easy = getIdleEasy (web, task->host);
 
     curl_easy_setopt (e, CURLOPT_AUTOREFERER, 1L);
     curl_easy_setopt (e, CURLOPT_COOKIEFILE, web->cookie_filename);
@@ -168,6 +286,11 @@ createEasy (tr_session * s, struct tr_web * web, struct tr_web_task * task)
     curl_easy_setopt (e, CURLOPT_FOLLOWLOCATION, 1L);
     curl_easy_setopt (e, CURLOPT_MAXREDIRS, -1L);
     curl_easy_setopt (e, CURLOPT_NOSIGNAL, 1L);
+#ifdef USE_LIBCURL_MULTIPLEX
+    /* wait to see if a new connection to this host can be multiplexed
+     * before opening another one */
+    curl_easy_setopt (e, CURLOPT_PIPEWAIT, 1L);
+#endif
     curl_easy_setopt (e, CURLOPT_PRIVATE, task);
 #ifdef USE_LIBCURL_SOCKOPT
     curl_easy_setopt (e, CURLOPT_SOCKOPTFUNCTION, sockoptfunction);
@@ -225,6 +348,12 @@ task_finish_func (void * vtask)
     task_free (task);
 }
 
+static void
+wakeWebThread (struct tr_web * web, char ch)
+{
+    send (web->fds[1], &ch, 1, 0);
+}
+
 /****
 *****
 ****/
@@ -255,6 +384,7 @@ tr_webRunWithBuffer (tr_session         * session,
 
     if (web != NULL)
     {
+        bool wasIdle;
         struct tr_web_task * task = tr_new0 (struct tr_web_task, 1);
 
         task->session = session;
@@ -267,53 +397,212 @@ tr_webRunWithBuffer (tr_session         * session,
         task->freebuf = buffer ? NULL : task->response;
 
         tr_lockLock (web->taskLock);
+        wasIdle = web->tasks == NULL;
         task->next = web->tasks;
         web->tasks = task;
         tr_lockUnlock (web->taskLock);
+
+        if (wasIdle)
+            wakeWebThread (web, 't');
         return task;
     }
     return NULL;
 }
 
-/**
- * Portability wrapper for select ().
- *
- * http://msdn.microsoft.com/en-us/library/ms740141%28VS.85%29.aspx
- * On win32, any two of the parameters, readfds, writefds, or exceptfds,
- * can be given as null. At least one must be non-null, and any non-null
- * descriptor set must contain at least one handle to a socket.
- */
+static bool
+webIsDone (const struct tr_web * web)
+{
+    if (web->close_mode == TR_WEB_CLOSE_NOW)
+        return true;
+
+    return (web->close_mode == TR_WEB_CLOSE_WHEN_IDLE)
+        && (web->tasks == NULL)
+        && (web->taskCount == 0);
+}
+
+/* pump completed tasks from the multi */
 static void
-tr_select (int nfds,
-           fd_set * r_fd_set, fd_set * w_fd_set, fd_set * c_fd_set,
-           struct timeval  * t)
+checkMultiInfo (struct tr_web * web)
 {
-#ifdef WIN32
-    if (!r_fd_set->fd_count && !w_fd_set->fd_count && !c_fd_set->fd_count)
+    int unused;
+    CURLMsg * msg;
+
+    while ((msg = curl_multi_info_read (web->multi, &unused)))
+    {
+        if ((msg->msg == CURLMSG_DONE) && (msg->easy_handle != NULL))
+        {
+            double total_time;
+            struct tr_web_task * task;
+            long req_bytes_sent;
+            long num_connects;
+            CURL * e = msg->easy_handle;
+            curl_easy_getinfo (e, CURLINFO_PRIVATE, (void*)&task);
+            curl_easy_getinfo (e, CURLINFO_RESPONSE_CODE, &task->code);
+            curl_easy_getinfo (e, CURLINFO_REQUEST_SIZE, &req_bytes_sent);
+            curl_easy_getinfo (e, CURLINFO_TOTAL_TIME, &total_time);
+            curl_easy_getinfo (e, CURLINFO_NUM_CONNECTS, &num_connects);
+            task->did_connect = task->code>0 || req_bytes_sent>0;
+            task->did_timeout = !task->code && (total_time >= task->timeout_secs);
+            curl_multi_remove_handle (web->multi, e);
+            putIdleEasy (web, e, task->host);
+            task->curl_easy = NULL;
+
+            tr_lockLock (web->taskLock);
+            ++web->stats.requestCount;
+            web->stats.connectionCount += num_connects;
+            if (task->did_connect && !num_connects)
+                ++web->stats.reusedCount;
+            tr_lockUnlock (web->taskLock);
+
+            tr_runInEventThread (task->session, task_finish_func, task);
+            --web->taskCount;
+        }
+    }
+
+    if (webIsDone (web))
+        event_base_loopbreak (web->base);
+}
+
+/* libevent says a socket that curl is watching is ready */
+static void
+onSocketEvent (evutil_socket_t fd, short what, void * vweb)
+{
+    int unused;
+    int action = 0;
+    struct tr_web * web = vweb;
+
+    if (what & EV_READ)
+        action |= CURL_CSELECT_IN;
+    if (what & EV_WRITE)
+        action |= CURL_CSELECT_OUT;
+
+    curl_multi_socket_action (web->multi, fd, action, &unused);
+    checkMultiInfo (web);
+}
+
+/* curl's timeout expired */
+static void
+onTimer (evutil_socket_t fd UNUSED, short what UNUSED, void * vweb)
+{
+    int unused;
+    struct tr_web * web = vweb;
+
+    curl_multi_socket_action (web->multi, CURL_SOCKET_TIMEOUT, 0, &unused);
+    checkMultiInfo (web);
+}
+
+/* CURLMOPT_SOCKETFUNCTION: curl wants us to (stop) watching a socket */
+static int
+socketFunc (CURL * e UNUSED, curl_socket_t fd, int action, void * vweb, void * vevent)
+{
+    struct tr_web * web = vweb;
+    struct event * ev = vevent;
+
+    if (ev != NULL)
+        event_free (ev);
+
+    if (action == CURL_POLL_REMOVE)
     {
-        const long int msec = t->tv_sec*1000 + t->tv_usec/1000;
-        tr_wait_msec (msec);
+        ev = NULL;
     }
-    else if (select (0, r_fd_set->fd_count ? r_fd_set : NULL,
-                        w_fd_set->fd_count ? w_fd_set : NULL,
-                        c_fd_set->fd_count ? c_fd_set : NULL, t) < 0)
+    else
     {
-        char errstr[512];
-        const int e = EVUTIL_SOCKET_ERROR ();
-        tr_net_strerror (errstr, sizeof (errstr), e);
-        dbgmsg ("Error: select (%d) %s", e, errstr);
+        short kind = EV_PERSIST;
+        if (action & CURL_POLL_IN)
+            kind |= EV_READ;
+        if (action & CURL_POLL_OUT)
+            kind |= EV_WRITE;
+
+        ev = event_new (web->base, fd, kind, onSocketEvent, web);
+        event_add (ev, NULL);
     }
-#else
-    select (nfds, r_fd_set, w_fd_set, c_fd_set, t);
+
+    curl_multi_assign (web->multi, fd, ev);
+    return 0;
+}
+
+/* CURLMOPT_TIMERFUNCTION: curl wants onTimer () called in timeout_ms */
+static int
+timerFunc (CURLM * multi UNUSED, long timeout_ms, void * vweb)
+{
+    struct tr_web * web = vweb;
+
+    if (timeout_ms < 0)
+    {
+        evtimer_del (web->timer);
+    }
+    else
+    {
+        struct timeval tv;
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+        evtimer_add (web->timer, &tv);
+    }
+
+    return 0;
+}
+
+/* pick up changes to the session's web-connections-per-host setting */
+static void
+updateConnectionLimit (struct tr_web * web)
+{
+    const int limit = web->session->webConnectionsPerHost;
+
+    if (web->connectionsPerHost != limit)
+    {
+        web->connectionsPerHost = limit;
+#ifdef USE_LIBCURL_MAX_HOST_CONNECTIONS
+        curl_multi_setopt (web->multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)limit);
 #endif
+    }
+}
+
+/* tr_webRun () or tr_webClose () woke us up */
+static void
+onWakeup (evutil_socket_t fd, short what UNUSED, void * vweb)
+{
+    int i;
+    int len;
+    char buf[64];
+    struct tr_web_task * task;
+    struct tr_web * web = vweb;
+
+    while ((len = recv (fd, buf, sizeof (buf), 0)) > 0)
+    {
+        for (i=0; i<len; ++i)
+        {
+            if (buf[i] == 'n')
+                web->close_mode = TR_WEB_CLOSE_NOW;
+            else if ((buf[i] == 'i') && (web->close_mode != TR_WEB_CLOSE_NOW))
+                web->close_mode = TR_WEB_CLOSE_WHEN_IDLE;
+        }
+    }
+
+    updateConnectionLimit (web);
+
+    /* add tasks from the queue */
+    tr_lockLock (web->taskLock);
+    while (web->tasks != NULL)
+    {
+        /* pop the task */
+        task = web->tasks;
+        web->tasks = task->next;
+        task->next = NULL;
+
+        dbgmsg ("adding task to curl: [%s]", task->url);
+        curl_multi_add_handle (web->multi, createEasy (web->session, web, task));
+        ++web->taskCount;
+    }
+    tr_lockUnlock (web->taskLock);
+
+    if (webIsDone (web))
+        event_base_loopbreak (web->base);
 }
 
 static void
 tr_webThreadFunc (void * vsession)
 {
-    CURLM * multi;
     struct tr_web * web;
-    int taskCount = 0;
     struct tr_web_task * task;
     tr_session * session = vsession;
 
@@ -326,6 +615,7 @@ tr_webThreadFunc (void * vsession)
     web->close_mode = ~0;
     web->taskLock = tr_lockNew ();
     web->tasks = NULL;
+    web->session = session;
     web->curl_verbose = getenv ("TR_CURL_VERBOSE") != NULL;
     web->curl_ssl_verify = getenv ("TR_CURL_SSL_VERIFY") != NULL;
     web->curl_ca_bundle = getenv ("CURL_CA_BUNDLE");
@@ -337,110 +627,69 @@ tr_webThreadFunc (void * vsession)
     }
     web->cookie_filename = tr_buildPath (session->configDir, "cookies.txt", NULL);
 
-    multi = curl_multi_init ();
-    session->web = web;
-
-    for (;;)
-    {
-        long msec;
-        int unused;
-        CURLMsg * msg;
-        CURLMcode mcode;
-
-        if (web->close_mode == TR_WEB_CLOSE_NOW)
-            break;
-        if ((web->close_mode == TR_WEB_CLOSE_WHEN_IDLE) && (web->tasks == NULL))
-            break;
-
-        /* add tasks from the queue */
-        tr_lockLock (web->taskLock);
-        while (web->tasks != NULL)
-        {
-            /* pop the task */
-            task = web->tasks;
-            web->tasks = task->next;
-            task->next = NULL;
-
-            dbgmsg ("adding task to curl: [%s]", task->url);
-            curl_multi_add_handle (multi, createEasy (session, web, task));
-            /*fprintf (stderr, "adding a task.. taskCount is now %d\n", taskCount);*/
-            ++taskCount;
-        }
-        tr_lockUnlock (web->taskLock);
+    /* curl tells us which sockets to watch and when its next timeout is,
+     * and we wait for them in our own event loop. This thread has its own
+     * event_base because curl may block while resolving a hostname. */
+    web->base = event_base_new ();
+    web->timer = evtimer_new (web->base, onTimer, web);
+    evutil_socketpair (WAKEUP_FAMILY, SOCK_STREAM, 0, web->fds);
+    evutil_make_socket_nonblocking (web->fds[0]);
+    web->wakeEvent = event_new (web->base, web->fds[0], EV_READ | EV_PERSIST, onWakeup, web);
+    event_add (web->wakeEvent, NULL);
+
+    web->multi = curl_multi_init ();
+    curl_multi_setopt (web->multi, CURLMOPT_SOCKETFUNCTION, socketFunc);
+    curl_multi_setopt (web->multi, CURLMOPT_SOCKETDATA, web);
+    curl_multi_setopt (web->multi, CURLMOPT_TIMERFUNCTION, timerFunc);
+    curl_multi_setopt (web->multi, CURLMOPT_TIMERDATA, web);
+
+    /* keep connections to the trackers alive between announces. Past the
+     * per-host limit, curl queues requests until a connection is free */
+    curl_multi_setopt (web->multi, CURLMOPT_MAXCONNECTS, (long)MAX_CACHED_CONNECTIONS);
+#ifdef USE_LIBCURL_MULTIPLEX
+    curl_multi_setopt (web->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
 
-        /* maybe wait a little while before calling curl_multi_perform () */
-        msec = 0;
-        curl_multi_timeout (multi, &msec);
-        if (msec < 0)
-            msec = THREADFUNC_MAX_SLEEP_MSEC;
-        if (session->isClosed)
-            msec = 100; /* on shutdown, call perform () more frequently */
-        if (msec > 0)
-        {
-            int usec;
-            int max_fd;
-            struct timeval t;
-            fd_set r_fd_set, w_fd_set, c_fd_set;
-
-            max_fd = 0;
-            FD_ZERO (&r_fd_set);
-            FD_ZERO (&w_fd_set);
-            FD_ZERO (&c_fd_set);
-            curl_multi_fdset (multi, &r_fd_set, &w_fd_set, &c_fd_set, &max_fd);
-
-            if (msec > THREADFUNC_MAX_SLEEP_MSEC)
-                msec = THREADFUNC_MAX_SLEEP_MSEC;
-
-            usec = msec * 1000;
-            t.tv_sec =  usec / 1000000;
-            t.tv_usec = usec % 1000000;
-            tr_select (max_fd+1, &r_fd_set, &w_fd_set, &c_fd_set, &t);
-        }
+    session->web = web;
 
-        /* call curl_multi_perform () */
-        do {
-            mcode = curl_multi_perform (multi, &unused);
-        } while (mcode == CURLM_CALL_MULTI_PERFORM);
+    /* pick up any tasks that were added before we started listening */
+    onWakeup (web->fds[0], EV_READ, web);
 
-        /* pump completed tasks from the multi */
-        while ((msg = curl_multi_info_read (multi, &unused)))
-        {
-            if ((msg->msg == CURLMSG_DONE) && (msg->easy_handle != NULL))
-            {
-                double total_time;
-                struct tr_web_task * task;
-                long req_bytes_sent;
-                CURL * e = msg->easy_handle;
-                curl_easy_getinfo (e, CURLINFO_PRIVATE, (void*)&task);
-                curl_easy_getinfo (e, CURLINFO_RESPONSE_CODE, &task->code);
-                curl_easy_getinfo (e, CURLINFO_REQUEST_SIZE, &req_bytes_sent);
-                curl_easy_getinfo (e, CURLINFO_TOTAL_TIME, &total_time);
-                task->did_connect = task->code>0 || req_bytes_sent>0;
-                task->did_timeout = !task->code && (total_time >= task->timeout_secs);
-                curl_multi_remove_handle (multi, e);
-                curl_easy_cleanup (e);
-/*fprintf (stderr, "removing a completed task.. taskCount is now %d (response code: %d, response len: %d)\n", taskCount, (int)task->code, (int)evbuffer_get_length (task->response));*/
-                tr_runInEventThread (task->session, task_finish_func, task);
-                --taskCount;
-            }
-        }
-    }
+    while (!webIsDone (web))
+        event_base_dispatch (web->base);
 
     /* Discard any remaining tasks.
      * This is rare, but can happen on shutdown with unresponsive trackers. */
+    tr_lockLock (web->taskLock);
     while (web->tasks != NULL) {
         task = web->tasks;
         web->tasks = task->next;
         dbgmsg ("Discarding task \"%s\"", task->url);
         task_free (task);
     }
+    session->web = NULL;
+    tr_lockUnlock (web->taskLock);
+
+    tr_ndbg ("web", "%" PRIu64 " requests, %" PRIu64 " connections opened, %" PRIu64 " reused",
+             web->stats.requestCount, web->stats.connectionCount, web->stats.reusedCount);
 
     /* cleanup */
-    curl_multi_cleanup (multi);
+    while (web->idle != NULL) {
+        struct tr_web_idle_easy * idle = web->idle;
+        web->idle = idle->next;
+        curl_easy_cleanup (idle->curl_easy);
+        tr_free (idle->host);
+        tr_free (idle);
+    }
+    curl_multi_cleanup (web->multi);
+    event_free (web->wakeEvent);
+    event_free (web->timer);
+    event_base_free (web->base);
+    evutil_closesocket (web->fds[0]);
+    evutil_closesocket (web->fds[1]);
     tr_lockFree (web->taskLock);
     tr_free (web->cookie_filename);
     tr_free (web);
-    session->web = NULL;
 }
 
 void
@@ -452,9 +701,11 @@ tr_webInit (tr_session * session)
 void
 tr_webClose (tr_session * session, tr_web_close_mode close_mode)
 {
-    if (session->web != NULL)
+    struct tr_web * web = session->web;
+
+    if (web != NULL)
     {
-        session->web->close_mode = close_mode;
+        wakeWebThread (web, close_mode == TR_WEB_CLOSE_NOW ? 'n' : 'i');
 
         if (close_mode == TR_WEB_CLOSE_NOW)
             while (session->web != NULL)
@@ -462,6 +713,20 @@ tr_webClose (tr_session * session, tr_web_close_mode close_mode)
     }
 }
 
+bool
+tr_webGetStats (tr_session * session, tr_web_stats * setme)
+{
+    struct tr_web * web = session->web;
+
+    if (web == NULL)
+        return false;
+
+    tr_lockLock (web->taskLock);
+    *setme = web->stats;
+    tr_lockUnlock (web->taskLock);
+    return true;
+}
+
 void
 tr_webGetTaskInfo (struct tr_web_task * task, tr_web_task_info info, void * dst)
 {
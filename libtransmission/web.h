@@ -70,6 +70,22 @@ struct tr_web_task * tr_webRunWithBuffer (tr_session         * session,
 
 void tr_webGetTaskInfo (struct tr_web_task * task, tr_web_task_info info, void * dst);
 
+/**
+ * Connections are kept alive between requests and shared by every request
+ * to the same host, up to the session's "web-connections-per-host" limit.
+ * These counters show how well that's working.
+ */
+typedef struct tr_web_stats
+{
+    uint64_t requestCount;    /* finished requests */
+    uint64_t connectionCount; /* new connections that were opened for them */
+    uint64_t reusedCount;     /* requests sent on an already-open connection */
+}
+tr_web_stats;
+
+/** @return false if the web thread isn't running */
+bool tr_webGetStats (tr_session * session, tr_web_stats * setme);
+
 void tr_http_escape (struct evbuffer *out, const char *str, int len, bool escape_slashes);
 
 void tr_http_escape_sha1 (char * out, const uint8_t * sha1_digest);
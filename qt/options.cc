@@ -538,7 +538,7 @@ Options :: onTimeout( )
     {
         const QByteArray result( myVerifyHash.result( ) );
         const bool matches = !memcmp( result.constData(),
-                                      myInfo.pieces[myVerifyPieceIndex].hash,
+                                      myInfo.pieceHashes + myVerifyPieceIndex * SHA_DIGEST_LENGTH,
                                       SHA_DIGEST_LENGTH );
         myVerifyFlags[myVerifyPieceIndex] = matches;
         myVerifyPiecePos = 0;
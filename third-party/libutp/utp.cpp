@@ -2822,6 +2822,13 @@ void UTP_GetDelays(UTPSocket *conn, int32 *ours, int32 *theirs, uint32 *age)
 	if (age) *age = g_current_ms - conn->last_measured_delay;
 }
 
+uint32 UTP_GetRTT(UTPSocket *conn)
+{
+	assert(conn);
+
+	return conn->rtt;
+}
+
 #ifdef _DEBUG
 void UTP_GetStats(UTPSocket *conn, UTPStats *stats)
 {
@@ -128,6 +128,10 @@ void UTP_GetPeerName(struct UTPSocket *socket, struct sockaddr *addr, socklen_t
 
 void UTP_GetDelays(struct UTPSocket *socket, int32 *ours, int32 *theirs, uint32 *age);
 
+// Get the smoothed round-trip time in milliseconds, or 0 if it hasn't
+// been measured yet.
+uint32 UTP_GetRTT(struct UTPSocket *socket);
+
 size_t UTP_GetPacketSize(struct UTPSocket *socket);
 
 #ifdef _DEBUG